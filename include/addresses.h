@@ -25,8 +25,14 @@
 #include "list.h"
 #include "config.h"
 
+struct address_port_range {
+	int					first;
+	int					last;
+};
+
 struct address {
 	struct list_head	list;
+	struct list_head	dirty;
 	int					action;
 	char				*name;
 	char				*fqdn;
@@ -42,11 +48,15 @@ struct address {
 	int					logrtlimit;
 	int					logrtlimit_unit;
 	struct list_head	policies;
+	struct list_head	farms;
 	int					policies_used;
 	int					policies_action;
 	int					used;
 	int					nft_chains;
-	int					port_list[NFTLB_MAX_PORTS];
+	unsigned long long	nft_fingerprint;
+	unsigned int		seq;
+	struct address_port_range	*port_ranges;
+	int					nranges;
 	int					nports;
 };
 
@@ -68,11 +78,14 @@ int address_set_netinfo(struct address *a);
 int address_set_ports(struct address *a, char *new_value);
 int address_rulerize(struct address *a);
 int address_s_rulerize(void);
+void address_set_dirty(struct address *a);
+void address_s_set_dirty(void);
 int address_needs_policies(struct address *a);
 int address_set_protocol(struct address *a, int new_value);
 int address_not_used(struct address *a);
 int address_delete(struct address *paddress);
-int address_search_array_port(struct address *a, int port);
+int address_next_port(struct address *a, int port);
+int address_next_port_range(struct address *a, int port, int *last);
 int address_validate_iface(struct address *a);
 int address_validate_iether(struct address *a);
 int address_s_clean_nft_chains(void);
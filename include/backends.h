@@ -42,6 +42,7 @@ struct backend {
 	int			estconnlimit;
 	char		*estconnlimit_logprefix;
 	int			state;
+	struct list_head	timed_sessions;
 };
 
 void backend_s_print(struct farm *f);
@@ -70,6 +71,8 @@ int bck_pos_actionable(struct config_pair *c, int action);
 
 int backend_s_gen_priority(struct farm *f, int action);
 int backend_get_mark(struct backend *b);
+int backend_get_marks_used(void);
+int backend_get_marks_max(void);
 int backend_s_check_have_iface(struct farm *f);
 
 #endif /* _BACKENDS_H_ */
@@ -47,6 +47,9 @@
 #define CONFIG_KEY_SCHEDPARAM	"sched-param"
 #define CONFIG_KEY_PERSIST		"persistence"
 #define CONFIG_KEY_PERSISTTM	"persist-ttl"
+#define CONFIG_KEY_PERSISTSIZE	"persist-max-size"
+#define CONFIG_KEY_PERSISTFILL	"persist-fill"
+#define CONFIG_KEY_PERSISTREJECTED	"persist-rejected"
 #define CONFIG_KEY_HELPER		"helper"
 #define CONFIG_KEY_LOG			"log"
 #define CONFIG_KEY_LOGPREFIX	"log-prefix"
@@ -82,11 +85,23 @@
 #define CONFIG_KEY_INTRACONNECT				"intra-connect"
 #define CONFIG_KEY_USED				"used"
 #define CONFIG_KEY_EXPIRATION			"expiration"
+#define CONFIG_KEY_EXPIRESBEFORE		"expires-before"
+#define CONFIG_KEY_LIMIT			"limit"
+#define CONFIG_KEY_CURSOR			"cursor"
 #define CONFIG_KEY_ADDRESSES		"addresses"
 #define CONFIG_KEY_ROUTE		"route"
 #define CONFIG_KEY_VERDICT		"verdict"
 #define CONFIG_KEY_COUNTER_PACKETS		"counter-packets"
 #define CONFIG_KEY_COUNTER_BYTES		"counter-bytes"
+#define CONFIG_KEY_STATS			"stats"
+#define CONFIG_KEY_BCK_MARKS_USED		"backend-marks-used"
+#define CONFIG_KEY_BCK_MARKS_MAX		"backend-marks-max"
+#define CONFIG_KEY_OPT_STMTS			"optimizer-statements"
+#define CONFIG_KEY_OPT_RULES			"optimizer-rules"
+#define CONFIG_KEY_OPT_ELEMENTS			"optimizer-elements"
+#define CONFIG_KEY_OPT_DEDUP			"optimizer-duplicated"
+#define CONFIG_KEY_OPT_CANCELLED		"optimizer-cancelled"
+#define CONFIG_KEY_OPT_MERGED			"optimizer-merged"
 
 #define CONFIG_VALUE_FAMILY_IPV4	"ipv4"
 #define CONFIG_VALUE_FAMILY_IPV6	"ipv6"
@@ -179,12 +194,13 @@ void config_set_output(char *fmt, ...);
 int config_file(const char *file);
 int config_buffer(const char *buf, int apply_action);
 int config_print_farms(char **buf, char *name);
-int config_print_farm_sessions(char **buf, char *name);
+int config_print_farm_sessions(char **buf, char *name, char *query);
 int config_print_policies(char **buf, char *name);
 int config_set_farm_action(const char *name, const char *value);
 int config_set_session_backend_action(const char *fname, const char *bname, const char *value);
 int config_set_backend_action(const char *fname, const char *bname, const char *value);
 int config_set_session_action(const char *fname, const char *sname, const char *value);
+int config_load_farm_sessions(const char *fname, const char *buf);
 int config_set_fpolicy_action(const char *fname, const char *fpname, const char *value);
 int config_set_policy_action(const char *name, const char *value);
 int config_set_element_action(const char *pname, const char *edata, const char *value);
@@ -194,6 +210,7 @@ void config_print_response(char **buf, char *fmt, ...);
 int config_set_address_action(const char *name, const char *value);
 int config_set_farmaddress_action(const char *fname, const char *faname, const char *value);
 int config_print_addresses(char **buf, char *name);
+int config_print_stats(char **buf);
 int config_check_policy(const char *name);
 int config_check_farm(const char *name);
 
@@ -36,5 +36,9 @@ struct ev_io *events_get_srv(void);
 struct ev_io *events_create_srv(void);
 void events_delete_srv(void);
 
+struct ev_async *events_get_commit(void);
+struct ev_async *events_create_commit(void);
+void events_delete_commit(void);
+
 
 #endif /* _EVENTS_H_ */
@@ -27,6 +27,7 @@
 
 struct farmaddress {
 	struct list_head	list;
+	struct list_head	address_list;
 	struct farm			*farm;
 	struct address		*address;
 	int					action;
@@ -34,7 +35,7 @@ struct farmaddress {
 
 void farmaddress_s_print(struct farm *f);
 struct farmaddress * farmaddress_lookup_by_name(struct farm *f, const char *name);
-int farmaddress_s_lookup_address_action(struct farm *f, char *name, int action);
+int farmaddress_lookup_address_action(struct farmaddress *fa, int action);
 int farmaddress_set_attribute(struct config_pair *c);
 int farmaddress_set_action(struct farmaddress *fa, int action);
 int farmaddress_s_set_action(struct farm *f, int action);
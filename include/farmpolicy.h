@@ -27,6 +27,7 @@
 
 struct farmpolicy {
 	struct list_head	list;
+	struct list_head	policy_list;
 	struct farm			*farm;
 	struct policy		*policy;
 	int					action;
@@ -38,7 +39,7 @@ int farmpolicy_set_attribute(struct config_pair *c);
 int farmpolicy_set_action(struct farmpolicy *fp, int action);
 int farmpolicy_s_set_action(struct farm *f, int action);
 int farmpolicy_s_delete(struct farm *f);
-int farmpolicy_s_lookup_policy_action(struct farm *f, char *name, int action);
+int farmpolicy_lookup_policy_action(struct farmpolicy *fp, int action);
 int farmpolicy_pre_actionable(struct config_pair *c);
 int farmpolicy_pos_actionable(struct config_pair *c);
 
@@ -23,6 +23,7 @@
 #define _FARMS_H_
 
 #include "list.h"
+#include "u_hash.h"
 #include "config.h"
 #include "nftst.h"
 
@@ -98,13 +99,31 @@ enum switches {
 #define VALUE_RLD_TCPSTRICT_STOP			(1 << 8)
 #define VALUE_RLD_QUEUE_STOP				(1 << 9)
 
+#define VALUE_RLD_BCKS						(1 << 10)
+
+/* only the attributes below changed, the rest of the farm rules are kept */
+#define VALUE_RLD_ATTRS						(1 << 11)
+#define VALUE_RLD_LOG						(1 << 12)
+#define VALUE_RLD_LOGPREFIX					(1 << 13)
+#define VALUE_RLD_HELPER					(1 << 14)
+#define VALUE_RLD_PERSISTTM					(1 << 15)
+#define VALUE_RLD_FLOWOFFLOAD				(1 << 16)
+#define VALUE_RLD_SCHED						(1 << 17)
+#define VALUE_RLD_SRCADDR					(1 << 18)
+
 #define STATEFUL_RLD_START(x)				(x & VALUE_RLD_NEWRTLIMIT_START) || (x & VALUE_RLD_RSTRTLIMIT_START) || (x & VALUE_RLD_ESTCONNLIMIT_START) || (x & VALUE_RLD_TCPSTRICT_START)
 #define STATEFUL_RLD_STOP(x)				(x & VALUE_RLD_NEWRTLIMIT_STOP) || (x & VALUE_RLD_RSTRTLIMIT_STOP) || (x & VALUE_RLD_ESTCONNLIMIT_STOP) || (x & VALUE_RLD_TCPSTRICT_STOP)
 
+struct nft_frag;
+struct nft_bck_elems;
+
 struct farm {
 	struct list_head	list;
+	struct list_head	dirty;
 	int			action;
 	int			reload_action;
+	int			reload_helper;
+	int			reload_flow_offload;
 	char			*name;
 	char			*fqdn;
 	char			*oface;
@@ -117,6 +136,7 @@ struct farm {
 	int			schedparam;
 	int			persistence;
 	int			persistttl;
+	int			persistsize;
 	int			helper;
 	int			log;
 	char		*logprefix;
@@ -152,12 +172,27 @@ struct farm {
 	int			policies_action;
 	int			policies_used;
 	int			nft_chains;
+	int			nft_bck_maps;
+	int			nft_sched_slots;
+	unsigned long long	nft_fingerprint;
+	struct nft_frag		*nft_frag;
+	struct nft_bck_elems	*nft_bck_elems;
+	unsigned int		seq;
 	struct list_head	backends;
+	struct u_hash		backends_index;
+	struct u_hash		backends_ipaddr_index;
+	struct u_hash		backends_ethaddr_index;
+	struct u_hash		backends_mark_index;
+	int			backends_mark_stamp;
+	int			backends_mark_dirty;
 	struct list_head	policies;
 	int					total_timed_sessions;
 	struct list_head	timed_sessions;
+	struct u_hash		timed_sessions_index;
+	unsigned long long	timed_sessions_stamp;
 	int					total_static_sessions;
 	struct list_head	static_sessions;
+	struct u_hash		static_sessions_index;
 	struct list_head	addresses;
 	int					addresses_used;
 };
@@ -179,18 +214,23 @@ int farm_is_available(struct farm *f);
 int farm_changed(struct config_pair *c);
 int farm_actionable(struct config_pair *c);
 int farm_pre_actionable(struct config_pair *c);
-int farm_pos_actionable(struct config_pair *c);
+int farm_pos_actionable(struct config_pair *c, int action);
 
 int farm_set_attribute(struct config_pair *c);
 int farm_set_action(struct farm *f, int action);
+int farm_set_bcks_action(struct farm *f);
+void farm_set_config_error(struct farm *f);
 int farm_s_set_action(int action);
 int farm_get_masquerade(struct farm *f);
+int farm_get_persist_rejected(struct farm *f, unsigned long long *rejected);
 void farm_s_set_backend_ether_by_oifidx(int interface_idx, const char * ip_bck, char * ether_bck);
-int farm_s_lookup_policy_action(char *name, int action);
-int farm_s_lookup_address_action(char *name, int action);
+int farm_s_lookup_policy_action(struct policy *p, int action);
+int farm_s_lookup_address_action(struct address *a, int action);
 
 int farm_rulerize(struct farm *f);
 int farm_s_rulerize(void);
+void farm_set_dirty(struct farm *f);
+void farm_s_set_dirty(void);
 int farm_get_mark(struct farm *f);
 void farm_s_set_oface_info(struct address *a);
 int farm_s_set_reload_start(int action);
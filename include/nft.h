@@ -23,15 +23,40 @@
 #define _NFT_H_
 
 #include "farms.h"
+#include "nftir.h"
 
 #define NFTLB_MASQUERADE_MARK_DEFAULT		0x80000000
 
+typedef void (*nft_commit_cb)(void *data, int error);
+typedef int (*nft_session_cb)(struct farm *f, char *client, char *bck, char *expiration, void *data);
+
+int nft_init(void);
+void nft_fini(void);
+int nft_worker_init(void);
+void nft_worker_fini(void);
+unsigned int nft_commit_id(void);
+int nft_commit_notify(unsigned int since, nft_commit_cb cb, void *data);
+void nft_commit_sync(void);
+void nft_txn_forget(void *obj, size_t size);
 int nft_reset(void);
+void nft_fingerprint_reset(void);
+int nft_fingerprint_unchanged(void);
 int nft_check_tables(void);
+int nft_warm_start(void);
+int nft_transaction_begin(void);
+int nft_transaction_commit(void);
+void nft_transaction_release_elements(struct policy *p);
+void nft_farm_release(struct farm *f);
 int nft_rulerize_farms(struct farm *f);
+void nft_rulerize_farms_prepare(struct list_head *farms);
+void nft_rulerize_farms_release(void);
 int nft_rulerize_address(struct address *a);
 int nft_rulerize_policies(struct policy *p);
 int nft_get_rules_buffer(const char **buf, int key, struct nftst *n);
 void nft_del_rules_buffer(const char *buf);
+int nft_get_sessions(struct nftst *n, nft_session_cb cb, void *data);
+int nft_get_persist_rejected(struct nftst *n, unsigned long long *rejected);
+int nft_get_optimizer_stats(struct nftir_stats *stats);
+char *nft_cmd_split(char *cmd, char sep);
 
 #endif /* _NFT_H_ */
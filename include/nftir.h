@@ -0,0 +1,45 @@
+/*
+ *   This file is part of nftlb, nftables load balancer.
+ *
+ *   Copyright (C) RELIANOID
+ *   Author: Laura Garcia Liebana <laura@relianoid.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _NFTIR_H_
+#define _NFTIR_H_
+
+#include "u_sbuffer.h"
+
+/*
+ * Opt-in peephole pass over the generated nft commands of a commit, enabled
+ * with --optimize. The commands are parsed back from their text, so it only
+ * sees what the generators already rendered: it doesn't produce a netlink
+ * batch and it doesn't account rules or their cost per farm, the totals are
+ * per commit.
+ */
+struct nftir_stats {
+	int stmts;
+	int rules;
+	int elements;
+	int dedup;
+	int cancelled;
+	int merged;
+};
+
+int nftir_optimize(struct u_buffer *buf, unsigned int max_elements, unsigned int max_bytes, struct nftir_stats *stats);
+
+#endif /* _NFTIR_H_ */
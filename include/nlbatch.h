@@ -0,0 +1,57 @@
+/*
+ *   This file is part of nftlb, nftables load balancer.
+ *
+ *   Copyright (C) RELIANOID
+ *   Author: Laura Garcia Liebana <laura@relianoid.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _NLBATCH_H_
+#define _NLBATCH_H_
+
+#include <stdint.h>
+
+#include "list.h"
+#include "u_sbuffer.h"
+
+#define NLBATCH_ELEM_ADD		0
+#define NLBATCH_ELEM_DEL		1
+
+struct nlbatch_elem {
+	const unsigned char	*key;
+	uint32_t			key_len;
+	const unsigned char	*data;
+	uint32_t			data_len;
+	uint64_t			expiration;
+};
+
+int nlbatch_init(void);
+void nlbatch_fini(void);
+int nlbatch_enabled(void);
+int nlbatch_is_empty(void);
+int nlbatch_elem_append(int cmd, char *family, char *table, char *set, int key_family, char *data);
+int nlbatch_commit(void);
+int nlbatch_render(struct u_buffer *buf);
+void nlbatch_reset(void);
+
+void nlbatch_detach(struct list_head *blocks);
+int nlbatch_commit_blocks(struct list_head *blocks);
+int nlbatch_render_blocks(struct u_buffer *buf, struct list_head *blocks);
+void nlbatch_reset_blocks(struct list_head *blocks);
+
+int nlbatch_dump_elems(char *family, char *table, char *set, int (*cb)(struct nlbatch_elem *e, void *arg), void *arg);
+
+#endif /* _NLBATCH_H_ */
@@ -22,6 +22,8 @@
 #ifndef _OBJECTS_H_
 #define _OBJECTS_H_
 
+#include "u_hash.h"
+
 #define NFTLB_MAX_PORTS				65535
 
 #define DEFAULT_NAME		""
@@ -42,6 +44,7 @@
 #define DEFAULT_SCHEDPARAM	VALUE_META_NONE
 #define DEFAULT_PERSIST		VALUE_META_NONE
 #define DEFAULT_PERSISTTM	60
+#define DEFAULT_PERSISTSIZE	0
 #define DEFAULT_HELPER		VALUE_HELPER_NONE
 #define DEFAULT_LOG			VALUE_LOG_NONE
 #define DEFAULT_LOG_LOGPREFIX	"TYPE-FNAME "
@@ -128,6 +131,7 @@ enum keys {
 	KEY_SCHEDPARAM,
 	KEY_PERSISTENCE,
 	KEY_PERSISTTM,
+	KEY_PERSISTSIZE,
 	KEY_HELPER,
 	KEY_LOG,
 	KEY_MARK,
@@ -168,6 +172,7 @@ enum keys {
 	KEY_LOG_RTLIMIT,
 	KEY_COUNTER_PACKETS,
 	KEY_COUNTER_BYTES,
+	KEY_EXPIRESBEFORE,
 };
 
 enum families {
@@ -205,6 +210,8 @@ struct obj_config {
 
 void objects_init(void);
 struct list_head * obj_get_farms(void);
+struct u_hash * obj_get_farms_index(void);
+struct list_head * obj_get_farms_dirty(void);
 int obj_get_total_farms(void);
 void obj_set_total_farms(int new_value);
 int obj_get_dsr_counter(void);
@@ -251,6 +258,8 @@ void obj_print(void);
 int obj_rulerize(int mode);
 
 struct list_head * obj_get_policies(void);
+struct u_hash * obj_get_policies_index(void);
+struct list_head * obj_get_policies_dirty(void);
 int obj_get_total_policies(void);
 void obj_set_total_policies(int new_value);
 char * obj_print_policy_type(int type);
@@ -259,6 +268,8 @@ void obj_print_verdict(int verdict, char* buf);
 
 int obj_get_total_addresses(void);
 struct list_head * obj_get_addresses(void);
+struct u_hash * obj_get_addresses_index(void);
+struct list_head * obj_get_addresses_dirty(void);
 void obj_set_total_addresses(int new_value);
 int obj_recovery(void);
 
@@ -23,6 +23,7 @@
 #define _POLICIES_H_
 
 #include "list.h"
+#include "u_hash.h"
 #include "config.h"
 
 enum type {
@@ -37,6 +38,7 @@ enum route {
 
 struct policy {
 	struct list_head	list;
+	struct list_head	dirty;
 	char				*name;
 	int					type;
 	int					route;
@@ -46,7 +48,11 @@ struct policy {
 	int					used;
 	char				*logprefix;
 	int					action;
+	unsigned long long	nft_fingerprint;
+	unsigned int		seq;
 	struct list_head	elements;
+	struct u_hash		elements_index;
+	struct list_head	farms;
 };
 
 void policy_print(struct policy *p);
@@ -60,6 +66,8 @@ int policy_pre_actionable(struct config_pair *c);
 int policy_pos_actionable(struct config_pair *c);
 int policy_rulerize(struct policy *p);
 int policy_s_rulerize(void);
+void policy_set_dirty(struct policy *p);
+void policy_s_set_dirty(void);
 
 
 #endif /* _POLICIES_H_ */
@@ -32,21 +32,44 @@ enum session_type {
 
 struct session {
 	struct list_head	list;
+	struct list_head	bck_list;
 	struct farm			*f;
 	char				*client;
 	struct backend		*bck;
 	char				*expiration;
+	unsigned long long	expires;
 	int					state;
 	int					action;
 };
 
+/* conditions of a sessions query, evaluated while the sessions are dumped */
+struct session_filter {
+	struct backend		*bck;
+	char				*client;
+	int					client_family;
+	unsigned char		client_addr[16];
+	int					client_prefix;
+	unsigned long long	expires_before;
+};
+
+/* a NULL client discards the sessions received so far */
+typedef int (*session_filter_cb)(struct farm *f, const char *client, struct backend *bck, const char *expiration, void *data);
+
 int session_set_action(struct session *s, int type, int action);
 struct session * session_lookup_by_key(struct farm *f, int type, int key, const char *name);
 int session_s_set_action(struct farm *f, struct backend *b, int action);
 void session_s_print(struct farm *f);
 int session_get_timed(struct farm *f);
-int session_get_client(struct session *s, char **parsed);
+int session_get_timed_cached(struct farm *f);
+void session_put_timed(struct farm *f);
+void session_filter_init(struct session_filter *flt);
+void session_filter_clean(struct session_filter *flt);
+int session_filter_set(struct farm *f, struct session_filter *flt, int key, const char *value);
+int session_s_dump(struct farm *f, struct session_filter *flt, session_filter_cb cb, void *data);
+int session_set_static(struct farm *f, const char *client, const char *bck);
 int session_backend_action(struct farm *f, struct backend *b, int action);
+void session_backend_detach(struct farm *f, struct backend *b);
+void session_uncache_timed(struct farm *f);
 int session_s_delete(struct farm *f, int type);
 int session_set_attribute(struct config_pair *c);
 int session_pre_actionable(struct config_pair *c);
@@ -35,6 +35,8 @@
 #include "nft.h"
 #include "u_log.h"
 
+static unsigned int address_seq = 0;
+
 struct address * address_create(char *name)
 {
 	struct list_head *addresses = obj_get_addresses();
@@ -63,14 +65,22 @@ struct address * address_create(char *name)
 	paddress->policies_action = ACTION_NONE;
 
 	init_list_head(&paddress->policies);
+	init_list_head(&paddress->farms);
 
 	paddress->policies_used = 0;
 	paddress->used = 0;
 	paddress->nft_chains = 0;
+	paddress->nft_fingerprint = 0;
+	paddress->seq = address_seq++;
+	init_list_head(&paddress->dirty);
+	paddress->port_ranges = NULL;
+	paddress->nranges = 0;
 	paddress->nports = 0;
 
 	list_add_tail(&paddress->list, addresses);
+	u_hash_add(obj_get_addresses_index(), paddress->name, paddress);
 	obj_set_total_addresses(obj_get_total_addresses() + 1);
+	address_set_dirty(paddress);
 
 	return paddress;
 }
@@ -84,6 +94,8 @@ int address_delete(struct address *paddress)
 				   __FUNCTION__, __LINE__, paddress->name);
 
 	list_del(&paddress->list);
+	list_del_init(&paddress->dirty);
+	u_hash_del(obj_get_addresses_index(), paddress->name, paddress);
 
 	if (paddress->name && strcmp(paddress->name, "") != 0)
 		free(paddress->name);
@@ -97,9 +109,12 @@ int address_delete(struct address *paddress)
 		free(paddress->ipaddr);
 	if (paddress->ports && strcmp(paddress->ports, "") != 0)
 		free(paddress->ports);
+	if (paddress->port_ranges)
+		free(paddress->port_ranges);
 	if (paddress->logprefix && strcmp(paddress->logprefix, DEFAULT_LOG_LOGPREFIX_ADDRESS) != 0)
 		free(paddress->logprefix);
 
+	nft_txn_forget(paddress, sizeof(struct address));
 	free(paddress);
 	obj_set_total_addresses(obj_get_total_addresses() - 1);
 
@@ -111,42 +126,107 @@ static void address_get_range_ports(const char *ptr, int *first, int *last)
 	sscanf(ptr, "%d-%d[^,]", first, last);
 }
 
-int address_search_array_port(struct address *a, int port)
+/* index of the first range whose last port is not lower than the given port */
+static int address_lookup_port_range(struct address *a, int port)
 {
-	if (a->port_list[port-1])
-		return 1;
+	int low = 0;
+	int high = a->nranges;
+	int mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (a->port_ranges[mid].last < port)
+			low = mid + 1;
+		else
+			high = mid;
+	}
 
-	return 0;
+	return low;
 }
 
-static void address_add_array_port(struct address *a, int port)
+/* next port of the address after the given one, or 0 if there is none */
+int address_next_port(struct address *a, int port)
 {
-	if (!a->port_list[port-1]) {
-		a->nports++;
-		a->port_list[port-1] = 1;
+	int i = address_lookup_port_range(a, port + 1);
+
+	if (i == a->nranges)
+		return 0;
+
+	if (a->port_ranges[i].first > port)
+		return a->port_ranges[i].first;
+
+	return port + 1;
+}
+
+/* first port of the next range after the given port, or 0 if there is none */
+int address_next_port_range(struct address *a, int port, int *last)
+{
+	int i = address_lookup_port_range(a, port + 1);
+
+	if (i == a->nranges)
+		return 0;
+
+	*last = a->port_ranges[i].last;
+	if (a->port_ranges[i].first > port)
+		return a->port_ranges[i].first;
+
+	return port + 1;
+}
+
+static int address_cmp_port_range(const void *r1, const void *r2)
+{
+	return ((const struct address_port_range *)r1)->first - ((const struct address_port_range *)r2)->first;
+}
+
+static int address_add_port_range(struct address *a, int first, int last, int *size)
+{
+	struct address_port_range *ranges;
+
+	if (a->nranges == *size) {
+		*size = *size ? *size * 2 : 8;
+		ranges = (struct address_port_range *)realloc(a->port_ranges, *size * sizeof(struct address_port_range));
+		if (!ranges) {
+			u_log_print(LOG_ERR, "%s():%d: port ranges memory allocation error", __FUNCTION__, __LINE__);
+			return -1;
+		}
+		a->port_ranges = ranges;
 	}
+
+	a->port_ranges[a->nranges].first = first;
+	a->port_ranges[a->nranges].last = last;
+	a->nranges++;
+
+	return 0;
 }
 
-static int address_get_array_ports(struct address *a)
+static int address_get_port_ranges(struct address *a)
 {
-	int index = 0;
 	char *ptr;
-	int iport, new;
-	int last = 0;
-
+	int first, last;
+	int size = 0;
+	int i, j;
+
+	if (a->port_ranges)
+		free(a->port_ranges);
+	a->port_ranges = NULL;
+	a->nranges = 0;
 	a->nports = 0;
-	memset(a->port_list, 0, NFTLB_MAX_PORTS * sizeof(int));
+
 	ptr = a->ports;
 	while (ptr != NULL && *ptr != '\0') {
-		last = new = 0;
-		address_get_range_ports(ptr, &new, &last);
+		last = first = 0;
+		address_get_range_ports(ptr, &first, &last);
 		if (last == 0)
-			last = new;
-		if (new > last)
+			last = first;
+		if (first < 1)
+			first = 1;
+		if (last > NFTLB_MAX_PORTS)
+			last = NFTLB_MAX_PORTS;
+		if (first > last)
 			goto next;
 
-		for (iport = new; iport <= last; iport++)
-			address_add_array_port(a, iport);
+		if (address_add_port_range(a, first, last, &size))
+			return -1;
 
 next:
 		ptr = strchr(ptr, ',');
@@ -154,7 +234,26 @@ next:
 			ptr++;
 	}
 
-	return index;
+	if (!a->nranges)
+		return 0;
+
+	// keep the ranges sorted and merge the overlapping or contiguous ones
+	qsort(a->port_ranges, a->nranges, sizeof(struct address_port_range), address_cmp_port_range);
+
+	for (i = 0, j = 1; j < a->nranges; j++) {
+		if (a->port_ranges[j].first <= a->port_ranges[i].last + 1) {
+			if (a->port_ranges[j].last > a->port_ranges[i].last)
+				a->port_ranges[i].last = a->port_ranges[j].last;
+			continue;
+		}
+		a->port_ranges[++i] = a->port_ranges[j];
+	}
+	a->nranges = i + 1;
+
+	for (i = 0; i < a->nranges; i++)
+		a->nports += a->port_ranges[i].last - a->port_ranges[i].first + 1;
+
+	return 0;
 }
 
 int address_set_ports(struct address *a, char *new_value)
@@ -168,7 +267,7 @@ int address_set_ports(struct address *a, char *new_value)
 	if (strcmp(new_value, "") == 0)
 		a->protocol = VALUE_PROTO_ALL;
 
-	address_get_array_ports(a);
+	address_get_port_ranges(a);
 
 	return 0;
 }
@@ -362,15 +461,7 @@ void address_s_print(void)
 
 struct address * address_lookup_by_name(const char *name)
 {
-	struct list_head *addresses = obj_get_addresses();
-	struct address *a;
-
-	list_for_each_entry(a, addresses, list) {
-		if (strcmp(a->name, name) == 0)
-			return a;
-	}
-
-	return NULL;
+	return (struct address *)u_hash_lookup(obj_get_addresses_index(), name);
 }
 
 int address_pre_actionable(struct config_pair *c)
@@ -487,16 +578,18 @@ int address_set_action(struct address *a, int action)
 		return 0;
 
 	if (action == ACTION_DELETE) {
-		if (!farm_s_lookup_address_action(a->name, action))
+		if (!farm_s_lookup_address_action(a, action))
 			address_delete(a);
 		return 1;
 	}
 
 	if (action == ACTION_STOP)
-		farm_s_lookup_address_action(a->name, action);
+		farm_s_lookup_address_action(a, action);
 
-	if (a->action > action)
+	if (a->action > action) {
 		a->action = action;
+		address_set_dirty(a);
+	}
 	return 1;
 }
 
@@ -529,6 +622,8 @@ int address_rulerize(struct address *a)
 {
 	u_log_print(LOG_DEBUG, "%s():%d: rulerize address %s", __FUNCTION__, __LINE__, a->name);
 
+	list_del_init(&a->dirty);
+
 	address_print(a);
 
 	if (a->used) {
@@ -541,14 +636,15 @@ int address_rulerize(struct address *a)
 
 int address_s_rulerize(void)
 {
-	struct list_head *addresses = obj_get_addresses();
-	struct address *a, *next;
+	struct list_head *dirty = obj_get_addresses_dirty();
+	struct address *a;
 	int ret = 0;
 	int output = 0;
 
-	u_log_print(LOG_DEBUG, "%s():%d: rulerize addresses", __FUNCTION__, __LINE__);
+	u_log_print(LOG_DEBUG, "%s():%d: rulerize changed addresses", __FUNCTION__, __LINE__);
 
-	list_for_each_entry_safe(a, next, addresses, list) {
+	while (!list_empty(dirty)) {
+		a = list_first_entry(dirty, struct address, dirty);
 		ret = address_rulerize(a);
 		output = output || ret;
 	}
@@ -556,6 +652,31 @@ int address_s_rulerize(void)
 	return output;
 }
 
+/* the policies action is also reset by the rulerize, so any change of it queues the address */
+void address_set_dirty(struct address *a)
+{
+	struct list_head *dirty = obj_get_addresses_dirty();
+	struct address *pos;
+
+	if (!list_empty(&a->dirty))
+		return;
+
+	list_for_each_entry_reverse(pos, dirty, dirty) {
+		if (pos->seq < a->seq)
+			break;
+	}
+	list_add(&a->dirty, &pos->dirty);
+}
+
+void address_s_set_dirty(void)
+{
+	struct list_head *addresses = obj_get_addresses();
+	struct address *a;
+
+	list_for_each_entry(a, addresses, list)
+		address_set_dirty(a);
+}
+
 int address_needs_policies(struct address *a)
 {
 	return (a->policies_used > 0) || (a->policies_action != ACTION_NONE);
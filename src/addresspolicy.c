@@ -26,6 +26,7 @@
 #include "addresspolicy.h"
 #include "objects.h"
 #include "network.h"
+#include "nft.h"
 #include "u_log.h"
 
 static struct addresspolicy * addresspolicy_create(struct address *a, struct policy *p)
@@ -48,6 +49,7 @@ static struct addresspolicy * addresspolicy_create(struct address *a, struct pol
 	if (a->policies_used > 0 && a->action == ACTION_RELOAD)
 		a->policies_action = ACTION_RELOAD;
 	a->policies_used++;
+	address_set_dirty(a);
 
 	list_add_tail(&ap->list, &a->policies);
 
@@ -68,7 +70,9 @@ static int addresspolicy_delete(struct addresspolicy *ap)
 		ap->policy->used--;
 
 	ap->address->policies_action = ACTION_STOP;
+	address_set_dirty(ap->address);
 
+	nft_txn_forget(ap, sizeof(struct addresspolicy));
 	free(ap);
 
 	return 0;
@@ -107,6 +111,7 @@ int addresspolicy_set_action(struct addresspolicy *ap, int action)
 	if (ap->action > action) {
 		ap->action = action;
 		ap->address->policies_action = ACTION_RELOAD;
+		address_set_dirty(ap->address);
 		return 1;
 	}
 
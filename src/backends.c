@@ -30,39 +30,80 @@
 #include "objects.h"
 #include "network.h"
 #include "sessions.h"
+#include "nft.h"
 #include "u_log.h"
 
 #define BACKEND_MARK_MIN			0x00000001
 #define BACKEND_MARK_MAX			0x00000FFF
+#define BACKEND_MARK_WORDS			((BACKEND_MARK_MAX >> 6) + 1)
+
+/*
+ * Marks in use by the backends of every farm. The marks can be set by hand,
+ * so every mark keeps the number of backends using it and the bitmap tracks
+ * the marks with at least one.
+ */
+struct backend_marks_stct {
+	unsigned int		refs[BACKEND_MARK_MAX + 1];
+	unsigned long long	used[BACKEND_MARK_WORDS];
+	int					total;
+};
+
+static struct backend_marks_stct st_marks;
+
+static void backend_mark_get(int mark)
+{
+	if (mark < BACKEND_MARK_MIN || mark > BACKEND_MARK_MAX)
+		return;
+
+	if (st_marks.refs[mark]++ == 0) {
+		st_marks.used[mark >> 6] |= 1ULL << (mark & 63);
+		st_marks.total++;
+	}
+}
+
+static void backend_mark_put(int mark)
+{
+	if (mark < BACKEND_MARK_MIN || mark > BACKEND_MARK_MAX || st_marks.refs[mark] == 0)
+		return;
+
+	if (--st_marks.refs[mark] == 0) {
+		st_marks.used[mark >> 6] &= ~(1ULL << (mark & 63));
+		st_marks.total--;
+	}
+}
 
 static int backend_gen_next_mark(void)
 {
-	struct list_head *farms = obj_get_farms();
-	struct farm *f;
-	struct backend *b;
-	int mark = BACKEND_MARK_MIN;
-	int found = 0;
-
-	for (mark = BACKEND_MARK_MIN; mark <= BACKEND_MARK_MAX; mark++) {
-		found = 0;
-		list_for_each_entry(f, farms, list) {
-			list_for_each_entry(b, &f->backends, list) {
-				if (mark == b->mark) {
-					found = 1;
-					continue;
-				}
-			}
-			if (found)
-				continue;
-		}
+	unsigned long long free_marks;
+	int mark;
+	int i;
+
+	for (i = BACKEND_MARK_MIN >> 6; i < BACKEND_MARK_WORDS; i++) {
+		free_marks = ~st_marks.used[i];
+		if (i == BACKEND_MARK_MIN >> 6)
+			free_marks &= ~0ULL << (BACKEND_MARK_MIN & 63);
+		if (!free_marks)
+			continue;
 
-		if (!found)
-			return mark;
+		mark = (i << 6) + __builtin_ctzll(free_marks);
+		if (mark > BACKEND_MARK_MAX)
+			break;
+		return mark;
 	}
 
 	return DEFAULT_MARK;
 }
 
+int backend_get_marks_used(void)
+{
+	return st_marks.total;
+}
+
+int backend_get_marks_max(void)
+{
+	return BACKEND_MARK_MAX - BACKEND_MARK_MIN + 1;
+}
+
 static struct backend * backend_create(struct farm *f, char *name)
 {
 	struct backend *b = (struct backend *)malloc(sizeof(struct backend));
@@ -84,14 +125,18 @@ static struct backend * backend_create(struct farm *f, char *name)
 	b->weight = DEFAULT_WEIGHT;
 	b->priority = DEFAULT_PRIORITY;
 	b->mark = backend_gen_next_mark();
+	backend_mark_get(b->mark);
 	b->estconnlimit = DEFAULT_ESTCONNLIMIT;
 	b->estconnlimit_logprefix = DEFAULT_B_ESTCONNLIMIT_LOGPREFIX;
 	b->state = DEFAULT_BACKEND_STATE;
 	b->action = DEFAULT_ACTION;
+	init_list_head(&b->timed_sessions);
 
 	b->parent->bcks_have_port = 0;
 
 	list_add_tail(&b->list, &f->backends);
+	u_hash_add(&f->backends_index, b->name, b);
+	f->backends_mark_dirty = 1;
 	f->total_bcks++;
 
 	return b;
@@ -100,6 +145,12 @@ static struct backend * backend_create(struct farm *f, char *name)
 static int backend_delete_node(struct backend *b)
 {
 	list_del(&b->list);
+	u_hash_del(&b->parent->backends_index, b->name, b);
+	u_hash_del(&b->parent->backends_ipaddr_index, b->ipaddr, b);
+	u_hash_del(&b->parent->backends_ethaddr_index, b->ethaddr, b);
+	b->parent->backends_mark_dirty = 1;
+	backend_mark_put(b->mark);
+	session_backend_detach(b->parent, b);
 	if (b->name)
 		free(b->name);
 	if (b->fqdn && strcmp(b->fqdn, "") != 0)
@@ -117,6 +168,7 @@ static int backend_delete_node(struct backend *b)
 	if (b->estconnlimit_logprefix && strcmp(b->estconnlimit_logprefix, DEFAULT_B_ESTCONNLIMIT_LOGPREFIX) != 0)
 		free(b->estconnlimit_logprefix);
 
+	nft_txn_forget(b, sizeof(struct backend));
 	free(b);
 
 	return 0;
@@ -216,38 +268,62 @@ void backend_s_print(struct farm *f)
 	}
 }
 
-struct backend * backend_lookup_by_key(struct farm *f, int key, const char *name, int value)
+/*
+ * The full mark of a backend depends on the farm mark, the masquerading and
+ * the source address, so the index is rebuilt lazily when any of them changed
+ * since the last build. The first backend in list order wins for a mark.
+ */
+static void backend_s_index_marks(struct farm *f)
 {
 	struct backend *b;
+	char key[16];
+
+	u_hash_clean(&f->backends_mark_index);
+	list_for_each_entry(b, &f->backends, list) {
+		snprintf(key, sizeof(key), "%x", backend_get_mark(b));
+		if (!u_hash_lookup(&f->backends_mark_index, key))
+			u_hash_add(&f->backends_mark_index, key, b);
+	}
+
+	f->backends_mark_stamp = farm_get_mark(f);
+	f->backends_mark_dirty = 0;
+}
+
+struct backend * backend_lookup_by_key(struct farm *f, int key, const char *name, int value)
+{
+	char mark[16];
 
 	u_log_print(LOG_DEBUG, "%s():%d: farm %s key %d name %s value %d", __FUNCTION__, __LINE__, f->name, key, name, value);
 
-	list_for_each_entry(b, &f->backends, list) {
-		switch (key) {
-		case KEY_NAME:
-			if (strcmp(b->name, name) == 0)
-				return b;
-			break;
-		case KEY_MARK:
-			if (value == backend_get_mark(b))
-				return b;
-			break;
-		case KEY_ETHADDR:
-			if (b->ethaddr && strcmp(b->ethaddr, name) == 0)
-				return b;
-			break;
-		case KEY_IPADDR:
-			if (b->ipaddr && strcmp(b->ipaddr, name) == 0)
-				return b;
-			break;
-		default:
-			return NULL;
-		}
+	switch (key) {
+	case KEY_NAME:
+		return (struct backend *)u_hash_lookup(&f->backends_index, name);
+	case KEY_ETHADDR:
+		return (struct backend *)u_hash_lookup(&f->backends_ethaddr_index, name);
+	case KEY_IPADDR:
+		return (struct backend *)u_hash_lookup(&f->backends_ipaddr_index, name);
+	case KEY_MARK:
+		if (f->backends_mark_dirty || f->backends_mark_stamp != farm_get_mark(f))
+			backend_s_index_marks(f);
+		snprintf(mark, sizeof(mark), "%x", value);
+		return (struct backend *)u_hash_lookup(&f->backends_mark_index, mark);
+	default:
+		break;
 	}
 
 	return NULL;
 }
 
+static void backend_set_ethaddr(struct backend *b, char *new_value)
+{
+	u_hash_del(&b->parent->backends_ethaddr_index, b->ethaddr, b);
+	if (b->ethaddr)
+		free(b->ethaddr);
+	obj_set_attribute_string(new_value, &b->ethaddr);
+	u_hash_add(&b->parent->backends_ethaddr_index, b->ethaddr, b);
+	session_uncache_timed(b->parent);
+}
+
 static int backend_set_ipaddr_from_ether(struct backend *b)
 {
 	struct farm *f = b->parent;
@@ -307,9 +383,7 @@ static int backend_set_ipaddr_from_ether(struct backend *b)
 
 		u_log_print(LOG_DEBUG, "%s():%d: discovered ether address for %s is %s", __FUNCTION__, __LINE__, b->name, streth);
 
-		if (b->ethaddr)
-			free(b->ethaddr);
-		obj_set_attribute_string(streth, &b->ethaddr);
+		backend_set_ethaddr(b, streth);
 	}
 
 	return ret;
@@ -409,7 +483,11 @@ static int backend_set_mark(struct backend *b, int new_value)
 	u_log_print(LOG_DEBUG, "%s():%d: current value is %d, but new value will be %d",
 				   __FUNCTION__, __LINE__, old_value, new_value);
 
+	backend_mark_put(old_value);
 	b->mark = new_value;
+	backend_mark_get(new_value);
+	b->parent->backends_mark_dirty = 1;
+	session_uncache_timed(b->parent);
 
 	return 0;
 }
@@ -444,6 +522,8 @@ static int backend_set_srcaddr(struct backend *b, char *new_value)
 	if (b->srcaddr)
 		free(b->srcaddr);
 	obj_set_attribute_string(new_value, &b->srcaddr);
+	b->parent->backends_mark_dirty = 1;
+	session_uncache_timed(b->parent);
 
 	if (b->srcaddr && strcmp(b->srcaddr, "") != 0)
 		b->parent->bcks_have_srcaddr = 1;
@@ -518,12 +598,12 @@ static int backend_set_ipaddr(struct backend *b, char *new_value)
 	u_log_print(LOG_DEBUG, "%s():%d: current value is %s, but new value will be %s",
 				   __FUNCTION__, __LINE__, old_value, new_value);
 
+	u_hash_del(&b->parent->backends_ipaddr_index, b->ipaddr, b);
 	if (b->ipaddr)
 		free(b->ipaddr);
-	if (b->ethaddr)
-		free(b->ethaddr);
 	obj_set_attribute_string(new_value, &b->ipaddr);
-	obj_set_attribute_string("", &b->ethaddr);
+	u_hash_add(&b->parent->backends_ipaddr_index, b->ipaddr, b);
+	backend_set_ethaddr(b, "");
 
 	netconfig = (backend_set_ifinfo(b) == 0 && backend_set_ipaddr_from_ether(b) == 0);
 
@@ -737,8 +817,10 @@ int backend_set_attribute(struct config_pair *c)
 		obj_set_current_backend(b);
 		break;
 	case KEY_NEWNAME:
+		u_hash_del(&b->parent->backends_index, b->name, b);
 		free(b->name);
 		obj_set_attribute_string(c->str_value, &b->name);
+		u_hash_add(&b->parent->backends_index, b->name, b);
 		break;
 	case KEY_FQDN:
 		if (strcmp(b->fqdn, DEFAULT_FQDN) != 0)
@@ -749,9 +831,7 @@ int backend_set_attribute(struct config_pair *c)
 		backend_set_ipaddr(b, c->str_value);
 		break;
 	case KEY_ETHADDR:
-		if (b->ethaddr)
-			free(b->ethaddr);
-		obj_set_attribute_string(c->str_value, &b->ethaddr);
+		backend_set_ethaddr(b, c->str_value);
 		break;
 	case KEY_PORT:
 		backend_set_port(b, c->str_value);
@@ -846,7 +926,7 @@ int backend_set_state(struct backend *b, int new_value)
 	}
 
 	if (b->action != ACTION_NONE) {
-		farm_set_action(f, ACTION_RELOAD);
+		farm_set_bcks_action(f);
 		backend_s_gen_priority(f, ACTION_NONE);
 	}
 
@@ -867,16 +947,14 @@ int backend_s_set_ether_by_ipaddr(struct farm *f, const char *ip_bck, char *ethe
 
 		if (!b->ethaddr || (b->ethaddr && strcmp(b->ethaddr, ether_bck) != 0)) {
 			if (f->persistence != VALUE_META_NONE)
-				session_get_timed(f);
-			if (b->ethaddr)
-				free(b->ethaddr);
-			obj_set_attribute_string(ether_bck, &b->ethaddr);
+				session_get_timed_cached(f);
+			backend_set_ethaddr(b, ether_bck);
 			changed = 1;
 			if (f->persistence != VALUE_META_NONE) {
 				session_backend_action(f, b, ACTION_RELOAD);
 				farm_set_action(f, ACTION_RELOAD);
 				obj_rulerize(OBJ_START);
-				session_s_delete(f, SESSION_TYPE_TIMED);
+				session_put_timed(f);
 			}
 
 			u_log_print(LOG_INFO, "%s():%d: ether address changed for backend %s with %s", __FUNCTION__, __LINE__, b->name, ether_bck);
@@ -985,13 +1063,19 @@ int bck_pos_actionable(struct config_pair *c, int action)
 	switch (action) {
 	case ACTION_START:
 		if (backend_set_action(b, ACTION_START)) {
-			farm_set_action(f, ACTION_RELOAD);
+			if (c->key == KEY_PRIORITY)
+				farm_set_bcks_action(f);
+			else
+				farm_set_action(f, ACTION_RELOAD);
 			farmaddress_s_set_action(f, ACTION_RELOAD);
 			farm_rulerize(f);
 		}
 		break;
 	case ACTION_RELOAD:
-		farm_set_action(f, ACTION_RELOAD);
+		if (c->key == KEY_STATE || c->key == KEY_WEIGHT)
+			farm_set_bcks_action(f);
+		else
+			farm_set_action(f, ACTION_RELOAD);
 		break;
 	case ACTION_FLUSH:
 		farm_set_action(f, ACTION_START);
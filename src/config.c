@@ -36,6 +36,7 @@
 #include "addresses.h"
 #include "farmaddress.h"
 #include "addresspolicy.h"
+#include "nft.h"
 #include "u_log.h"
 
 #define CONFIG_MAXBUF			4096
@@ -44,7 +45,6 @@
 static int config_json(json_t *element, int level, int source, int key, int apply_action);
 
 struct config_pair c;
-unsigned int continue_obj = 0;
 char config_outbuf[CONFIG_OUTBUF_SIZE] = { 0 };
 
 static void init_pair(struct config_pair *c)
@@ -389,6 +389,7 @@ static int config_value(const char *value)
 		break;
 	case KEY_RESPONSETTL:
 	case KEY_PERSISTTM:
+	case KEY_PERSISTSIZE:
 	case KEY_LIMITSTTL:
 	case KEY_NEWRTLIMITBURST:
 	case KEY_RSTRTLIMITBURST:
@@ -529,6 +530,8 @@ static int config_key(const char *key)
 		return KEY_PERSISTENCE;
 	if (strcmp(key, CONFIG_KEY_PERSISTTM) == 0)
 		return KEY_PERSISTTM;
+	if (strcmp(key, CONFIG_KEY_PERSISTSIZE) == 0)
+		return KEY_PERSISTSIZE;
 	if (strcmp(key, CONFIG_KEY_HELPER) == 0)
 		return KEY_HELPER;
 	if (strcmp(key, CONFIG_KEY_LOG) == 0)
@@ -829,6 +832,23 @@ static void add_dump_obj(json_t *obj, const char *name, char *value)
 
 static int add_dump_elements(json_t *obj, struct policy *p);
 
+static void add_dump_session(json_t *jarray, const char *client, struct backend *bck, const char *expiration)
+{
+	json_t *item = json_object();
+
+	add_dump_obj(item, CONFIG_KEY_CLIENT, (char *)client);
+
+	if (!bck)
+		add_dump_obj(item, CONFIG_KEY_BACKEND, UNDEFINED_VALUE);
+	else
+		add_dump_obj(item, CONFIG_KEY_BACKEND, bck->name);
+
+	if (expiration)
+		add_dump_obj(item, CONFIG_KEY_EXPIRATION, (char *)expiration);
+
+	json_array_append_new(jarray, item);
+}
+
 static struct json_t *add_dump_list(json_t *obj, const char *objname, int object,
 			  struct list_head *head, char *name)
 {
@@ -846,10 +866,7 @@ static struct json_t *add_dump_list(json_t *obj, const char *objname, int object
 	char value[10];
 	char buf[100] = {};
 
-	if (continue_obj)
-		jarray = obj;
-	else
-		jarray = json_array();
+	jarray = json_array();
 
 	switch (object) {
 	case LEVEL_FARMS:
@@ -895,6 +912,11 @@ static struct json_t *add_dump_list(json_t *obj, const char *objname, int object
 			config_dump_int(value, f->persistttl);
 			add_dump_obj(item, CONFIG_KEY_PERSISTTM, value);
 
+			if (f->persistsize != DEFAULT_PERSISTSIZE) {
+				snprintf(buf, sizeof(buf), "%d", f->persistsize);
+				add_dump_obj(item, CONFIG_KEY_PERSISTSIZE, buf);
+			}
+
 			add_dump_obj(item, CONFIG_KEY_HELPER, obj_print_helper(f->helper));
 
 			obj_print_log(f->log, (char *)buf);
@@ -1074,31 +1096,15 @@ static struct json_t *add_dump_list(json_t *obj, const char *objname, int object
 		}
 		break;
 	case LEVEL_SESSIONS:
-		list_for_each_entry(s, head, list) {
-			item = json_object();
-			add_dump_obj(item, CONFIG_KEY_CLIENT, s->client);
-
-			if (!s->bck)
-				add_dump_obj(item, CONFIG_KEY_BACKEND, UNDEFINED_VALUE);
-			else
-				add_dump_obj(item, CONFIG_KEY_BACKEND, s->bck->name);
-
-			if (s->expiration)
-				add_dump_obj(item, CONFIG_KEY_EXPIRATION, s->expiration);
-
-			json_array_append_new(jarray, item);
-		}
+		list_for_each_entry(s, head, list)
+			add_dump_session(jarray, s->client, s->bck, s->expiration);
 		break;
 	default:
 		return NULL;
 	}
 
-	if (!continue_obj) {
-		json_object_set_new(obj, objname, jarray);
-		return jarray;
-	}
-
-	return NULL;
+	json_object_set_new(obj, objname, jarray);
+	return jarray;
 }
 
 static int add_dump_elements(json_t *jdata, struct policy *p)
@@ -1135,11 +1141,181 @@ int config_print_farms(char **buf, char *name)
 	return 0;
 }
 
-int config_print_farm_sessions(char **buf, char *name)
+struct config_session_item {
+	char				*client;
+	struct backend		*bck;
+	char				*expiration;
+};
+
+/*
+ * A page of sessions sorted by client. The cursor is the last client of the
+ * previous page compared as a string, not as an address, so every page scans
+ * the whole maps again and only the lowest clients after the cursor are kept
+ * in a max heap of the page size. A page costs O(N log limit) and listing all
+ * the sessions by pages costs N / limit scans.
+ */
+struct config_sessions_page {
+	json_t						*jarray;
+	char						*cursor;
+	struct config_session_item	*items;
+	int							limit;
+	int							len;
+	int							more;
+};
+
+static void config_session_item_clean(struct config_session_item *item)
 {
-	json_t *jdata = json_object();
-	json_t *jdata_cont;
+	free(item->client);
+	if (item->expiration)
+		free(item->expiration);
+}
+
+static int config_session_item_cmp(const void *i1, const void *i2)
+{
+	return strcmp(((const struct config_session_item *)i1)->client, ((const struct config_session_item *)i2)->client);
+}
+
+static void config_sessions_page_sift(struct config_sessions_page *page, int pos)
+{
+	struct config_session_item tmp;
+	int child;
+
+	while ((child = 2 * pos + 1) < page->len) {
+		if (child + 1 < page->len && config_session_item_cmp(&page->items[child + 1], &page->items[child]) > 0)
+			child++;
+		if (config_session_item_cmp(&page->items[child], &page->items[pos]) <= 0)
+			break;
+		tmp = page->items[pos];
+		page->items[pos] = page->items[child];
+		page->items[child] = tmp;
+		pos = child;
+	}
+}
+
+static int config_sessions_page_cb(struct farm *f, const char *client, struct backend *bck, const char *expiration, void *data)
+{
+	struct config_sessions_page *page = (struct config_sessions_page *)data;
+	struct config_session_item tmp;
+	int pos, parent;
+	char *str;
+
+	// the sessions sent so far are sent again
+	if (!client) {
+		json_array_clear(page->jarray);
+		while (page->len)
+			config_session_item_clean(&page->items[--page->len]);
+		page->more = 0;
+		return 0;
+	}
+
+	if (page->cursor && strcmp(client, page->cursor) <= 0)
+		return 0;
+
+	if (!page->limit) {
+		add_dump_session(page->jarray, client, bck, expiration);
+		return 0;
+	}
+
+	// the root of the full heap is the highest client of the page
+	if (page->len == page->limit) {
+		page->more = 1;
+		if (strcmp(client, page->items[0].client) >= 0)
+			return 0;
+	}
+
+	str = strdup(client);
+	if (!str)
+		return 0;
+
+	if (page->len == page->limit) {
+		config_session_item_clean(&page->items[0]);
+		page->items[0].client = str;
+		page->items[0].bck = bck;
+		page->items[0].expiration = expiration ? strdup(expiration) : NULL;
+		config_sessions_page_sift(page, 0);
+		return 0;
+	}
+
+	pos = page->len++;
+	page->items[pos].client = str;
+	page->items[pos].bck = bck;
+	page->items[pos].expiration = expiration ? strdup(expiration) : NULL;
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (config_session_item_cmp(&page->items[pos], &page->items[parent]) <= 0)
+			break;
+		tmp = page->items[pos];
+		page->items[pos] = page->items[parent];
+		page->items[parent] = tmp;
+		pos = parent;
+	}
+
+	return 0;
+}
+
+static int config_parse_sessions_query(struct farm *f, char *query, struct session_filter *flt, struct config_sessions_page *page)
+{
+	char *pair, *value, *c;
+	char *saveptr = NULL;
+	int ret;
+
+	for (pair = strtok_r(query, "&", &saveptr); pair; pair = strtok_r(NULL, "&", &saveptr)) {
+		value = strchr(pair, '=');
+		if (!value) {
+			config_set_output(". Invalid sessions query '%s'", pair);
+			return PARSER_STRUCT_FAILED;
+		}
+		*value++ = '\0';
+
+		/* Traduce URL to plain text */
+		if (strcmp(pair, CONFIG_KEY_CLIENT) == 0 || strcmp(pair, CONFIG_KEY_CURSOR) == 0)
+			for (c = value; (c = strchr(c, '_')); ++c)
+				*c = ' ';
+
+		ret = PARSER_OK;
+		if (strcmp(pair, CONFIG_KEY_BACKEND) == 0)
+			ret = session_filter_set(f, flt, KEY_BACKEND, value);
+		else if (strcmp(pair, CONFIG_KEY_CLIENT) == 0)
+			ret = session_filter_set(f, flt, KEY_CLIENT, value);
+		else if (strcmp(pair, CONFIG_KEY_EXPIRESBEFORE) == 0)
+			ret = session_filter_set(f, flt, KEY_EXPIRESBEFORE, value);
+		else if (strcmp(pair, CONFIG_KEY_CURSOR) == 0)
+			page->cursor = value;
+		else if (strcmp(pair, CONFIG_KEY_LIMIT) == 0) {
+			page->limit = atoi(value);
+			if (page->limit <= 0)
+				ret = PARSER_VALID_FAILED;
+		} else {
+			config_set_output(". Unknown sessions query key '%s'", pair);
+			return PARSER_STRUCT_FAILED;
+		}
+
+		if (ret != PARSER_OK) {
+			if (ret == PARSER_VALID_FAILED)
+				config_set_output(". Invalid value '%s' for '%s'", value, pair);
+			return ret;
+		}
+	}
+
+	return PARSER_OK;
+}
+
+/*
+ * The sessions are streamed from the static list and the persistence maps,
+ * optionally filtered and paginated like /farms/lb01/sessions?backend=bck1&limit=100
+ * If the persistence map is bounded, its fill and rejected insertions are
+ * reported too, as the map is already dumped here.
+ */
+int config_print_farm_sessions(char **buf, char *name, char *query)
+{
+	struct config_sessions_page page = { 0 };
+	struct session_filter flt;
+	unsigned long long rejected;
+	char value[32];
+	char *cursor, *c;
 	struct farm *f;
+	json_t *jdata;
+	int ret = PARSER_OK, i, fill;
 
 	if (!name || strcmp(name, "") == 0)
 		return PARSER_STRUCT_FAILED;
@@ -1148,21 +1324,60 @@ int config_print_farm_sessions(char **buf, char *name)
 	if (!f)
 		return PARSER_OBJ_UNKNOWN;
 
-	jdata_cont = add_dump_list(jdata, CONFIG_KEY_SESSIONS, LEVEL_SESSIONS, &f->static_sessions, name);
-	continue_obj = 1;
-	session_get_timed(f);
-	add_dump_list(jdata_cont, CONFIG_KEY_SESSIONS, LEVEL_SESSIONS, &f->timed_sessions, name);
-	continue_obj = 0;
+	session_filter_init(&flt);
+	if (query)
+		ret = config_parse_sessions_query(f, query, &flt, &page);
+	if (ret != PARSER_OK)
+		goto out;
+
+	if (page.limit) {
+		page.items = (struct config_session_item *)calloc(page.limit, sizeof(struct config_session_item));
+		if (!page.items) {
+			ret = PARSER_FAILED;
+			goto out;
+		}
+	}
+
+	jdata = json_object();
+	page.jarray = json_array();
+	json_object_set_new(jdata, CONFIG_KEY_SESSIONS, page.jarray);
+
+	fill = session_s_dump(f, &flt, config_sessions_page_cb, &page);
+	if (page.len)
+		qsort(page.items, page.len, sizeof(struct config_session_item), config_session_item_cmp);
+
+	for (i = 0; i < page.len; i++)
+		add_dump_session(page.jarray, page.items[i].client, page.items[i].bck, page.items[i].expiration);
+
+	// the cursor to request the next page
+	if (page.more) {
+		cursor = strdup(page.items[page.len - 1].client);
+		for (c = cursor; c && (c = strchr(c, ' ')); ++c)
+			*c = '_';
+		add_dump_obj(jdata, CONFIG_KEY_CURSOR, cursor);
+		free(cursor);
+	}
+
+	if (farm_get_persist_rejected(f, &rejected) == 0) {
+		snprintf(value, sizeof(value), "%d", fill);
+		add_dump_obj(jdata, CONFIG_KEY_PERSISTFILL, value);
+		snprintf(value, sizeof(value), "%llu", rejected);
+		add_dump_obj(jdata, CONFIG_KEY_PERSISTREJECTED, value);
+	}
+
 	free(*buf);
 	*buf = json_dumps(jdata, JSON_INDENT(8));
-
 	json_decref(jdata);
-	session_s_delete(f, SESSION_TYPE_TIMED);
 
-	if (*buf == NULL)
-		return PARSER_FAILED;
+	ret = (*buf == NULL) ? PARSER_FAILED : PARSER_OK;
 
-	return PARSER_OK;
+out:
+	for (i = 0; i < page.len; i++)
+		config_session_item_clean(&page.items[i]);
+	if (page.items)
+		free(page.items);
+	session_filter_clean(&flt);
+	return ret;
 }
 
 int config_print_policies(char **buf, char *name)
@@ -1227,7 +1442,7 @@ int config_set_session_backend_action(const char *fname, const char *bname, cons
 		return PARSER_OBJ_UNKNOWN;
 	}
 
-	session_get_timed(f);
+	session_get_timed_cached(f);
 
 	if (config_value_action(value) == ACTION_DELETE) {
 		ret = session_backend_action(f, b, ACTION_STOP);
@@ -1236,7 +1451,7 @@ int config_set_session_backend_action(const char *fname, const char *bname, cons
 	}
 	ret = session_backend_action(f, b, config_value_action(value));
 
-	session_s_delete(f, SESSION_TYPE_TIMED);
+	session_put_timed(f);
 	return ret;
 }
 
@@ -1255,7 +1470,7 @@ int config_set_backend_action(const char *fname, const char *bname, const char *
 		return PARSER_OBJ_UNKNOWN;
 	}
 
-	session_get_timed(f);
+	session_get_timed_cached(f);
 
 	if (!bname || strcmp(bname, "") == 0) {
 		ret = backend_s_set_action(f, config_value_action(value));
@@ -1265,14 +1480,14 @@ int config_set_backend_action(const char *fname, const char *bname, const char *
 	b = backend_lookup_by_key(f, KEY_NAME, bname, 0);
 	if (!b) {
 		config_set_output(". Unknown backend '%s' in farm '%s'", bname, fname);
-		session_s_delete(f, SESSION_TYPE_TIMED);
+		session_put_timed(f);
 		return PARSER_OBJ_UNKNOWN;
 	}
 
 	ret = backend_set_action(b, config_value_action(value));
 
 out:
-	session_s_delete(f, SESSION_TYPE_TIMED);
+	session_put_timed(f);
 	return (ret >= 0) ? PARSER_OK : PARSER_FAILED;
 }
 
@@ -1298,6 +1513,8 @@ int config_set_session_action(const char *fname, const char *sname, const char *
 	}
 
 	if (!sname || strcmp(sname, "") == 0) {
+		// only the static sessions, the cached timed ones could be gone already
+		session_s_delete(f, SESSION_TYPE_TIMED);
 		ret = session_s_set_action(f, NULL, action);
 		goto apply;
 	}
@@ -1334,7 +1551,7 @@ apply:
 	}
 
 	if (timed) {
-		session_s_delete(f, SESSION_TYPE_TIMED);
+		session_put_timed(f);
 		return PARSER_OK;
 	}
 
@@ -1347,6 +1564,77 @@ apply:
 	return (session_set_action(s, SESSION_TYPE_STATIC, ACTION_DELETE) >= 0) ? PARSER_OK : PARSER_FAILED;
 }
 
+/*
+ * Import a list of static sessions like { "sessions" : [ { "client" : "<ip>",
+ * "backend" : "<name>" }, ... ] }. The clients already pinned are looked up
+ * in the sessions index, so a repeated client just updates its backend.
+ */
+int config_load_farm_sessions(const char *fname, const char *buf)
+{
+	json_error_t error;
+	json_t *root, *jsessions, *item;
+	const char *client, *bck;
+	struct farm *f;
+	size_t size, i;
+	int changed = 0, unchanged = 0, rejected = 0;
+	int ret = PARSER_OK;
+
+	u_log_print(LOG_NOTICE, "%s():%d: payload %d for farm %s", __FUNCTION__, __LINE__, (int)strlen(buf), fname);
+
+	f = farm_lookup_by_name(fname);
+	if (!f) {
+		config_set_output(". Unknown farm '%s'", fname);
+		return PARSER_OBJ_UNKNOWN;
+	}
+
+	root = json_loadb(buf, strlen(buf), JSON_ALLOW_NUL, &error);
+	if (!root) {
+		u_log_print(LOG_ERR, "Configuration error on line %d: %s", error.line, error.text);
+		config_set_output(". Configuration error on line %d: %s", error.line, error.text);
+		return PARSER_STRUCT_FAILED;
+	}
+
+	jsessions = json_object_get(root, CONFIG_KEY_SESSIONS);
+	if (!json_is_array(jsessions)) {
+		config_set_output(". Key '%s' has to be an array", CONFIG_KEY_SESSIONS);
+		ret = PARSER_STRUCT_FAILED;
+		goto out;
+	}
+
+	size = json_array_size(jsessions);
+	for (i = 0; i < size; i++) {
+		item = json_array_get(jsessions, i);
+		client = json_string_value(json_object_get(item, CONFIG_KEY_CLIENT));
+		bck = json_string_value(json_object_get(item, CONFIG_KEY_BACKEND));
+
+		switch (client && bck ? session_set_static(f, client, bck) : -1) {
+		case 1:
+			changed++;
+			break;
+		case 0:
+			unchanged++;
+			break;
+		default:
+			u_log_print(LOG_ERR, "%s():%d: session %s of farm %s rejected", __FUNCTION__, __LINE__, client ? client : UNDEFINED_VALUE, fname);
+			rejected++;
+			break;
+		}
+	}
+
+	if (changed)
+		farm_set_action(f, ACTION_RELOAD);
+
+	config_set_output(". Sessions changed %d, unchanged %d, rejected %d", changed, unchanged, rejected);
+
+	// the accepted sessions are applied anyway
+	if (rejected)
+		ret = PARSER_VALID_FAILED;
+
+out:
+	json_decref(root);
+	return ret;
+}
+
 int config_set_fpolicy_action(const char *fname, const char *fpname, const char *value)
 {
 	struct farm *f;
@@ -1539,6 +1827,44 @@ int config_set_farmaddress_action(const char *fname, const char *faname, const c
 	return 0;
 }
 
+int config_print_stats(char **buf)
+{
+	struct nftir_stats opt;
+	char value[12];
+	json_t *jdata = json_object();
+	json_t *item = json_object();
+
+	config_dump_int(value, backend_get_marks_used());
+	add_dump_obj(item, CONFIG_KEY_BCK_MARKS_USED, value);
+	config_dump_int(value, backend_get_marks_max());
+	add_dump_obj(item, CONFIG_KEY_BCK_MARKS_MAX, value);
+
+	if (nft_get_optimizer_stats(&opt) == 0) {
+		config_dump_int(value, opt.stmts);
+		add_dump_obj(item, CONFIG_KEY_OPT_STMTS, value);
+		config_dump_int(value, opt.rules);
+		add_dump_obj(item, CONFIG_KEY_OPT_RULES, value);
+		config_dump_int(value, opt.elements);
+		add_dump_obj(item, CONFIG_KEY_OPT_ELEMENTS, value);
+		config_dump_int(value, opt.dedup);
+		add_dump_obj(item, CONFIG_KEY_OPT_DEDUP, value);
+		config_dump_int(value, opt.cancelled);
+		add_dump_obj(item, CONFIG_KEY_OPT_CANCELLED, value);
+		config_dump_int(value, opt.merged);
+		add_dump_obj(item, CONFIG_KEY_OPT_MERGED, value);
+	}
+	json_object_set_new(jdata, CONFIG_KEY_STATS, item);
+
+	free(*buf);
+	*buf = json_dumps(jdata, JSON_INDENT(8));
+	json_decref(jdata);
+
+	if (*buf == NULL)
+		return -1;
+
+	return 0;
+}
+
 int config_print_addresses(char **buf, char *name)
 {
 	struct list_head *addresses = obj_get_addresses();
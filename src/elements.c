@@ -49,14 +49,16 @@ static struct element * element_create(struct policy *p, char *data, char *time,
 	obj_set_attribute_string(counter_bytes, &e->counter_bytes);
 
 	list_add_tail(&e->list, &p->elements);
+	u_hash_add(&p->elements_index, e->data, e);
 	p->total_elem++;
 
 	return e;
 }
 
-static int element_delete_node(struct element *e)
+static void element_free(struct element *e)
 {
-	list_del(&e->list);
+	nft_txn_forget(e, sizeof(struct element));
+
 	if (e->data)
 		free(e->data);
 	if (e->time)
@@ -67,6 +69,13 @@ static int element_delete_node(struct element *e)
 		free(e->counter_bytes);
 
 	free(e);
+}
+
+static int element_delete_node(struct element *e)
+{
+	list_del(&e->list);
+	u_hash_del(&e->policy->elements_index, e->data, e);
+	element_free(e);
 
 	return 0;
 }
@@ -159,14 +168,7 @@ void element_s_print(struct policy *p)
 
 struct element * element_lookup_by_name(struct policy *p, const char *data)
 {
-	struct element *e;
-
-	list_for_each_entry(e, &p->elements, list) {
-		if (strcmp(e->data, data) == 0)
-			return e;
-	}
-
-	return NULL;
+	return (struct element *)u_hash_lookup(&p->elements_index, data);
 }
 
 int element_set_action(struct element *e, int action)
@@ -213,6 +215,51 @@ int element_s_delete(struct policy *p)
 	return 0;
 }
 
+/*
+ * Move the elements of the policy out of it, as they are deleted, but keep
+ * them until the commit that applies them succeeds.
+ */
+int element_s_detach(struct policy *p, struct list_head *detached)
+{
+	struct element *e, *next;
+
+	list_for_each_entry_safe(e, next, &p->elements, list) {
+		p->total_elem--;
+		policy_set_action(p, ACTION_RELOAD);
+		u_hash_del(&p->elements_index, e->data, e);
+		list_move_tail(&e->list, detached);
+	}
+
+	p->total_elem = 0;
+
+	return 0;
+}
+
+/* put the detached elements back into their policies */
+int element_s_attach(struct list_head *detached)
+{
+	struct element *e, *next;
+
+	list_for_each_entry_safe(e, next, detached, list) {
+		list_move_tail(&e->list, &e->policy->elements);
+		u_hash_add(&e->policy->elements_index, e->data, e);
+	}
+
+	return 0;
+}
+
+int element_s_release(struct list_head *detached)
+{
+	struct element *e, *next;
+
+	list_for_each_entry_safe(e, next, detached, list) {
+		list_del(&e->list);
+		element_free(e);
+	}
+
+	return 0;
+}
+
 int element_set_attribute(struct config_pair *c, int apply_action)
 {
 	struct policy *p = obj_get_current_policy();
@@ -23,26 +23,44 @@
 #include "server.h"
 
 #include <stdlib.h>
+#include <signal.h>
 #include <ev.h>
 
 struct events_stct {
 	struct ev_loop *loop;
 	struct ev_io *srv_accept;
 	struct ev_io *net_ntlnk;
+	struct ev_async *nft_commit;
+	struct ev_signal sig_int;
+	struct ev_signal sig_term;
+	int stop;
 };
 
 static struct events_stct st_ev;
 
+/* the shutdown is done by the caller of the loop, out of the signal context */
+static void loop_signal_cb(struct ev_loop *loop, struct ev_signal *w, int revents)
+{
+	st_ev.stop = 1;
+	ev_break(loop, EVBREAK_ALL);
+}
+
 int loop_init(void)
 {
 	st_ev.loop = ev_default_loop(0);
+	st_ev.stop = 0;
+
+	ev_signal_init(&st_ev.sig_int, loop_signal_cb, SIGINT);
+	ev_signal_start(st_ev.loop, &st_ev.sig_int);
+	ev_signal_init(&st_ev.sig_term, loop_signal_cb, SIGTERM);
+	ev_signal_start(st_ev.loop, &st_ev.sig_term);
 
 	return 0;
 }
 
 int loop_run(void)
 {
-	while (1)
+	while (!st_ev.stop)
 		ev_loop(st_ev.loop, 0);
 
 	return 0;
@@ -86,3 +104,21 @@ void events_delete_srv(void)
 	if (st_ev.srv_accept)
 		free(st_ev.srv_accept);
 }
+
+struct ev_async *events_get_commit(void)
+{
+	return st_ev.nft_commit;
+}
+
+struct ev_async *events_create_commit(void)
+{
+	st_ev.nft_commit = (struct ev_async *)malloc(sizeof(struct ev_async));
+	return st_ev.nft_commit;
+}
+
+void events_delete_commit(void)
+{
+	if (st_ev.nft_commit)
+		free(st_ev.nft_commit);
+	st_ev.nft_commit = NULL;
+}
@@ -28,6 +28,7 @@
 #include "farms.h"
 #include "objects.h"
 #include "network.h"
+#include "nft.h"
 #include "u_log.h"
 
 static struct farmaddress * farmaddress_create(struct farm *f, struct address *a)
@@ -44,6 +45,7 @@ static struct farmaddress * farmaddress_create(struct farm *f, struct address *a
 	f->addresses_used++;
 
 	list_add_tail(&fa->list, &f->addresses);
+	list_add_tail(&fa->address_list, &a->farms);
 	a->used++;
 
 	if (f->policies_used)
@@ -58,6 +60,7 @@ static int farmaddress_delete(struct farmaddress *fa)
 		return 0;
 
 	list_del(&fa->list);
+	list_del(&fa->address_list);
 
 	if (fa->farm->addresses_used > 0)
 		fa->farm->addresses_used--;
@@ -68,6 +71,7 @@ static int farmaddress_delete(struct farmaddress *fa)
 	if (address_not_used(fa->address))
 		address_delete(fa->address);
 
+	nft_txn_forget(fa, sizeof(struct farmaddress));
 	free(fa);
 
 	return 0;
@@ -133,6 +137,7 @@ int farmaddress_set_action(struct farmaddress *fa, int action)
 		if (action != ACTION_RELOAD && f->policies_used) {
 			f->policies_action = action;
 			fa->address->policies_action = action;
+			address_set_dirty(fa->address);
 		}
 
 		return 1;
@@ -164,17 +169,17 @@ int farmaddress_s_delete(struct farm *f)
 	return 0;
 }
 
-int farmaddress_s_lookup_address_action(struct farm *f, char *name, int action)
+int farmaddress_lookup_address_action(struct farmaddress *fa, int action)
 {
-	struct farmaddress *fa;
+	struct farm *f = fa->farm;
 	int ret = 0;
 
-	fa = farmaddress_lookup_by_name(f, name);
-	if (fa)
-		ret = farmaddress_set_action(fa, action);
+	ret = farmaddress_set_action(fa, action);
 
-	if (ret)
+	if (ret) {
 		f->action = ACTION_RELOAD;
+		farm_set_dirty(f);
+	}
 
 	return ret;
 }
@@ -368,9 +373,11 @@ int farmaddress_rename_default(struct config_pair *c)
 	if (!strstr(a->name, "-addr"))
 		return 1;
 
+	u_hash_del(obj_get_addresses_index(), a->name, a);
 	free(a->name);
 	farmaddress_set_default_addr_name(fa_name, c->str_value);
 	obj_set_attribute_string(fa_name, &a->name);
+	u_hash_add(obj_get_addresses_index(), a->name, a);
 
 	return 0;
 }
@@ -28,6 +28,7 @@
 #include "farmaddress.h"
 #include "objects.h"
 #include "network.h"
+#include "nft.h"
 #include "u_log.h"
 
 
@@ -51,6 +52,7 @@ static struct farmpolicy * farmpolicy_create(struct farm *f, struct policy *p)
 	f->policies_used++;
 
 	list_add_tail(&fp->list, &f->policies);
+	list_add_tail(&fp->policy_list, &p->farms);
 
 	return fp;
 }
@@ -61,6 +63,7 @@ static int farmpolicy_delete(struct farmpolicy *fp)
 		return 0;
 
 	list_del(&fp->list);
+	list_del(&fp->policy_list);
 
 	if (fp->farm->policies_used > 0)
 		fp->farm->policies_used--;
@@ -68,6 +71,7 @@ static int farmpolicy_delete(struct farmpolicy *fp)
 	if (fp->policy->used > 0)
 		fp->policy->used--;
 
+	nft_txn_forget(fp, sizeof(struct farmpolicy));
 	free(fp);
 
 	return 0;
@@ -111,6 +115,7 @@ int farmpolicy_set_action(struct farmpolicy *fp, int action)
 	if (fp->action > action) {
 		fp->action = action;
 		fp->policy->action = ACTION_RELOAD;
+		policy_set_dirty(fp->policy);
 		// deactivate policies if it's the only one used
 		if (f->policies_used == 1 && fp->action == ACTION_STOP)
 			f->policies_action = action;
@@ -147,16 +152,14 @@ int farmpolicy_s_delete(struct farm *f)
 	return 0;
 }
 
-int farmpolicy_s_lookup_policy_action(struct farm *f, char *name, int action)
+int farmpolicy_lookup_policy_action(struct farmpolicy *fp, int action)
 {
-	struct farmpolicy *fp;
+	struct farm *f = fp->farm;
 	int ret = 0;
 
-	u_log_print(LOG_DEBUG, "%s():%d: looking for policy %s in farm %s", __FUNCTION__, __LINE__, name, f->name);
+	u_log_print(LOG_DEBUG, "%s():%d: policy %s in farm %s", __FUNCTION__, __LINE__, fp->policy->name, f->name);
 
-	fp = farmpolicy_lookup_by_name(f, name);
-	if (fp)
-		ret = farmpolicy_set_action(fp, action);
+	ret = farmpolicy_set_action(fp, action);
 
 	if (ret) {
 		farm_set_action(f, ACTION_RELOAD);
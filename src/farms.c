@@ -36,6 +36,8 @@
 #include "nftst.h"
 #include "u_log.h"
 
+static unsigned int farm_seq = 0;
+
 static struct farm * farm_create(char *name)
 {
 	struct list_head *farms = obj_get_farms();
@@ -59,6 +61,7 @@ static struct farm * farm_create(char *name)
 	pfarm->schedparam = DEFAULT_SCHEDPARAM;
 	pfarm->persistence = DEFAULT_PERSIST;
 	pfarm->persistttl = DEFAULT_PERSISTTM;
+	pfarm->persistsize = DEFAULT_PERSISTSIZE;
 	pfarm->helper = DEFAULT_HELPER;
 	pfarm->log = DEFAULT_LOG;
 	pfarm->logprefix = DEFAULT_LOG_LOGPREFIX;
@@ -68,8 +71,15 @@ static struct farm * farm_create(char *name)
 	pfarm->state = DEFAULT_FARM_STATE;
 	pfarm->action = DEFAULT_ACTION;
 	pfarm->reload_action = VALUE_RLD_NONE;
+	pfarm->reload_helper = DEFAULT_HELPER;
+	pfarm->reload_flow_offload = DEFAULT_FLOWOFFLOAD;
 
 	init_list_head(&pfarm->backends);
+	u_hash_init(&pfarm->backends_index);
+	u_hash_init(&pfarm->backends_ipaddr_index);
+	u_hash_init(&pfarm->backends_ethaddr_index);
+	u_hash_init(&pfarm->backends_mark_index);
+	pfarm->backends_mark_dirty = 1;
 	init_list_head(&pfarm->policies);
 
 	pfarm->total_weight = 0;
@@ -101,14 +111,26 @@ static struct farm * farm_create(char *name)
 	pfarm->policies_used = 0;
 	pfarm->policies_action = ACTION_NONE;
 	pfarm->nft_chains = 0;
+	pfarm->nft_bck_maps = 0;
+	pfarm->nft_sched_slots = 0;
+	pfarm->nft_fingerprint = 0;
+	pfarm->nft_frag = NULL;
+	pfarm->nft_bck_elems = NULL;
+	pfarm->seq = farm_seq++;
+	init_list_head(&pfarm->dirty);
 
 	init_list_head(&pfarm->static_sessions);
+	u_hash_init(&pfarm->static_sessions_index);
 	pfarm->total_static_sessions = 0;
 	init_list_head(&pfarm->timed_sessions);
+	u_hash_init(&pfarm->timed_sessions_index);
 	pfarm->total_timed_sessions = 0;
+	pfarm->timed_sessions_stamp = 0;
 
 	list_add_tail(&pfarm->list, farms);
+	u_hash_add(obj_get_farms_index(), pfarm->name, pfarm);
 	obj_set_total_farms(obj_get_total_farms() + 1);
+	farm_set_dirty(pfarm);
 
 	init_list_head(&pfarm->addresses);
 	pfarm->addresses_used = 0;
@@ -123,10 +145,19 @@ static int farm_delete(struct farm *pfarm)
 
 	u_log_print(LOG_DEBUG, "%s():%d: deleting farm %s", __FUNCTION__, __LINE__, pfarm->name);
 
+	session_s_delete(pfarm, SESSION_TYPE_TIMED);
 	backend_s_delete(pfarm);
 	farmpolicy_s_delete(pfarm);
 	farmaddress_s_delete(pfarm);
 	list_del(&pfarm->list);
+	list_del_init(&pfarm->dirty);
+	u_hash_del(obj_get_farms_index(), pfarm->name, pfarm);
+	u_hash_clean(&pfarm->backends_index);
+	u_hash_clean(&pfarm->backends_ipaddr_index);
+	u_hash_clean(&pfarm->backends_ethaddr_index);
+	u_hash_clean(&pfarm->backends_mark_index);
+	u_hash_clean(&pfarm->static_sessions_index);
+	u_hash_clean(&pfarm->timed_sessions_index);
 
 	if (pfarm->name && strcmp(pfarm->name, "") != 0)
 		free(pfarm->name);
@@ -147,6 +178,8 @@ static int farm_delete(struct farm *pfarm)
 	if (pfarm->tcpstrict_logprefix && strcmp(pfarm->tcpstrict_logprefix, DEFAULT_LOGPREFIX) != 0)
 		free(pfarm->tcpstrict_logprefix);
 
+	nft_farm_release(pfarm);
+	nft_txn_forget(pfarm, sizeof(struct farm));
 	free(pfarm);
 	obj_set_total_farms(obj_get_total_farms() - 1);
 
@@ -364,6 +397,7 @@ static int farm_set_mode(struct farm *f, int new_value)
 	u_log_print(LOG_DEBUG, "%s():%d: farm %s old mode %d new mode %d", __FUNCTION__, __LINE__, f->name, old_value, new_value);
 
 	if (old_value != new_value) {
+		session_s_delete(f, SESSION_TYPE_TIMED);
 		f->mode = new_value;
 		farm_set_netinfo(f);
 		backend_s_validate(f);
@@ -398,6 +432,7 @@ static int farm_set_persistence(struct farm *f, int new_value)
 	u_log_print(LOG_DEBUG, "%s():%d: farm %s old persistence %d new persistence %d", __FUNCTION__, __LINE__, f->name, old_value, new_value);
 
 	session_s_delete(f, SESSION_TYPE_STATIC);
+	session_s_delete(f, SESSION_TYPE_TIMED);
 
 	f->persistence = new_value;
 
@@ -478,6 +513,7 @@ static void farm_print(struct farm *f)
 	obj_print_meta(f->persistence, (char *)buf);
 	u_log_print(LOG_DEBUG,"    [%s] %s", CONFIG_KEY_PERSIST, buf);
 	u_log_print(LOG_DEBUG,"    [%s] %d", CONFIG_KEY_PERSISTTM, f->persistttl);
+	u_log_print(LOG_DEBUG,"    [%s] %d", CONFIG_KEY_PERSISTSIZE, f->persistsize);
 
 	u_log_print(LOG_DEBUG,"    [%s] %s", CONFIG_KEY_HELPER, obj_print_helper(f->helper));
 
@@ -736,6 +772,9 @@ int farm_changed(struct config_pair *c)
 	case KEY_PERSISTTM:
 		return !obj_equ_attribute_int(f->persistttl, c->int_value);
 		break;
+	case KEY_PERSISTSIZE:
+		return !obj_equ_attribute_int(f->persistsize, c->int_value);
+		break;
 	case KEY_HELPER:
 		return !obj_equ_attribute_int(f->helper, c->int_value);
 		break;
@@ -873,15 +912,7 @@ void farm_s_print(void)
 
 struct farm * farm_lookup_by_name(const char *name)
 {
-	struct list_head *farms = obj_get_farms();
-	struct farm *f;
-
-	list_for_each_entry(f, farms, list) {
-		if (strcmp(f->name, name) == 0)
-			return f;
-	}
-
-	return NULL;
+	return (struct farm *)u_hash_lookup(obj_get_farms_index(), name);
 }
 
 int farm_is_ingress_mode(struct farm *f)
@@ -961,15 +992,84 @@ int farm_set_oface_info(struct farm *f)
 	return 0;
 }
 
+/* attributes whose rules can be updated without rebuilding the rest of the farm */
+static int farm_get_reload_attr(struct farm *f, struct config_pair *c)
+{
+	int masquerade;
+
+	if (f->state != VALUE_STATE_UP || farm_is_ingress_mode(f))
+		return VALUE_RLD_NONE;
+
+	switch (c->key) {
+	case KEY_LOG:
+		return VALUE_RLD_LOG;
+	case KEY_LOGPREFIX:
+		return VALUE_RLD_LOGPREFIX;
+	case KEY_HELPER:
+		return VALUE_RLD_HELPER;
+	case KEY_PERSISTTM:
+		return VALUE_RLD_PERSISTTM;
+	case KEY_FLOWOFFLOAD:
+		return VALUE_RLD_FLOWOFFLOAD;
+	case KEY_SCHED:
+	case KEY_SCHEDPARAM:
+		return VALUE_RLD_SCHED;
+	case KEY_SRCADDR:
+		// the masquerade is part of the backend marks
+		masquerade = ((f->mode == VALUE_MODE_SNAT || f->mode == VALUE_MODE_LOCAL) && (!c->str_value || strcmp(c->str_value, "") == 0));
+		if (masquerade != farm_get_masquerade(f))
+			return VALUE_RLD_NONE;
+		return VALUE_RLD_SRCADDR;
+	default:
+		break;
+	}
+
+	return VALUE_RLD_NONE;
+}
+
+static void farm_set_reload_attr(struct farm *f, int reload)
+{
+	// keep the values applied in the ruleset until the reload replaces them
+	if ((reload & VALUE_RLD_HELPER) && !(f->reload_action & VALUE_RLD_HELPER))
+		f->reload_helper = f->helper;
+	if ((reload & VALUE_RLD_FLOWOFFLOAD) && !(f->reload_action & VALUE_RLD_FLOWOFFLOAD))
+		f->reload_flow_offload = f->flow_offload;
+
+	f->reload_action |= reload;
+}
+
+static int farm_set_attrs_action(struct farm *f)
+{
+	int attrs_only = (f->action == ACTION_NONE ||
+					  (f->action == ACTION_RELOAD && (f->reload_action & VALUE_RLD_ATTRS)));
+	int ret;
+
+	u_log_print(LOG_DEBUG, "%s():%d: farm %s attributes changed", __FUNCTION__, __LINE__, f->name);
+
+	ret = farm_set_action(f, ACTION_RELOAD);
+
+	if (attrs_only && f->action == ACTION_RELOAD)
+		f->reload_action |= VALUE_RLD_ATTRS;
+
+	return ret;
+}
+
 int farm_pre_actionable(struct config_pair *c)
 {
 	struct farm *f = obj_get_current_farm();
+	int reload;
 
 	if (!f)
 		return -1;
 
 	u_log_print(LOG_DEBUG, "%s():%d: pre actionable farm %s with param %d", __FUNCTION__, __LINE__, f->name, c->key);
 
+	reload = farm_get_reload_attr(f, c);
+	if (reload != VALUE_RLD_NONE) {
+		farm_set_reload_attr(f, reload);
+		return ACTION_RELOAD;
+	}
+
 	switch (c->key) {
 	case KEY_NAME:
 		break;
@@ -983,6 +1083,7 @@ int farm_pre_actionable(struct config_pair *c)
 	case KEY_PROTO:
 	case KEY_PERSISTENCE:
 	case KEY_PERSISTTM:
+	case KEY_PERSISTSIZE:
 	case KEY_FLOWOFFLOAD:
 	case KEY_LOG:
 	case KEY_HELPER:
@@ -998,7 +1099,7 @@ int farm_pre_actionable(struct config_pair *c)
 	return ACTION_START;
 }
 
-int farm_pos_actionable(struct config_pair *c)
+int farm_pos_actionable(struct config_pair *c, int action)
 {
 	struct farm *f = obj_get_current_farm();
 
@@ -1007,6 +1108,11 @@ int farm_pos_actionable(struct config_pair *c)
 
 	u_log_print(LOG_DEBUG, "%s():%d: pos actionable farm %s with param %d", __FUNCTION__, __LINE__, f->name, c->key);
 
+	if (action == ACTION_RELOAD) {
+		farm_set_attrs_action(f);
+		return 0;
+	}
+
 	switch (c->key) {
 	case KEY_NAME:
 		break;
@@ -1020,6 +1126,7 @@ int farm_pos_actionable(struct config_pair *c)
 	case KEY_PROTO:
 	case KEY_PERSISTENCE:
 	case KEY_PERSISTTM:
+	case KEY_PERSISTSIZE:
 	case KEY_FLOWOFFLOAD:
 	case KEY_LOG:
 	case KEY_HELPER:
@@ -1067,8 +1174,10 @@ int farm_set_attribute(struct config_pair *c)
 		nf = farm_lookup_by_name(c->str_value);
 		if (!nf) {
 			farmaddress_rename_default(c);
+			u_hash_del(obj_get_farms_index(), f->name, f);
 			free(f->name);
 			obj_set_attribute_string(c->str_value, &f->name);
+			u_hash_add(obj_get_farms_index(), f->name, f);
 		}
 		ret = PARSER_OK;
 		break;
@@ -1169,9 +1278,19 @@ int farm_set_attribute(struct config_pair *c)
 		ret = farm_set_persistence(f, c->int_value);
 		break;
 	case KEY_PERSISTTM:
+		// the persistence map is created again with the new timeout
+		if (f->persistttl != c->int_value)
+			session_s_delete(f, SESSION_TYPE_TIMED);
 		f->persistttl = c->int_value;
 		ret = PARSER_OK;
 		break;
+	case KEY_PERSISTSIZE:
+		// the persistence map is created again with the new size
+		if (f->persistsize != c->int_value)
+			session_s_delete(f, SESSION_TYPE_TIMED);
+		f->persistsize = c->int_value;
+		ret = PARSER_OK;
+		break;
 	case KEY_PRIORITY:
 		farm_set_priority(f, c->int_value);
 		ret = PARSER_OK;
@@ -1282,6 +1401,10 @@ int farm_set_action(struct farm *f, int action)
 	u_log_print(LOG_DEBUG, "%s():%d: farm %s action is %d - new action %d state %d", __FUNCTION__, __LINE__, f->name, f->action, action, f->state);
 	int force = 0;
 
+	// only backend membership and attributes changes are able to skip the rules rebuild
+	if (action == ACTION_RELOAD)
+		f->reload_action &= ~(VALUE_RLD_BCKS | VALUE_RLD_ATTRS);
+
 	if (action == ACTION_STOP && f->state == VALUE_STATE_CONFERR) {
 		f->policies_action = ACTION_NONE;
 		if (farm_validate(f)) {
@@ -1304,20 +1427,56 @@ int farm_set_action(struct farm *f, int action)
 		return 1;
 	}
 
+	// the persistence map is deleted along with the farm rules
+	if (action == ACTION_STOP)
+		session_s_delete(f, SESSION_TYPE_TIMED);
+
 	if (f->action > action || force) {
 		backend_s_gen_priority(f, ACTION_RELOAD);
 		farm_manage_eventd();
 		f->action = action;
+		farm_set_dirty(f);
 		farm_set_netinfo(f);
 		backend_s_validate(f);
 		if (action == ACTION_STOP || action == ACTION_START)
 			farmaddress_s_set_action(f, action);
+		if (action == ACTION_RELOAD)
+			f->reload_action &= ~(VALUE_RLD_BCKS | VALUE_RLD_ATTRS);
 		return 1;
 	}
 
 	return 0;
 }
 
+/* the rules of the farm were rejected, keep it out of the ruleset until it is reconfigured */
+void farm_set_config_error(struct farm *f)
+{
+	u_log_print(LOG_INFO, "%s():%d: farm %s set to config error", __FUNCTION__, __LINE__, f->name);
+
+	f->state = VALUE_STATE_CONFERR;
+	f->action = ACTION_NONE;
+	f->reload_action = VALUE_RLD_NONE;
+	f->policies_action = ACTION_NONE;
+	list_del_init(&f->dirty);
+	farm_manage_eventd();
+}
+
+int farm_set_bcks_action(struct farm *f)
+{
+	int bcks_only = (f->action == ACTION_NONE ||
+					 (f->action == ACTION_RELOAD && (f->reload_action & VALUE_RLD_BCKS)));
+	int ret;
+
+	u_log_print(LOG_DEBUG, "%s():%d: farm %s backends changed", __FUNCTION__, __LINE__, f->name);
+
+	ret = farm_set_action(f, ACTION_RELOAD);
+
+	if (bcks_only && f->action == ACTION_RELOAD)
+		f->reload_action |= VALUE_RLD_BCKS;
+
+	return ret;
+}
+
 int farm_s_set_action(int action)
 {
 	struct list_head *farms = obj_get_farms();
@@ -1349,8 +1508,10 @@ int farm_s_clean_nft_chains(void)
 	if (!farms)
 		return 0;
 
-	list_for_each_entry_safe(f, next, farms, list)
+	list_for_each_entry_safe(f, next, farms, list) {
 		f->nft_chains = 0;
+		f->nft_bck_maps = 0;
+	}
 
 	return 0;
 }
@@ -1364,6 +1525,34 @@ int farm_get_masquerade(struct farm *f)
 	return masq;
 }
 
+/* rejected insertions of the bounded persistence maps, one map per family */
+int farm_get_persist_rejected(struct farm *f, unsigned long long *rejected)
+{
+	struct farmaddress *fa;
+	struct nftst *n;
+	unsigned long long addr_rejected;
+	int families = 0;
+	int ret = -1;
+
+	*rejected = 0;
+
+	n = nftst_create_from_farm(f);
+	list_for_each_entry(fa, &f->addresses, list) {
+		if (families & (1 << fa->address->family))
+			continue;
+		families |= 1 << fa->address->family;
+
+		nftst_set_address(n, fa->address);
+		if (nft_get_persist_rejected(n, &addr_rejected))
+			continue;
+		*rejected += addr_rejected;
+		ret = 0;
+	}
+	nftst_delete(n);
+
+	return ret;
+}
+
 void farm_s_set_backend_ether_by_oifidx(int interface_idx, const char * ip_bck, char * ether_bck)
 {
 	struct list_head *farms = obj_get_farms();
@@ -1389,42 +1578,47 @@ void farm_s_set_backend_ether_by_oifidx(int interface_idx, const char * ip_bck,
 	}
 }
 
-int farm_s_lookup_policy_action(char *name, int action)
+int farm_s_lookup_policy_action(struct policy *p, int action)
 {
-	struct list_head *farms = obj_get_farms();
-	struct farm *f, *next;
+	struct farmpolicy *fp, *next;
 
-	u_log_print(LOG_DEBUG, "%s():%d: policy %s action %d", __FUNCTION__, __LINE__, name, action);
+	u_log_print(LOG_DEBUG, "%s():%d: policy %s action %d", __FUNCTION__, __LINE__, p->name, action);
 
-	list_for_each_entry_safe(f, next, farms, list)
-		farmpolicy_s_lookup_policy_action(f, name, action);
+	list_for_each_entry_safe(fp, next, &p->farms, policy_list)
+		farmpolicy_lookup_policy_action(fp, action);
 
 	return 0;
 }
 
-int farm_s_lookup_address_action(char *name, int action)
+/* the address could be deleted along with its last farm, don't use it afterwards */
+int farm_s_lookup_address_action(struct address *a, int action)
 {
-	struct list_head *farms = obj_get_farms();
-	struct farm *f, *next;
+	struct farmaddress *fa, *next;
+	struct list_head *farms = &a->farms;
 	int ret = 0;
+	int last;
 
-	u_log_print(LOG_DEBUG, "%s():%d: address %s action %d", __FUNCTION__, __LINE__, name, action);
+	u_log_print(LOG_DEBUG, "%s():%d: address %s action %d", __FUNCTION__, __LINE__, a->name, action);
 
-	list_for_each_entry_safe(f, next, farms, list)
-		ret |= farmaddress_s_lookup_address_action(f, name, action);
+	list_for_each_entry_safe(fa, next, farms, address_list) {
+		last = (&next->address_list == farms);
+		ret |= farmaddress_lookup_address_action(fa, action);
+		// deleting the last farm address frees the address and the list head
+		if (last)
+			break;
+	}
 
 	return ret;
 }
 
-int farm_rulerize(struct farm *f)
+/* clear the action of a farm that can't be rulerized */
+static int farm_rulerize_ready(struct farm *f)
 {
-	u_log_print(LOG_DEBUG, "%s():%d: rulerize farm %s action %d", __FUNCTION__, __LINE__, f->name, f->action);
-
-	farm_print(f);
-
 	if (f->action == ACTION_NONE)
 		return 0;
 
+	farm_print(f);
+
 	if (f->state == VALUE_STATE_CONFERR && farm_validate(f))
 		farm_set_state(f, VALUE_STATE_UP);
 
@@ -1437,26 +1631,74 @@ int farm_rulerize(struct farm *f)
 		return 0;
 	}
 
+	return 1;
+}
+
+int farm_rulerize(struct farm *f)
+{
+	u_log_print(LOG_DEBUG, "%s():%d: rulerize farm %s action %d", __FUNCTION__, __LINE__, f->name, f->action);
+
+	list_del_init(&f->dirty);
+
+	if (!farm_rulerize_ready(f))
+		return 0;
+
 	return nft_rulerize_farms(f);
 }
 
 int farm_s_rulerize(void)
 {
-	struct list_head *farms = obj_get_farms();
-	struct farm *f, *next;
+	struct list_head *dirty = obj_get_farms_dirty();
+	struct farm *f;
 	int ret = 0;
 	int output = 0;
 
-	u_log_print(LOG_DEBUG, "%s():%d: rulerize everything", __FUNCTION__, __LINE__);
+	u_log_print(LOG_DEBUG, "%s():%d: rulerize changed farms", __FUNCTION__, __LINE__);
 
-	list_for_each_entry_safe(f, next, farms, list) {
-		ret = farm_rulerize(f);
+	// the farms generated ahead are the ones that will be rulerized
+	list_for_each_entry(f, dirty, dirty)
+		farm_rulerize_ready(f);
+
+	nft_rulerize_farms_prepare(dirty);
+
+	while (!list_empty(dirty)) {
+		f = list_first_entry(dirty, struct farm, dirty);
+		u_log_print(LOG_DEBUG, "%s():%d: rulerize farm %s action %d", __FUNCTION__, __LINE__, f->name, f->action);
+		list_del_init(&f->dirty);
+		ret = (f->action != ACTION_NONE) ? nft_rulerize_farms(f) : 0;
 		output = output || ret;
 	}
 
+	nft_rulerize_farms_release();
+
 	return output;
 }
 
+/* queue the farm for the next rulerize, keeping the creation order of the farms list */
+void farm_set_dirty(struct farm *f)
+{
+	struct list_head *dirty = obj_get_farms_dirty();
+	struct farm *pos;
+
+	if (!list_empty(&f->dirty))
+		return;
+
+	list_for_each_entry_reverse(pos, dirty, dirty) {
+		if (pos->seq < f->seq)
+			break;
+	}
+	list_add(&f->dirty, &pos->dirty);
+}
+
+void farm_s_set_dirty(void)
+{
+	struct list_head *farms = obj_get_farms();
+	struct farm *f;
+
+	list_for_each_entry(f, farms, list)
+		farm_set_dirty(f);
+}
+
 int farm_get_mark(struct farm *f)
 {
 	int mark = f->mark;
@@ -1469,24 +1711,21 @@ int farm_get_mark(struct farm *f)
 
 void farm_s_set_oface_info(struct address *a)
 {
-	struct list_head *farms = obj_get_farms();
-	struct farm *f, *next;
 	struct farmaddress *fa;
+	struct farm *f;
 
 	if (!a->iface)
 		return;
 
-	list_for_each_entry_safe(f, next, farms, list) {
+	list_for_each_entry(fa, &a->farms, address_list) {
+		f = fa->farm;
 		if (f->ofidx != DEFAULT_IFIDX)
 			continue;
 
-		fa = farmaddress_lookup_by_name(f, a->name);
-		if (fa) {
-			if (a->iface)
-				obj_set_attribute_string(a->iface, &f->oface);
-			if (a->iethaddr)
-				obj_set_attribute_string(a->iethaddr, &f->oethaddr);
-			f->ofidx = a->ifidx;
-		}
+		if (a->iface)
+			obj_set_attribute_string(a->iface, &f->oface);
+		if (a->iethaddr)
+			obj_set_attribute_string(a->iethaddr, &f->oethaddr);
+		f->ofidx = a->ifidx;
 	}
 }
@@ -39,9 +39,29 @@
 #define NFTLB_BG_MODE			1
 #define NFTLB_EXIT_MODE			1
 #define NFTLB_NFT_SERIALIZE		0
+#define NFTLB_NFT_NETLINK		0
+#define NFTLB_NFT_SYNC			0
+#define NFTLB_NFT_BCK_MAPS		0
+#define NFTLB_NFT_INTERVAL_MAPS	0
+#define NFTLB_NFT_OPTIMIZE		0
+#define NFTLB_NFT_WARM_START	0
+#define NFTLB_NFT_MAX_BYTES		0
+#define NFTLB_NFT_MAX_ELEMENTS	20000
+#define NFTLB_SESSIONS_TTL		0
+#define NFTLB_NFT_LISTING		0
 #define NFTLB_SERVER_KEY_VAR	"NFTLB_SERVER_KEY"
 
 unsigned int serialize = NFTLB_NFT_SERIALIZE;
+unsigned int netlink_batch = NFTLB_NFT_NETLINK;
+unsigned int nft_max_bytes = NFTLB_NFT_MAX_BYTES;
+unsigned int nft_max_elements = NFTLB_NFT_MAX_ELEMENTS;
+static unsigned int nft_sync = NFTLB_NFT_SYNC;
+static unsigned int nft_warm = NFTLB_NFT_WARM_START;
+unsigned int nft_bck_maps = NFTLB_NFT_BCK_MAPS;
+unsigned int nft_interval_maps = NFTLB_NFT_INTERVAL_MAPS;
+unsigned int nft_optimize = NFTLB_NFT_OPTIMIZE;
+unsigned int sessions_ttl = NFTLB_SESSIONS_TTL;
+unsigned int nft_listing = NFTLB_NFT_LISTING;
 int masquerade_mark = NFTLB_MASQUERADE_MARK_DEFAULT;
 
 static void print_usage(const char *prog_name)
@@ -61,6 +81,16 @@ static void print_usage(const char *prog_name)
 		"  [ -H <HOST> | --host <HOST> ]		Set the host for the listening port\n"
 		"  [ -P <PORT> | --port <PORT> ]		Set the port for the listening port\n"
 		"  [ -S | --serial ]			Serialize nft commands\n"
+		"  [ -s | --sync ]			Execute nft commits in the event loop instead of a worker thread\n"
+		"  [ -W | --warm-start ]		Adopt the existing nftlb tables and replace their rules in a single commit instead of deleting them\n"
+		"  [ -n | --netlink ]			Send set elements through a netlink batch\n"
+		"  [ -B | --backend-maps ]		Keep the farm backends in named maps updated by elements\n"
+		"  [ -I | --interval-maps ]		Use port ranges in the service maps, it requires concatenated intervals support\n"
+		"  [ -O | --optimize ]			Deduplicate, cancel and merge the generated nft commands before every commit\n"
+		"  [ -b <BYTES> | --batch-bytes <BYTES> ]	Split nft commands bigger than the given size, not atomic, disabled by default\n"
+		"  [ -E <ELEMS> | --batch-elements <ELEMS> ]	Split element lists longer than the given size, 0 to disable\n"
+		"  [ -T <SECONDS> | --sessions-ttl <SECONDS> ]	Keep the dumped timed sessions cached for backend changes, 0 to disable\n"
+		"  [ -N | --nft-listing ]		Read the timed sessions from the nft listing instead of a netlink dump\n"
 		"  [ -m | --masquerade-mark ]			Set masquerade mark in hex\n"
 		, prog_name, VERSION, prog_name);
 }
@@ -77,17 +107,20 @@ static const struct option options[] = {
 	{ .name = "host",	.has_arg = 1,	.val = 'H' },
 	{ .name = "port",	.has_arg = 1,	.val = 'P' },
 	{ .name = "serial",	.has_arg = 0,	.val = 'S' },
+	{ .name = "sync",	.has_arg = 0,	.val = 's' },
+	{ .name = "warm-start",	.has_arg = 0,	.val = 'W' },
+	{ .name = "netlink",	.has_arg = 0,	.val = 'n' },
+	{ .name = "backend-maps",	.has_arg = 0,	.val = 'B' },
+	{ .name = "interval-maps",	.has_arg = 0,	.val = 'I' },
+	{ .name = "optimize",	.has_arg = 0,	.val = 'O' },
+	{ .name = "batch-bytes",	.has_arg = 1,	.val = 'b' },
+	{ .name = "batch-elements",	.has_arg = 1,	.val = 'E' },
+	{ .name = "sessions-ttl",	.has_arg = 1,	.val = 'T' },
+	{ .name = "nft-listing",	.has_arg = 0,	.val = 'N' },
 	{ .name = "masquerade-mark",	.has_arg = 1,	.val = 'm' },
 	{ NULL },
 };
 
-static void nftlb_sighandler(int signo)
-{
-	u_log_print(LOG_INFO, "shutting down %s, bye", PACKAGE);
-	server_fini();
-	exit(EXIT_SUCCESS);
-}
-
 static void nftlb_trace() {
 	int level;
 
@@ -105,8 +138,17 @@ static int main_process(const char *config, int mode)
 {
 	objects_init();
 
-	if (nft_check_tables())
-		nft_reset();
+	if (nft_init() != 0) {
+		u_log_print(LOG_ERR, "Cannot initialize the nftables context");
+		return EXIT_FAILURE;
+	}
+
+	if (nft_check_tables()) {
+		if (nft_warm)
+			nft_warm_start();
+		else
+			nft_reset();
+	}
 
 	loop_init();
 
@@ -126,8 +168,15 @@ static int main_process(const char *config, int mode)
 		return EXIT_FAILURE;
 	}
 
+	if (!nft_sync && !serialize && nft_worker_init() != 0)
+		u_log_print(LOG_ERR, "Cannot start the commit worker, nft commits will be synchronous");
+
 	loop_run();
 
+	u_log_print(LOG_INFO, "shutting down %s, bye", PACKAGE);
+	server_fini();
+	nft_fini();
+
 	return EXIT_SUCCESS;
 }
 
@@ -142,7 +191,7 @@ int main(int argc, char *argv[])
 	pid_t	pid;
 	char *_server_key;
 
-	while ((c = getopt_long(argc, argv, "hl:L:c:k:ed6H:P:Sm:", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "hl:L:c:k:ed6H:P:SsWnBIOb:E:T:Nm:", options, NULL)) != -1) {
 		switch (c) {
 		case 'h':
 			print_usage(argv[0]);
@@ -178,6 +227,36 @@ int main(int argc, char *argv[])
 		case 'S':
 			serialize = 1;
 			break;
+		case 's':
+			nft_sync = 1;
+			break;
+		case 'W':
+			nft_warm = 1;
+			break;
+		case 'n':
+			netlink_batch = 1;
+			break;
+		case 'B':
+			nft_bck_maps = 1;
+			break;
+		case 'I':
+			nft_interval_maps = 1;
+			break;
+		case 'O':
+			nft_optimize = 1;
+			break;
+		case 'b':
+			nft_max_bytes = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'E':
+			nft_max_elements = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'T':
+			sessions_ttl = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'N':
+			nft_listing = 1;
+			break;
 		case 'm':
 			masquerade_mark = (int)strtol(optarg, NULL, 16);
 			break;
@@ -187,9 +266,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (signal(SIGINT, nftlb_sighandler) == SIG_ERR ||
-	    signal(SIGTERM, nftlb_sighandler) == SIG_ERR ||
-	    signal(SIGPIPE, SIG_IGN) == SIG_ERR ||
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR ||
 	    signal(SIGABRT, nftlb_trace) == SIG_ERR ||
 	    signal(SIGSEGV, nftlb_trace) == SIG_ERR) {
 		u_log_print(LOG_ERR, "Error assigning signals");
@@ -32,6 +32,9 @@
 #include "addresspolicy.h"
 #include "config.h"
 #include "list.h"
+#include "nlbatch.h"
+#include "nftir.h"
+#include "events.h"
 #include "u_sbuffer.h"
 #include "u_log.h"
 
@@ -39,6 +42,12 @@
 #include <nftables/libnftables.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
 
 #define NFTLB_MAX_CMD				2048
 #define NFTLB_MAX_IFACES			100
@@ -46,6 +55,7 @@
 #define NFTLB_MAX_OBJ_NAME			256
 #define NFTLB_MAX_OBJ_DEVICE		16
 #define NFTLB_MAX_OBJ_PROTO			11
+#define NFTLB_MAX_OBJ_PORTS			12
 
 #define NFTLB_TABLE_NAME			"nftlb"
 #define NFTLB_TABLE_PREROUTING		"prerouting"
@@ -107,6 +117,7 @@
 #define NFTLB_MAP_TYPE_MAC			"ether_addr"
 #define NFTLB_MAP_TYPE_MARK			"mark"
 #define NFTLB_MAP_TYPE_PROTO		"inet_proto"
+#define NFTLB_MAP_TYPE_IFINDEX		"iface_index"
 
 #define NFTLB_IPV4_FAMILY			0
 #define NFTLB_IPV6_FAMILY			1
@@ -130,6 +141,20 @@
 #define NFTLB_NFT_SADDR				"saddr"
 #define NFTLB_NFT_SPORT				"sport"
 
+#define NFTLB_BCK_MAP_SCHED			0
+#define NFTLB_BCK_MAP_ADDR			1
+#define NFTLB_BCK_MAP_ADDR_PORT		2
+#define NFTLB_BCK_MAP_ETHER			3
+#define NFTLB_BCK_MAP_PORT			4
+#define NFTLB_BCK_MAP_OFACE			5
+#define NFTLB_BCK_MAP_MAX			6
+
+#define NFTLB_SCHED_SLOTS_MIN		64
+#define NFTLB_SCHED_SLOTS_REPS		8
+
+#define NFTLB_FNV_OFFSET			0xcbf29ce484222325ULL
+#define NFTLB_FNV_PRIME				0x100000001b3ULL
+
 #define NFTLB_NFT_VERDICT_NONE		""
 #define NFTLB_NFT_VERDICT_DROP		"drop"
 #define NFTLB_NFT_VERDICT_ACCEPT	"accept"
@@ -152,9 +177,36 @@
 #define NFTLB_CHECK_AVAIL			0
 #define NFTLB_CHECK_USABLE			1
 
+#define NFTLB_TXN_UNDO_SIZE			256
+#define NFTLB_TXN_SEGS_SIZE			64
+#define NFTLB_TXN_MAX_RETRIES		3
+
+#define NFTLB_GEN_MIN_FARMS			64
+#define NFTLB_GEN_MAX_WORKERS		16
+#define NFTLB_GEN_OPS_SIZE			32
+
+#define NFTLB_EXEC_SILENT			0
+#define NFTLB_EXEC_RECOVERY			1
+#define NFTLB_EXEC_LOG				2
+
 extern unsigned int serialize;
+extern unsigned int netlink_batch;
+extern unsigned int nft_max_bytes;
+extern unsigned int nft_max_elements;
+extern unsigned int nft_bck_maps;
+extern unsigned int nft_interval_maps;
+extern unsigned int nft_optimize;
+extern unsigned int nft_listing;
 extern int masquerade_mark;
-struct nft_ctx *ctx = NULL;
+/* every thread executing commands owns its own context */
+static __thread struct nft_ctx *ctx = NULL;
+
+struct nft_elem_block {
+	struct u_buffer			*buf;
+	char					head[NFTLB_MAX_CMD];
+	unsigned int			elements;
+	int						begin;
+};
 
 int nftlb_flowtable_prio = NFTLB_FLOWTABLE_BASE_PRIO;
 
@@ -217,6 +269,113 @@ struct nft_chain_srv_counters {
 
 struct nft_chain_srv_counters service_counters[NFTLB_F_CHAIN_MAX];
 
+/*
+ * Updates of the base rules and the service counters found while a farm is
+ * generated ahead by the pool. They depend on the farms before, so they're
+ * applied at their position of the farm commands once the farm takes its
+ * turn, as a serial generation would do.
+ */
+enum nft_gen_op_kind {
+	NFTLB_GEN_OP_TABLE,
+	NFTLB_GEN_OP_CHAIN,
+	NFTLB_GEN_OP_COUNTERS,
+	NFTLB_GEN_OP_SNAT_BEGIN,
+	NFTLB_GEN_OP_SNAT_END,
+};
+
+struct nft_gen_op {
+	enum nft_gen_op_kind	kind;
+	int						offset;
+	struct nftst			n;
+	struct address			*address;
+	int						type;
+	int						family;
+	int						rules;
+	int						qty;
+	int						action;
+};
+
+/* the commands of a farm generated ahead by the pool */
+struct nft_frag {
+	struct u_buffer			buf;
+	struct nft_gen_op		*ops;
+	int						ops_len;
+	int						ops_size;
+	struct nft_gen_op		lost;
+	unsigned long long		fingerprint;
+};
+
+struct nft_gen_stct {
+	pthread_t				threads[NFTLB_GEN_MAX_WORKERS];
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+	pthread_cond_t			done;
+	struct farm				**farms;
+	int						total;
+	int						next;
+	int						workers;
+	int						busy;
+	int						stop;
+	unsigned int			batch;
+};
+
+static struct nft_gen_stct st_gen = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.cond		= PTHREAD_COND_INITIALIZER,
+	.done		= PTHREAD_COND_INITIALIZER,
+	.workers	= 0,
+};
+
+/* the farm being generated by the current pool thread */
+static __thread struct nft_frag *gen_frag = NULL;
+
+/*
+ * Keep an update of the shared state for the farm generated by the current
+ * pool thread, or return NULL to apply it right away.
+ */
+static struct nft_gen_op *nft_gen_defer(enum nft_gen_op_kind kind)
+{
+	struct nft_frag *frag = gen_frag;
+	struct nft_gen_op *ops;
+	int size;
+
+	if (!frag)
+		return NULL;
+
+	if (frag->ops_len == frag->ops_size) {
+		size = frag->ops_size ? frag->ops_size * 2 : NFTLB_GEN_OPS_SIZE;
+		ops = (struct nft_gen_op *)realloc(frag->ops, size * sizeof(struct nft_gen_op));
+		if (!ops) {
+			u_log_print(LOG_ERR, "%s():%d: unable to allocate the farm updates", __FUNCTION__, __LINE__);
+			return &frag->lost;
+		}
+		frag->ops = ops;
+		frag->ops_size = size;
+	}
+
+	memset(&frag->ops[frag->ops_len], 0, sizeof(struct nft_gen_op));
+	frag->ops[frag->ops_len].kind = kind;
+	frag->ops[frag->ops_len].offset = frag->buf.next;
+
+	return &frag->ops[frag->ops_len++];
+}
+
+struct nft_warm_obj {
+	char				*kind;
+	char				*family;
+	char				*name;
+};
+
+/* existing nftlb objects adopted by a warm start until the first commit */
+struct nft_warm_stct {
+	int					pending;
+	unsigned int		tables;
+	struct nft_warm_obj	*objs;
+	int					total;
+};
+
+static struct nft_warm_stct st_warm;
+
 static int get_chain_pos_counter(int type)
 {
 	if (type & NFTLB_F_CHAIN_ING_FILTER)
@@ -277,8 +436,19 @@ static unsigned int get_rules_needed(struct address *a)
 
 static void update_service_counters(struct address *a, int type, int structure, int family, int qty, int action)
 {
+	struct nft_gen_op *op = nft_gen_defer(NFTLB_GEN_OP_COUNTERS);
 	unsigned int *counter;
 
+	if (op) {
+		op->address = a;
+		op->type = type;
+		op->rules = structure;
+		op->family = family;
+		op->qty = qty;
+		op->action = action;
+		return;
+	}
+
 	if ((type & NFTLB_F_CHAIN_POS_SNAT) && structure)
 		counter = get_service_counter(type, NFTLB_IP_ACTIVE | NFTLB_MARK_ACTIVE, family);
 	else
@@ -350,6 +520,44 @@ struct nft_base_rules {
 
 struct nft_base_rules nft_base_rules;
 
+struct nft_txn_field {
+	int		*field;
+	int		value;
+};
+
+/* the commands generated by every object of the transaction */
+struct nft_txn_seg {
+	int		type;
+	void	*obj;
+	int		start;
+	int		end;
+};
+
+/* what is needed to roll back the objects of a commit that failed */
+struct nft_txn_log {
+	int						objects;
+	int						executed;
+	int						forgotten;
+	struct nft_txn_field	*undo;
+	int						undo_len;
+	int						undo_size;
+	struct nft_txn_seg		*segs;
+	int						segs_len;
+	int						segs_size;
+	struct list_head		elements;
+	struct nft_base_rules	base_rules;
+	struct nft_chain_srv_counters	service_counters[NFTLB_F_CHAIN_MAX];
+};
+
+struct nft_transaction {
+	int						depth;
+	int						retries;
+	struct u_buffer			buf;
+	struct nft_txn_log		log;
+};
+
+static struct nft_transaction nft_txn;
+
 static void print_nft_base_rules(void)
 {
 	u_log_print(LOG_DEBUG, "%s():    table ip = %d", __FUNCTION__, nft_base_rules.tables & NFTLB_TABLE_IP_ACTIVE);
@@ -392,6 +600,21 @@ static int reset_ndv_base(struct if_base_rule_list *ndv_if_rules)
 	return 0;
 }
 
+static void nft_txn_log_delete(struct nft_txn_log *log)
+{
+	if (!log)
+		return;
+
+	reset_ndv_base(&log->base_rules.ndv_ingress_rules);
+	reset_ndv_base(&log->base_rules.ndv_ingress_dnat_rules);
+	element_s_release(&log->elements);
+	if (log->undo)
+		free(log->undo);
+	if (log->segs)
+		free(log->segs);
+	free(log);
+}
+
 static void clean_rules_counters(void)
 {
 	reset_ndv_base(&nft_base_rules.ndv_ingress_rules);
@@ -471,659 +694,1820 @@ static int del_ndv_base(struct if_base_rule_list *ndv_if_rules, char *ifname)
 	return 0;
 }
 
-static int exec_cmd_open(char *cmd, const char **out, int error_output)
+static struct nft_ctx * nft_ctx_get(void)
 {
-	int error;
-
-	if (strlen(cmd) == 0 || strcmp(cmd, "") == 0)
-		return 0;
-
-	u_log_print(LOG_NOTICE, "nft command exec : %s", cmd);
+	if (ctx != NULL)
+		return ctx;
 
 	ctx = nft_ctx_new(0);
-	nft_ctx_buffer_error(ctx);
+	if (ctx == NULL) {
+		u_log_print(LOG_ERR, "%s():%d: unable to create the nft context", __FUNCTION__, __LINE__);
+		return NULL;
+	}
 
-	if (out != NULL)
-		nft_ctx_buffer_output(ctx);
+	nft_ctx_buffer_output(ctx);
+	nft_ctx_buffer_error(ctx);
 
-	error = nft_run_cmd_from_buffer(ctx, cmd);
+	return ctx;
+}
 
-	if (error && error_output) {
-		u_log_print(LOG_ERR, "nft command error : %s", nft_ctx_get_error_buffer(ctx));
-		obj_recovery();
-	}
+int nft_init(void)
+{
+	if (nft_ctx_get() == NULL)
+		return -1;
 
-	if (out != NULL)
-		*out = nft_ctx_get_output_buffer(ctx);
+	if (netlink_batch && nlbatch_init() != 0)
+		u_log_print(LOG_ERR, "%s():%d: netlink batch not available, using nft commands", __FUNCTION__, __LINE__);
 
-	return error;
+	return 0;
 }
 
-static void exec_cmd_close(const char *out)
+static void nft_ctx_release(void)
 {
 	if (ctx == NULL)
 		return;
 
-	if (out != NULL)
-		nft_ctx_unbuffer_output(ctx);
-
+	nft_ctx_unbuffer_output(ctx);
 	nft_ctx_unbuffer_error(ctx);
 	nft_ctx_free(ctx);
 	ctx = NULL;
 }
 
-static int exec_cmd(char *cmd)
+void nft_fini(void)
+{
+	nft_worker_fini();
+	nlbatch_fini();
+	nft_ctx_release();
+}
+
+static int exec_cmd_run(char *cmd, const char **out, int error_output)
 {
+	const char *output;
 	int error;
 
-	error = exec_cmd_open(cmd, NULL, 1);
-	exec_cmd_close(NULL);
+	if (out != NULL)
+		*out = NULL;
+
+	if (strlen(cmd) == 0 || strcmp(cmd, "") == 0)
+		return 0;
+
+	// the listings have to include the queued commits
+	if (out != NULL)
+		nft_commit_sync();
+
+	u_log_print(LOG_NOTICE, "nft command exec : %s", cmd);
+
+	if (nft_ctx_get() == NULL)
+		return -1;
+
+	error = nft_run_cmd_from_buffer(ctx, cmd);
+
+	/* fetching the buffers rewinds them for the next command */
+	output = nft_ctx_get_output_buffer(ctx);
+
+	if (error && error_output != NFTLB_EXEC_SILENT) {
+		u_log_print(LOG_ERR, "nft command error : %s", nft_ctx_get_error_buffer(ctx));
+		if (error_output == NFTLB_EXEC_RECOVERY)
+			obj_recovery();
+	} else
+		nft_ctx_get_error_buffer(ctx);
+
+	if (out != NULL)
+		*out = output;
 
 	return error;
 }
 
-static int exec_cmd_unbuffered(struct u_buffer *buf)
+/*
+ * List the objects without the elements of their sets and maps. Older
+ * libnftables lack the terse output, so the full listing is used instead.
+ */
+static int exec_cmd_list_terse(char *cmd, const char **out)
 {
+#ifdef HAVE_NFT_CTX_OUTPUT_TERSE
+	unsigned int flags;
 	int error;
-	error = exec_cmd(u_buf_get_data(buf));
-	u_buf_reset(buf);
+
+	if (nft_ctx_get() == NULL)
+		return -1;
+
+	flags = nft_ctx_output_get_flags(ctx);
+	nft_ctx_output_set_flags(ctx, flags | NFT_CTX_OUTPUT_TERSE);
+	error = exec_cmd_run(cmd, out, NFTLB_EXEC_SILENT);
+	nft_ctx_output_set_flags(ctx, flags);
 
 	return error;
+#else
+	return exec_cmd_run(cmd, out, NFTLB_EXEC_SILENT);
+#endif
 }
 
-static void concat_exec_cmd(struct u_buffer *buf, char *fmt, ...)
+/* validate the commands against the current ruleset without applying them */
+static int exec_cmd_check(char *cmd)
 {
-	int len;
-	va_list args;
+	int error;
 
-	va_start(args, fmt);
-	len = vsnprintf(0, 0, fmt, args);
-	va_end(args);
+	if (strlen(cmd) == 0)
+		return 0;
 
-	va_start(args, fmt);
-	u_buf_concat_va(buf, len, fmt, args);
-	va_end(args);
+	if (nft_ctx_get() == NULL)
+		return -1;
 
-	if (serialize)
-		exec_cmd_unbuffered(buf);
-}
+	nft_ctx_set_dry_run(ctx, true);
+	error = nft_run_cmd_from_buffer(ctx, cmd);
+	nft_ctx_set_dry_run(ctx, false);
 
-static char * print_nft_mode_service(int mode, int family)
-{
-	if (family == VALUE_FAMILY_IPV6) {
-		if (mode & NFTLB_PROTO_IP_ACTIVE)
-			return NFTLB_IP_SERVICES6_MAP;
-		else if (mode & NFTLB_PROTO_PORT_ACTIVE)
-			return NFTLB_PORT_SERVICES6_MAP;
-		else
-			return NFTLB_PROTO_SERVICES6_MAP;
-	} else {
-		if (mode & NFTLB_PROTO_IP_ACTIVE)
-			return NFTLB_IP_SERVICES_MAP;
-		else if (mode & NFTLB_PROTO_PORT_ACTIVE)
-			return NFTLB_PORT_SERVICES_MAP;
-		else
-			return NFTLB_PROTO_SERVICES_MAP;
-	}
+	nft_ctx_get_output_buffer(ctx);
+	nft_ctx_get_error_buffer(ctx);
+
+	return error;
 }
 
-static int get_address_service_mode(struct address *a)
+static long elapsed_usec(struct timespec *start)
 {
-	if (address_no_port(a))
-		return NFTLB_PROTO_IP_ACTIVE;
-	else if (address_no_ipaddr(a))
-		return NFTLB_PROTO_PORT_ACTIVE;
-	else
-		return NFTLB_PROTO_IP_PORT_ACTIVE;
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000000 + (end.tv_nsec - start->tv_nsec) / 1000;
 }
 
-static char * print_nft_family_type(int family)
+/*
+ * Find the next top level separator of the commands, those inside a block or
+ * a string are skipped. It's shared with the commands optimizer.
+ */
+char *nft_cmd_split(char *cmd, char sep)
 {
-	switch (family) {
-	case VALUE_FAMILY_IPV6:
-		return NFTLB_MAP_TYPE_IPV6;
-	default:
-		return NFTLB_MAP_TYPE_IPV4;
+	int depth = 0;
+	int quoted = 0;
+
+	for (; *cmd != '\0'; cmd++) {
+		if (*cmd == '"')
+			quoted = !quoted;
+		if (quoted)
+			continue;
+		if (*cmd == '{')
+			depth++;
+		else if (*cmd == '}' && depth > 0)
+			depth--;
+		else if (*cmd == sep && depth == 0)
+			return cmd;
 	}
+
+	return NULL;
 }
 
-static char * print_nft_family(int family)
+/*
+ * Find the last top level command separator that keeps the chunk starting at
+ * cmd under max bytes, or the first one after it if a single command is
+ * bigger than the ceiling. The separators before the first command are skipped.
+ */
+static char *exec_cmd_split(char *cmd, unsigned int max)
 {
-	switch (family) {
-	case VALUE_FAMILY_NETDEV:
-		return NFTLB_NETDEV_FAMILY_STR;
-	case VALUE_FAMILY_IPV6:
-		return NFTLB_IPV6_FAMILY_STR;
-	default:
-		return NFTLB_IPV4_FAMILY_STR;
+	char *last = NULL;
+	char *c;
+
+	for (c = nft_cmd_split(cmd + strspn(cmd, "; "), ';'); c; c = nft_cmd_split(c + 1, ';')) {
+		if ((unsigned int)(c - cmd) > max)
+			return last ? last : c;
+		last = c;
 	}
+
+	if (strlen(cmd) > max)
+		return last;
+
+	return NULL;
 }
 
-static char * print_nft_family_protocol(int family)
+static int exec_cmd_chunked(char *cmd, unsigned int max, int error_output)
 {
-	switch (family) {
-	case VALUE_FAMILY_IPV6:
-		return NFTLB_IPV6_PROTOCOL;
-	default:
-		return NFTLB_IPV4_PROTOCOL;
+	struct timespec start;
+	int chunk = 0;
+	char *next;
+	char sep;
+	int error = 0;
+
+	if (!max || strlen(cmd) <= max)
+		return exec_cmd_run(cmd, NULL, error_output);
+
+	/* every chunk is a transaction on its own, a failure stops the rest */
+	while (*cmd != '\0') {
+		next = exec_cmd_split(cmd, max);
+		if (next != NULL) {
+			sep = *next;
+			*next = '\0';
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		error = exec_cmd_run(cmd, NULL, error_output);
+		u_log_print(LOG_INFO, "%s():%d: nft chunk %d of %d bytes executed in %ld us", __FUNCTION__, __LINE__, chunk, (int)strlen(cmd), elapsed_usec(&start));
+
+		if (next == NULL)
+			break;
+		*next = sep;
+
+		if (error) {
+			u_log_print(LOG_ERR, "%s():%d: nft chunk %d failed, %d bytes not applied", __FUNCTION__, __LINE__, chunk, (int)strlen(next));
+			break;
+		}
+
+		cmd = next;
+		chunk++;
 	}
+
+	return error;
 }
 
-static char * print_nft_table_family(int family, unsigned int type)
+static int exec_cmd_open(char *cmd, const char **out, int error_output)
 {
-	if (family == VALUE_FAMILY_NETDEV || type & NFTLB_F_CHAIN_ING_FILTER || type & NFTLB_F_CHAIN_ING_DNAT)
-		return NFTLB_NETDEV_FAMILY_STR;
-	else if (family == VALUE_FAMILY_IPV6)
-		return NFTLB_IPV6_FAMILY_STR;
-	else
-		return NFTLB_IPV4_FAMILY_STR;
+	if (out != NULL)
+		return exec_cmd_run(cmd, out, error_output);
+
+	return exec_cmd_chunked(cmd, nft_max_bytes, error_output);
 }
 
-static char * print_nft_protocol(int protocol)
+static int exec_cmd(char *cmd)
 {
-	switch (protocol) {
-	case VALUE_PROTO_UDP:
-		return NFTLB_UDP_PROTO;
-	case VALUE_PROTO_SCTP:
-		return NFTLB_SCTP_PROTO;
-	default:
-		return NFTLB_TCP_PROTO;
-	}
+	int error;
+
+	error = exec_cmd_open(cmd, NULL, NFTLB_EXEC_RECOVERY);
+
+	return error;
 }
 
-static char * print_nft_verdict(int verdict, int type)
+static int exec_cmd_unbuffered(struct u_buffer *buf)
 {
-	if (type == VALUE_TYPE_ALLOW && verdict & VALUE_VERDICT_ACCEPT)
-		return NFTLB_NFT_VERDICT_ACCEPT;
-	else
-		if (type == VALUE_TYPE_DENY && verdict & VALUE_VERDICT_DROP)
-			return NFTLB_NFT_VERDICT_DROP;
-	return NFTLB_NFT_VERDICT_NONE;
+	int error;
+	error = exec_cmd(u_buf_get_data(buf));
+	u_buf_reset(buf);
+
+	return error;
 }
 
-static char * print_nft_prefix_policy(enum type type)
+/*
+ * The netlink batch and the nft commands are applied in different
+ * transactions, so the elements go through netlink only when there is
+ * nothing else to apply. Otherwise they are rendered after the commands,
+ * that is after the flush of their set, and applied atomically with them.
+ */
+static void exec_cmd_merge_elems(struct u_buffer *buf)
 {
-	if (type == VALUE_TYPE_ALLOW)
-		return NFTLB_NFT_PREFIX_POLICY_WL;
-	else
-		return NFTLB_NFT_PREFIX_POLICY_BL;
+	if (u_buf_isempty(buf) || nlbatch_is_empty())
+		return;
+
+	nlbatch_render(buf);
+	nlbatch_reset();
 }
 
-static unsigned int * get_rules_applied(int type, int family, char *iface)
+static int exec_cmd_batch(struct u_buffer *buf)
 {
-	unsigned int * ret = NULL;
-	struct if_base_rule *if_base;
+	int error;
 
-	if (type & NFTLB_F_CHAIN_ING_FILTER) {
-		if_base = get_ndv_base(&nft_base_rules.ndv_ingress_rules, iface);
-		if (!if_base)
-			if_base = add_ndv_base(&nft_base_rules.ndv_ingress_rules, iface);
-		if (!if_base)
-			return ret;
-		if (family == VALUE_FAMILY_IPV4)
-			ret = &if_base->rules_v4;
-		if (family == VALUE_FAMILY_IPV6)
-			ret = &if_base->rules_v6;
+	exec_cmd_merge_elems(buf);
 
-	} else if (type & NFTLB_F_CHAIN_ING_DNAT) {
-		if_base = get_ndv_base(&nft_base_rules.ndv_ingress_dnat_rules, iface);
-		if (!if_base)
-			if_base = add_ndv_base(&nft_base_rules.ndv_ingress_dnat_rules, iface);
-		if (!if_base)
-			return ret;
-		if (family == VALUE_FAMILY_IPV4)
-			ret = &if_base->rules_v4;
-		if (family == VALUE_FAMILY_IPV6)
-			ret = &if_base->rules_v6;
+	error = exec_cmd(u_buf_get_data(buf));
 
-	} else if (type & NFTLB_F_CHAIN_PRE_DNAT) {
-		if (family == VALUE_FAMILY_IPV4)
-			ret = &nft_base_rules.dnat_rules_v4;
-		if (family == VALUE_FAMILY_IPV6)
-			ret = &nft_base_rules.dnat_rules_v6;
+	if (nlbatch_is_empty())
+		return error;
 
-	} else if (type & NFTLB_F_CHAIN_PRE_FILTER) {
-		if (family == VALUE_FAMILY_IPV4)
-			ret = &nft_base_rules.filter_rules_v4;
-		if (family == VALUE_FAMILY_IPV6)
-			ret = &nft_base_rules.filter_rules_v6;
+	if (nlbatch_commit() != 0) {
+		u_log_print(LOG_INFO, "%s():%d: netlink batch failed, falling back to nft commands", __FUNCTION__, __LINE__);
+		u_buf_reset(buf);
+		nlbatch_render(buf);
+		error = exec_cmd(u_buf_get_data(buf));
+	}
+	nlbatch_reset();
 
-	} else if (type & NFTLB_F_CHAIN_FWD_FILTER) {
-		if (family == VALUE_FAMILY_IPV4)
-			ret = &nft_base_rules.fwd_rules_v4;
-		if (family == VALUE_FAMILY_IPV6)
-			ret = &nft_base_rules.fwd_rules_v6;
+	return error;
+}
 
-	} else if (type & NFTLB_F_CHAIN_POS_SNAT) {
-		if (family == VALUE_FAMILY_IPV4)
-			ret = &nft_base_rules.snat_rules_v4;
-		if (family == VALUE_FAMILY_IPV6)
-			ret = &nft_base_rules.snat_rules_v6;
+struct nft_commit_job {
+	struct list_head		list;
+	struct list_head		logged;
+	unsigned int			id;
+	struct u_buffer			buf;
+	struct u_buffer			raw;
+	struct list_head		blocks;
+	struct nft_txn_log		*log;
+	unsigned int			max_bytes;
+	int						atomic;
+	int						error;
+};
 
-	} else if (type & NFTLB_F_CHAIN_OUT_FILTER) {
-		if (family == VALUE_FAMILY_IPV4)
-			ret = &nft_base_rules.out_filter_rules_v4;
-		if (family == VALUE_FAMILY_IPV6)
-			ret = &nft_base_rules.out_filter_rules_v6;
+struct nft_commit_waiter {
+	struct list_head		list;
+	unsigned int			first;
+	unsigned int			last;
+	int						error;
+	nft_commit_cb			cb;
+	void					*data;
+};
 
-	} else if (type & NFTLB_F_CHAIN_OUT_DNAT) {
-		if (family == VALUE_FAMILY_IPV4)
-			ret = &nft_base_rules.out_nat_rules_v4;
-		if (family == VALUE_FAMILY_IPV6)
-			ret = &nft_base_rules.out_nat_rules_v6;
-	}
+struct nft_worker_stct {
+	pthread_t				thread;
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+	struct list_head		queue;
+	struct list_head		done;
+	struct list_head		logged;
+	int						busy;
+	int						stop;
+	int						failed;
+	int						running;
+	int						bypass;
+	unsigned int			last_id;
+	unsigned int			done_id;
+	struct list_head		waiters;
+};
 
-	return ret;
+static struct nft_worker_stct st_wrk = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.cond		= PTHREAD_COND_INITIALIZER,
+	.running	= 0,
+};
+
+static int nft_worker_active(void)
+{
+	return st_wrk.running && !st_wrk.bypass && !serialize;
 }
 
-static void logprefix_replace(char *buf, char *token, char *value)
+static void nft_commit_job_delete(struct nft_commit_job *job)
 {
-	char tmp[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char *ptr = buf;
-	char *tmpptr = tmp;
+	if (job->log)
+		list_del(&job->logged);
+	nft_txn_log_delete(job->log);
+	u_buf_clean(&job->raw);
+	u_buf_clean(&job->buf);
+	nlbatch_reset_blocks(&job->blocks);
+	free(job);
+}
 
-	while (*ptr != '\0') {
-		if (strncmp(token, ptr, strlen(token)) == 0) {
-			strcat(tmpptr, value);
-			ptr += strlen(token);
-			tmpptr += strlen(value);
-		}
-		*tmpptr = *ptr;
-		ptr++;
-		tmpptr++;
+static int nft_commit_job_exec(struct nft_commit_job *job)
+{
+	struct timespec start;
+	int error;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	error = exec_cmd_chunked(u_buf_get_data(&job->buf), job->max_bytes, NFTLB_EXEC_LOG);
+	if (!error && nlbatch_commit_blocks(&job->blocks) != 0) {
+		u_log_print(LOG_INFO, "%s():%d: netlink batch failed, falling back to nft commands", __FUNCTION__, __LINE__);
+		u_buf_reset(&job->buf);
+		nlbatch_render_blocks(&job->buf, &job->blocks);
+		error = exec_cmd_chunked(u_buf_get_data(&job->buf), job->max_bytes, NFTLB_EXEC_LOG);
 	}
 
-	*tmpptr = '\0';
-	sprintf(buf, "%s", tmp);
+	u_log_print(LOG_DEBUG, "%s():%d: commit %u executed in %ld us", __FUNCTION__, __LINE__, job->id, elapsed_usec(&start));
+
+	return error;
 }
 
-static void print_log_format(char *buf, int key, int type, struct nftst *n)
+/* after a failure the queued commits wait for the main loop to recover */
+static void * nft_worker_run(void *arg)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	struct backend *b = nftst_get_backend(n);
-	struct policy *p = nftst_get_policy(n);
+	struct nft_commit_job *job;
 
-	if (!f && !a)
-		return;
-
-	switch (key) {
-	case KEY_LOGPREFIX:
-		if (p) {
-			sprintf(buf, "%s", p->logprefix);
-			logprefix_replace(buf, "KNAME", "policy");
-			if (f)
-				logprefix_replace(buf, "FNAME", f->name);
-			if (a)
-				logprefix_replace(buf, "ANAME", a->name);
-			logprefix_replace(buf, "PNAME", p->name);
-			logprefix_replace(buf, "TYPE", print_nft_prefix_policy(p->type));
-			return;
-		}
-		if (f) {
-			sprintf(buf, "%s", f->logprefix);
-			logprefix_replace(buf, "FNAME", f->name);
-		}
-		if (a) {
-			sprintf(buf, "%s", a->logprefix);
-			logprefix_replace(buf, "ANAME", a->name);
-		}
-		logprefix_replace(buf, "KNAME", CONFIG_KEY_LOG);
-		if ((a || (f->log & VALUE_LOG_INPUT)) && ((type & NFTLB_F_CHAIN_ING_FILTER) || (type & NFTLB_F_CHAIN_PRE_FILTER) || (type & NFTLB_F_CHAIN_PRE_DNAT)))
-			logprefix_replace(buf, "TYPE", "IN");
-		else if ((f->log & VALUE_LOG_FORWARD) && (type & NFTLB_F_CHAIN_FWD_FILTER))
-			logprefix_replace(buf, "TYPE", "FWD");
-		else if ((f->log & VALUE_LOG_OUTPUT) && ((type & NFTLB_F_CHAIN_POS_SNAT) || (type & NFTLB_F_CHAIN_ING_DNAT)))
-			logprefix_replace(buf, "TYPE", "OUT");
-		break;
-	case KEY_NEWRTLIMIT_LOGPREFIX:
-		sprintf(buf, "%s", f->newrtlimit_logprefix);
-		logprefix_replace(buf, "KNAME", CONFIG_KEY_NEWRTLIMIT);
-		if (f)
-			logprefix_replace(buf, "FNAME", f->name);
-		if (a)
-			logprefix_replace(buf, "ANAME", a->name);
-		break;
-	case KEY_RSTRTLIMIT_LOGPREFIX:
-		sprintf(buf, "%s", f->rstrtlimit_logprefix);
-		logprefix_replace(buf, "KNAME", CONFIG_KEY_RSTRTLIMIT);
-		if (f)
-			logprefix_replace(buf, "FNAME", f->name);
-		if (a)
-			logprefix_replace(buf, "ANAME", a->name);
-		break;
-	case KEY_ESTCONNLIMIT_LOGPREFIX:
-		if (b) {
-			sprintf(buf, "%s", b->estconnlimit_logprefix);
-			logprefix_replace(buf, "KNAME", CONFIG_KEY_ESTCONNLIMIT);
-			logprefix_replace(buf, "BNAME", b->name);
-			if (f)
-				logprefix_replace(buf, "FNAME", f->name);
-			if (a)
-				logprefix_replace(buf, "ANAME", a->name);
-			return;
+	pthread_mutex_lock(&st_wrk.lock);
+	while (!st_wrk.stop) {
+		if (list_empty(&st_wrk.queue) || st_wrk.failed) {
+			pthread_cond_wait(&st_wrk.cond, &st_wrk.lock);
+			continue;
 		}
-		sprintf(buf, "%s", f->estconnlimit_logprefix);
-		logprefix_replace(buf, "KNAME", CONFIG_KEY_ESTCONNLIMIT);
-		if (f)
-			logprefix_replace(buf, "FNAME", f->name);
-		if (a)
-			logprefix_replace(buf, "ANAME", a->name);
-		break;
-	case KEY_TCPSTRICT_LOGPREFIX:
-		sprintf(buf, "%s", f->tcpstrict_logprefix);
-		logprefix_replace(buf, "KNAME", CONFIG_KEY_TCPSTRICT);
-		if (f)
-			logprefix_replace(buf, "FNAME", f->name);
-		if (a)
-			logprefix_replace(buf, "ANAME", a->name);
-		break;
-	default:
-		break;
+
+		job = list_first_entry(&st_wrk.queue, struct nft_commit_job, list);
+		list_del(&job->list);
+		st_wrk.busy = 1;
+		pthread_mutex_unlock(&st_wrk.lock);
+
+		job->error = nft_commit_job_exec(job);
+
+		pthread_mutex_lock(&st_wrk.lock);
+		list_add_tail(&job->list, &st_wrk.done);
+		st_wrk.busy = 0;
+		if (job->error)
+			st_wrk.failed = 1;
+		pthread_cond_broadcast(&st_wrk.cond);
+		ev_async_send(get_loop(), events_get_commit());
 	}
+	pthread_mutex_unlock(&st_wrk.lock);
+
+	nft_ctx_release();
+
+	return NULL;
 }
 
-static int need_filter(struct farm *f)
+/*
+ * Hand over the generated commands and the pending netlink blocks to the
+ * worker, the buffer is left empty for the caller. The commands are split
+ * at the given size, 0 to apply them in a single transaction. The rollback
+ * log of the transaction and its commands as generated, if any, are kept
+ * along with the job to recover from a failure.
+ */
+static int nft_worker_queue(struct u_buffer *buf, unsigned int max_bytes, struct nft_txn_log *log, struct u_buffer *raw)
 {
-	return (!farm_is_ingress_mode(f));
+	struct nft_commit_job *job;
+
+	if (u_buf_isempty(buf) && nlbatch_is_empty()) {
+		nft_txn_log_delete(log);
+		return 0;
+	}
+
+	job = (struct nft_commit_job *)calloc(1, sizeof(struct nft_commit_job));
+	if (!job) {
+		u_log_print(LOG_ERR, "%s():%d: commit job memory allocation error", __FUNCTION__, __LINE__);
+		nft_txn_log_delete(log);
+		return exec_cmd_batch(buf);
+	}
+
+	job->buf = *buf;
+	buf->data = NULL;
+	buf->size = 0;
+	buf->next = 0;
+	if (raw) {
+		job->raw = *raw;
+		raw->data = NULL;
+		raw->size = 0;
+		raw->next = 0;
+	}
+	nlbatch_detach(&job->blocks);
+	job->max_bytes = max_bytes;
+	// a split commit could have applied some chunks already
+	job->atomic = !max_bytes || job->buf.next <= (int)max_bytes;
+	job->log = log;
+	if (log)
+		list_add_tail(&job->logged, &st_wrk.logged);
+	job->id = ++st_wrk.last_id;
+
+	pthread_mutex_lock(&st_wrk.lock);
+	list_add_tail(&job->list, &st_wrk.queue);
+	pthread_cond_signal(&st_wrk.cond);
+	pthread_mutex_unlock(&st_wrk.lock);
+
+	return 0;
 }
 
-static int need_forward(struct farm *f)
+static void nft_commit_waiters_update(unsigned int id, int error)
 {
-	return ((f->log & VALUE_LOG_FORWARD) || farm_needs_flowtable(f));
+	struct nft_commit_waiter *w;
+
+	st_wrk.done_id = id;
+
+	if (!error)
+		return;
+
+	list_for_each_entry(w, &st_wrk.waiters, list) {
+		if (id > w->first && id <= w->last)
+			w->error = error;
+	}
 }
 
-static int need_output(struct farm *f)
+static void nft_commit_waiters_notify(void)
 {
-	return farm_needs_intraconnect(f);
+	struct nft_commit_waiter *w, *next;
+
+	list_for_each_entry_safe(w, next, &st_wrk.waiters, list) {
+		if (w->last > st_wrk.done_id)
+			continue;
+		list_del(&w->list);
+		w->cb(w->data, w->error);
+		free(w);
+	}
 }
 
-static unsigned int get_stage_by_farm_mode(struct farm *f)
+unsigned int nft_commit_id(void)
 {
-	if (f->mode == VALUE_MODE_DSR)
-		return NFTLB_F_CHAIN_ING_FILTER;
-	else if (f->mode == VALUE_MODE_STLSDNAT)
-		return NFTLB_F_CHAIN_ING_DNAT;
-	else
-		return NFTLB_F_CHAIN_PRE_FILTER;
+	return st_wrk.last_id;
 }
 
-static void get_chain_name(char *chain, char *name, int type)
+int nft_commit_notify(unsigned int since, nft_commit_cb cb, void *data)
 {
-	if (type & NFTLB_F_CHAIN_ING_FILTER)
-		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s", name);
-	else if (type & NFTLB_F_CHAIN_PRE_FILTER)
-		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TYPE_FILTER, name);
-	else if (type & NFTLB_F_CHAIN_PRE_DNAT)
-		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TYPE_NAT, name);
-	else if (type & NFTLB_F_CHAIN_FWD_FILTER)
-		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TYPE_FWD, name);
-	else if (type & NFTLB_F_CHAIN_ING_DNAT)
-		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-back", name);
-	else if (type & NFTLB_F_CHAIN_OUT_FILTER)
-		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TYPE_FILTER, name);
-	else if (type & NFTLB_F_CHAIN_OUT_DNAT)
-		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TYPE_NAT, name);
+	struct nft_commit_waiter *w;
+
+	if (st_wrk.last_id == since)
+		return -1;
+
+	w = (struct nft_commit_waiter *)calloc(1, sizeof(struct nft_commit_waiter));
+	if (!w) {
+		u_log_print(LOG_ERR, "%s():%d: commit waiter memory allocation error", __FUNCTION__, __LINE__);
+		return -1;
+	}
+
+	w->first = since;
+	w->last = st_wrk.last_id;
+	w->cb = cb;
+	w->data = data;
+	list_add_tail(&w->list, &st_wrk.waiters);
+
+	return 0;
 }
 
-static void get_flowtable_name(char *name, struct farm *f)
+/* accumulated results of the optimizer passes since the startup */
+static struct nftir_stats nft_optimizer_stats;
+
+static void exec_cmd_optimize(struct u_buffer *buf)
 {
-	snprintf(name, NFTLB_MAX_OBJ_NAME, "ft-%s", f->name);
+	struct nftir_stats stats;
+
+	if (!nft_optimize || serialize)
+		return;
+
+	if (nftir_optimize(buf, nft_max_elements, nft_max_bytes, &stats))
+		return;
+
+	if (!stats.stmts)
+		return;
+
+	nft_optimizer_stats.stmts += stats.stmts;
+	nft_optimizer_stats.rules += stats.rules;
+	nft_optimizer_stats.elements += stats.elements;
+	nft_optimizer_stats.dedup += stats.dedup;
+	nft_optimizer_stats.cancelled += stats.cancelled;
+	nft_optimizer_stats.merged += stats.merged;
+
+	u_log_print((stats.dedup || stats.cancelled || stats.merged) ? LOG_INFO : LOG_DEBUG,
+				"%s():%d: %d statements with %d rules and %d elements, %d duplicated, %d cancelled and %d merged",
+				__FUNCTION__, __LINE__, stats.stmts, stats.rules, stats.elements, stats.dedup, stats.cancelled, stats.merged);
 }
 
-static void get_nft_name_service(char *name, int srv_mode, char *trailing, int type, int family)
+/* the optimizer totals, returns -1 if the optimizer is disabled */
+int nft_get_optimizer_stats(struct nftir_stats *stats)
 {
-	if (type & NFTLB_F_CHAIN_ING_FILTER)
-		sprintf(name, "%s%s", print_nft_mode_service(srv_mode, family), trailing);
-	else if (type & NFTLB_F_CHAIN_PRE_FILTER)
-		sprintf(name, "%s-%s%s", NFTLB_TYPE_FILTER, print_nft_mode_service(srv_mode, family), trailing);
-	else if (type & NFTLB_F_CHAIN_PRE_DNAT)
-		sprintf(name, "%s-%s%s", NFTLB_TYPE_NAT, print_nft_mode_service(srv_mode, family), trailing);
-	else if (type & NFTLB_F_CHAIN_FWD_FILTER)
-		sprintf(name, "%s-%s%s", NFTLB_TYPE_FWD, print_nft_mode_service(srv_mode, family), trailing);
-	else if (type & NFTLB_F_CHAIN_POS_SNAT)
-		sprintf(name, "%s-back%s", print_nft_mode_service(NFTLB_PROTO_IP_ACTIVE, family), trailing);
-	else if (type & NFTLB_F_CHAIN_ING_DNAT)
-		sprintf(name, "%s-dnat%s", print_nft_mode_service(srv_mode, family), trailing);
-	else if (type & NFTLB_F_CHAIN_OUT_FILTER)
-		sprintf(name, "%s-%s%s", NFTLB_TABLE_OUT_FILTER, print_nft_mode_service(srv_mode, family), trailing);
-	else if (type & NFTLB_F_CHAIN_OUT_DNAT)
-		sprintf(name, "%s-%s%s", NFTLB_TABLE_OUT_NAT, print_nft_mode_service(srv_mode, family), trailing);
+	if (!nft_optimize)
+		return -1;
+
+	*stats = nft_optimizer_stats;
+	return 0;
 }
 
-static void get_address_service(char *name, struct address *a, int type, int family, int key_mode)
+static int exec_cmd_commit(struct u_buffer *buf)
 {
-	char trailing[NFTLB_MAX_OBJ_NAME];
+	exec_cmd_merge_elems(buf);
+	exec_cmd_optimize(buf);
 
-	if (type & NFTLB_F_CHAIN_ING_FILTER || type & NFTLB_F_CHAIN_ING_DNAT) {
-		sprintf(trailing, "-%s", a->iface);
-		get_nft_name_service(name, get_address_service_mode(a), trailing, type, family);
-	}
+	if (nft_worker_active())
+		return nft_worker_queue(buf, nft_max_bytes, NULL, NULL);
 
-	else if (type & NFTLB_F_CHAIN_POS_SNAT && (key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_MARK))
-		get_nft_name_service(name, get_address_service_mode(a), "-m", type, family);
-	else
-		get_nft_name_service(name, get_address_service_mode(a), "", type, family);
+	return exec_cmd_batch(buf);
 }
 
-static int nft_table_handler(struct u_buffer *buf, char *str_family, int action)
+static void concat_exec_cmd(struct u_buffer *buf, char *fmt, ...)
 {
-	int old_serial = serialize;
-	serialize = 1;
+	va_list args;
 
-	switch (action) {
-	case ACTION_RELOAD:
-		concat_exec_cmd(buf, " ; flush table %s %s", str_family, NFTLB_TABLE_NAME);
-		break;
-	case ACTION_START:
-		concat_exec_cmd(buf, " ; add table %s %s", str_family, NFTLB_TABLE_NAME);
-		break;
-	case ACTION_STOP:
-	case ACTION_DELETE:
-		concat_exec_cmd(buf, " ; delete table %s %s", str_family, NFTLB_TABLE_NAME);
-		break;
-	default:
-		break;
-	}
+	va_start(args, fmt);
+	u_buf_vconcat(buf, fmt, args);
+	va_end(args);
 
-	serialize = old_serial;
-	return 0;
+	if (serialize)
+		exec_cmd_unbuffered(buf);
 }
 
-static int nft_chain_handler(struct u_buffer *buf, char *str_family, char *chain, char *str_type, char *hook, char *str_device, int priority, int action)
+static void elem_block_init(struct nft_elem_block *blk, struct u_buffer *buf, char *fmt, ...)
 {
-	switch (action) {
-	case ACTION_RELOAD:
-		concat_exec_cmd(buf, " ; flush chain %s %s %s", str_family, NFTLB_TABLE_NAME, chain);
-		break;
-	case ACTION_START:
-		u_buf_concat(buf, " ; add chain %s %s %s", str_family, NFTLB_TABLE_NAME, chain);
-		if (!obj_equ_attribute_string(str_type, "") && !obj_equ_attribute_string(hook, "")) {
-			u_buf_concat(buf, " { type %s hook %s", str_type, hook);
-			if (!obj_equ_attribute_string(str_device, ""))
-				u_buf_concat(buf, " device %s", str_device);
-			u_buf_concat(buf, " priority %d ;}", priority);
-		}
-		concat_exec_cmd(buf, "");
-		break;
-	case ACTION_STOP:
-	case ACTION_DELETE:
-		concat_exec_cmd(buf, " ; delete chain %s %s %s", str_family, NFTLB_TABLE_NAME, chain);
-		break;
-	default:
-		break;
-	}
+	va_list args;
 
-	return 0;
+	va_start(args, fmt);
+	vsnprintf(blk->head, NFTLB_MAX_CMD, fmt, args);
+	va_end(args);
+
+	blk->buf = buf;
+	blk->elements = 0;
+	blk->begin = 0;
 }
 
-static int run_nftst_rules_gen_chain(struct u_buffer *buf, struct nftst *n, int family, int type, int action)
+static void elem_block_end(struct nft_elem_block *blk)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
-
-	get_chain_name(chain, nftst_get_name(n), type);
+	if (blk->elements)
+		concat_exec_cmd(blk->buf, " }");
+	blk->elements = 0;
+}
 
-	switch (action) {
-	case ACTION_RELOAD:
-		if ((nftst_get_chains(n) & type) == 0)
-			action = ACTION_START;
-		break;
-	case ACTION_START:
-		if (nftst_get_chains(n) & type)
-			action = ACTION_RELOAD;
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		if ((nftst_get_chains(n) & type) == 0)
-			action = ACTION_NONE;
-		break;
-	default:
-		break;
-	}
+/*
+ * Append an element to the current element list, closing it and opening a new
+ * one once the element or byte ceiling is reached so that every list can be
+ * executed on its own.
+ */
+static void elem_block_concat(struct nft_elem_block *blk, char *fmt, ...)
+{
+	va_list args;
 
-	// output uses the same farm chains than prerouting-filter and prerouting-nat
-	if (type == NFTLB_F_CHAIN_OUT_FILTER || type == NFTLB_F_CHAIN_OUT_DNAT)
-		return 0;
+	if (blk->elements &&
+		((nft_max_elements && blk->elements >= nft_max_elements) ||
+		 (nft_max_bytes && (unsigned int)(blk->buf->next - blk->begin) >= nft_max_bytes)))
+		elem_block_end(blk);
 
-	switch (action) {
-	case ACTION_RELOAD:
-	case ACTION_START:
-		nft_chain_handler(buf, print_nft_table_family(family, type), chain, NULL, NULL, NULL, 0, action);
-		nftst_set_chains(n, nftst_get_chains(n) | type);
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		if ((f && f->addresses_used == 1) ||
-			(!f && a)){
-			nft_chain_handler(buf, print_nft_table_family(family, type), chain, NULL, NULL, NULL, 0, action);
-			nftst_set_chains(n, nftst_get_chains(n) & ~type);
-		}
-		break;
-	default:
-		break;
+	if (blk->elements)
+		u_buf_concat(blk->buf, ", ");
+	else {
+		blk->begin = blk->buf->next;
+		u_buf_concat(blk->buf, "%s ", blk->head);
 	}
 
-	return 0;
-}
-
-static int run_base_chain_set_meta_mark(struct u_buffer *buf, int type, char *chain_family, char *base_chain)
-{
-
-	if (type & NFTLB_F_CHAIN_PRE_FILTER)
-		concat_exec_cmd(buf, " ; add rule %s %s %s meta mark 0x0 meta mark set ct mark", chain_family, NFTLB_TABLE_NAME, base_chain);
-	if (type & NFTLB_F_CHAIN_PRE_DNAT)
-		concat_exec_cmd(buf, " ; add rule %s %s %s ct state new meta mark 0x0 meta mark set ct mark", chain_family, NFTLB_TABLE_NAME, base_chain);
+	va_start(args, fmt);
+	u_buf_vconcat(blk->buf, fmt, args);
+	va_end(args);
 
-	return 0;
+	blk->elements++;
 }
 
-static int run_base_chain_postrouting_masquerade(struct u_buffer *buf, int type, char *chain_family)
+static char * print_nft_mode_service(int mode, int family)
 {
-	if (type & NFTLB_F_CHAIN_POS_SNAT) {
-		concat_exec_cmd(buf, " ; add rule %s %s %s ct mark 0x0 ct mark set meta mark", chain_family, NFTLB_TABLE_NAME, NFTLB_TABLE_POSTROUTING);
-		concat_exec_cmd(buf, " ; add rule %s %s %s ct mark and 0x%x == 0x%x masquerade", chain_family, NFTLB_TABLE_NAME, NFTLB_TABLE_POSTROUTING, masquerade_mark, masquerade_mark);
+	if (family == VALUE_FAMILY_IPV6) {
+		if (mode & NFTLB_PROTO_IP_ACTIVE)
+			return NFTLB_IP_SERVICES6_MAP;
+		else if (mode & NFTLB_PROTO_PORT_ACTIVE)
+			return NFTLB_PORT_SERVICES6_MAP;
+		else
+			return NFTLB_PROTO_SERVICES6_MAP;
+	} else {
+		if (mode & NFTLB_PROTO_IP_ACTIVE)
+			return NFTLB_IP_SERVICES_MAP;
+		else if (mode & NFTLB_PROTO_PORT_ACTIVE)
+			return NFTLB_PORT_SERVICES_MAP;
+		else
+			return NFTLB_PROTO_SERVICES_MAP;
 	}
-
-	return 0;
 }
 
-static int run_base_chain_postrouting_bckmark(struct u_buffer *buf, char *service, int type, int family)
+static int get_address_service_mode(struct address *a)
 {
-	if (~type & NFTLB_F_CHAIN_POS_SNAT)
-		return 0;
-
-	concat_exec_cmd(buf, " ; add map %s %s %s { type %s : %s ;}", print_nft_family(family), NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_MARK, print_nft_family_type(family));
-	concat_exec_cmd(buf, " ; add rule %s %s %s snat to ct mark map @%s", print_nft_family(family), NFTLB_TABLE_NAME, NFTLB_TABLE_POSTROUTING, service);
-
-	return 1;
+	if (address_no_port(a))
+		return NFTLB_PROTO_IP_ACTIVE;
+	else if (address_no_ipaddr(a))
+		return NFTLB_PROTO_PORT_ACTIVE;
+	else
+		return NFTLB_PROTO_IP_PORT_ACTIVE;
 }
 
-static int run_farm_rules_gen_meta_param(struct u_buffer *buf, int protocol, int family, int param, int type)
+static char * print_nft_family_type(int family)
 {
-	int items = 0;
-
-	if ((param & VALUE_META_NONE) ||
-		(param & VALUE_META_SRCIP)) {
-		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " %s", print_nft_family_type(family)) : u_buf_concat(buf, " %s saddr", print_nft_family(family));
-		items++;
-	}
-
-	if (param & VALUE_META_DSTIP) {
-		if (items)
-			u_buf_concat(buf, " .");
-		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " %s", print_nft_family_type(family)) : u_buf_concat(buf, " %s daddr", print_nft_family(family));
-		items++;
-	}
-
-	if (param & VALUE_META_SRCPORT) {
-		if (items)
-			u_buf_concat(buf, " .");
-		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " inet_service") : u_buf_concat(buf, " %s sport", print_nft_protocol(protocol));
-		items++;
-	}
-
-	if (param & VALUE_META_DSTPORT) {
-		if (items)
-			u_buf_concat(buf, " .");
-		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " inet_service") : u_buf_concat(buf, " %s dport", print_nft_protocol(protocol));
-		items++;
-	}
-
-	if (param & VALUE_META_SRCMAC) {
-		if (items)
-			u_buf_concat(buf, " .");
-		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " ether_addr") : u_buf_concat(buf, " ether saddr");
-		items++;
+	switch (family) {
+	case VALUE_FAMILY_IPV6:
+		return NFTLB_MAP_TYPE_IPV6;
+	default:
+		return NFTLB_MAP_TYPE_IPV4;
 	}
+}
 
-	if (param & VALUE_META_DSTMAC) {
-		if (items)
-			u_buf_concat(buf, " .");
-		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " ether_addr") : u_buf_concat(buf, " ether daddr");
+static char * print_nft_family(int family)
+{
+	switch (family) {
+	case VALUE_FAMILY_NETDEV:
+		return NFTLB_NETDEV_FAMILY_STR;
+	case VALUE_FAMILY_IPV6:
+		return NFTLB_IPV6_FAMILY_STR;
+	default:
+		return NFTLB_IPV4_FAMILY_STR;
 	}
+}
 
-	if (param & VALUE_META_MARK) {
-		if (items)
-			u_buf_concat(buf, " .");
-		u_buf_concat(buf, " mark");
+static char * print_nft_family_protocol(int family)
+{
+	switch (family) {
+	case VALUE_FAMILY_IPV6:
+		return NFTLB_IPV6_PROTOCOL;
+	default:
+		return NFTLB_IPV4_PROTOCOL;
 	}
+}
 
-	return 0;
+static char * print_nft_table_family(int family, unsigned int type)
+{
+	if (family == VALUE_FAMILY_NETDEV || type & NFTLB_F_CHAIN_ING_FILTER || type & NFTLB_F_CHAIN_ING_DNAT)
+		return NFTLB_NETDEV_FAMILY_STR;
+	else if (family == VALUE_FAMILY_IPV6)
+		return NFTLB_IPV6_FAMILY_STR;
+	else
+		return NFTLB_IPV4_FAMILY_STR;
 }
 
-static void run_farm_map(struct u_buffer *buf, struct address *a, int family, unsigned int stage, char *mapname, int key, int data, int timeout, int action)
+static char * print_nft_protocol(int protocol)
 {
-	switch (action) {
-	case ACTION_START:
-		u_buf_concat(buf, " ; add map %s %s %s { type ", print_nft_table_family(family, stage), NFTLB_TABLE_NAME, mapname);
-		run_farm_rules_gen_meta_param(buf, a->protocol, family, key, NFTLB_MAP_KEY_TYPE);
-		u_buf_concat(buf, " :");
-		run_farm_rules_gen_meta_param(buf, a->protocol, family, data, NFTLB_MAP_KEY_TYPE);
-		u_buf_concat(buf, ";");
-		if (timeout != -1)
-			u_buf_concat(buf, " timeout %ds;", timeout);
-		concat_exec_cmd(buf, " }");
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		concat_exec_cmd(buf, " ; delete map %s %s %s", print_nft_table_family(family, stage), NFTLB_TABLE_NAME, mapname);
-		break;
-	case ACTION_RELOAD:
+	switch (protocol) {
+	case VALUE_PROTO_UDP:
+		return NFTLB_UDP_PROTO;
+	case VALUE_PROTO_SCTP:
+		return NFTLB_SCTP_PROTO;
 	default:
-		break;
+		return NFTLB_TCP_PROTO;
 	}
 }
 
-static int run_base_table(struct u_buffer *buf, int type, int family, int action)
+static char * print_nft_verdict(int verdict, int type)
 {
-	char *chain_family = print_nft_table_family(family, type);
-
-	if (action == ACTION_STOP || action == ACTION_DELETE) {
-		// delete ip and ip6 based nftlb tables
-		if ((type & NFTLB_F_CHAIN_PRE_DNAT || type & NFTLB_F_CHAIN_PRE_FILTER) &&
-			((nft_base_rules.tables & NFTLB_TABLE_IP_ACTIVE && family == VALUE_FAMILY_IPV4 && (nft_base_rules.dnat_rules_v4 == 0 && nft_base_rules.filter_rules_v4 == 0)) ||
+	if (type == VALUE_TYPE_ALLOW && verdict & VALUE_VERDICT_ACCEPT)
+		return NFTLB_NFT_VERDICT_ACCEPT;
+	else
+		if (type == VALUE_TYPE_DENY && verdict & VALUE_VERDICT_DROP)
+			return NFTLB_NFT_VERDICT_DROP;
+	return NFTLB_NFT_VERDICT_NONE;
+}
+
+static char * print_nft_prefix_policy(enum type type)
+{
+	if (type == VALUE_TYPE_ALLOW)
+		return NFTLB_NFT_PREFIX_POLICY_WL;
+	else
+		return NFTLB_NFT_PREFIX_POLICY_BL;
+}
+
+static unsigned int * get_rules_applied(int type, int family, char *iface)
+{
+	unsigned int * ret = NULL;
+	struct if_base_rule *if_base;
+
+	if (type & NFTLB_F_CHAIN_ING_FILTER) {
+		if_base = get_ndv_base(&nft_base_rules.ndv_ingress_rules, iface);
+		if (!if_base)
+			if_base = add_ndv_base(&nft_base_rules.ndv_ingress_rules, iface);
+		if (!if_base)
+			return ret;
+		if (family == VALUE_FAMILY_IPV4)
+			ret = &if_base->rules_v4;
+		if (family == VALUE_FAMILY_IPV6)
+			ret = &if_base->rules_v6;
+
+	} else if (type & NFTLB_F_CHAIN_ING_DNAT) {
+		if_base = get_ndv_base(&nft_base_rules.ndv_ingress_dnat_rules, iface);
+		if (!if_base)
+			if_base = add_ndv_base(&nft_base_rules.ndv_ingress_dnat_rules, iface);
+		if (!if_base)
+			return ret;
+		if (family == VALUE_FAMILY_IPV4)
+			ret = &if_base->rules_v4;
+		if (family == VALUE_FAMILY_IPV6)
+			ret = &if_base->rules_v6;
+
+	} else if (type & NFTLB_F_CHAIN_PRE_DNAT) {
+		if (family == VALUE_FAMILY_IPV4)
+			ret = &nft_base_rules.dnat_rules_v4;
+		if (family == VALUE_FAMILY_IPV6)
+			ret = &nft_base_rules.dnat_rules_v6;
+
+	} else if (type & NFTLB_F_CHAIN_PRE_FILTER) {
+		if (family == VALUE_FAMILY_IPV4)
+			ret = &nft_base_rules.filter_rules_v4;
+		if (family == VALUE_FAMILY_IPV6)
+			ret = &nft_base_rules.filter_rules_v6;
+
+	} else if (type & NFTLB_F_CHAIN_FWD_FILTER) {
+		if (family == VALUE_FAMILY_IPV4)
+			ret = &nft_base_rules.fwd_rules_v4;
+		if (family == VALUE_FAMILY_IPV6)
+			ret = &nft_base_rules.fwd_rules_v6;
+
+	} else if (type & NFTLB_F_CHAIN_POS_SNAT) {
+		if (family == VALUE_FAMILY_IPV4)
+			ret = &nft_base_rules.snat_rules_v4;
+		if (family == VALUE_FAMILY_IPV6)
+			ret = &nft_base_rules.snat_rules_v6;
+
+	} else if (type & NFTLB_F_CHAIN_OUT_FILTER) {
+		if (family == VALUE_FAMILY_IPV4)
+			ret = &nft_base_rules.out_filter_rules_v4;
+		if (family == VALUE_FAMILY_IPV6)
+			ret = &nft_base_rules.out_filter_rules_v6;
+
+	} else if (type & NFTLB_F_CHAIN_OUT_DNAT) {
+		if (family == VALUE_FAMILY_IPV4)
+			ret = &nft_base_rules.out_nat_rules_v4;
+		if (family == VALUE_FAMILY_IPV6)
+			ret = &nft_base_rules.out_nat_rules_v6;
+	}
+
+	return ret;
+}
+
+static void logprefix_replace(char *buf, char *token, char *value)
+{
+	char tmp[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char *ptr = buf;
+	char *tmpptr = tmp;
+
+	while (*ptr != '\0') {
+		if (strncmp(token, ptr, strlen(token)) == 0) {
+			strcat(tmpptr, value);
+			ptr += strlen(token);
+			tmpptr += strlen(value);
+		}
+		*tmpptr = *ptr;
+		ptr++;
+		tmpptr++;
+	}
+
+	*tmpptr = '\0';
+	sprintf(buf, "%s", tmp);
+}
+
+static void print_log_format(char *buf, int key, int type, struct nftst *n)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	struct backend *b = nftst_get_backend(n);
+	struct policy *p = nftst_get_policy(n);
+
+	if (!f && !a)
+		return;
+
+	switch (key) {
+	case KEY_LOGPREFIX:
+		if (p) {
+			sprintf(buf, "%s", p->logprefix);
+			logprefix_replace(buf, "KNAME", "policy");
+			if (f)
+				logprefix_replace(buf, "FNAME", f->name);
+			if (a)
+				logprefix_replace(buf, "ANAME", a->name);
+			logprefix_replace(buf, "PNAME", p->name);
+			logprefix_replace(buf, "TYPE", print_nft_prefix_policy(p->type));
+			return;
+		}
+		if (f) {
+			sprintf(buf, "%s", f->logprefix);
+			logprefix_replace(buf, "FNAME", f->name);
+		}
+		if (a) {
+			sprintf(buf, "%s", a->logprefix);
+			logprefix_replace(buf, "ANAME", a->name);
+		}
+		logprefix_replace(buf, "KNAME", CONFIG_KEY_LOG);
+		if ((a || (f->log & VALUE_LOG_INPUT)) && ((type & NFTLB_F_CHAIN_ING_FILTER) || (type & NFTLB_F_CHAIN_PRE_FILTER) || (type & NFTLB_F_CHAIN_PRE_DNAT)))
+			logprefix_replace(buf, "TYPE", "IN");
+		else if ((f->log & VALUE_LOG_FORWARD) && (type & NFTLB_F_CHAIN_FWD_FILTER))
+			logprefix_replace(buf, "TYPE", "FWD");
+		else if ((f->log & VALUE_LOG_OUTPUT) && ((type & NFTLB_F_CHAIN_POS_SNAT) || (type & NFTLB_F_CHAIN_ING_DNAT)))
+			logprefix_replace(buf, "TYPE", "OUT");
+		break;
+	case KEY_NEWRTLIMIT_LOGPREFIX:
+		sprintf(buf, "%s", f->newrtlimit_logprefix);
+		logprefix_replace(buf, "KNAME", CONFIG_KEY_NEWRTLIMIT);
+		if (f)
+			logprefix_replace(buf, "FNAME", f->name);
+		if (a)
+			logprefix_replace(buf, "ANAME", a->name);
+		break;
+	case KEY_RSTRTLIMIT_LOGPREFIX:
+		sprintf(buf, "%s", f->rstrtlimit_logprefix);
+		logprefix_replace(buf, "KNAME", CONFIG_KEY_RSTRTLIMIT);
+		if (f)
+			logprefix_replace(buf, "FNAME", f->name);
+		if (a)
+			logprefix_replace(buf, "ANAME", a->name);
+		break;
+	case KEY_ESTCONNLIMIT_LOGPREFIX:
+		if (b) {
+			sprintf(buf, "%s", b->estconnlimit_logprefix);
+			logprefix_replace(buf, "KNAME", CONFIG_KEY_ESTCONNLIMIT);
+			logprefix_replace(buf, "BNAME", b->name);
+			if (f)
+				logprefix_replace(buf, "FNAME", f->name);
+			if (a)
+				logprefix_replace(buf, "ANAME", a->name);
+			return;
+		}
+		sprintf(buf, "%s", f->estconnlimit_logprefix);
+		logprefix_replace(buf, "KNAME", CONFIG_KEY_ESTCONNLIMIT);
+		if (f)
+			logprefix_replace(buf, "FNAME", f->name);
+		if (a)
+			logprefix_replace(buf, "ANAME", a->name);
+		break;
+	case KEY_TCPSTRICT_LOGPREFIX:
+		sprintf(buf, "%s", f->tcpstrict_logprefix);
+		logprefix_replace(buf, "KNAME", CONFIG_KEY_TCPSTRICT);
+		if (f)
+			logprefix_replace(buf, "FNAME", f->name);
+		if (a)
+			logprefix_replace(buf, "ANAME", a->name);
+		break;
+	default:
+		break;
+	}
+}
+
+static int need_filter(struct farm *f)
+{
+	return (!farm_is_ingress_mode(f));
+}
+
+static int need_forward(struct farm *f)
+{
+	return ((f->log & VALUE_LOG_FORWARD) || farm_needs_flowtable(f));
+}
+
+static int need_output(struct farm *f)
+{
+	return farm_needs_intraconnect(f);
+}
+
+static unsigned int get_stage_by_farm_mode(struct farm *f)
+{
+	if (f->mode == VALUE_MODE_DSR)
+		return NFTLB_F_CHAIN_ING_FILTER;
+	else if (f->mode == VALUE_MODE_STLSDNAT)
+		return NFTLB_F_CHAIN_ING_DNAT;
+	else
+		return NFTLB_F_CHAIN_PRE_FILTER;
+}
+
+static void get_chain_name(char *chain, char *name, int type)
+{
+	if (type & NFTLB_F_CHAIN_ING_FILTER)
+		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s", name);
+	else if (type & NFTLB_F_CHAIN_PRE_FILTER)
+		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TYPE_FILTER, name);
+	else if (type & NFTLB_F_CHAIN_PRE_DNAT)
+		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TYPE_NAT, name);
+	else if (type & NFTLB_F_CHAIN_FWD_FILTER)
+		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TYPE_FWD, name);
+	else if (type & NFTLB_F_CHAIN_ING_DNAT)
+		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-back", name);
+	else if (type & NFTLB_F_CHAIN_OUT_FILTER)
+		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TYPE_FILTER, name);
+	else if (type & NFTLB_F_CHAIN_OUT_DNAT)
+		snprintf(chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TYPE_NAT, name);
+}
+
+static void get_flowtable_name(char *name, struct farm *f)
+{
+	snprintf(name, NFTLB_MAX_OBJ_NAME, "ft-%s", f->name);
+}
+
+static void get_nft_name_service(char *name, int srv_mode, char *trailing, int type, int family)
+{
+	if (type & NFTLB_F_CHAIN_ING_FILTER)
+		sprintf(name, "%s%s", print_nft_mode_service(srv_mode, family), trailing);
+	else if (type & NFTLB_F_CHAIN_PRE_FILTER)
+		sprintf(name, "%s-%s%s", NFTLB_TYPE_FILTER, print_nft_mode_service(srv_mode, family), trailing);
+	else if (type & NFTLB_F_CHAIN_PRE_DNAT)
+		sprintf(name, "%s-%s%s", NFTLB_TYPE_NAT, print_nft_mode_service(srv_mode, family), trailing);
+	else if (type & NFTLB_F_CHAIN_FWD_FILTER)
+		sprintf(name, "%s-%s%s", NFTLB_TYPE_FWD, print_nft_mode_service(srv_mode, family), trailing);
+	else if (type & NFTLB_F_CHAIN_POS_SNAT)
+		sprintf(name, "%s-back%s", print_nft_mode_service(NFTLB_PROTO_IP_ACTIVE, family), trailing);
+	else if (type & NFTLB_F_CHAIN_ING_DNAT)
+		sprintf(name, "%s-dnat%s", print_nft_mode_service(srv_mode, family), trailing);
+	else if (type & NFTLB_F_CHAIN_OUT_FILTER)
+		sprintf(name, "%s-%s%s", NFTLB_TABLE_OUT_FILTER, print_nft_mode_service(srv_mode, family), trailing);
+	else if (type & NFTLB_F_CHAIN_OUT_DNAT)
+		sprintf(name, "%s-%s%s", NFTLB_TABLE_OUT_NAT, print_nft_mode_service(srv_mode, family), trailing);
+}
+
+static void get_address_service(char *name, struct address *a, int type, int family, int key_mode)
+{
+	char trailing[NFTLB_MAX_OBJ_NAME];
+
+	if (type & NFTLB_F_CHAIN_ING_FILTER || type & NFTLB_F_CHAIN_ING_DNAT) {
+		sprintf(trailing, "-%s", a->iface);
+		get_nft_name_service(name, get_address_service_mode(a), trailing, type, family);
+	}
+
+	else if (type & NFTLB_F_CHAIN_POS_SNAT && (key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_MARK))
+		get_nft_name_service(name, get_address_service_mode(a), "-m", type, family);
+	else
+		get_nft_name_service(name, get_address_service_mode(a), "", type, family);
+}
+
+static int nft_table_handler(struct u_buffer *buf, char *str_family, int action)
+{
+	int old_serial = serialize;
+
+	// the adopted tables are replaced in the same commit
+	if (st_warm.pending && action == ACTION_START) {
+		u_buf_concat(buf, " ; add table %s %s", str_family, NFTLB_TABLE_NAME);
+		return 0;
+	}
+
+	serialize = 1;
+
+	switch (action) {
+	case ACTION_RELOAD:
+		concat_exec_cmd(buf, " ; flush table %s %s", str_family, NFTLB_TABLE_NAME);
+		break;
+	case ACTION_START:
+		concat_exec_cmd(buf, " ; add table %s %s", str_family, NFTLB_TABLE_NAME);
+		break;
+	case ACTION_STOP:
+	case ACTION_DELETE:
+		concat_exec_cmd(buf, " ; delete table %s %s", str_family, NFTLB_TABLE_NAME);
+		break;
+	default:
+		break;
+	}
+
+	// the pending commands of the transaction were applied along with the table
+	if (buf == &nft_txn.buf && action != ACTION_NONE)
+		nft_txn.log.executed = 1;
+
+	serialize = old_serial;
+	return 0;
+}
+
+static int nft_chain_handler(struct u_buffer *buf, char *str_family, char *chain, char *str_type, char *hook, char *str_device, int priority, int action)
+{
+	switch (action) {
+	case ACTION_RELOAD:
+		concat_exec_cmd(buf, " ; flush chain %s %s %s", str_family, NFTLB_TABLE_NAME, chain);
+		break;
+	case ACTION_START:
+		u_buf_concat(buf, " ; add chain %s %s %s", str_family, NFTLB_TABLE_NAME, chain);
+		if (!obj_equ_attribute_string(str_type, "") && !obj_equ_attribute_string(hook, "")) {
+			u_buf_concat(buf, " { type %s hook %s", str_type, hook);
+			if (!obj_equ_attribute_string(str_device, ""))
+				u_buf_concat(buf, " device %s", str_device);
+			u_buf_concat(buf, " priority %d ;}", priority);
+		}
+		concat_exec_cmd(buf, "");
+		break;
+	case ACTION_STOP:
+	case ACTION_DELETE:
+		concat_exec_cmd(buf, " ; delete chain %s %s %s", str_family, NFTLB_TABLE_NAME, chain);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int get_nftst_first_port(struct nftst *n)
+{
+	struct address *a = nftst_get_address(n);
+
+	if (nftst_get_proto(n) == VALUE_PROTO_ALL || a->nports == 0)
+		return 0;
+
+	return address_next_port(a, 0);
+}
+
+static void run_farm_rules_gen_bck_data(struct u_buffer *buf, struct nftst *n, struct backend *b, enum map_modes data_mode)
+{
+	struct farm *f = nftst_get_farm(n);
+	int port;
+
+	switch (data_mode) {
+	case BCK_MAP_MARK:
+		u_buf_concat(buf, " 0x%x", backend_get_mark(b));
+		break;
+	case BCK_MAP_ETHADDR:
+		u_buf_concat(buf, " %s", b->ethaddr);
+		break;
+	case BCK_MAP_IPADDR_PORT:
+		if (backend_no_port(b)) {
+			port = get_nftst_first_port(n);
+			u_buf_concat(buf, " %s . %d", b->ipaddr, port);
+		} else
+			u_buf_concat(buf, " %s . %s", b->ipaddr, b->port);
+		break;
+	case BCK_MAP_PORT:
+		u_buf_concat(buf, " %s", b->port);
+		break;
+	case BCK_MAP_IPADDR:
+		u_buf_concat(buf, " %s", b->ipaddr);
+		break;
+	case BCK_MAP_OFACE:
+		if (b->oface)
+			u_buf_concat(buf, " %s", b->oface);
+		else
+			u_buf_concat(buf, " %s", f->oface);
+		break;
+	default:
+		break;
+	}
+}
+
+static int run_farm_rules_gen_bck_elems(struct u_buffer *buf, struct nftst *n, enum map_modes key_mode, enum map_modes data_mode, int usable)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct backend *b;
+	int i = 0;
+	int last = 0;
+	int new;
+
+	list_for_each_entry(b, &f->backends, list) {
+		if (usable == NFTLB_CHECK_USABLE && !backend_is_usable(b))
+			continue;
+		if (usable == NFTLB_CHECK_AVAIL && !backend_is_available(b))
+			continue;
+		if (data_mode == BCK_MAP_PORT && backend_no_port(b))
+			continue;
+
+		if (i != 0)
+			u_buf_concat(buf, ",");
+
+		switch (key_mode) {
+		case BCK_MAP_MARK:
+			u_buf_concat(buf, " 0x%x", backend_get_mark(b));
+			break;
+		case BCK_MAP_IPADDR:
+			u_buf_concat(buf, " %s", b->ipaddr);
+			break;
+		case BCK_MAP_WEIGHT:
+			new = last + b->weight - 1;
+			u_buf_concat(buf, " %d", last);
+			if (new != last)
+				u_buf_concat(buf, "-%d", new);
+			last = new + 1;
+			break;
+		case BCK_MAP_ETHADDR:
+			u_buf_concat(buf, " %s", b->ethaddr);
+			break;
+		default:
+			break;
+		}
+
+		u_buf_concat(buf, ":");
+		run_farm_rules_gen_bck_data(buf, n, b, data_mode);
+
+		i++;
+	}
+
+	return i;
+}
+
+static int run_farm_rules_gen_sched_elem(struct u_buffer *buf, struct nftst *n, struct backend *b, enum map_modes data_mode, int first, int last, int i)
+{
+	if (i != 0)
+		u_buf_concat(buf, ",");
+
+	u_buf_concat(buf, " %d", first);
+	if (last != first)
+		u_buf_concat(buf, "-%d", last);
+	u_buf_concat(buf, ":");
+	run_farm_rules_gen_bck_data(buf, n, b, data_mode);
+
+	return i + 1;
+}
+
+static int run_farm_rules_gen_sched_elems(struct u_buffer *buf, struct nftst *n, enum map_modes data_mode)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct backend *b, *prev = NULL;
+	int slots = f->nft_sched_slots;
+	int weight = 0;
+	int avail = 0;
+	int least = 0;
+	int first = 0;
+	int pos = 0;
+	int i = 0;
+	int reps, rem, acc, share, r;
+
+	list_for_each_entry(b, &f->backends, list) {
+		if (!backend_is_available(b))
+			continue;
+		weight += b->weight;
+		avail++;
+	}
+
+	if (weight <= 0 || slots < avail)
+		return 0;
+
+	reps = slots / weight;
+	rem = slots % weight;
+
+	// with more weight than slots every backend keeps one, the rest are shared by weight
+	if (!reps) {
+		least = 1;
+		rem = slots - avail;
+	}
+
+	// repeat the weighted sequence over the slots, the trailing ones are shared by weight
+	for (r = 0; r <= reps; r++) {
+		acc = 0;
+		list_for_each_entry(b, &f->backends, list) {
+			if (!backend_is_available(b))
+				continue;
+
+			if (r < reps)
+				share = b->weight;
+			else
+				share = least + (rem * (acc + b->weight)) / weight - (rem * acc) / weight;
+			acc += b->weight;
+
+			if (share <= 0)
+				continue;
+
+			if (prev && prev != b) {
+				i = run_farm_rules_gen_sched_elem(buf, n, prev, data_mode, first, pos - 1, i);
+				first = pos;
+			}
+			prev = b;
+			pos += share;
+		}
+	}
+
+	if (prev)
+		i = run_farm_rules_gen_sched_elem(buf, n, prev, data_mode, first, pos - 1, i);
+
+	return i;
+}
+
+static int get_farm_sched_slots(struct farm *f)
+{
+	struct backend *b;
+	int weight = 0;
+	int reps;
+
+	list_for_each_entry(b, &f->backends, list)
+		weight += b->weight;
+
+	if (weight <= 0)
+		weight = 1;
+
+	reps = (NFTLB_SCHED_SLOTS_MIN + weight - 1) / weight;
+	if (reps < NFTLB_SCHED_SLOTS_REPS)
+		reps = NFTLB_SCHED_SLOTS_REPS;
+
+	return weight * reps;
+}
+
+static char * print_bck_map_kind(int kind)
+{
+	switch (kind) {
+	case NFTLB_BCK_MAP_SCHED:
+		return "sched";
+	case NFTLB_BCK_MAP_ADDR:
+		return "addr";
+	case NFTLB_BCK_MAP_ADDR_PORT:
+		return "addr-port";
+	case NFTLB_BCK_MAP_ETHER:
+		return "ether";
+	case NFTLB_BCK_MAP_PORT:
+		return "port";
+	case NFTLB_BCK_MAP_OFACE:
+		return "oface";
+	default:
+		return "";
+	}
+}
+
+static int get_bck_map_index(int kind, int family)
+{
+	return kind * 2 + (family == VALUE_FAMILY_IPV6);
+}
+
+static int get_bck_map_bit(int kind, int family)
+{
+	return 1 << get_bck_map_index(kind, family);
+}
+
+static int get_bck_maps_family(int family)
+{
+	int maps = 0;
+	int kind;
+
+	for (kind = 0; kind < NFTLB_BCK_MAP_MAX; kind++)
+		maps |= get_bck_map_bit(kind, family);
+
+	return maps;
+}
+
+static void get_bck_map_name(char *name, struct farm *f, int kind, int family)
+{
+	snprintf(name, NFTLB_MAX_OBJ_NAME, "bck-%s%s-%s", print_bck_map_kind(kind), (family == VALUE_FAMILY_IPV6) ? "6" : "", f->name);
+}
+
+static int get_bck_map_kind(enum map_modes key_mode, enum map_modes data_mode)
+{
+	switch (key_mode) {
+	case BCK_MAP_WEIGHT:
+		return NFTLB_BCK_MAP_SCHED;
+	case BCK_MAP_MARK:
+		return (data_mode == BCK_MAP_IPADDR_PORT) ? NFTLB_BCK_MAP_ADDR_PORT : NFTLB_BCK_MAP_ADDR;
+	case BCK_MAP_IPADDR:
+		return NFTLB_BCK_MAP_ETHER;
+	case BCK_MAP_ETHADDR:
+		return (data_mode == BCK_MAP_PORT) ? NFTLB_BCK_MAP_PORT : NFTLB_BCK_MAP_OFACE;
+	default:
+		return -1;
+	}
+}
+
+static int get_bck_map_modes(struct farm *f, int kind, enum map_modes *key_mode, enum map_modes *data_mode)
+{
+	switch (kind) {
+	case NFTLB_BCK_MAP_SCHED:
+		*key_mode = BCK_MAP_WEIGHT;
+		if (f->mode == VALUE_MODE_DSR)
+			*data_mode = BCK_MAP_ETHADDR;
+		else if (f->mode == VALUE_MODE_STLSDNAT)
+			*data_mode = BCK_MAP_IPADDR;
+		else
+			*data_mode = BCK_MAP_MARK;
+		return NFTLB_CHECK_AVAIL;
+	case NFTLB_BCK_MAP_ADDR:
+		*key_mode = BCK_MAP_MARK;
+		*data_mode = BCK_MAP_IPADDR;
+		return NFTLB_CHECK_USABLE;
+	case NFTLB_BCK_MAP_ADDR_PORT:
+		*key_mode = BCK_MAP_MARK;
+		*data_mode = BCK_MAP_IPADDR_PORT;
+		return NFTLB_CHECK_USABLE;
+	case NFTLB_BCK_MAP_ETHER:
+		*key_mode = BCK_MAP_IPADDR;
+		*data_mode = BCK_MAP_ETHADDR;
+		return NFTLB_CHECK_AVAIL;
+	case NFTLB_BCK_MAP_PORT:
+		*key_mode = BCK_MAP_ETHADDR;
+		*data_mode = BCK_MAP_PORT;
+		return NFTLB_CHECK_AVAIL;
+	case NFTLB_BCK_MAP_OFACE:
+	default:
+		*key_mode = BCK_MAP_ETHADDR;
+		*data_mode = BCK_MAP_OFACE;
+		return NFTLB_CHECK_AVAIL;
+	}
+}
+
+static void get_bck_map_type(char *type, int family, enum map_modes mode)
+{
+	switch (mode) {
+	case BCK_MAP_WEIGHT:
+	case BCK_MAP_MARK:
+		snprintf(type, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_MAP_TYPE_MARK);
+		break;
+	case BCK_MAP_ETHADDR:
+		snprintf(type, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_MAP_TYPE_MAC);
+		break;
+	case BCK_MAP_IPADDR:
+		snprintf(type, NFTLB_MAX_OBJ_NAME, "%s", print_nft_family_type(family));
+		break;
+	case BCK_MAP_IPADDR_PORT:
+		snprintf(type, NFTLB_MAX_OBJ_NAME, "%s . %s", print_nft_family_type(family), NFTLB_MAP_TYPE_INETSRV);
+		break;
+	case BCK_MAP_PORT:
+		snprintf(type, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_MAP_TYPE_INETSRV);
+		break;
+	case BCK_MAP_OFACE:
+		snprintf(type, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_MAP_TYPE_IFINDEX);
+		break;
+	default:
+		break;
+	}
+}
+
+static int get_bck_map_chain(struct farm *f, int kind)
+{
+	if (farm_is_ingress_mode(f))
+		return NFTLB_F_CHAIN_ING_FILTER;
+
+	if (kind == NFTLB_BCK_MAP_SCHED)
+		return NFTLB_F_CHAIN_PRE_FILTER;
+
+	return NFTLB_F_CHAIN_PRE_DNAT;
+}
+
+static int get_bck_maps_needed(struct nftst *n, int family)
+{
+	struct farm *f = nftst_get_farm(n);
+	int maps = 0;
+
+	// the default port of the backends depends on the farm address
+	if (!nft_bck_maps || f->addresses_used > 1 || f->bcks_usable == 0)
+		return 0;
+
+	switch (f->mode) {
+	case VALUE_MODE_LOCAL:
+		break;
+	case VALUE_MODE_DSR:
+	case VALUE_MODE_STLSDNAT:
+		if (f->bcks_available)
+			maps |= get_bck_map_bit(NFTLB_BCK_MAP_SCHED, family);
+		if (f->mode == VALUE_MODE_STLSDNAT)
+			maps |= get_bck_map_bit(NFTLB_BCK_MAP_ETHER, family);
+		if (f->mode == VALUE_MODE_STLSDNAT && f->bcks_have_port)
+			maps |= get_bck_map_bit(NFTLB_BCK_MAP_PORT, family);
+		if (f->bcks_have_if)
+			maps |= get_bck_map_bit(NFTLB_BCK_MAP_OFACE, family);
+		break;
+	default:
+		if (f->bcks_available && !(f->scheduler == VALUE_SCHED_SYMHASH && f->bcks_available == 1))
+			maps |= get_bck_map_bit(NFTLB_BCK_MAP_SCHED, family);
+		if (f->bcks_have_port && nftst_get_proto(n) != VALUE_PROTO_ALL)
+			maps |= get_bck_map_bit(NFTLB_BCK_MAP_ADDR_PORT, family);
+		else
+			maps |= get_bck_map_bit(NFTLB_BCK_MAP_ADDR, family);
+		break;
+	}
+
+	return maps;
+}
+
+/* the elements of the named backend maps as they were generated */
+struct nft_bck_elems {
+	unsigned int	epoch;
+	char			*elems[NFTLB_BCK_MAP_MAX * 2];
+};
+
+/* a rolled back commit leaves the elements of every map unknown */
+static unsigned int nft_bck_elems_epoch;
+
+static void nft_bck_elems_clean(struct nft_bck_elems *be)
+{
+	int i;
+
+	for (i = 0; i < NFTLB_BCK_MAP_MAX * 2; i++) {
+		if (be->elems[i])
+			free(be->elems[i]);
+		be->elems[i] = NULL;
+	}
+}
+
+static char *nft_bck_elems_get(struct farm *f, int idx)
+{
+	struct nft_bck_elems *be = f->nft_bck_elems;
+
+	if (!be || be->epoch != nft_bck_elems_epoch)
+		return NULL;
+
+	return be->elems[idx];
+}
+
+static void nft_bck_elems_set(struct farm *f, int idx, char *elems)
+{
+	struct nft_bck_elems *be = f->nft_bck_elems;
+
+	if (!be) {
+		be = (struct nft_bck_elems *)calloc(1, sizeof(struct nft_bck_elems));
+		if (!be)
+			return;
+		be->epoch = nft_bck_elems_epoch;
+		f->nft_bck_elems = be;
+	}
+
+	if (be->epoch != nft_bck_elems_epoch) {
+		nft_bck_elems_clean(be);
+		be->epoch = nft_bck_elems_epoch;
+	}
+
+	if (be->elems[idx])
+		free(be->elems[idx]);
+	be->elems[idx] = elems ? strdup(elems) : NULL;
+}
+
+void nft_farm_release(struct farm *f)
+{
+	if (!f->nft_bck_elems)
+		return;
+
+	nft_bck_elems_clean(f->nft_bck_elems);
+	free(f->nft_bck_elems);
+	f->nft_bck_elems = NULL;
+}
+
+/* split a " key: data" element list in place, returns its end */
+static char *nft_bck_elems_split(char *elems, struct u_hash *items)
+{
+	char *item = elems;
+	char *next;
+
+	while ((next = strchr(item, ',')) != NULL) {
+		*next = '\0';
+		u_hash_add(items, item, item);
+		item = next + 1;
+	}
+
+	if (*item)
+		u_hash_add(items, item, item);
+
+	return item + strlen(item);
+}
+
+static char *get_bck_map_elem(char *item, int *key_len)
+{
+	char *sep;
+
+	while (*item == ' ')
+		item++;
+
+	sep = strstr(item, ": ");
+	*key_len = sep ? (int)(sep - item) : (int)strlen(item);
+
+	return item;
+}
+
+/*
+ * Delete the elements that are gone or changed and add the new ones instead
+ * of flushing and refilling the whole map.
+ */
+static void run_farm_bck_map_diff(struct u_buffer *buf, char *table_family, char *name, char *old_elems, char *new_elems)
+{
+	struct nft_elem_block add, del;
+	struct u_hash old_items, new_items;
+	char *old = strdup(old_elems);
+	char *new = strdup(new_elems);
+	char *old_end, *new_end, *item, *elem;
+	int ndel = 0, nadd = 0;
+	int len;
+
+	if (!old || !new) {
+		if (old)
+			free(old);
+		if (new)
+			free(new);
+		concat_exec_cmd(buf, " ; flush map %s %s %s", table_family, NFTLB_TABLE_NAME, name);
+		if (*new_elems)
+			concat_exec_cmd(buf, " ; add element %s %s %s {%s }", table_family, NFTLB_TABLE_NAME, name, new_elems);
+		return;
+	}
+
+	u_hash_init(&old_items);
+	u_hash_init(&new_items);
+	old_end = nft_bck_elems_split(old, &old_items);
+	new_end = nft_bck_elems_split(new, &new_items);
+
+	elem_block_init(&del, buf, " ; %s element %s %s %s {", NFTLB_NFT_ACTION_DEL, table_family, NFTLB_TABLE_NAME, name);
+	elem_block_init(&add, buf, " ; %s element %s %s %s {", NFTLB_NFT_ACTION_ADD, table_family, NFTLB_TABLE_NAME, name);
+
+	for (item = old; item < old_end; item += strlen(item) + 1) {
+		if (!*item || u_hash_lookup(&new_items, item))
+			continue;
+		elem = get_bck_map_elem(item, &len);
+		elem_block_concat(&del, "%.*s", len, elem);
+		ndel++;
+	}
+	elem_block_end(&del);
+
+	for (item = new; item < new_end; item += strlen(item) + 1) {
+		if (!*item || u_hash_lookup(&old_items, item))
+			continue;
+		elem = get_bck_map_elem(item, &len);
+		elem_block_concat(&add, "%s", elem);
+		nadd++;
+	}
+	elem_block_end(&add);
+
+	u_log_print(LOG_DEBUG, "%s():%d: map %s with %d elements deleted and %d added", __FUNCTION__, __LINE__, name, ndel, nadd);
+
+	u_hash_clean(&old_items);
+	u_hash_clean(&new_items);
+	free(old);
+	free(new);
+}
+
+static void run_farm_bck_map(struct u_buffer *buf, struct nftst *n, int family, int kind, int action)
+{
+	struct farm *f = nftst_get_farm(n);
+	char name[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char key_type[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char data_type[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char *table_family = print_nft_table_family(family, get_bck_map_chain(f, kind));
+	int idx = get_bck_map_index(kind, family);
+	int bit = get_bck_map_bit(kind, family);
+	enum map_modes key_mode, data_mode;
+	struct u_buffer elems;
+	char *data, *old;
+	int usable, nelems;
+
+	get_bck_map_name(name, f, kind, family);
+	usable = get_bck_map_modes(f, kind, &key_mode, &data_mode);
+
+	switch (action) {
+	case ACTION_START:
+	case ACTION_RELOAD:
+		u_buf_create(&elems);
+		if (kind == NFTLB_BCK_MAP_SCHED)
+			nelems = run_farm_rules_gen_sched_elems(&elems, n, data_mode);
+		else
+			nelems = run_farm_rules_gen_bck_elems(&elems, n, key_mode, data_mode, usable);
+		data = nelems ? u_buf_get_data(&elems) : "";
+
+		old = (f->nft_bck_maps & bit) ? nft_bck_elems_get(f, idx) : NULL;
+		if (old) {
+			run_farm_bck_map_diff(buf, table_family, name, old, data);
+		} else {
+			if (f->nft_bck_maps & bit) {
+				concat_exec_cmd(buf, " ; flush map %s %s %s", table_family, NFTLB_TABLE_NAME, name);
+			} else {
+				get_bck_map_type(key_type, family, key_mode);
+				get_bck_map_type(data_type, family, data_mode);
+				concat_exec_cmd(buf, " ; add map %s %s %s { type %s : %s ;%s}", table_family, NFTLB_TABLE_NAME, name, key_type, data_type,
+								(kind == NFTLB_BCK_MAP_SCHED) ? " flags interval ;" : "");
+				f->nft_bck_maps |= bit;
+			}
+			if (nelems)
+				concat_exec_cmd(buf, " ; add element %s %s %s {%s }", table_family, NFTLB_TABLE_NAME, name, data);
+		}
+
+		nft_bck_elems_set(f, idx, data);
+		u_buf_clean(&elems);
+		break;
+	case ACTION_STOP:
+	case ACTION_DELETE:
+		if (!(f->nft_bck_maps & bit))
+			break;
+		concat_exec_cmd(buf, " ; delete map %s %s %s", table_family, NFTLB_TABLE_NAME, name);
+		f->nft_bck_maps &= ~bit;
+		nft_bck_elems_set(f, idx, NULL);
+		break;
+	default:
+		break;
+	}
+}
+
+static void run_farm_bck_maps(struct u_buffer *buf, struct nftst *n, int family, int type, int action)
+{
+	struct farm *f = nftst_get_farm(n);
+	int needed;
+	int kind;
+
+	if (!f)
+		return;
+
+	needed = get_bck_maps_needed(n, family);
+
+	for (kind = 0; kind < NFTLB_BCK_MAP_MAX; kind++) {
+		if (get_bck_map_chain(f, kind) != type)
+			continue;
+
+		if ((action == ACTION_START || action == ACTION_RELOAD) && (needed & get_bck_map_bit(kind, family))) {
+			if (kind == NFTLB_BCK_MAP_SCHED)
+				f->nft_sched_slots = get_farm_sched_slots(f);
+			run_farm_bck_map(buf, n, family, kind, action);
+		} else {
+			run_farm_bck_map(buf, n, family, kind, ACTION_STOP);
+		}
+	}
+}
+
+static int run_nftst_rules_gen_chain(struct u_buffer *buf, struct nftst *n, int family, int type, int action)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
+
+	get_chain_name(chain, nftst_get_name(n), type);
+
+	switch (action) {
+	case ACTION_RELOAD:
+		if ((nftst_get_chains(n) & type) == 0)
+			action = ACTION_START;
+		break;
+	case ACTION_START:
+		if (nftst_get_chains(n) & type)
+			action = ACTION_RELOAD;
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		if ((nftst_get_chains(n) & type) == 0)
+			action = ACTION_NONE;
+		break;
+	default:
+		break;
+	}
+
+	// output uses the same farm chains than prerouting-filter and prerouting-nat
+	if (type == NFTLB_F_CHAIN_OUT_FILTER || type == NFTLB_F_CHAIN_OUT_DNAT)
+		return 0;
+
+	switch (action) {
+	case ACTION_RELOAD:
+	case ACTION_START:
+		nft_chain_handler(buf, print_nft_table_family(family, type), chain, NULL, NULL, NULL, 0, action);
+		nftst_set_chains(n, nftst_get_chains(n) | type);
+		run_farm_bck_maps(buf, n, family, type, action);
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		if ((f && f->addresses_used == 1) ||
+			(!f && a)){
+			nft_chain_handler(buf, print_nft_table_family(family, type), chain, NULL, NULL, NULL, 0, action);
+			nftst_set_chains(n, nftst_get_chains(n) & ~type);
+			run_farm_bck_maps(buf, n, family, type, action);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int run_base_chain_set_meta_mark(struct u_buffer *buf, int type, char *chain_family, char *base_chain)
+{
+
+	if (type & NFTLB_F_CHAIN_PRE_FILTER)
+		concat_exec_cmd(buf, " ; add rule %s %s %s meta mark 0x0 meta mark set ct mark", chain_family, NFTLB_TABLE_NAME, base_chain);
+	if (type & NFTLB_F_CHAIN_PRE_DNAT)
+		concat_exec_cmd(buf, " ; add rule %s %s %s ct state new meta mark 0x0 meta mark set ct mark", chain_family, NFTLB_TABLE_NAME, base_chain);
+
+	return 0;
+}
+
+static int run_base_chain_postrouting_masquerade(struct u_buffer *buf, int type, char *chain_family)
+{
+	if (type & NFTLB_F_CHAIN_POS_SNAT) {
+		concat_exec_cmd(buf, " ; add rule %s %s %s ct mark 0x0 ct mark set meta mark", chain_family, NFTLB_TABLE_NAME, NFTLB_TABLE_POSTROUTING);
+		concat_exec_cmd(buf, " ; add rule %s %s %s ct mark and 0x%x == 0x%x masquerade", chain_family, NFTLB_TABLE_NAME, NFTLB_TABLE_POSTROUTING, masquerade_mark, masquerade_mark);
+	}
+
+	return 0;
+}
+
+static int run_base_chain_postrouting_bckmark(struct u_buffer *buf, char *service, int type, int family)
+{
+	if (~type & NFTLB_F_CHAIN_POS_SNAT)
+		return 0;
+
+	concat_exec_cmd(buf, " ; add map %s %s %s { type %s : %s ;}", print_nft_family(family), NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_MARK, print_nft_family_type(family));
+	concat_exec_cmd(buf, " ; add rule %s %s %s snat to ct mark map @%s", print_nft_family(family), NFTLB_TABLE_NAME, NFTLB_TABLE_POSTROUTING, service);
+
+	return 1;
+}
+
+static int run_farm_rules_gen_meta_param(struct u_buffer *buf, int protocol, int family, int param, int type)
+{
+	int items = 0;
+
+	if ((param & VALUE_META_NONE) ||
+		(param & VALUE_META_SRCIP)) {
+		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " %s", print_nft_family_type(family)) : u_buf_concat(buf, " %s saddr", print_nft_family(family));
+		items++;
+	}
+
+	if (param & VALUE_META_DSTIP) {
+		if (items)
+			u_buf_concat(buf, " .");
+		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " %s", print_nft_family_type(family)) : u_buf_concat(buf, " %s daddr", print_nft_family(family));
+		items++;
+	}
+
+	if (param & VALUE_META_SRCPORT) {
+		if (items)
+			u_buf_concat(buf, " .");
+		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " inet_service") : u_buf_concat(buf, " %s sport", print_nft_protocol(protocol));
+		items++;
+	}
+
+	if (param & VALUE_META_DSTPORT) {
+		if (items)
+			u_buf_concat(buf, " .");
+		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " inet_service") : u_buf_concat(buf, " %s dport", print_nft_protocol(protocol));
+		items++;
+	}
+
+	if (param & VALUE_META_SRCMAC) {
+		if (items)
+			u_buf_concat(buf, " .");
+		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " ether_addr") : u_buf_concat(buf, " ether saddr");
+		items++;
+	}
+
+	if (param & VALUE_META_DSTMAC) {
+		if (items)
+			u_buf_concat(buf, " .");
+		(type == NFTLB_MAP_KEY_TYPE) ? u_buf_concat(buf, " ether_addr") : u_buf_concat(buf, " ether daddr");
+	}
+
+	if (param & VALUE_META_MARK) {
+		if (items)
+			u_buf_concat(buf, " .");
+		u_buf_concat(buf, " mark");
+	}
+
+	return 0;
+}
+
+static void run_farm_map(struct u_buffer *buf, struct address *a, int family, unsigned int stage, char *mapname, int key, int data, int timeout, int size, int action)
+{
+	switch (action) {
+	case ACTION_START:
+		u_buf_concat(buf, " ; add map %s %s %s { type ", print_nft_table_family(family, stage), NFTLB_TABLE_NAME, mapname);
+		run_farm_rules_gen_meta_param(buf, a->protocol, family, key, NFTLB_MAP_KEY_TYPE);
+		u_buf_concat(buf, " :");
+		run_farm_rules_gen_meta_param(buf, a->protocol, family, data, NFTLB_MAP_KEY_TYPE);
+		u_buf_concat(buf, ";");
+		if (timeout != -1)
+			u_buf_concat(buf, " timeout %ds;", timeout);
+		if (size)
+			u_buf_concat(buf, " size %d;", size);
+		concat_exec_cmd(buf, " }");
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		concat_exec_cmd(buf, " ; delete map %s %s %s", print_nft_table_family(family, stage), NFTLB_TABLE_NAME, mapname);
+		break;
+	case ACTION_RELOAD:
+	default:
+		break;
+	}
+}
+
+static int run_base_table(struct u_buffer *buf, int type, int family, int action)
+{
+	struct nft_gen_op *op = nft_gen_defer(NFTLB_GEN_OP_TABLE);
+	char *chain_family = print_nft_table_family(family, type);
+
+	if (op) {
+		op->type = type;
+		op->family = family;
+		op->action = action;
+		return 0;
+	}
+
+	if (action == ACTION_STOP || action == ACTION_DELETE) {
+		// delete ip and ip6 based nftlb tables
+		if ((type & NFTLB_F_CHAIN_PRE_DNAT || type & NFTLB_F_CHAIN_PRE_FILTER) &&
+			((nft_base_rules.tables & NFTLB_TABLE_IP_ACTIVE && family == VALUE_FAMILY_IPV4 && (nft_base_rules.dnat_rules_v4 == 0 && nft_base_rules.filter_rules_v4 == 0)) ||
 				(nft_base_rules.tables & NFTLB_TABLE_IP6_ACTIVE && family == VALUE_FAMILY_IPV6 && (nft_base_rules.dnat_rules_v6 == 0 && nft_base_rules.filter_rules_v6 == 0)))) {
 			if (family == VALUE_FAMILY_IPV4)
 				nft_base_rules.tables &= ~NFTLB_TABLE_IP_ACTIVE;
@@ -1132,1385 +2516,2523 @@ static int run_base_table(struct u_buffer *buf, int type, int family, int action
 			nft_table_handler(buf, chain_family, ACTION_DELETE);
 		}
 
-		if (type & NFTLB_F_CHAIN_ING_FILTER && (nft_base_rules.tables & NFTLB_TABLE_NETDEV_ACTIVE) &&
-			nft_base_rules.ndv_ingress_policies == 0 && nft_base_rules.ndv_ingress_rules.n_interfaces == 0 && nft_base_rules.ndv_ingress_dnat_rules.n_interfaces == 0) {
-			nft_base_rules.tables &= ~NFTLB_TABLE_NETDEV_ACTIVE;
-			nft_table_handler(buf, chain_family, ACTION_DELETE);
+		if (type & NFTLB_F_CHAIN_ING_FILTER && (nft_base_rules.tables & NFTLB_TABLE_NETDEV_ACTIVE) &&
+			nft_base_rules.ndv_ingress_policies == 0 && nft_base_rules.ndv_ingress_rules.n_interfaces == 0 && nft_base_rules.ndv_ingress_dnat_rules.n_interfaces == 0) {
+			nft_base_rules.tables &= ~NFTLB_TABLE_NETDEV_ACTIVE;
+			nft_table_handler(buf, chain_family, ACTION_DELETE);
+		}
+	}
+
+	if (action == ACTION_RELOAD || action == ACTION_START) {
+		if ((type & NFTLB_F_CHAIN_PRE_DNAT || type & NFTLB_F_CHAIN_PRE_FILTER) &&
+			((~nft_base_rules.tables & NFTLB_TABLE_IP_ACTIVE && family == VALUE_FAMILY_IPV4 && (nft_base_rules.dnat_rules_v4 == 0 && nft_base_rules.filter_rules_v4 == 0)) ||
+			(~nft_base_rules.tables & NFTLB_TABLE_IP6_ACTIVE && family == VALUE_FAMILY_IPV6 && (nft_base_rules.dnat_rules_v6 == 0 && nft_base_rules.filter_rules_v6 == 0)))) {
+			if (family == VALUE_FAMILY_IPV4)
+				nft_base_rules.tables |= NFTLB_TABLE_IP_ACTIVE;
+			if (family == VALUE_FAMILY_IPV6)
+				nft_base_rules.tables |= NFTLB_TABLE_IP6_ACTIVE;
+			nft_table_handler(buf, chain_family, ACTION_START);
+		}
+
+		if (type & NFTLB_F_CHAIN_ING_FILTER && ~nft_base_rules.tables & NFTLB_TABLE_NETDEV_ACTIVE &&
+			nft_base_rules.ndv_ingress_rules.n_interfaces == 0 &&
+			nft_base_rules.ndv_ingress_dnat_rules.n_interfaces == 0) {
+			nft_base_rules.tables |= NFTLB_TABLE_NETDEV_ACTIVE;
+			nft_table_handler(buf, chain_family, ACTION_START);
+		}
+	}
+
+	return 0;
+}
+
+static char *print_srv_map_flags(void)
+{
+	return nft_interval_maps ? " flags interval ;" : "";
+}
+
+static int run_base_chain(struct u_buffer *buf, struct nftst *n, int type, int family, unsigned int rules_needed, int action)
+{
+	char service[NFTLB_MAX_OBJ_NAME-2] = { 0 };
+	char servicem[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char base_chain[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char chain_device[NFTLB_MAX_OBJ_DEVICE] = { 0 };
+	char trailing[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char *chain_type;
+	char *chain_hook;
+	char *chain_family;
+	int chain_prio;
+	unsigned int *base_rules;
+	unsigned int *base_rules_t;
+	struct if_base_rule_list *if_base_list = &nft_base_rules.ndv_ingress_rules;
+	struct address *a = nftst_get_address(n);
+	struct farm *f = nftst_get_farm(n);
+	struct nft_gen_op *op = nft_gen_defer(NFTLB_GEN_OP_CHAIN);
+
+	if (op) {
+		op->n = *n;
+		op->type = type;
+		op->family = family;
+		op->rules = rules_needed;
+		op->action = action;
+		return 0;
+	}
+
+	u_log_print(LOG_DEBUG, "%s():%d: chain %s - action %d", __FUNCTION__, __LINE__, get_chain_print_pos(get_chain_pos_counter(type)), action);
+
+	get_address_service(service, a, type, family, BCK_MAP_NONE);
+	get_address_service(servicem, a, NFTLB_F_CHAIN_POS_SNAT, family, BCK_MAP_BCK_MARK);
+	chain_family = print_nft_table_family(family, type);
+
+	if (type & NFTLB_F_CHAIN_ING_FILTER) {
+		base_rules = get_rules_applied(type, family, a->iface);
+		if (!base_rules)
+			return 1;
+		chain_prio = NFTLB_INGRESS_PRIO;
+		chain_type = NFTLB_TYPE_FILTER;
+		chain_hook = NFTLB_HOOK_INGRESS;
+		snprintf(chain_device, NFTLB_MAX_OBJ_DEVICE, "%s", a->iface);
+		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TABLE_INGRESS, a->iface);
+		snprintf(trailing, NFTLB_MAX_OBJ_NAME, "-%s", a->iface);
+
+	} else if (type & NFTLB_F_CHAIN_ING_DNAT) {
+		if (!f)
+			return 0;
+		base_rules = get_rules_applied(type, family, f->oface);
+		if (!base_rules)
+			return 1;
+		if_base_list = &nft_base_rules.ndv_ingress_dnat_rules;
+		chain_prio = NFTLB_INGRESS_DNAT_PRIO;
+		chain_type = NFTLB_TYPE_FILTER;
+		chain_hook = NFTLB_HOOK_INGRESS;
+		snprintf(chain_device, NFTLB_MAX_OBJ_DEVICE, "%s", f->oface);
+		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s-dnat-%s", NFTLB_TABLE_INGRESS, chain_device);
+		snprintf(trailing, NFTLB_MAX_OBJ_NAME, "-%s", f->oface);
+
+	} else if (type & NFTLB_F_CHAIN_PRE_FILTER) {
+		base_rules = get_rules_applied(type, family, "");
+		chain_prio = NFTLB_FILTER_PRIO;
+		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_FILTER);
+		chain_type = NFTLB_TYPE_FILTER;
+		chain_hook = NFTLB_HOOK_PREROUTING;
+
+	} else if (type & NFTLB_F_CHAIN_PRE_DNAT) {
+		base_rules = get_rules_applied(type, family, "");
+		chain_prio = NFTLB_PREROUTING_PRIO;
+		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_PREROUTING);
+		chain_type = NFTLB_TYPE_NAT;
+		chain_hook = NFTLB_HOOK_PREROUTING;
+
+	} else if (type & NFTLB_F_CHAIN_POS_SNAT) {
+		base_rules = get_rules_applied(type, family, "");
+		chain_prio = NFTLB_POSTROUTING_PRIO;
+		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_POSTROUTING);
+		chain_type = NFTLB_TYPE_NAT;
+		chain_hook = NFTLB_HOOK_POSTROUTING;
+
+	} else if (type & NFTLB_F_CHAIN_FWD_FILTER) {
+		base_rules = get_rules_applied(type, family, "");
+		chain_prio = NFTLB_PREROUTING_PRIO;
+		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_FORWARD);
+		chain_type = NFTLB_TYPE_FILTER;
+		chain_hook = NFTLB_HOOK_FORWARD;
+
+	} else if (type & NFTLB_F_CHAIN_OUT_FILTER) {
+		base_rules = get_rules_applied(type, family, "");
+		chain_prio = NFTLB_FILTER_PRIO;
+		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_OUT_FILTER);
+		chain_type = NFTLB_TYPE_FILTER;
+		chain_hook = NFTLB_HOOK_OUTPUT;
+
+	} else if (type & NFTLB_F_CHAIN_OUT_DNAT) {
+		base_rules = get_rules_applied(type, family, "");
+		chain_prio = NFTLB_PREROUTING_PRIO;
+		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_OUT_NAT);
+		chain_type = NFTLB_TYPE_NAT;
+		chain_hook = NFTLB_HOOK_OUTPUT;
+
+	} else
+		return 1;
+
+	if (action == ACTION_STOP || action == ACTION_DELETE) {
+
+		// If any chain type counter is 0, then reload chain rules and deactivate the usage flag
+		if (((*base_rules & NFTLB_PROTO_IP_PORT_ACTIVE) && *get_service_counter(type, NFTLB_PROTO_IP_PORT_ACTIVE, family) == 0) ||
+			((*base_rules & NFTLB_PROTO_PORT_ACTIVE) && *get_service_counter(type, NFTLB_PROTO_PORT_ACTIVE, family) == 0) ||
+			((*base_rules & NFTLB_PROTO_IP_ACTIVE) && *get_service_counter(type, NFTLB_PROTO_IP_ACTIVE, family) == 0) ||
+			((*base_rules & NFTLB_MARK_ACTIVE) && *get_service_counter(type, NFTLB_MARK_ACTIVE, family) == 0)) {
+
+			nft_chain_handler(buf, chain_family, base_chain, NULL, NULL, NULL, 0, ACTION_RELOAD);
+			run_base_chain_set_meta_mark(buf, type, chain_family, base_chain);
+			run_farm_map(buf, a, family, type, service, 0, 0, 0, 0, ACTION_DELETE);
+			*base_rules &= ~NFTLB_PROTO_IP_PORT_ACTIVE & ~NFTLB_PROTO_PORT_ACTIVE & ~NFTLB_PROTO_IP_ACTIVE & ~NFTLB_MARK_ACTIVE;
+		}
+
+		if ((*get_service_counter(type, NFTLB_PROTO_IP_PORT_ACTIVE, family) == 0) &&
+			(*get_service_counter(type, NFTLB_PROTO_PORT_ACTIVE, family) == 0) &&
+			(*get_service_counter(type, NFTLB_PROTO_IP_ACTIVE, family) == 0) &&
+			(*get_service_counter(type, NFTLB_MARK_ACTIVE, family) == 0)) {
+
+			// for prerouting stage, do not remove the chain if postrouting is being used
+			if (type & NFTLB_F_CHAIN_PRE_DNAT && (
+					(*get_service_counter(NFTLB_F_CHAIN_POS_SNAT, NFTLB_PROTO_IP_PORT_ACTIVE, family) != 0) ||
+					(*get_service_counter(NFTLB_F_CHAIN_POS_SNAT, NFTLB_PROTO_PORT_ACTIVE, family) != 0) ||
+					(*get_service_counter(NFTLB_F_CHAIN_POS_SNAT, NFTLB_PROTO_IP_ACTIVE, family) != 0) ||
+					(*get_service_counter(NFTLB_F_CHAIN_POS_SNAT, NFTLB_MARK_ACTIVE, family) != 0)))
+				return 0;
+
+			if (type & NFTLB_F_CHAIN_POS_SNAT)
+				return 0;
+
+			*base_rules &= ~NFTLB_IP_ACTIVE;
+			nft_chain_handler(buf, chain_family, base_chain, NULL, NULL, NULL, 0, ACTION_DELETE);
+
+			if (type & NFTLB_F_CHAIN_ING_FILTER || type & NFTLB_F_CHAIN_ING_DNAT)
+				del_ndv_base(if_base_list, a->iface);
+
+			// in prerouting stage, apply the same action to prerouting
+			if (type & NFTLB_F_CHAIN_PRE_DNAT) {
+				nft_chain_handler(buf, chain_family, NFTLB_TABLE_POSTROUTING, NULL, NULL, NULL, 0, ACTION_DELETE);
+				run_farm_map(buf, a, family, type, servicem, 0, 0, 0, 0, ACTION_DELETE);
+				base_rules_t = get_rules_applied(NFTLB_F_CHAIN_POS_SNAT, family, "");
+				*base_rules_t &= ~NFTLB_IP_ACTIVE & ~NFTLB_PROTO_IP_PORT_ACTIVE & ~NFTLB_PROTO_PORT_ACTIVE & ~NFTLB_PROTO_IP_ACTIVE & ~NFTLB_MARK_ACTIVE;
+			}
+			return 0;
+		}
+
+		rules_needed = *base_rules;
+
+		if (*get_service_counter(type, NFTLB_PROTO_IP_PORT_ACTIVE, family) != 0)
+				rules_needed |= NFTLB_PROTO_IP_PORT_ACTIVE;
+		if (*get_service_counter(type, NFTLB_PROTO_PORT_ACTIVE, family) != 0)
+				rules_needed |= NFTLB_PROTO_PORT_ACTIVE;
+		if (*get_service_counter(type, NFTLB_PROTO_IP_ACTIVE, family) != 0)
+				rules_needed |= NFTLB_PROTO_IP_ACTIVE;
+		if (*get_service_counter(type, NFTLB_MARK_ACTIVE, family) != 0)
+				rules_needed |= NFTLB_MARK_ACTIVE;
+	}
+
+	if ((rules_needed & NFTLB_IP_ACTIVE) && !(*base_rules & NFTLB_IP_ACTIVE)) {
+
+		nft_chain_handler(buf, chain_family, base_chain, chain_type, chain_hook, chain_device, chain_prio, ACTION_START);
+		run_base_chain_set_meta_mark(buf, type, chain_family, base_chain);
+
+		if (type & NFTLB_F_CHAIN_POS_SNAT) {
+			get_nft_name_service(servicem, NFTLB_PROTO_IP_PORT_ACTIVE, "-m", type, family);
+			run_base_chain_postrouting_masquerade(buf, type, chain_family);
+			run_base_chain_postrouting_bckmark(buf, servicem, type, family);
+		}
+		*base_rules |= NFTLB_IP_ACTIVE;
+	}
+
+	if ((rules_needed & NFTLB_PROTO_IP_PORT_ACTIVE) && !(*base_rules & NFTLB_PROTO_IP_PORT_ACTIVE)) {
+		get_nft_name_service(service, NFTLB_PROTO_IP_PORT_ACTIVE, trailing, type, family);
+		if (type & NFTLB_F_CHAIN_POS_SNAT) {
+		} else if (type & NFTLB_F_CHAIN_ING_DNAT) {
+			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s . %s : verdict ;%s}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, print_nft_family_type(family), NFTLB_MAP_TYPE_INETSRV, print_srv_map_flags());
+			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . %s saddr . th sport vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), print_nft_family(family), service);
+			*base_rules |= NFTLB_PROTO_IP_PORT_ACTIVE;
+		} else if (type & NFTLB_F_CHAIN_FWD_FILTER) {
+			concat_exec_cmd(buf, " ; add map %s %s %s { type %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_MARK);
+			concat_exec_cmd(buf, " ; add rule %s %s %s ct mark vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, service);
+			*base_rules |= NFTLB_PROTO_IP_PORT_ACTIVE;
+		} else {
+			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s . %s : verdict ;%s}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, print_nft_family_type(family), NFTLB_MAP_TYPE_INETSRV, print_srv_map_flags());
+			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . %s daddr . th dport vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), print_nft_family(family), service);
+			*base_rules |= NFTLB_PROTO_IP_PORT_ACTIVE;
+		}
+	}
+
+	if ((rules_needed & NFTLB_PROTO_PORT_ACTIVE) && !(*base_rules & NFTLB_PROTO_PORT_ACTIVE)) {
+		get_nft_name_service(service, NFTLB_PROTO_PORT_ACTIVE, trailing, type, family);
+		if (type & NFTLB_F_CHAIN_POS_SNAT) {
+		} else if (type & NFTLB_F_CHAIN_ING_DNAT) {
+			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s : verdict ;%s}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, NFTLB_MAP_TYPE_INETSRV, print_srv_map_flags());
+			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . th sport vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), service);
+			*base_rules |= NFTLB_PROTO_PORT_ACTIVE;
+		} else if (type & NFTLB_F_CHAIN_FWD_FILTER) {
+			concat_exec_cmd(buf, " ; add map %s %s %s { type %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_MARK);
+			concat_exec_cmd(buf, " ; add rule %s %s %s ct mark vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, service);
+			*base_rules |= NFTLB_PROTO_PORT_ACTIVE;
+		} else {
+			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s : verdict ;%s}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, NFTLB_MAP_TYPE_INETSRV, print_srv_map_flags());
+			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . th dport vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), service);
+			*base_rules |= NFTLB_PROTO_PORT_ACTIVE;
+		}
+	}
+
+	if ((rules_needed & NFTLB_PROTO_IP_ACTIVE) && !(*base_rules & NFTLB_PROTO_IP_ACTIVE)) {
+		get_nft_name_service(service, NFTLB_PROTO_IP_ACTIVE, trailing, type, family);
+		if (type & NFTLB_F_CHAIN_POS_SNAT) {
+		} else if (type & NFTLB_F_CHAIN_ING_DNAT) {
+			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, print_nft_family_type(family));
+			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . %s saddr vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), print_nft_family(family), service);
+			*base_rules |= NFTLB_PROTO_IP_ACTIVE;
+		} else if (type & NFTLB_F_CHAIN_FWD_FILTER) {
+			concat_exec_cmd(buf, " ; add map %s %s %s { type %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_MARK);
+			concat_exec_cmd(buf, " ; add rule %s %s %s ct mark vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, service);
+			*base_rules |= NFTLB_PROTO_IP_ACTIVE;
+		} else {
+			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, print_nft_family_type(family));
+			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . %s daddr vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), print_nft_family(family), service);
+			*base_rules |= NFTLB_PROTO_IP_ACTIVE;
+		}
+	}
+
+	return 0;
+}
+
+static int run_nftst_rules_gen_srv_data(char **buf, struct nftst *n, char *chain, enum map_modes data_mode)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct backend *b = nftst_get_backend(n);
+
+	switch (data_mode) {
+	case BCK_MAP_SRCIPADDR:
+		if (f)
+			sprintf(*buf, ": %s ", f->srcaddr);
+		break;
+	case BCK_MAP_NAME:
+		sprintf(*buf, ": goto %s ", chain);
+		break;
+	case BCK_MAP_BCK_BF_SRCIPADDR:
+		if (b && b->srcaddr && b->srcaddr != DEFAULT_SRCADDR && strcmp(b->srcaddr, "") != 0)
+			sprintf(*buf, ": %s ", b->srcaddr);
+		else if (f && f->srcaddr != DEFAULT_SRCADDR && strcmp(f->srcaddr, "") != 0)
+			sprintf(*buf, ": %s ", f->srcaddr);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Add the virtual ports of the address to the element list, as port ranges when
+ * the service maps are intervals or one element per port otherwise.
+ */
+static int run_nftst_rules_gen_srv_ports(struct nft_elem_block *blk, struct address *a, char *key, char *data_str)
+{
+	int elements = 0;
+	int iport, last;
+
+	if (!nft_interval_maps) {
+		for (iport = address_next_port(a, 0); iport; iport = address_next_port(a, iport)) {
+			elem_block_concat(blk, "%s . %d %s", key, iport, data_str);
+			elements++;
+		}
+		return elements;
+	}
+
+	for (iport = address_next_port_range(a, 0, &last); iport; iport = address_next_port_range(a, last, &last)) {
+		if (iport == last)
+			elem_block_concat(blk, "%s . %d %s", key, iport, data_str);
+		else
+			elem_block_concat(blk, "%s . %d-%d %s", key, iport, last, data_str);
+		elements++;
+	}
+
+	return elements;
+}
+
+/*
+ * Next virtual ports of the address to be keyed by the backends without port,
+ * the whole port range when the service maps are intervals so the elements
+ * per backend don't grow with the number of ports.
+ */
+static int get_srv_next_ports(struct address *a, int port, int *last)
+{
+	if (nft_interval_maps)
+		return address_next_port_range(a, port, last);
+
+	*last = address_next_port(a, port);
+	return *last;
+}
+
+static void print_srv_ports(char *port_str, int first, int last)
+{
+	if (first == last)
+		snprintf(port_str, NFTLB_MAX_OBJ_PORTS, "%d", first);
+	else
+		snprintf(port_str, NFTLB_MAX_OBJ_PORTS, "%d-%d", first, last);
+}
+
+static int run_nftst_rules_gen_srv_map(struct u_buffer *buf, struct nftst *n, int family, int type, int proto, int action, enum map_modes key_mode, enum map_modes data_mode)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	char action_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char key_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char *data_str = NULL;
+	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char service[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char protocol[NFTLB_MAX_OBJ_PROTO] = { 0 };
+	char *nft_family = print_nft_table_family(family, type);
+	struct nft_elem_block blk;
+	struct backend *b;
+	char port_str[NFTLB_MAX_OBJ_PORTS] = { 0 };
+	int nports = a->nports;
+	int iport, lport;
+	int bckmark;
+	int output = 0;
+	int first_port = 1;
+	int structure = 0;
+	int replace = 0;
+
+	data_str = calloc(1, 255);
+	if (!data_str) {
+		u_log_print(LOG_ERR, "%s():%d: memory allocation error", __FUNCTION__, __LINE__);
+		return -1;
+	}
+
+	switch (action) {
+	case ACTION_RELOAD:
+	case ACTION_START:
+		sprintf(action_str, "add");
+		break;
+	case ACTION_STOP:
+	case ACTION_DELETE:
+		sprintf(action_str, "delete");
+		break;
+	default:
+		return -1;
+		break;
+	}
+
+	get_chain_name(chain, nftst_get_name(n), type);
+	get_address_service(service, nftst_get_address(n), type, nftst_get_family(n), BCK_MAP_NONE);
+	snprintf(protocol, NFTLB_MAX_OBJ_PROTO, "%s", print_nft_protocol(proto));
+
+	switch (key_mode) {
+	case BCK_MAP_IPADDR:
+		run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
+		concat_exec_cmd(buf, " ; %s element %s %s %s { %s %s}", action_str, nft_family, NFTLB_TABLE_NAME, service, a->ipaddr, data_str);
+		output++;
+		break;
+	case BCK_MAP_PROTO_IPADDR:
+		run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
+		concat_exec_cmd(buf, " ; %s element %s %s %s { %s . %s %s}", action_str, nft_family, NFTLB_TABLE_NAME, service, protocol, a->ipaddr, data_str);
+		output++;
+		break;
+	case BCK_MAP_IPADDR_PORT:
+		run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
+
+		if (nports == 0)
+			break;
+
+		elem_block_init(&blk, buf, " ; %s element %s %s %s {", action_str, nft_family, NFTLB_TABLE_NAME, service);
+
+		output += run_nftst_rules_gen_srv_ports(&blk, a, a->ipaddr, data_str);
+		elem_block_end(&blk);
+		break;
+	case BCK_MAP_PROTO_IPADDR_PORT:
+		run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
+
+		if (nports == 0)
+			break;
+
+		elem_block_init(&blk, buf, " ; %s element %s %s %s {", action_str, nft_family, NFTLB_TABLE_NAME, service);
+
+		snprintf(key_str, NFTLB_MAX_OBJ_NAME, "%s . %s", protocol, a->ipaddr);
+		output += run_nftst_rules_gen_srv_ports(&blk, a, key_str, data_str);
+		elem_block_end(&blk);
+		break;
+	case BCK_MAP_PROTO_PORT:
+		run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
+
+		if (nports == 0)
+			break;
+
+		elem_block_init(&blk, buf, " ; %s element %s %s %s {", action_str, nft_family, NFTLB_TABLE_NAME, service);
+
+		output += run_nftst_rules_gen_srv_ports(&blk, a, protocol, data_str);
+		elem_block_end(&blk);
+		break;
+	default:
+		nports = (nftst_get_proto(n) == VALUE_PROTO_ALL) ? 1 : a->nports;
+
+		if (nports == 0)
+			break;
+
+		// the source address is the data of the snat elements, so every element is replaced
+		replace = (action == ACTION_RELOAD && type == NFTLB_F_CHAIN_POS_SNAT && (f->reload_action & VALUE_RLD_SRCADDR));
+
+		// a farm without protocol is iterated once with a dummy port
+		lport = 1;
+		iport = (nftst_get_proto(n) == VALUE_PROTO_ALL) ? 1 : get_srv_next_ports(a, 0, &lport);
+		while (iport)
+		{
+			print_srv_ports(port_str, iport, lport);
+			list_for_each_entry(b, &f->backends, list) {
+				if (!backend_validate(b))
+					continue;
+
+				get_address_service(service, a, type, nftst_get_family(n), key_mode);
+
+				bckmark = backend_get_mark(b);
+				if (type == NFTLB_F_CHAIN_POS_SNAT && bckmark & masquerade_mark)
+					continue;
+
+				structure = 0;
+				if ((key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_MARK) && bckmark != DEFAULT_MARK) {
+					if (!first_port) { continue; }
+					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "0x%x", bckmark);
+					structure = NFTLB_MARK_ACTIVE;
+				} else if ((key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_PROTO_IPADDR_F_PORT) && backend_no_port(b)) {
+					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "%s . %s . %s", protocol, b->ipaddr, port_str);
+					structure = NFTLB_PROTO_IP_PORT_ACTIVE;
+				} else if ((key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_PROTO_IPADDR_F_PORT) && !backend_no_port(b)) {
+					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "%s . %s . %s", protocol, b->ipaddr, b->port);
+					structure = NFTLB_PROTO_IP_PORT_ACTIVE;
+				} else if ((key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_IPADDR_F_PORT) && backend_no_port(b)) {
+					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "%s . %s", b->ipaddr, port_str);
+					structure = NFTLB_PROTO_PORT_ACTIVE;
+				} else if (key_mode == BCK_MAP_BCK_ID && !backend_no_port(b)) {
+					if (!first_port) { continue; }
+					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "%s . %s", b->ipaddr, b->port);
+					structure = NFTLB_PROTO_PORT_ACTIVE;
+				} else if (key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_IPADDR) {
+					if (!first_port) { continue; }
+					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "%s", b->ipaddr);
+					structure = NFTLB_PROTO_IP_ACTIVE;
+				} else
+					if (!first_port) { continue; }
+
+				nftst_set_backend(n, b);
+				run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
+
+				if (b->action == ACTION_STOP || b->action == ACTION_DELETE || b->action == ACTION_RELOAD ||
+					(replace && b->action == ACTION_NONE && backend_is_usable(b))) {
+					if (action == ACTION_START)
+						continue;
+					concat_exec_cmd(buf, " ; delete element %s %s %s { %s }", nft_family, NFTLB_TABLE_NAME, service, key_str);
+					update_service_counters(a, type, structure, family, 1, ACTION_DELETE);
+				}
+
+				if(!backend_is_usable(b))
+					continue;
+
+				if (action == ACTION_RELOAD && b->action == ACTION_NONE && !replace)
+					continue;
+
+				concat_exec_cmd(buf, " ; %s element %s %s %s { %s %s}", action_str, nft_family, NFTLB_TABLE_NAME, service, key_str, data_str);
+				update_service_counters(a, type, structure, family, 1, action);
+				output++;
+			}
+			nftst_set_backend(n, NULL);
+
+			iport = (nftst_get_proto(n) == VALUE_PROTO_ALL) ? 0 : get_srv_next_ports(a, lport, &lport);
+			first_port = 0;
+		}
+		break;
+	}
+
+	if (data_str)
+		free(data_str);
+
+	return output;
+}
+
+static void run_nftst_rules_gen_srv_map_by_type(struct u_buffer *buf, struct nftst *n, int type, int family, int protocol, int action)
+{
+	struct address *a = nftst_get_address(n);
+	int elements = 0;
+
+	u_log_print(LOG_DEBUG, "%s():%d: ", __FUNCTION__, __LINE__);
+
+	if (type & NFTLB_F_CHAIN_ING_FILTER)
+		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_PROTO_IPADDR_PORT), BCK_MAP_NAME);
+	else if (type & NFTLB_F_CHAIN_PRE_FILTER)
+		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_PROTO_IPADDR_PORT), BCK_MAP_NAME);
+	else if (type & NFTLB_F_CHAIN_PRE_DNAT)
+		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_PROTO_IPADDR_PORT), BCK_MAP_NAME);
+	else if (type & NFTLB_F_CHAIN_FWD_FILTER)
+		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, BCK_MAP_BCK_MARK, BCK_MAP_NAME);
+	else if (type & NFTLB_F_CHAIN_POS_SNAT)
+		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, BCK_MAP_BCK_ID, BCK_MAP_BCK_BF_SRCIPADDR);
+	else if (type & NFTLB_F_CHAIN_ING_DNAT)
+		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_BCK_PROTO_IPADDR_F_PORT), BCK_MAP_NAME);
+	else if (type & NFTLB_F_CHAIN_OUT_FILTER)
+		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_PROTO_IPADDR_PORT), BCK_MAP_NAME);
+	else if (type & NFTLB_F_CHAIN_OUT_DNAT)
+		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_PROTO_IPADDR_PORT), BCK_MAP_NAME);
+	else
+		return;
+
+	if (elements && (~type & NFTLB_F_CHAIN_POS_SNAT) && (~type & NFTLB_F_CHAIN_FWD_FILTER))
+		update_service_counters(a, type, family, 0, elements, action);
+}
+
+static void run_nftst_rules_gen_srv_map_by_protocol(struct u_buffer *buf, struct nftst *n, int type, int family, int action)
+{
+	u_log_print(LOG_DEBUG, "%s():%d: ", __FUNCTION__, __LINE__);
+
+	if (nftst_get_proto(n) != VALUE_PROTO_ALL || (type & NFTLB_F_CHAIN_FWD_FILTER) || (type & NFTLB_F_CHAIN_POS_SNAT)) {
+		run_nftst_rules_gen_srv_map_by_type(buf, n, type, family, nftst_get_proto(n), action);
+	} else {
+		run_nftst_rules_gen_srv_map_by_type(buf, n, type, family, VALUE_PROTO_TCP, action);
+		run_nftst_rules_gen_srv_map_by_type(buf, n, type, family, VALUE_PROTO_UDP, action);
+		run_nftst_rules_gen_srv_map_by_type(buf, n, type, family, VALUE_PROTO_SCTP, action);
+	}
+}
+
+static void run_nftst_rules_gen_vsrv(struct u_buffer *buf, struct nftst *n, int type, int family, int srv_action, int action)
+{
+	u_log_print(LOG_DEBUG, "%s():%d: pos %d", __FUNCTION__, __LINE__, get_chain_pos_counter(type));
+
+	if (srv_action == ACTION_NONE)
+		srv_action = action;
+
+	switch (srv_action) {
+	case ACTION_RELOAD:
+		run_nftst_rules_gen_chain(buf, n, family, type, action);
+		break;
+	case ACTION_START:
+		run_nftst_rules_gen_chain(buf, n, family, type, action);
+		run_nftst_rules_gen_srv_map_by_protocol(buf, n, type, family, srv_action);
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		run_nftst_rules_gen_srv_map_by_protocol(buf, n, type, family, srv_action);
+		run_nftst_rules_gen_chain(buf, n, family, type, action);
+		break;
+	default:
+		break;
+	}
+
+	return;
+}
+
+static int has_snat_rules(int family)
+{
+	return (family == VALUE_FAMILY_IPV4 && nft_base_rules.snat_rules_v4) || (family == VALUE_FAMILY_IPV6 && nft_base_rules.snat_rules_v6);
+}
+
+static int run_farm_snat(struct u_buffer *buf, struct nftst *n, int family, int action)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct nft_gen_op *op;
+
+	u_log_print(LOG_DEBUG, "%s():%d: ", __FUNCTION__, __LINE__);
+
+	if (f->mode != VALUE_MODE_SNAT && f->mode != VALUE_MODE_LOCAL)
+		return 0;
+
+	switch (action) {
+	case ACTION_RELOAD:
+	case ACTION_START:
+		run_nftst_rules_gen_srv_map_by_protocol(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, action);
+		break;
+	case ACTION_STOP:
+	case ACTION_DELETE:
+		// in the pool, the postrouting rules are checked once the farm takes its turn
+		op = nft_gen_defer(NFTLB_GEN_OP_SNAT_BEGIN);
+		if (op)
+			op->family = family;
+		if (op || has_snat_rules(family)) {
+			run_nftst_rules_gen_srv_map_by_protocol(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, action);
+			nft_gen_defer(NFTLB_GEN_OP_SNAT_END);
 		}
+		break;
+	}
+
+	return 0;
+}
+
+static int run_farm_rules_gen_sched(struct u_buffer *buf, struct nftst *n, int family)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	int mod = f->total_weight;
+
+	// the named scheduler map keeps a fixed number of slots
+	if (f->nft_bck_maps & get_bck_map_bit(NFTLB_BCK_MAP_SCHED, family))
+		mod = f->nft_sched_slots;
+
+	switch (f->scheduler) {
+	case VALUE_SCHED_RR:
+		u_buf_concat(buf, " numgen inc mod %d", mod);
+		break;
+	case VALUE_SCHED_WEIGHT:
+		u_buf_concat(buf, " numgen random mod %d", mod);
+		break;
+	case VALUE_SCHED_HASH:
+		u_buf_concat(buf, " jhash");
+		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->schedparam, NFTLB_MAP_KEY_RULE);
+		u_buf_concat(buf, " mod %d", mod);
+		break;
+	case VALUE_SCHED_SYMHASH:
+		u_buf_concat(buf, " symhash mod %d", mod);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static int run_farm_rules_gen_bck_map(struct u_buffer *buf, struct nftst *n, int family, enum map_modes key_mode, enum map_modes data_mode, int usable)
+{
+	struct farm *f = nftst_get_farm(n);
+	char name[NFTLB_MAX_OBJ_NAME] = { 0 };
+	int kind = get_bck_map_kind(key_mode, data_mode);
+	int i;
+
+	if (kind != -1 && (f->nft_bck_maps & get_bck_map_bit(kind, family))) {
+		get_bck_map_name(name, f, kind, family);
+		u_buf_concat(buf, " map @%s", name);
+		return 0;
+	}
+
+	u_buf_concat(buf, " map {");
+	i = run_farm_rules_gen_bck_elems(buf, n, key_mode, data_mode, usable);
+	u_buf_concat(buf, " }");
+
+	if (i == 0)
+		return -1;
+
+	return 0;
+}
+
+static void run_farm_helper(struct u_buffer *buf, struct farm *f, int helper, int family, int action, char *protocol)
+{
+	switch (action) {
+	case ACTION_START:
+		concat_exec_cmd(buf, " ; add ct helper %s %s %s-%s-%s { type \"%s\" protocol %s ; } ;", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, f->name, obj_print_helper(helper), protocol, obj_print_helper(helper), protocol);
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		concat_exec_cmd(buf, " ; delete ct helper %s %s %s-%s-%s ; ", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, f->name, obj_print_helper(helper), protocol);
+		break;
+	case ACTION_RELOAD:
+	default:
+		break;
+	}
+}
+
+static int run_farm_log_prefix(struct u_buffer *buf, struct farm *f, int key, int type, int action)
+{
+	char logprefix_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	struct nftst *n;
+
+	if (f->log == VALUE_LOG_NONE)
+		return 0;
+
+	if (f->log & key) {
+		n = nftst_create_from_farm(f);
+		print_log_format(logprefix_str, KEY_LOGPREFIX, type, n);
+		u_buf_concat(buf, " log prefix \"%s\"", logprefix_str);
 	}
 
-	if (action == ACTION_RELOAD || action == ACTION_START) {
-		if ((type & NFTLB_F_CHAIN_PRE_DNAT || type & NFTLB_F_CHAIN_PRE_FILTER) &&
-			((~nft_base_rules.tables & NFTLB_TABLE_IP_ACTIVE && family == VALUE_FAMILY_IPV4 && (nft_base_rules.dnat_rules_v4 == 0 && nft_base_rules.filter_rules_v4 == 0)) ||
-			(~nft_base_rules.tables & NFTLB_TABLE_IP6_ACTIVE && family == VALUE_FAMILY_IPV6 && (nft_base_rules.dnat_rules_v6 == 0 && nft_base_rules.filter_rules_v6 == 0)))) {
-			if (family == VALUE_FAMILY_IPV4)
-				nft_base_rules.tables |= NFTLB_TABLE_IP_ACTIVE;
-			if (family == VALUE_FAMILY_IPV6)
-				nft_base_rules.tables |= NFTLB_TABLE_IP6_ACTIVE;
-			nft_table_handler(buf, chain_family, ACTION_START);
-		}
+	return 0;
+}
 
-		if (type & NFTLB_F_CHAIN_ING_FILTER && ~nft_base_rules.tables & NFTLB_TABLE_NETDEV_ACTIVE &&
-			nft_base_rules.ndv_ingress_rules.n_interfaces == 0 &&
-			nft_base_rules.ndv_ingress_dnat_rules.n_interfaces == 0) {
-			nft_base_rules.tables |= NFTLB_TABLE_NETDEV_ACTIVE;
-			nft_table_handler(buf, chain_family, ACTION_START);
-		}
+static int run_farm_gen_log_rules(struct u_buffer *buf, struct farm *f, int family, char * chain, int key, int type, int action)
+{
+	if (f->log == VALUE_LOG_NONE)
+		return 0;
+
+	if (f->log & key) {
+		u_buf_concat(buf, " ; add rule %s %s %s", print_nft_table_family(family, type), NFTLB_TABLE_NAME, chain);
+		run_farm_log_prefix(buf,f, key, type, action);
+		concat_exec_cmd(buf, "");
 	}
 
 	return 0;
 }
 
-static int run_base_chain(struct u_buffer *buf, struct nftst *n, int type, int family, unsigned int rules_needed, int action)
+static void run_farm_rules_gen_helper(struct u_buffer *buf, struct farm *f, int family, char *chain, char *protocol, int action)
 {
-	char service[NFTLB_MAX_OBJ_NAME-2] = { 0 };
-	char servicem[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char base_chain[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char chain_device[NFTLB_MAX_OBJ_DEVICE] = { 0 };
-	char trailing[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char *chain_type;
-	char *chain_hook;
-	char *chain_family;
-	int chain_prio;
-	unsigned int *base_rules;
-	unsigned int *base_rules_t;
-	struct if_base_rule_list *if_base_list = &nft_base_rules.ndv_ingress_rules;
+	// the helper applied in the ruleset until a reload replaces it
+	int helper = (f->reload_action & VALUE_RLD_HELPER) ? f->reload_helper : f->helper;
+
+	if (action == ACTION_RELOAD && (f->reload_action & VALUE_RLD_HELPER)) {
+		if (helper != DEFAULT_HELPER)
+			run_farm_helper(buf, f, helper, family, ACTION_STOP, protocol);
+		helper = f->helper;
+		if (helper != DEFAULT_HELPER)
+			run_farm_helper(buf, f, helper, family, ACTION_START, protocol);
+	} else if (action == ACTION_START) {
+		helper = f->helper;
+	}
+
+	if (helper == DEFAULT_HELPER)
+		return;
+
+	run_farm_helper(buf, f, helper, family, action, protocol);
+	if (action == ACTION_START || action == ACTION_RELOAD)
+		concat_exec_cmd(buf, " ; add rule %s %s %s %s %s %s ct helper set %s-%s-%s", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), print_nft_family_protocol(family), protocol, f->name, obj_print_helper(helper), protocol);
+}
+
+static int run_farm_rules_filter_helper(struct u_buffer *buf, struct nftst *n, int family, char *chain, int action)
+{
+	struct farm *f = nftst_get_farm(n);
 	struct address *a = nftst_get_address(n);
+
+	if (!(f->mode == VALUE_MODE_SNAT || f->mode == VALUE_MODE_LOCAL || f->mode == VALUE_MODE_DNAT))
+		return 0;
+
+	if (a->protocol == VALUE_PROTO_TCP || a->protocol == VALUE_PROTO_ALL)
+		run_farm_rules_gen_helper(buf, f, family, chain, "tcp", action);
+
+	if (a->protocol == VALUE_PROTO_UDP || a->protocol == VALUE_PROTO_ALL)
+		run_farm_rules_gen_helper(buf, f, family, chain, "udp", action);
+
+	return 0;
+}
+
+/*
+ * The persistence map is only bounded when the session update is a rule on
+ * its own, so a full map doesn't stop forwarding the new clients.
+ */
+static int farm_persist_bounded(struct farm *f)
+{
+	return f->persistsize && f->mode != VALUE_MODE_DSR && f->mode != VALUE_MODE_STLSDNAT;
+}
+
+/* the insertions rejected because the persistence map was full */
+static void print_persist_counter(char *str, struct farm *f)
+{
+	snprintf(str, NFTLB_MAX_OBJ_NAME, "persist-rejected-%s", f->name);
+}
+
+static void run_farm_persist_counter(struct u_buffer *buf, struct farm *f, int family, int action)
+{
+	char counter[NFTLB_MAX_OBJ_NAME] = { 0 };
+
+	print_persist_counter(counter, f);
+
+	switch (action) {
+	case ACTION_START:
+		concat_exec_cmd(buf, " ; add counter %s %s %s", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, counter);
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		concat_exec_cmd(buf, " ; delete counter %s %s %s", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, counter);
+		break;
+	default:
+		break;
+	}
+}
+
+static int run_farm_sessions_map(struct u_buffer *buf, struct nftst *n, int stype, int family, int action)
+{
 	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	int ttl = 0;
+	int size = 0;
 
-	u_log_print(LOG_DEBUG, "%s():%d: chain %s - action %d", __FUNCTION__, __LINE__, get_chain_print_pos(get_chain_pos_counter(type)), action);
+	if (f->persistence == VALUE_META_NONE)
+		return 0;
 
-	get_address_service(service, a, type, family, BCK_MAP_NONE);
-	get_address_service(servicem, a, NFTLB_F_CHAIN_POS_SNAT, family, BCK_MAP_BCK_MARK);
-	chain_family = print_nft_table_family(family, type);
+	if (stype == SESSION_TYPE_STATIC)
+		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "static-sessions-%s", f->name);
+	else {
+		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "persist-%s", f->name);
+		ttl = f->persistttl;
+		if (farm_persist_bounded(f))
+			size = f->persistsize;
+	}
 
-	if (type & NFTLB_F_CHAIN_ING_FILTER) {
-		base_rules = get_rules_applied(type, family, a->iface);
-		if (!base_rules)
-			return 1;
-		chain_prio = NFTLB_INGRESS_PRIO;
-		chain_type = NFTLB_TYPE_FILTER;
-		chain_hook = NFTLB_HOOK_INGRESS;
-		snprintf(chain_device, NFTLB_MAX_OBJ_DEVICE, "%s", a->iface);
-		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s-%s", NFTLB_TABLE_INGRESS, a->iface);
-		snprintf(trailing, NFTLB_MAX_OBJ_NAME, "-%s", a->iface);
+	if (size && action == ACTION_START)
+		run_farm_persist_counter(buf, f, family, action);
 
-	} else if (type & NFTLB_F_CHAIN_ING_DNAT) {
-		if (!f)
+	// the timeout of a map can't be updated, the chain was flushed so the map is created again
+	if (action == ACTION_RELOAD && stype == SESSION_TYPE_TIMED && (f->reload_action & VALUE_RLD_PERSISTTM) &&
+		f->mode != VALUE_MODE_DSR && f->mode != VALUE_MODE_STLSDNAT) {
+		run_farm_map(buf, a, family, NFTLB_F_CHAIN_PRE_FILTER, map_str, f->persistence, VALUE_META_MARK, ttl, size, ACTION_STOP);
+		action = ACTION_START;
+	}
+
+	if (f->mode == VALUE_MODE_DSR)
+		run_farm_map(buf, a, family, NFTLB_F_CHAIN_ING_FILTER, map_str, f->persistence, VALUE_META_DSTMAC, ttl, 0, action);
+	else if (f->mode == VALUE_MODE_STLSDNAT)
+		run_farm_map(buf, a, family, NFTLB_F_CHAIN_ING_FILTER, map_str, f->persistence, VALUE_META_DSTIP, ttl, 0, action);
+	else
+		run_farm_map(buf, a, family, NFTLB_F_CHAIN_PRE_FILTER, map_str, f->persistence, VALUE_META_MARK, ttl, size, action);
+
+	if (size && (action == ACTION_STOP || action == ACTION_DELETE))
+		run_farm_persist_counter(buf, f, family, action);
+
+	return 0;
+}
+
+/* the map data pointing to the session backend, if it can take sessions */
+static int print_session_data(char *str, int size, struct farm *f, struct backend *b)
+{
+	if (!b || !backend_is_available(b))
+		return 0;
+
+	switch (f->mode) {
+	case VALUE_MODE_DSR:
+		if (b->ethaddr == DEFAULT_ETHADDR)
 			return 0;
-		base_rules = get_rules_applied(type, family, f->oface);
-		if (!base_rules)
-			return 1;
-		if_base_list = &nft_base_rules.ndv_ingress_dnat_rules;
-		chain_prio = NFTLB_INGRESS_DNAT_PRIO;
-		chain_type = NFTLB_TYPE_FILTER;
-		chain_hook = NFTLB_HOOK_INGRESS;
-		snprintf(chain_device, NFTLB_MAX_OBJ_DEVICE, "%s", f->oface);
-		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s-dnat-%s", NFTLB_TABLE_INGRESS, chain_device);
-		snprintf(trailing, NFTLB_MAX_OBJ_NAME, "-%s", f->oface);
+		snprintf(str, size, "%s", b->ethaddr);
+		break;
+	case VALUE_MODE_STLSDNAT:
+		if (b->ipaddr == DEFAULT_IPADDR)
+			return 0;
+		snprintf(str, size, "%s", b->ipaddr);
+		break;
+	default:
+		if (b->mark == DEFAULT_MARK)
+			return 0;
+		snprintf(str, size, "0x%x", backend_get_mark(b));
+		break;
+	}
 
-	} else if (type & NFTLB_F_CHAIN_PRE_FILTER) {
-		base_rules = get_rules_applied(type, family, "");
-		chain_prio = NFTLB_FILTER_PRIO;
-		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_FILTER);
-		chain_type = NFTLB_TYPE_FILTER;
-		chain_hook = NFTLB_HOOK_PREROUTING;
+	return 1;
+}
+
+static int run_farm_manage_sessions(struct u_buffer *buf, struct farm *f, int stype, int family, int action)
+{
+	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char data[NFTLB_MAX_OBJ_NAME] = { 0 };
+	struct nft_elem_block add, del;
+	struct session *s;
+	struct list_head *sessions;
+
+	if (action != ACTION_START && action != ACTION_RELOAD)
+		return 0;
+
+	if (f->persistence == VALUE_META_NONE)
+		return 0;
+
+	if (f->bcks_usable == 0)
+		return 0;
+
+	if (stype == SESSION_TYPE_STATIC) {
+		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "static-sessions-%s", f->name);
+		sessions = &f->static_sessions;
+	} else {
+		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "persist-%s", f->name);
+		sessions = &f->timed_sessions;
+	}
+
+	elem_block_init(&del, buf, " ; delete element %s %s %s {", print_nft_table_family(family, get_stage_by_farm_mode(f)), NFTLB_TABLE_NAME, map_str);
+	elem_block_init(&add, buf, " ; add element %s %s %s {", print_nft_table_family(family, get_stage_by_farm_mode(f)), NFTLB_TABLE_NAME, map_str);
+
+	// the old elements are removed before adding the new ones with the same client
+	list_for_each_entry(s, sessions, list) {
+		if (stype == SESSION_TYPE_TIMED && s->action == ACTION_NONE)
+			continue;
+		if ((action == ACTION_RELOAD && (s->action == ACTION_STOP || s->action == ACTION_DELETE)) || s->action == ACTION_RELOAD)
+			elem_block_concat(&del, "%s", s->client);
+	}
+	elem_block_end(&del);
+
+	list_for_each_entry(s, sessions, list) {
+		// the cached timed sessions without changes are already in the map
+		if (stype == SESSION_TYPE_TIMED && s->action == ACTION_NONE)
+			continue;
+
+		if ((action == ACTION_START || s->action == ACTION_START || s->action == ACTION_RELOAD) &&
+			print_session_data(data, NFTLB_MAX_OBJ_NAME, f, s->bck)) {
+			if (stype == SESSION_TYPE_TIMED && s->expiration)
+				elem_block_concat(&add, "%s expires %s : %s", s->client, s->expiration, data);
+			else
+				elem_block_concat(&add, "%s : %s", s->client, data);
+		}
+		s->action = ACTION_NONE;
+	}
+	elem_block_end(&add);
+
+	return 0;
+}
+
+static int run_farm_rules_update_sessions(struct u_buffer *buf, struct nftst *n, int family, char *chain, int action)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char counter[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char mark_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+
+	if (f->persistence == VALUE_META_NONE || f->total_bcks == 0)
+		return 0;
+
+	snprintf(map_str, NFTLB_MAX_OBJ_NAME, "persist-%s", f->name);
+
+	if (action != ACTION_START && action != ACTION_RELOAD)
+		return 0;
+
+	switch (f->mode) {
+	case VALUE_MODE_DSR:
+		u_buf_concat(buf, " update @%s { ",  map_str);
+		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
+		concat_exec_cmd(buf, " : ");
+		run_farm_rules_gen_meta_param(buf, a->protocol, family, VALUE_META_DSTMAC, NFTLB_MAP_KEY_RULE);
+		concat_exec_cmd(buf, " }");
+		break;
+	case VALUE_MODE_STLSDNAT:
+		u_buf_concat(buf, " update @%s { ",  map_str);
+		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
+		concat_exec_cmd(buf, " : ");
+		run_farm_rules_gen_meta_param(buf, a->protocol, family, VALUE_META_DSTIP, NFTLB_MAP_KEY_RULE);
+		concat_exec_cmd(buf, " }");
+		break;
+	default:
+		if (farm_get_masquerade(f))
+			snprintf(mark_str, NFTLB_MAX_OBJ_NAME, "ct mark != { 0x00000000, %u }", masquerade_mark);
+		else
+			snprintf(mark_str, NFTLB_MAX_OBJ_NAME, "ct mark != 0x00000000");
+
+		u_buf_concat(buf, " ; add rule %s %s %s %s update @%s { ", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, mark_str, map_str);
+		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
+		u_buf_concat(buf, " : ct mark }");
+
+		// a full map breaks the update rule, so only the rejected insertions reach the counter
+		if (farm_persist_bounded(f)) {
+			print_persist_counter(counter, f);
+			u_buf_concat(buf, " return ; add rule %s %s %s %s counter name %s", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, mark_str, counter);
+		}
+		concat_exec_cmd(buf, "");
+		break;
+	}
+
+	return 0;
+}
+
+static int run_farm_rules_check_sessions(struct u_buffer *buf, struct nftst *n, int stype, int family, int type, int action)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
+
+	if (f->persistence == VALUE_META_NONE || f->total_bcks == 0)
+		return 0;
+
+	if (action != ACTION_START && action != ACTION_RELOAD)
+		return 0;
+
+	if (stype == SESSION_TYPE_STATIC)
+		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "static-sessions-%s", f->name);
+	else
+		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "persist-%s", f->name);
 
-	} else if (type & NFTLB_F_CHAIN_PRE_DNAT) {
-		base_rules = get_rules_applied(type, family, "");
-		chain_prio = NFTLB_PREROUTING_PRIO;
-		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_PREROUTING);
-		chain_type = NFTLB_TYPE_NAT;
-		chain_hook = NFTLB_HOOK_PREROUTING;
+	get_chain_name(chain, f->name, type);
 
-	} else if (type & NFTLB_F_CHAIN_POS_SNAT) {
-		base_rules = get_rules_applied(type, family, "");
-		chain_prio = NFTLB_POSTROUTING_PRIO;
-		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_POSTROUTING);
-		chain_type = NFTLB_TYPE_NAT;
-		chain_hook = NFTLB_HOOK_POSTROUTING;
+	switch (f->mode) {
+	case VALUE_MODE_DSR:
+		get_chain_name(chain, f->name, NFTLB_F_CHAIN_ING_FILTER);
+		u_buf_concat(buf, " ; add rule %s %s %s ether daddr set", print_nft_table_family(family, NFTLB_F_CHAIN_ING_FILTER), NFTLB_TABLE_NAME, chain);
+		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
+		concat_exec_cmd(buf, " map @%s ether saddr set %s", map_str, a->iethaddr);
 
-	} else if (type & NFTLB_F_CHAIN_FWD_FILTER) {
-		base_rules = get_rules_applied(type, family, "");
-		chain_prio = NFTLB_PREROUTING_PRIO;
-		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_FORWARD);
-		chain_type = NFTLB_TYPE_FILTER;
-		chain_hook = NFTLB_HOOK_FORWARD;
+		if (stype == SESSION_TYPE_TIMED)
+			run_farm_rules_update_sessions(buf, n, family, chain, action);
 
-	} else if (type & NFTLB_F_CHAIN_OUT_FILTER) {
-		base_rules = get_rules_applied(type, family, "");
-		chain_prio = NFTLB_FILTER_PRIO;
-		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_OUT_FILTER);
-		chain_type = NFTLB_TYPE_FILTER;
-		chain_hook = NFTLB_HOOK_OUTPUT;
+		u_buf_concat(buf, " fwd to");
+		if (f->bcks_have_if) {
+			u_buf_concat(buf, " ether daddr");
+			run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_ETHADDR, BCK_MAP_OFACE, NFTLB_CHECK_AVAIL);
+		} else
+			u_buf_concat(buf, " %s", f->oface);
+		concat_exec_cmd(buf, "");
+		break;
 
-	} else if (type & NFTLB_F_CHAIN_OUT_DNAT) {
-		base_rules = get_rules_applied(type, family, "");
-		chain_prio = NFTLB_PREROUTING_PRIO;
-		snprintf(base_chain, NFTLB_MAX_OBJ_NAME, "%s", NFTLB_TABLE_OUT_NAT);
-		chain_type = NFTLB_TYPE_NAT;
-		chain_hook = NFTLB_HOOK_OUTPUT;
+	case VALUE_MODE_STLSDNAT:
+		get_chain_name(chain, f->name, NFTLB_F_CHAIN_ING_FILTER);
+		u_buf_concat(buf, " ; add rule %s %s %s %s daddr set", print_nft_table_family(family, NFTLB_F_CHAIN_ING_FILTER), NFTLB_TABLE_NAME, chain, print_nft_family(family));
+		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
+		concat_exec_cmd(buf, " map @%s ether daddr set %s daddr", map_str, print_nft_family(family));
+		run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_IPADDR, BCK_MAP_ETHADDR, NFTLB_CHECK_AVAIL);
 
-	} else
-		return 1;
+		if (f->bcks_have_port) {
+			u_buf_concat(buf, " th dport set ether daddr");
+			run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_ETHADDR, BCK_MAP_PORT, NFTLB_CHECK_AVAIL);
+		}
 
-	if (action == ACTION_STOP || action == ACTION_DELETE) {
+		u_buf_concat(buf, " ether saddr set %s", f->oethaddr);
 
-		// If any chain type counter is 0, then reload chain rules and deactivate the usage flag
-		if (((*base_rules & NFTLB_PROTO_IP_PORT_ACTIVE) && *get_service_counter(type, NFTLB_PROTO_IP_PORT_ACTIVE, family) == 0) ||
-			((*base_rules & NFTLB_PROTO_PORT_ACTIVE) && *get_service_counter(type, NFTLB_PROTO_PORT_ACTIVE, family) == 0) ||
-			((*base_rules & NFTLB_PROTO_IP_ACTIVE) && *get_service_counter(type, NFTLB_PROTO_IP_ACTIVE, family) == 0) ||
-			((*base_rules & NFTLB_MARK_ACTIVE) && *get_service_counter(type, NFTLB_MARK_ACTIVE, family) == 0)) {
+		if (stype == SESSION_TYPE_TIMED)
+			run_farm_rules_update_sessions(buf, n, family, chain, action);
 
-			nft_chain_handler(buf, chain_family, base_chain, NULL, NULL, NULL, 0, ACTION_RELOAD);
-			run_base_chain_set_meta_mark(buf, type, chain_family, base_chain);
-			run_farm_map(buf, a, family, type, service, 0, 0, 0, ACTION_DELETE);
-			*base_rules &= ~NFTLB_PROTO_IP_PORT_ACTIVE & ~NFTLB_PROTO_PORT_ACTIVE & ~NFTLB_PROTO_IP_ACTIVE & ~NFTLB_MARK_ACTIVE;
+		u_buf_concat(buf, " fwd to");
+		if (f->bcks_have_if) {
+			u_buf_concat(buf, " ether daddr");
+			run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_ETHADDR, BCK_MAP_OFACE, NFTLB_CHECK_AVAIL);
+		} else
+			u_buf_concat(buf, " %s", f->oface);
+		concat_exec_cmd(buf, "");
+		break;
+
+	default:
+		get_chain_name(chain, f->name, NFTLB_F_CHAIN_PRE_FILTER);
+		if (stype == SESSION_TYPE_STATIC) {
+			u_buf_concat(buf, " ; add rule %s %s %s ct mark set", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain);
+			run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
+			concat_exec_cmd(buf, " map @%s accept", map_str);
+		} else {
+			u_buf_concat(buf, " ; add rule %s %s %s ct state new ct mark set", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain);
+			run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
+			concat_exec_cmd(buf, " map @%s", map_str);
 		}
+		break;
+	}
 
-		if ((*get_service_counter(type, NFTLB_PROTO_IP_PORT_ACTIVE, family) == 0) &&
-			(*get_service_counter(type, NFTLB_PROTO_PORT_ACTIVE, family) == 0) &&
-			(*get_service_counter(type, NFTLB_PROTO_IP_ACTIVE, family) == 0) &&
-			(*get_service_counter(type, NFTLB_MARK_ACTIVE, family) == 0)) {
+	return 0;
+}
 
-			// for prerouting stage, do not remove the chain if postrouting is being used
-			if (type & NFTLB_F_CHAIN_PRE_DNAT && (
-					(*get_service_counter(NFTLB_F_CHAIN_POS_SNAT, NFTLB_PROTO_IP_PORT_ACTIVE, family) != 0) ||
-					(*get_service_counter(NFTLB_F_CHAIN_POS_SNAT, NFTLB_PROTO_PORT_ACTIVE, family) != 0) ||
-					(*get_service_counter(NFTLB_F_CHAIN_POS_SNAT, NFTLB_PROTO_IP_ACTIVE, family) != 0) ||
-					(*get_service_counter(NFTLB_F_CHAIN_POS_SNAT, NFTLB_MARK_ACTIVE, family) != 0)))
-				return 0;
+static void run_farm_meter(struct u_buffer *buf, struct farm *f, int table_family, int family, int type, char *name, int action)
+{
+	switch (action) {
+	case ACTION_START:
+		u_buf_concat(buf, " ; add set %s %s %s { type %s ; flags dynamic ; ", print_nft_table_family(table_family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, name, print_nft_family_type(family));
 
-			if (type & NFTLB_F_CHAIN_POS_SNAT)
-				return 0;
+		if (type == KEY_ELEMENTS)
+			u_buf_concat(buf, "counter ; ");
 
-			*base_rules &= ~NFTLB_IP_ACTIVE;
-			nft_chain_handler(buf, chain_family, base_chain, NULL, NULL, NULL, 0, ACTION_DELETE);
+		// ct count doesn't require timeout as it is implemented implicitly
+		if (type != KEY_ESTCONNLIMIT &&
+			f->limitsttl)
+			u_buf_concat(buf, "timeout %ds; ", f->limitsttl);
+		concat_exec_cmd(buf, "} ;");
+		break;
+	case ACTION_STOP:
+		concat_exec_cmd(buf, " ; delete set %s %s %s ; ", print_nft_table_family(table_family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, name);
+		break;
+	default:
+		break;
+	}
+}
 
-			if (type & NFTLB_F_CHAIN_ING_FILTER || type & NFTLB_F_CHAIN_ING_DNAT)
-				del_ndv_base(if_base_list, a->iface);
+static int run_farm_log_rate_limit(struct u_buffer *buf, struct nftst *n)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	char rtlimit_str[NFTLB_MAX_OBJ_NAME] = { 0 };
 
-			// in prerouting stage, apply the same action to prerouting
-			if (type & NFTLB_F_CHAIN_PRE_DNAT) {
-				nft_chain_handler(buf, chain_family, NFTLB_TABLE_POSTROUTING, NULL, NULL, NULL, 0, ACTION_DELETE);
-				run_farm_map(buf, a, family, type, servicem, 0, 0, 0, ACTION_DELETE);
-				base_rules_t = get_rules_applied(NFTLB_F_CHAIN_POS_SNAT, family, "");
-				*base_rules_t &= ~NFTLB_IP_ACTIVE & ~NFTLB_PROTO_IP_PORT_ACTIVE & ~NFTLB_PROTO_PORT_ACTIVE & ~NFTLB_PROTO_IP_ACTIVE & ~NFTLB_MARK_ACTIVE;
-			}
-			return 0;
-		}
+	if ((f && !f->logrtlimit) || (a && !a->logrtlimit))
+		return 0;
 
-		rules_needed = *base_rules;
+	if (f) {
+		obj_print_rtlimit(rtlimit_str, f->logrtlimit, f->logrtlimit_unit);
+		u_buf_concat(buf, " limit rate %s", rtlimit_str);
+	}
 
-		if (*get_service_counter(type, NFTLB_PROTO_IP_PORT_ACTIVE, family) != 0)
-				rules_needed |= NFTLB_PROTO_IP_PORT_ACTIVE;
-		if (*get_service_counter(type, NFTLB_PROTO_PORT_ACTIVE, family) != 0)
-				rules_needed |= NFTLB_PROTO_PORT_ACTIVE;
-		if (*get_service_counter(type, NFTLB_PROTO_IP_ACTIVE, family) != 0)
-				rules_needed |= NFTLB_PROTO_IP_ACTIVE;
-		if (*get_service_counter(type, NFTLB_MARK_ACTIVE, family) != 0)
-				rules_needed |= NFTLB_MARK_ACTIVE;
+	if (a) {
+		obj_print_rtlimit(rtlimit_str, a->logrtlimit, a->logrtlimit_unit);
+		u_buf_concat(buf, " limit rate %s", rtlimit_str);
 	}
 
-	if ((rules_needed & NFTLB_IP_ACTIVE) && !(*base_rules & NFTLB_IP_ACTIVE)) {
+	return 0;
+}
 
-		nft_chain_handler(buf, chain_family, base_chain, chain_type, chain_hook, chain_device, chain_prio, ACTION_START);
-		run_base_chain_set_meta_mark(buf, type, chain_family, base_chain);
+static void run_farm_rules_log_and_verdict(struct u_buffer *buf, struct nftst *n, int logrt, int flags, int verdict, int key, int chain)
+{
+	char logprefix_str[NFTLB_MAX_OBJ_NAME] = { 0 };
 
-		if (type & NFTLB_F_CHAIN_POS_SNAT) {
-			get_nft_name_service(servicem, NFTLB_PROTO_IP_PORT_ACTIVE, "-m", type, family);
-			run_base_chain_postrouting_masquerade(buf, type, chain_family);
-			run_base_chain_postrouting_bckmark(buf, servicem, type, family);
+	if (flags & VALUE_VERDICT_LOG) {
+		if (logrt) {
+			u_buf_concat(buf, " jump {");
+			run_farm_log_rate_limit(buf, n);
+		}
+		print_log_format(logprefix_str, key, chain, n);
+		u_buf_concat(buf, " log prefix \"%s\"", logprefix_str);
+		if (logrt) {
+			u_buf_concat(buf, " ;");
 		}
-		*base_rules |= NFTLB_IP_ACTIVE;
 	}
 
-	if ((rules_needed & NFTLB_PROTO_IP_PORT_ACTIVE) && !(*base_rules & NFTLB_PROTO_IP_PORT_ACTIVE)) {
-		get_nft_name_service(service, NFTLB_PROTO_IP_PORT_ACTIVE, trailing, type, family);
-		if (type & NFTLB_F_CHAIN_POS_SNAT) {
-		} else if (type & NFTLB_F_CHAIN_ING_DNAT) {
-			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s . %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, print_nft_family_type(family), NFTLB_MAP_TYPE_INETSRV);
-			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . %s saddr . th sport vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), print_nft_family(family), service);
-			*base_rules |= NFTLB_PROTO_IP_PORT_ACTIVE;
-		} else if (type & NFTLB_F_CHAIN_FWD_FILTER) {
-			concat_exec_cmd(buf, " ; add map %s %s %s { type %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_MARK);
-			concat_exec_cmd(buf, " ; add rule %s %s %s ct mark vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, service);
-			*base_rules |= NFTLB_PROTO_IP_PORT_ACTIVE;
-		} else {
-			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s . %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, print_nft_family_type(family), NFTLB_MAP_TYPE_INETSRV);
-			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . %s daddr . th dport vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), print_nft_family(family), service);
-			*base_rules |= NFTLB_PROTO_IP_PORT_ACTIVE;
-		}
+	u_buf_concat(buf, " %s", print_nft_verdict(flags, verdict));
+
+	if (flags & VALUE_VERDICT_LOG && logrt)
+		u_buf_concat(buf, "; }");
+	concat_exec_cmd(buf, "");
+}
+
+static int run_farm_rules_filter_policies(struct u_buffer *buf, struct farm *f, int family, char *chain, int action)
+{
+	char meter_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char burst_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	struct nftst *n = nftst_create_from_farm(f);
+	char rtlimit_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+
+	if ((action == ACTION_START || action == ACTION_RELOAD) && f->tcpstrict == VALUE_SWITCH_ON) {
+		u_buf_concat(buf, " ; add rule %s %s %s ct state invalid",
+						print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain);
+		run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, VALUE_TYPE_DENY, KEY_TCPSTRICT_LOGPREFIX, NFTLB_F_CHAIN_PRE_FILTER);
 	}
 
-	if ((rules_needed & NFTLB_PROTO_PORT_ACTIVE) && !(*base_rules & NFTLB_PROTO_PORT_ACTIVE)) {
-		get_nft_name_service(service, NFTLB_PROTO_PORT_ACTIVE, trailing, type, family);
-		if (type & NFTLB_F_CHAIN_POS_SNAT) {
-		} else if (type & NFTLB_F_CHAIN_ING_DNAT) {
-			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, NFTLB_MAP_TYPE_INETSRV);
-			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . th sport vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), service);
-			*base_rules |= NFTLB_PROTO_PORT_ACTIVE;
-		} else if (type & NFTLB_F_CHAIN_FWD_FILTER) {
-			concat_exec_cmd(buf, " ; add map %s %s %s { type %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_MARK);
-			concat_exec_cmd(buf, " ; add rule %s %s %s ct mark vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, service);
-			*base_rules |= NFTLB_PROTO_PORT_ACTIVE;
-		} else {
-			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, NFTLB_MAP_TYPE_INETSRV);
-			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . th dport vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), service);
-			*base_rules |= NFTLB_PROTO_PORT_ACTIVE;
-		}
+	snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s", CONFIG_KEY_NEWRTLIMIT, f->name);
+	if ((action == ACTION_START && f->newrtlimit != DEFAULT_NEWRTLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_NEWRTLIMIT_START))
+		run_farm_meter(buf, f, family, family, KEY_NEWRTLIMIT, meter_str, ACTION_START);
+	if (((action == ACTION_STOP || action == ACTION_DELETE) && f->newrtlimit != DEFAULT_NEWRTLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_NEWRTLIMIT_STOP))
+		run_farm_meter(buf, f, family, family, KEY_NEWRTLIMIT, meter_str, ACTION_STOP);
+	if ((action == ACTION_START || action == ACTION_RELOAD) && f->newrtlimit != DEFAULT_NEWRTLIMIT) {
+		if (f->newrtlimitbst != DEFAULT_RTLIMITBURST)
+			snprintf(burst_str, NFTLB_MAX_OBJ_NAME, "burst %d packets ", f->newrtlimitbst);
+		//~ u_buf_concat(buf, " ; add rule %s %s %s ct state new add @%s { %s saddr limit rate over %s %s counter }",
+		obj_print_rtlimit(rtlimit_str, f->newrtlimit, f->newrtlimit_unit);
+		u_buf_concat(buf, " ; add rule %s %s %s ct state new add @%s { %s saddr limit rate over %s %s }",
+				   print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, meter_str, print_nft_family(family), rtlimit_str, burst_str);
+		run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, VALUE_TYPE_DENY, KEY_NEWRTLIMIT_LOGPREFIX, NFTLB_F_CHAIN_PRE_FILTER);
+	}
+
+	snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s", CONFIG_KEY_RSTRTLIMIT, f->name);
+	if ((action == ACTION_START && f->rstrtlimit != DEFAULT_RSTRTLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_RSTRTLIMIT_START))
+		run_farm_meter(buf, f, family, family, KEY_RSTRTLIMIT, meter_str, ACTION_START);
+	if (((action == ACTION_STOP || action == ACTION_DELETE) && f->rstrtlimit != DEFAULT_RSTRTLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_RSTRTLIMIT_STOP))
+		run_farm_meter(buf, f, family, family, KEY_RSTRTLIMIT, meter_str, ACTION_STOP);
+	if ((action == ACTION_START || action == ACTION_RELOAD) && f->rstrtlimit != DEFAULT_RSTRTLIMIT) {
+		if (f->rstrtlimitbst != DEFAULT_RTLIMITBURST)
+			snprintf(burst_str, NFTLB_MAX_OBJ_NAME, "burst %d packets ", f->rstrtlimitbst);
+		//~ u_buf_concat(buf, " ; add rule %s %s %s tcp flags rst add @%s { %s saddr limit rate over %s %s counter }",
+		obj_print_rtlimit(rtlimit_str, f->rstrtlimit, f->rstrtlimit_unit);
+		u_buf_concat(buf, " ; add rule %s %s %s tcp flags rst add @%s { %s saddr limit rate over %s %s }",
+				   print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, meter_str, print_nft_family(family), rtlimit_str, burst_str);
+		run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, VALUE_TYPE_DENY, KEY_RSTRTLIMIT_LOGPREFIX, NFTLB_F_CHAIN_PRE_FILTER);
+	}
+
+	snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s", CONFIG_KEY_ESTCONNLIMIT, f->name);
+	if ((action == ACTION_START && f->estconnlimit != DEFAULT_ESTCONNLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_ESTCONNLIMIT_START))
+		run_farm_meter(buf, f, family, family, KEY_ESTCONNLIMIT, meter_str, ACTION_START);
+	if (((action == ACTION_STOP || action == ACTION_DELETE) && f->estconnlimit != DEFAULT_ESTCONNLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_ESTCONNLIMIT_STOP))
+		run_farm_meter(buf, f, family, family, KEY_ESTCONNLIMIT, meter_str, ACTION_STOP);
+	if ((action == ACTION_START || action == ACTION_RELOAD) && f->estconnlimit != DEFAULT_ESTCONNLIMIT) {
+		//~ u_buf_concat(buf, " ; add rule %s %s %s ct state new add @%s { %s saddr ct count over %d counter }",
+		u_buf_concat(buf, " ; add rule %s %s %s ct state new add @%s { %s saddr ct count over %d }",
+						print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, meter_str, print_nft_family(family), f->estconnlimit);
+		run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, VALUE_TYPE_DENY, KEY_ESTCONNLIMIT_LOGPREFIX, NFTLB_F_CHAIN_PRE_FILTER);
 	}
 
-	if ((rules_needed & NFTLB_PROTO_IP_ACTIVE) && !(*base_rules & NFTLB_PROTO_IP_ACTIVE)) {
-		get_nft_name_service(service, NFTLB_PROTO_IP_ACTIVE, trailing, type, family);
-		if (type & NFTLB_F_CHAIN_POS_SNAT) {
-		} else if (type & NFTLB_F_CHAIN_ING_DNAT) {
-			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, print_nft_family_type(family));
-			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . %s saddr vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), print_nft_family(family), service);
-			*base_rules |= NFTLB_PROTO_IP_ACTIVE;
-		} else if (type & NFTLB_F_CHAIN_FWD_FILTER) {
-			concat_exec_cmd(buf, " ; add map %s %s %s { type %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_MARK);
-			concat_exec_cmd(buf, " ; add rule %s %s %s ct mark vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, service);
-			*base_rules |= NFTLB_PROTO_IP_ACTIVE;
-		} else {
-			concat_exec_cmd(buf, " ; add map %s %s %s { type %s . %s : verdict ;}", chain_family, NFTLB_TABLE_NAME, service, NFTLB_MAP_TYPE_PROTO, print_nft_family_type(family));
-			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s . %s daddr vmap @%s", chain_family, NFTLB_TABLE_NAME, base_chain, print_nft_family(family), print_nft_family_protocol(family), print_nft_family(family), service);
-			*base_rules |= NFTLB_PROTO_IP_ACTIVE;
-		}
+	if ((action == ACTION_START || action == ACTION_RELOAD) && f->queue != DEFAULT_QUEUE)
+		concat_exec_cmd(buf, " ; add rule %s %s %s tcp flags syn queue num %d bypass",
+						print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, f->queue);
+	return 0;
+}
+
+static int run_farm_rules_gen_limits_per_bck(struct u_buffer *buf, struct farm *f, int family, char *chain, int action)
+{
+	struct backend *b;
+	struct nftst *n = nftst_create_from_farm(f);
+
+	list_for_each_entry(b, &f->backends, list) {
+		if (b->estconnlimit == 0)
+			continue;
+
+		if ((b->action == ACTION_STOP && !backend_is_usable(b)) || (action == ACTION_STOP || action == ACTION_DELETE))
+			continue;
+
+		nftst_set_backend(n, b);
+		u_buf_concat(buf, " ; add rule %s %s %s ct mark 0x%x ct count over %d",
+						print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, backend_get_mark(b), b->estconnlimit);
+		run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, VALUE_TYPE_DENY, KEY_ESTCONNLIMIT_LOGPREFIX, NFTLB_F_CHAIN_PRE_FILTER);
 	}
 
 	return 0;
 }
 
-static int run_nftst_rules_gen_srv_data(char **buf, struct nftst *n, char *chain, enum map_modes data_mode)
+static int run_farm_rules_filter_marks(struct u_buffer *buf, struct nftst *n, int family, char *chain, int action)
 {
 	struct farm *f = nftst_get_farm(n);
-	struct backend *b = nftst_get_backend(n);
+	struct backend *b;
 
-	switch (data_mode) {
-	case BCK_MAP_SRCIPADDR:
-		if (f)
-			sprintf(*buf, ": %s ", f->srcaddr);
-		break;
-	case BCK_MAP_NAME:
-		sprintf(*buf, ": goto %s ", chain);
-		break;
-	case BCK_MAP_BCK_BF_SRCIPADDR:
-		if (b && b->srcaddr && b->srcaddr != DEFAULT_SRCADDR && strcmp(b->srcaddr, "") != 0)
-			sprintf(*buf, ": %s ", b->srcaddr);
-		else if (f && f->srcaddr != DEFAULT_SRCADDR && strcmp(f->srcaddr, "") != 0)
-			sprintf(*buf, ": %s ", f->srcaddr);
-		break;
-	default:
-		break;
+	int mark = farm_get_mark(f);
+
+	if (action == ACTION_START || action == ACTION_RELOAD) {
+		if (f->bcks_available) {
+			u_buf_concat(buf, " ; add rule %s %s %s ct state new ct mark 0x0 ct mark set", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain);
+			if (f->scheduler == VALUE_SCHED_SYMHASH && f->bcks_available == 1) { // FIXME: Control bug in nftables
+				list_for_each_entry(b, &f->backends, list) {
+					if (!backend_is_available(b))
+						continue;
+					u_buf_concat(buf, " 0x%x", backend_get_mark(b));
+				}
+			} else {
+				if (run_farm_rules_gen_sched(buf, n, family) == -1)
+					return -1;
+				run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_WEIGHT, BCK_MAP_MARK, NFTLB_CHECK_AVAIL);
+			}
+			run_farm_rules_gen_limits_per_bck(buf, f, family, chain, action);
+		} else if (mark != DEFAULT_MARK) {
+			u_buf_concat(buf, " ; add rule %s %s %s ct state new ct mark 0x0 ct mark set 0x%x", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, mark);
+		}
+	} else if (action == ACTION_STOP || action == ACTION_DELETE || (action == ACTION_RELOAD && f->bcks_usable == 0)) {
+		run_farm_rules_gen_limits_per_bck(buf, f, family, chain, action);
 	}
+	concat_exec_cmd(buf, "");
 
 	return 0;
 }
 
-static int run_nftst_rules_gen_srv_map(struct u_buffer *buf, struct nftst *n, int family, int type, int proto, int action, enum map_modes key_mode, enum map_modes data_mode)
+static int run_farm_rules_filter(struct u_buffer *buf, struct nftst *n, int family, int action)
 {
 	struct farm *f = nftst_get_farm(n);
 	struct address *a = nftst_get_address(n);
-	char action_str[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char key_str[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char *data_str = NULL;
 	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char service[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char protocol[NFTLB_MAX_OBJ_PROTO] = { 0 };
-	char *nft_family = print_nft_table_family(family, type);
-	struct backend *b;
-	int nports = a->nports;
-	int iport = 1;
-	int bckmark;
-	int output = 0;
-	int first_port = 1;
-	int structure = 0;
+	int need = need_filter(f);
+	int naction = nftst_get_action(n);
 
-	data_str = calloc(1, 255);
-	if (!data_str) {
-		u_log_print(LOG_ERR, "%s():%d: memory allocation error", __FUNCTION__, __LINE__);
-		return -1;
-	}
+	if (!need && f->reload_action == VALUE_RLD_NONE)
+		return 0;
+
+	get_chain_name(chain, f->name, NFTLB_F_CHAIN_PRE_FILTER);
+
+	if (action == ACTION_RELOAD && need && (STATEFUL_RLD_START(f->reload_action)))
+		action = ACTION_RELOAD;
+
+	if (action == ACTION_RELOAD && !need && (STATEFUL_RLD_STOP(f->reload_action)))
+		action = ACTION_STOP;
 
 	switch (action) {
-	case ACTION_RELOAD:
 	case ACTION_START:
-		sprintf(action_str, "add");
+	case ACTION_RELOAD:
+		run_base_table(buf, NFTLB_F_CHAIN_PRE_FILTER, family, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_FILTER, family, get_rules_needed(a), action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_FILTER, family, naction, action);
+		run_farm_rules_filter_policies(buf, f, family, chain, action);
+		if (f->mode != VALUE_MODE_LOCAL) {
+			run_farm_rules_filter_helper(buf, n, family, chain, action);
+			run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
+			run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
+			run_farm_manage_sessions(buf, f, SESSION_TYPE_STATIC, family, action);
+			run_farm_manage_sessions(buf, f, SESSION_TYPE_TIMED, family, action);
+			run_farm_rules_check_sessions(buf, n, SESSION_TYPE_STATIC, family, NFTLB_F_CHAIN_PRE_FILTER, action);
+			run_farm_rules_check_sessions(buf, n, SESSION_TYPE_TIMED, family, NFTLB_F_CHAIN_PRE_FILTER, action);
+			run_farm_rules_filter_marks(buf, n, family, chain, action);
+			run_farm_rules_update_sessions(buf, n, family, chain, action);
+		}
 		break;
-	case ACTION_STOP:
 	case ACTION_DELETE:
-		sprintf(action_str, "delete");
+	case ACTION_STOP:
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_FILTER, family, naction, action);
+		if (f->mode != VALUE_MODE_LOCAL) {
+			run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
+			run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
+			run_farm_rules_filter_marks(buf, n, family, chain, action);
+			run_farm_rules_filter_helper(buf, n, family, chain, action);
+		}
+		run_farm_rules_filter_policies(buf, f, family, chain, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_FILTER, family, get_rules_needed(a), action);
 		break;
 	default:
-		return -1;
 		break;
 	}
 
-	get_chain_name(chain, nftst_get_name(n), type);
-	get_address_service(service, nftst_get_address(n), type, nftst_get_family(n), BCK_MAP_NONE);
-	snprintf(protocol, NFTLB_MAX_OBJ_PROTO, "%s", print_nft_protocol(proto));
+	return 0;
+}
 
-	switch (key_mode) {
-	case BCK_MAP_IPADDR:
-		run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
-		concat_exec_cmd(buf, " ; %s element %s %s %s { %s %s}", action_str, nft_family, NFTLB_TABLE_NAME, service, a->ipaddr, data_str);
-		output++;
-		break;
-	case BCK_MAP_PROTO_IPADDR:
-		run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
-		concat_exec_cmd(buf, " ; %s element %s %s %s { %s . %s %s}", action_str, nft_family, NFTLB_TABLE_NAME, service, protocol, a->ipaddr, data_str);
-		output++;
-		break;
-	case BCK_MAP_IPADDR_PORT:
-		run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
+static int get_farm_interfaces(struct nftst *n, char *list)
+{
+	struct backend *b;
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	int number = 0;
+	char *p = NULL;
 
-		if (nports == 0)
-			break;
+	if (a->iface) {
+		strcat(list, a->iface);
+		number++;
+	}
 
-		u_buf_concat(buf, " ; %s element %s %s %s { ", action_str, nft_family, NFTLB_TABLE_NAME, service);
+	if (f->oface && !(p = strstr(list, f->oface))) {
+		if (number)
+			strcat(list, ", ");
+		strcat(list, f->oface);
+		number++;
+	}
 
-		while (iport <= NFTLB_MAX_PORTS && nports > 0)
-		{
-			if (!address_search_array_port(a, iport)) { iport++; continue; }
+	list_for_each_entry(b, &f->backends, list) {
+		if (b->oface && !(p = strstr(list, b->oface))) {
+			if (number)
+				strcat(list, ", ");
+			strcat(list, b->oface);
+			number++;
+		}
+	}
 
-			u_buf_concat(buf, "%s . %d %s", a->ipaddr, iport, data_str);
+	return number;
+}
 
-			if (nports != 1)
-				u_buf_concat(buf, ", ");
+static void run_farm_flowtable(struct u_buffer *buf, struct nftst *n, int family, char *name, int action)
+{
+	char interfaces[NFTLB_MAX_OBJ_NAME] = { 0 };
+	struct farm *f = nftst_get_farm(n);
+	// the flowtable applied in the ruleset until a reload replaces it
+	int applied = (f->reload_action & VALUE_RLD_FLOWOFFLOAD) ? f->reload_flow_offload : farm_needs_flowtable(f);
 
-			output++;
-			iport++;
-			nports--;
-		}
-		concat_exec_cmd(buf, " }");
-		break;
-	case BCK_MAP_PROTO_IPADDR_PORT:
-		run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
+	if (action == ACTION_RELOAD) {
+		if (!(f->reload_action & VALUE_RLD_FLOWOFFLOAD) || applied == farm_needs_flowtable(f))
+			return;
+		action = applied ? ACTION_STOP : ACTION_START;
+	}
 
-		if (nports == 0)
-			break;
+	if (action == ACTION_START)
+		applied = farm_needs_flowtable(f);
 
-		u_buf_concat(buf, " ; %s element %s %s %s { ", action_str, nft_family, NFTLB_TABLE_NAME, service);
+	if (!applied || !get_farm_interfaces(n, interfaces))
+		return;
 
-		while (iport <= NFTLB_MAX_PORTS && nports > 0)
-		{
-			if (!address_search_array_port(a, iport)) { iport++; continue; }
+	switch (action) {
+	case ACTION_START:
+		concat_exec_cmd(buf, " ; add flowtable %s %s %s { hook %s priority %d ; devices = { %s } ; } ;", print_nft_table_family(family, NFTLB_F_CHAIN_FWD_FILTER), NFTLB_TABLE_NAME, name, NFTLB_HOOK_INGRESS, nftlb_flowtable_prio++, interfaces);
+		break;
+	case ACTION_STOP:
+	case ACTION_DELETE:
+		concat_exec_cmd(buf, " ; delete flowtable %s %s %s ; ", print_nft_table_family(family, NFTLB_F_CHAIN_FWD_FILTER), NFTLB_TABLE_NAME, name);
+		nftlb_flowtable_prio--;
+		break;
+	default:
+		break;
+	}
+	return;
+}
 
-			u_buf_concat(buf, "%s . %s . %d %s", protocol, a->ipaddr, iport, data_str);
+static void run_farm_gen_flowtable_rules(struct u_buffer *buf, struct nftst *n, int family, char *chain, char *name, int action)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
 
-			if (nports != 1)
-				u_buf_concat(buf, ", ");
+	if (!farm_needs_flowtable(f) || !a->iface)
+		return;
 
-			output++;
-			iport++;
-			nports--;
-		}
-		concat_exec_cmd(buf, " }");
-		break;
-	case BCK_MAP_PROTO_PORT:
-		run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
+	concat_exec_cmd(buf, " ; add rule %s %s %s flow add @%s", print_nft_table_family(family, NFTLB_F_CHAIN_FWD_FILTER), NFTLB_TABLE_NAME, chain, name);
+	return;
+}
 
-		if (nports == 0)
-			break;
+static int run_farm_rules_forward(struct u_buffer *buf, struct nftst *n, int family, int action)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	int naction = nftst_get_action(n);
+	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char flowtable[NFTLB_MAX_OBJ_NAME] = { 0 };
 
-		u_buf_concat(buf, " ; %s element %s %s %s { ", action_str, nft_family, NFTLB_TABLE_NAME, service);
+	if (!need_forward(f) && !(nftst_get_chains(n) & NFTLB_F_CHAIN_FWD_FILTER))
+		return 0;
 
-		while (iport <= NFTLB_MAX_PORTS && nports > 0)
-		{
-			if (!address_search_array_port(a, iport)) { iport++; continue; }
+	// the log and flowtable changes are able to add or remove the forward chain
+	if ((action == ACTION_START || action == ACTION_RELOAD) && !need_forward(f))
+		action = ACTION_STOP;
+	else if (action == ACTION_RELOAD && !(nftst_get_chains(n) & NFTLB_F_CHAIN_FWD_FILTER))
+		action = ACTION_START;
 
-			if (nports != 1)
-				u_buf_concat(buf, ", ");
+	get_chain_name(chain, f->name, NFTLB_F_CHAIN_FWD_FILTER);
+	get_flowtable_name(flowtable, f);
 
-			u_buf_concat(buf, "%s . %d %s", protocol, iport, data_str);
-			output++;
-			iport++;
-			nports--;
-		}
-		concat_exec_cmd(buf, " }");
+	switch (action) {
+	case ACTION_START:
+		run_base_table(buf, NFTLB_F_CHAIN_FWD_FILTER, family, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, get_rules_needed(a), action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, naction, action);
+		run_farm_gen_log_rules(buf, f, family, chain, VALUE_LOG_FORWARD, NFTLB_F_CHAIN_FWD_FILTER, action);
+		run_farm_flowtable(buf, n, family, flowtable, action);
+		run_farm_gen_flowtable_rules(buf, n, family, chain, flowtable, action);
 		break;
-	default:
-		nports = (nftst_get_proto(n) == VALUE_PROTO_ALL) ? 1 : a->nports;
-
-		if (nports == 0)
-			break;
+	case ACTION_RELOAD:
+		run_base_table(buf, NFTLB_F_CHAIN_FWD_FILTER, family, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, get_rules_needed(a), action);
 
-		while (iport <= NFTLB_MAX_PORTS && nports > 0)
-		{
-			if (!address_search_array_port(a, iport) && nftst_get_proto(n) != VALUE_PROTO_ALL) { iport++; continue; }
+		run_nftst_rules_gen_chain(buf, n, family, NFTLB_F_CHAIN_FWD_FILTER, ACTION_RELOAD);
+		run_nftst_rules_gen_srv_map_by_protocol(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, ACTION_RELOAD);
 
-			list_for_each_entry(b, &f->backends, list) {
-				if (!backend_validate(b))
-					continue;
+		run_farm_gen_log_rules(buf, f, family, chain, VALUE_LOG_FORWARD, NFTLB_F_CHAIN_FWD_FILTER, action);
+		run_farm_flowtable(buf, n, family, flowtable, action);
+		run_farm_gen_flowtable_rules(buf, n, family, chain, flowtable, action);
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, naction, action);
+		run_farm_flowtable(buf, n, family, flowtable, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, get_rules_needed(a), action);
+		break;
+	default:
+		break;
+	}
 
-				get_address_service(service, a, type, nftst_get_family(n), key_mode);
+	return 0;
+}
 
-				bckmark = backend_get_mark(b);
-				if (type == NFTLB_F_CHAIN_POS_SNAT && bckmark & masquerade_mark)
-					continue;
+static int run_farm_rules_output(struct u_buffer *buf, struct nftst *n, int family, int action)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	int naction = nftst_get_action(n);
 
-				structure = 0;
-				if ((key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_MARK) && bckmark != DEFAULT_MARK) {
-					if (!first_port) { continue; }
-					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "0x%x", bckmark);
-					structure = NFTLB_MARK_ACTIVE;
-				} else if ((key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_PROTO_IPADDR_F_PORT) && backend_no_port(b)) {
-					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "%s . %s . %d", protocol, b->ipaddr, iport);
-					structure = NFTLB_PROTO_IP_PORT_ACTIVE;
-				} else if ((key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_PROTO_IPADDR_F_PORT) && !backend_no_port(b)) {
-					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "%s . %s . %s", protocol, b->ipaddr, b->port);
-					structure = NFTLB_PROTO_IP_PORT_ACTIVE;
-				} else if ((key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_IPADDR_F_PORT) && backend_no_port(b)) {
-					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "%s . %d", b->ipaddr, iport);
-					structure = NFTLB_PROTO_PORT_ACTIVE;
-				} else if (key_mode == BCK_MAP_BCK_ID && !backend_no_port(b)) {
-					if (!first_port) { continue; }
-					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "%s . %s", b->ipaddr, b->port);
-					structure = NFTLB_PROTO_PORT_ACTIVE;
-				} else if (key_mode == BCK_MAP_BCK_ID || key_mode == BCK_MAP_BCK_IPADDR) {
-					if (!first_port) { continue; }
-					snprintf(key_str, NFTLB_MAX_OBJ_NAME, "%s", b->ipaddr);
-					structure = NFTLB_PROTO_IP_ACTIVE;
-				} else
-					if (!first_port) { continue; }
+	if (!need_output(f))
+		return 0;
 
-				nftst_set_backend(n, b);
-				run_nftst_rules_gen_srv_data((char **) &data_str, n, chain, data_mode);
+	switch (action) {
+	case ACTION_START:
+		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, get_rules_needed(a), action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, naction, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, get_rules_needed(a), action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, naction, action);
+		break;
+	case ACTION_RELOAD:
+		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, get_rules_needed(a), action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, naction, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, get_rules_needed(a), action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, naction, action);
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, naction, action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, naction, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, get_rules_needed(a), action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, get_rules_needed(a), action);
+		break;
+	default:
+		break;
+	}
 
-				if (b->action == ACTION_STOP || b->action == ACTION_DELETE || b->action == ACTION_RELOAD) {
-					if (action == ACTION_START)
-						continue;
-					concat_exec_cmd(buf, " ; delete element %s %s %s { %s }", nft_family, NFTLB_TABLE_NAME, service, key_str);
-					update_service_counters(a, type, structure, family, 1, ACTION_DELETE);
-				}
+	return 0;
+}
 
-				if(!backend_is_usable(b))
-					continue;
+static int run_farm_rules_ingress_policies(struct u_buffer *buf, struct farm *f, char *chain, int action)
+{
+	struct farmpolicy *fp;
+	char meter_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	struct nftst *n = nftst_create_from_farm(f);
 
-				if (action == ACTION_RELOAD && b->action == ACTION_NONE)
-					continue;
+	list_for_each_entry(fp, &f->policies, list) {
+		nftst_set_policy(n, fp->policy);
+		snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s-cnt", fp->policy->name, f->name);
+		if ((fp->action == ACTION_RELOAD && f->policies_action == ACTION_RELOAD) ||
+			(action == ACTION_START && f->policies_action != ACTION_RELOAD) ||
+			(action == ACTION_RELOAD && f->policies_action == ACTION_START) ||
+			(fp->action == ACTION_START && f->policies_action == ACTION_RELOAD)) {
+			run_farm_meter(buf, f, VALUE_FAMILY_NETDEV, fp->policy->family, KEY_ELEMENTS, meter_str, ACTION_START);
+			nftst_set_policy(n, fp->policy);
 
-				concat_exec_cmd(buf, " ; %s element %s %s %s { %s %s}", action_str, nft_family, NFTLB_TABLE_NAME, service, key_str, data_str);
-				update_service_counters(a, type, structure, family, 1, action);
-				output++;
-			}
-			nftst_set_backend(n, NULL);
+		} else if (((action == ACTION_STOP || action == ACTION_DELETE) && f->policies_action != ACTION_RELOAD) ||
+					(action == ACTION_RELOAD && f->policies_action == ACTION_STOP) ||
+					(fp->action == ACTION_STOP && f->policies_action == ACTION_RELOAD)) {
+			run_farm_meter(buf, f, VALUE_FAMILY_NETDEV, fp->policy->family, KEY_ELEMENTS, meter_str, ACTION_STOP);
+		}
 
-			iport++;
-			first_port = 0;
-			nports--;
-			continue;
+		if ((fp->action == ACTION_NONE && (f->policies_action == ACTION_RELOAD || f->policies_action == ACTION_START)) ||
+			(fp->action == ACTION_START && (f->policies_action == ACTION_RELOAD || f->policies_action == ACTION_START)) ||
+			(fp->action == ACTION_RELOAD && f->policies_action == ACTION_RELOAD)) {
+			u_buf_concat(buf, " ; add rule %s %s %s %s saddr @%s add @%s { %s saddr }",
+							NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, chain, print_nft_family(fp->policy->family), fp->policy->name, meter_str, print_nft_family(fp->policy->family));
+			run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, fp->policy->type, KEY_LOGPREFIX, NFTLB_F_CHAIN_ING_FILTER);
 		}
-		break;
-	}
 
-	if (data_str)
-		free(data_str);
+		fp->action = ACTION_NONE;
+	}
 
-	return output;
+	return 0;
 }
 
-static void run_nftst_rules_gen_srv_map_by_type(struct u_buffer *buf, struct nftst *n, int type, int family, int protocol, int action)
+static int run_nftst_rules_ingress_policies(struct u_buffer *buf, struct nftst *n, char *chain, int action)
 {
 	struct address *a = nftst_get_address(n);
-	int elements = 0;
+	struct addresspolicy *ap;
 
-	u_log_print(LOG_DEBUG, "%s():%d: ", __FUNCTION__, __LINE__);
+	if (a->policies_action != ACTION_START && a->policies_action != ACTION_RELOAD && action != ACTION_RELOAD)
+		return 0;
 
-	if (type & NFTLB_F_CHAIN_ING_FILTER)
-		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_PROTO_IPADDR_PORT), BCK_MAP_NAME);
-	else if (type & NFTLB_F_CHAIN_PRE_FILTER)
-		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_PROTO_IPADDR_PORT), BCK_MAP_NAME);
-	else if (type & NFTLB_F_CHAIN_PRE_DNAT)
-		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_PROTO_IPADDR_PORT), BCK_MAP_NAME);
-	else if (type & NFTLB_F_CHAIN_FWD_FILTER)
-		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, BCK_MAP_BCK_MARK, BCK_MAP_NAME);
-	else if (type & NFTLB_F_CHAIN_POS_SNAT)
-		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, BCK_MAP_BCK_ID, BCK_MAP_BCK_BF_SRCIPADDR);
-	else if (type & NFTLB_F_CHAIN_ING_DNAT)
-		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_BCK_PROTO_IPADDR_F_PORT), BCK_MAP_NAME);
-	else if (type & NFTLB_F_CHAIN_OUT_FILTER)
-		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_PROTO_IPADDR_PORT), BCK_MAP_NAME);
-	else if (type & NFTLB_F_CHAIN_OUT_DNAT)
-		elements = run_nftst_rules_gen_srv_map(buf, n, family, type, protocol, action, address_no_port(a) ? BCK_MAP_PROTO_IPADDR : (address_no_ipaddr(a) ? BCK_MAP_PROTO_PORT : BCK_MAP_PROTO_IPADDR_PORT), BCK_MAP_NAME);
-	else
-		return;
+	list_for_each_entry(ap, &a->policies, list) {
+		u_buf_concat(buf, " ; add rule %s %s %s %s saddr @%s",
+						NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, chain, print_nft_family(ap->policy->family), ap->policy->name);
+		run_farm_rules_log_and_verdict(buf, n, a->logrtlimit, a->verdict, ap->policy->type, KEY_LOGPREFIX, NFTLB_F_CHAIN_ING_FILTER);
+		ap->action = ACTION_NONE;
+	}
 
-	if (elements && (~type & NFTLB_F_CHAIN_POS_SNAT) && (~type & NFTLB_F_CHAIN_FWD_FILTER))
-		update_service_counters(a, type, family, 0, elements, action);
+	return 0;
 }
 
-static void run_nftst_rules_gen_srv_map_by_protocol(struct u_buffer *buf, struct nftst *n, int type, int family, int action)
+static void get_farm_rules_nat_params(struct u_buffer *buf, int family, int mode)
 {
-	u_log_print(LOG_DEBUG, "%s():%d: ", __FUNCTION__, __LINE__);
-
-	if (nftst_get_proto(n) != VALUE_PROTO_ALL || (type & NFTLB_F_CHAIN_FWD_FILTER) || (type & NFTLB_F_CHAIN_POS_SNAT)) {
-		run_nftst_rules_gen_srv_map_by_type(buf, n, type, family, nftst_get_proto(n), action);
-	} else {
-		run_nftst_rules_gen_srv_map_by_type(buf, n, type, family, VALUE_PROTO_TCP, action);
-		run_nftst_rules_gen_srv_map_by_type(buf, n, type, family, VALUE_PROTO_UDP, action);
-		run_nftst_rules_gen_srv_map_by_type(buf, n, type, family, VALUE_PROTO_SCTP, action);
+	switch (mode) {
+	case BCK_MAP_IPADDR_PORT:
+		u_buf_concat(buf, " %s addr . port", print_nft_family(family));
+		break;
+	default:
+		break;
 	}
 }
 
-static void run_nftst_rules_gen_vsrv(struct u_buffer *buf, struct nftst *n, int type, int family, int srv_action, int action)
+static int run_farm_rules_gen_nat(struct u_buffer *buf, struct nftst *n, int family, int type, int action)
 {
-	u_log_print(LOG_DEBUG, "%s():%d: pos %d", __FUNCTION__, __LINE__, get_chain_pos_counter(type));
+	struct farm *f = nftst_get_farm(n);
+	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	int bck_map_data = BCK_MAP_IPADDR;
 
-	if (srv_action == ACTION_NONE)
-		srv_action = action;
+	if (f->bcks_usable == 0)
+		return 0;
 
-	switch (srv_action) {
-	case ACTION_RELOAD:
-		run_nftst_rules_gen_chain(buf, n, family, type, action);
-		break;
-	case ACTION_START:
-		run_nftst_rules_gen_chain(buf, n, family, type, action);
-		run_nftst_rules_gen_srv_map_by_protocol(buf, n, type, family, srv_action);
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		run_nftst_rules_gen_srv_map_by_protocol(buf, n, type, family, srv_action);
-		run_nftst_rules_gen_chain(buf, n, family, type, action);
-		break;
-	default:
+	get_chain_name(chain, f->name, type);
+
+	switch (f->mode) {
+	case VALUE_MODE_DSR:
+		run_farm_rules_check_sessions(buf, n, SESSION_TYPE_STATIC, family, NFTLB_F_CHAIN_ING_FILTER, action);
+		run_farm_rules_check_sessions(buf, n, SESSION_TYPE_TIMED, family, NFTLB_F_CHAIN_ING_FILTER, action);
+
+		if (f->bcks_available) {
+			u_buf_concat(buf, " ; add rule %s %s %s", print_nft_table_family(family, NFTLB_F_CHAIN_ING_FILTER), NFTLB_TABLE_NAME, chain);
+			run_farm_log_prefix(buf, f, VALUE_LOG_INPUT, NFTLB_F_CHAIN_ING_FILTER, ACTION_START);
+			// TODO: support of different output interfaces per backend during saddr
+			u_buf_concat(buf, " ether saddr set %s ether daddr set", f->oethaddr);
+			run_farm_rules_gen_sched(buf, n, family);
+			run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_WEIGHT, BCK_MAP_ETHADDR, NFTLB_CHECK_AVAIL);
+			run_farm_rules_update_sessions(buf, n, family, chain, action);
+			run_farm_log_prefix(buf, f, VALUE_LOG_OUTPUT, NFTLB_F_CHAIN_ING_DNAT, ACTION_START);
+			u_buf_concat(buf, " fwd to");
+			if (f->bcks_have_if) {
+				u_buf_concat(buf, " ether daddr");
+				run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_ETHADDR, BCK_MAP_OFACE, NFTLB_CHECK_AVAIL);
+			} else
+				u_buf_concat(buf, " %s", f->oface);
+		}
+		concat_exec_cmd(buf, "");
 		break;
-	}
+	case VALUE_MODE_STLSDNAT:
+		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "map-%s-back", f->name);
+		concat_exec_cmd(buf, " ; add rule %s %s %s update @%s { %s saddr : ether saddr }", print_nft_table_family(family, NFTLB_F_CHAIN_ING_FILTER), NFTLB_TABLE_NAME, chain, map_str, print_nft_family(family));
 
-	return;
-}
+		run_farm_rules_check_sessions(buf, n, SESSION_TYPE_STATIC, family, NFTLB_F_CHAIN_ING_FILTER, action);
+		run_farm_rules_check_sessions(buf, n, SESSION_TYPE_TIMED, family, NFTLB_F_CHAIN_ING_FILTER, action);
+
+		if (f->bcks_available) {
+			u_buf_concat(buf, " ; add rule %s %s %s", print_nft_table_family(family, NFTLB_F_CHAIN_ING_FILTER), NFTLB_TABLE_NAME, chain);
+			run_farm_log_prefix(buf, f, VALUE_LOG_INPUT, NFTLB_F_CHAIN_ING_FILTER, ACTION_START);
+			u_buf_concat(buf, " %s daddr set", print_nft_family(family));
+			run_farm_rules_gen_sched(buf, n, family);
+			run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_WEIGHT, BCK_MAP_IPADDR, NFTLB_CHECK_AVAIL);
+			u_buf_concat(buf, " ether daddr set %s daddr", print_nft_family(family));
+			run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_IPADDR, BCK_MAP_ETHADDR, NFTLB_CHECK_AVAIL);
 
-static int run_farm_snat(struct u_buffer *buf, struct nftst *n, int family, int action)
-{
-	struct farm *f = nftst_get_farm(n);
+			if (f->bcks_have_port) {
+				u_buf_concat(buf, " th dport set ether daddr");
+				run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_ETHADDR, BCK_MAP_PORT, NFTLB_CHECK_AVAIL);
+			}
 
-	u_log_print(LOG_DEBUG, "%s():%d: ", __FUNCTION__, __LINE__);
+			// TODO: support of different output interfaces per backend during saddr
+			u_buf_concat(buf, " ether saddr set %s", f->oethaddr);
 
-	if (f->mode != VALUE_MODE_SNAT && f->mode != VALUE_MODE_LOCAL)
-		return 0;
+			run_farm_rules_update_sessions(buf, n, family, chain, action);
 
-	switch (action) {
-	case ACTION_RELOAD:
-	case ACTION_START:
-		run_nftst_rules_gen_srv_map_by_protocol(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, action);
+			run_farm_log_prefix(buf, f, VALUE_LOG_OUTPUT, NFTLB_F_CHAIN_ING_DNAT, ACTION_START);
+			u_buf_concat(buf, " fwd to");
+			if (f->bcks_have_if) {
+				u_buf_concat(buf, " ether daddr");
+				run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_ETHADDR, BCK_MAP_OFACE, NFTLB_CHECK_AVAIL);
+			} else {
+				u_buf_concat(buf, " %s", f->oface);
+			}
+		}
+		concat_exec_cmd(buf, "");
 		break;
-	case ACTION_STOP:
-	case ACTION_DELETE:
-		if ((family == VALUE_FAMILY_IPV4 && nft_base_rules.snat_rules_v4) || (family == VALUE_FAMILY_IPV6 && nft_base_rules.snat_rules_v6))
-			run_nftst_rules_gen_srv_map_by_protocol(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, action);
+	case VALUE_MODE_LOCAL:
+		run_farm_gen_log_rules(buf, f, family, chain, VALUE_LOG_INPUT, NFTLB_F_CHAIN_PRE_DNAT, ACTION_START);
 		break;
-	}
+	default:
+		run_farm_gen_log_rules(buf, f, family, chain, VALUE_LOG_INPUT, NFTLB_F_CHAIN_PRE_DNAT, ACTION_START);
 
-	return 0;
-}
+		u_buf_concat(buf, " ; add rule %s %s %s", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_DNAT), NFTLB_TABLE_NAME, chain);
 
-static int run_farm_rules_gen_sched(struct u_buffer *buf, struct nftst *n, int family)
-{
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
+		if (nftst_get_proto(n) != VALUE_PROTO_ALL)
+			u_buf_concat(buf, " %s %s %s", print_nft_family(family), print_nft_family_protocol(family), print_nft_protocol(nftst_get_proto(n)));
 
-	switch (f->scheduler) {
-	case VALUE_SCHED_RR:
-		u_buf_concat(buf, " numgen inc mod %d", f->total_weight);
-		break;
-	case VALUE_SCHED_WEIGHT:
-		u_buf_concat(buf, " numgen random mod %d", f->total_weight);
-		break;
-	case VALUE_SCHED_HASH:
-		u_buf_concat(buf, " jhash");
-		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->schedparam, NFTLB_MAP_KEY_RULE);
-		u_buf_concat(buf, " mod %d", f->total_weight);
-		break;
-	case VALUE_SCHED_SYMHASH:
-		u_buf_concat(buf, " symhash mod %d", f->total_weight);
-		break;
-	default:
-		return -1;
-	}
+		u_buf_concat(buf, " dnat");
 
-	return 0;
-}
+		if (f->bcks_have_port && nftst_get_proto(n) != VALUE_PROTO_ALL)
+			bck_map_data = BCK_MAP_IPADDR_PORT;
 
-static int get_nftst_first_port(struct nftst *n)
-{
-	struct address *a = nftst_get_address(n);
-	int iport = 0;
+		get_farm_rules_nat_params(buf, family, bck_map_data);
+		u_buf_concat(buf, " to ct mark");
+		run_farm_rules_gen_bck_map(buf, n, family, BCK_MAP_MARK, bck_map_data, NFTLB_CHECK_USABLE);
 
-	if (nftst_get_proto(n) == VALUE_PROTO_ALL || a->nports == 0)
-		return 0;
+		concat_exec_cmd(buf, "");
 
-	while (iport <= NFTLB_MAX_PORTS && a->nports > 0) {
-		if (a->port_list[iport])
-			return ++iport;
-		iport++;
+		break;
 	}
+
 	return 0;
 }
 
-static int run_farm_rules_gen_bck_map(struct u_buffer *buf, struct nftst *n, enum map_modes key_mode, enum map_modes data_mode, int usable)
+static int run_nftst_ingress_policies(struct u_buffer *buf, struct nftst *n, int family, int action)
 {
 	struct farm *f = nftst_get_farm(n);
-	struct backend *b;
-	int i = 0;
-	int last = 0;
-	int new;
-	int port;
-
-	u_buf_concat(buf, " map {");
+	struct address *a = nftst_get_address(n);
+	int naction = nftst_get_action(n);
+	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
 
-	list_for_each_entry(b, &f->backends, list) {
-		if (usable == NFTLB_CHECK_USABLE && !backend_is_usable(b))
-			continue;
-		if (usable == NFTLB_CHECK_AVAIL && !backend_is_available(b))
-			continue;
-		if (data_mode == BCK_MAP_PORT && backend_no_port(b))
-			continue;
+	if ((f && !farm_needs_policies(f)) ||
+		(!f && a && !address_needs_policies(a)) ||
+		(f && !farm_is_ingress_mode(f) && naction == ACTION_NONE))
+		return 0;
 
-		if (i != 0)
-			u_buf_concat(buf, ",");
+	get_chain_name(chain, nftst_get_name(n), NFTLB_F_CHAIN_ING_FILTER);
 
-		switch (key_mode) {
-		case BCK_MAP_MARK:
-			u_buf_concat(buf, " 0x%x", backend_get_mark(b));
-			break;
-		case BCK_MAP_IPADDR:
-			u_buf_concat(buf, " %s", b->ipaddr);
-			break;
-		case BCK_MAP_WEIGHT:
-			new = last + b->weight - 1;
-			u_buf_concat(buf, " %d", last);
-			if (new != last)
-				u_buf_concat(buf, "-%d", new);
-			last = new + 1;
-			break;
-		case BCK_MAP_ETHADDR:
-			u_buf_concat(buf, " %s", b->ethaddr);
-			break;
-		default:
-			break;
+	switch (action) {
+	case ACTION_START:
+		if ((f && !farm_is_ingress_mode(f)) || a) {
+				run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, ACTION_START);
+				run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), ACTION_START);
+				if ((f && f->policies_used > 1) || (a && a->policies_used > 1))
+					run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_RELOAD, ACTION_RELOAD);
+				else
+					run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_START, ACTION_START);
 		}
 
-		u_buf_concat(buf, ":");
-
-		switch (data_mode) {
-		case BCK_MAP_MARK:
-			u_buf_concat(buf, " 0x%x", backend_get_mark(b));
-			break;
-		case BCK_MAP_ETHADDR:
-			u_buf_concat(buf, " %s", b->ethaddr);
-			break;
-		case BCK_MAP_IPADDR_PORT:
-			if (backend_no_port(b)) {
-				port = get_nftst_first_port(n);
-				u_buf_concat(buf, " %s . %d", b->ipaddr, port);
-			} else
-				u_buf_concat(buf, " %s . %s", b->ipaddr, b->port);
-			break;
-		case BCK_MAP_PORT:
-			u_buf_concat(buf, " %s", b->port);
-			break;
-		case BCK_MAP_IPADDR:
-			u_buf_concat(buf, " %s", b->ipaddr);
-			break;
-		case BCK_MAP_OFACE:
-			if (b->oface)
-				u_buf_concat(buf, " %s", b->oface);
-			else
-				u_buf_concat(buf, " %s", f->oface);
-			break;
-		default:
-			break;
+		if (f)
+			run_farm_rules_ingress_policies(buf, f, chain, action);
+		else if (a)
+			run_nftst_rules_ingress_policies(buf, n, chain, action);
+		break;
+	case ACTION_RELOAD:
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_RELOAD, ACTION_RELOAD);
+		if (f)
+			run_farm_rules_ingress_policies(buf, f, chain, action);
+		else if (a)
+			run_nftst_rules_ingress_policies(buf, n, chain, action);
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		if ((f && !farm_is_ingress_mode(f)) || a) {
+			run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_STOP, ACTION_STOP);
+			run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), ACTION_STOP);
+			run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, ACTION_STOP);
 		}
 
-		i++;
-	}
-
-	u_buf_concat(buf, " }");
+		if (f && f->addresses_used <= 1)
+			run_farm_rules_ingress_policies(buf, f, chain, action);
+		else if (a)
+			run_nftst_rules_ingress_policies(buf, n, chain, action);
 
-	if (i == 0)
-		return -1;
+		break;
+	default:
+		break;
+	}
 
 	return 0;
 }
 
-static void run_farm_helper(struct u_buffer *buf, struct farm *f, int family, int action, char *protocol)
+static int run_farm_dsr(struct u_buffer *buf, struct nftst *n, int family, int action)
 {
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	int naction = nftst_get_action(n);
+
 	switch (action) {
+	case ACTION_RELOAD:
 	case ACTION_START:
-		concat_exec_cmd(buf, " ; add ct helper %s %s %s-%s-%s { type \"%s\" protocol %s ; } ;", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, f->name, obj_print_helper(f->helper), protocol, obj_print_helper(f->helper), protocol);
+		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, naction, action);
+		run_nftst_ingress_policies(buf, n, family, ACTION_RELOAD);
+		run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
+		run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
+		run_farm_manage_sessions(buf, f, SESSION_TYPE_STATIC, family, action);
+		run_farm_manage_sessions(buf, f, SESSION_TYPE_TIMED, family, action);
+		run_farm_rules_gen_nat(buf, n, family, NFTLB_F_CHAIN_ING_FILTER, action);
 		break;
 	case ACTION_DELETE:
 	case ACTION_STOP:
-		concat_exec_cmd(buf, " ; delete ct helper %s %s %s-%s-%s ; ", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, f->name, obj_print_helper(f->helper), protocol);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, naction, action);
+		run_farm_manage_sessions(buf, f, SESSION_TYPE_STATIC, family, action);
+		run_farm_manage_sessions(buf, f, SESSION_TYPE_TIMED, family, action);
+		run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
+		run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), action);
+		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, action);
+		run_nftst_ingress_policies(buf, n, family, f->policies_action);
 		break;
-	case ACTION_RELOAD:
 	default:
 		break;
 	}
-}
-
-static int run_farm_log_prefix(struct u_buffer *buf, struct farm *f, int key, int type, int action)
-{
-	char logprefix_str[NFTLB_MAX_OBJ_NAME] = { 0 };
-	struct nftst *n;
-
-	if (f->log == VALUE_LOG_NONE)
-		return 0;
-
-	if (f->log & key) {
-		n = nftst_create_from_farm(f);
-		print_log_format(logprefix_str, KEY_LOGPREFIX, type, n);
-		u_buf_concat(buf, " log prefix \"%s\"", logprefix_str);
-	}
 
 	return 0;
 }
 
-static int run_farm_gen_log_rules(struct u_buffer *buf, struct farm *f, int family, char * chain, int key, int type, int action)
+static int run_farm_stlsnat(struct u_buffer *buf, struct nftst *n, int family, int action)
 {
-	if (f->log == VALUE_LOG_NONE)
-		return 0;
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	int naction = nftst_get_action(n);
+	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
 
-	if (f->log & key) {
-		u_buf_concat(buf, " ; add rule %s %s %s", print_nft_table_family(family, type), NFTLB_TABLE_NAME, chain);
-		run_farm_log_prefix(buf,f, key, type, action);
-		concat_exec_cmd(buf, "");
+	snprintf(map_str, NFTLB_MAX_OBJ_NAME, "map-%s-back", f->name);
+
+	get_chain_name(chain, f->name, NFTLB_F_CHAIN_ING_DNAT);
+
+	switch (action) {
+	case ACTION_RELOAD:
+	case ACTION_START:
+		run_nftst_ingress_policies(buf, n, family, f->policies_action);
+		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_DNAT, family, get_rules_needed(a), action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_DNAT, family, naction, action);
+		run_farm_map(buf, a, family, NFTLB_F_CHAIN_ING_DNAT, map_str, VALUE_META_SRCIP, VALUE_META_SRCMAC, f->persistttl, 0, action);
+		concat_exec_cmd(buf, " ; add rule %s %s %s %s saddr set %s ether saddr set %s ether daddr set %s daddr map @%s fwd to %s", print_nft_table_family(family, NFTLB_F_CHAIN_ING_DNAT), NFTLB_TABLE_NAME, chain, print_nft_family(family), a->ipaddr, a->iethaddr, print_nft_family(family), map_str, a->iface);
+		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, naction, action);
+		run_nftst_ingress_policies(buf, n, family, f->policies_action);
+		run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
+		run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
+		run_farm_manage_sessions(buf, f, SESSION_TYPE_STATIC, family, action);
+		run_farm_manage_sessions(buf, f, SESSION_TYPE_TIMED, family, action);
+		run_farm_rules_gen_nat(buf, n, family, NFTLB_F_CHAIN_ING_FILTER, action);
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_DNAT, family, naction, action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, naction, action);
+		run_farm_manage_sessions(buf, f, SESSION_TYPE_STATIC, family, action);
+		run_farm_manage_sessions(buf, f, SESSION_TYPE_TIMED, family, action);
+		run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
+		run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
+		run_farm_map(buf, a, family, NFTLB_F_CHAIN_ING_DNAT, map_str, VALUE_META_SRCIP, VALUE_META_SRCMAC, f->persistttl, 0, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_DNAT, family, get_rules_needed(a), action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), action);
+		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, action);
+		run_nftst_ingress_policies(buf, n, family, f->policies_action);
+		break;
+	default:
+		break;
 	}
 
 	return 0;
 }
 
-static int run_farm_rules_filter_helper(struct u_buffer *buf, struct nftst *n, int family, char *chain, int action)
+static int run_farm_nat(struct u_buffer *buf, struct nftst *n, int family, int action)
 {
 	struct farm *f = nftst_get_farm(n);
 	struct address *a = nftst_get_address(n);
-	char protocol[NFTLB_MAX_OBJ_NAME] = {0};
-
-	if (!(f->helper != DEFAULT_HELPER && (f->mode == VALUE_MODE_SNAT || f->mode == VALUE_MODE_LOCAL || f->mode == VALUE_MODE_DNAT)))
-		return 0;
+	int naction = nftst_get_action(n);
 
-	if (a->protocol == VALUE_PROTO_TCP || a->protocol == VALUE_PROTO_ALL) {
-		sprintf(protocol, "tcp");
-		run_farm_helper(buf, f, family, action, protocol);
-		if (action == ACTION_START || action == ACTION_RELOAD)
-			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s %s ct helper set %s-%s-%s", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), print_nft_family_protocol(family), protocol, f->name, obj_print_helper(f->helper), protocol);
-	}
+	u_log_print(LOG_DEBUG, "%s():%d: ", __FUNCTION__, __LINE__);
 
-	if (a->protocol == VALUE_PROTO_UDP || a->protocol == VALUE_PROTO_ALL) {
-		sprintf(protocol, "udp");
-		run_farm_helper(buf, f, family, action, protocol);
-		if (action == ACTION_START || action == ACTION_RELOAD)
-			concat_exec_cmd(buf, " ; add rule %s %s %s %s %s %s ct helper set %s-%s-%s", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), print_nft_family_protocol(family), protocol, f->name, obj_print_helper(f->helper), protocol);
+	switch (action) {
+	case ACTION_RELOAD:
+	case ACTION_START:
+		run_farm_rules_filter(buf, n, family, action);
+		run_nftst_ingress_policies(buf, n, family, f->policies_action);
+		run_base_table(buf, NFTLB_F_CHAIN_PRE_DNAT, family, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, get_rules_needed(a), action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, get_rules_needed(a), action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, naction, action);
+		run_farm_rules_gen_nat(buf, n, family, NFTLB_F_CHAIN_PRE_DNAT, action);
+		run_farm_rules_forward(buf, n, family, action);
+		run_farm_rules_output(buf, n, family, action);
+		run_farm_snat(buf, n, family, action);
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		run_farm_rules_forward(buf, n, family, action);
+		run_farm_rules_output(buf, n, family, action);
+		run_farm_rules_filter(buf, n, family, action);
+		run_farm_snat(buf, n, family, action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, naction, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, get_rules_needed(a), action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, get_rules_needed(a), action);
+		run_base_table(buf, NFTLB_F_CHAIN_PRE_DNAT, family, action);
+		run_nftst_ingress_policies(buf, n, family, f->policies_action);
+		break;
+	default:
+		break;
 	}
 
 	return 0;
 }
 
-static int run_farm_sessions_map(struct u_buffer *buf, struct nftst *n, int stype, int family, int action)
+static int run_farm_local(struct u_buffer *buf, struct nftst *n, int family, int action)
 {
 	struct farm *f = nftst_get_farm(n);
 	struct address *a = nftst_get_address(n);
-	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
-	int ttl = 0;
 
-	if (f->persistence == VALUE_META_NONE)
-		return 0;
-
-	if (stype == SESSION_TYPE_STATIC)
-		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "static-sessions-%s", f->name);
-	else {
-		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "persist-%s", f->name);
-		ttl = f->persistttl;
+	switch (action) {
+	case ACTION_RELOAD:
+	case ACTION_START:
+		run_base_table(buf, NFTLB_F_CHAIN_PRE_DNAT, family, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, get_rules_needed(a), action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, get_rules_needed(a), action);
+		run_farm_snat(buf, n, family, action);
+		run_farm_rules_filter(buf, n, family, action);
+		run_nftst_ingress_policies(buf, n, family, f->policies_action);
+		run_farm_rules_forward(buf, n, family, action);
+		run_farm_rules_output(buf, n, family, action);
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, action, action);
+		break;
+	case ACTION_DELETE:
+	case ACTION_STOP:
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, action, action);
+		run_farm_rules_forward(buf, n, family, action);
+		run_farm_rules_output(buf, n, family, action);
+		run_farm_rules_filter(buf, n, family, action);
+		run_farm_snat(buf, n, family, action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, get_rules_needed(a), action);
+		run_base_chain(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, get_rules_needed(a), action);
+		run_base_table(buf, NFTLB_F_CHAIN_PRE_DNAT, family, action);
+		run_nftst_ingress_policies(buf, n, family, f->policies_action);
+		break;
+	default:
+		break;
 	}
 
-	if (f->mode == VALUE_MODE_DSR)
-		run_farm_map(buf, a, family, NFTLB_F_CHAIN_ING_FILTER, map_str, f->persistence, VALUE_META_DSTMAC, ttl, action);
-	else if (f->mode == VALUE_MODE_STLSDNAT)
-		run_farm_map(buf, a, family, NFTLB_F_CHAIN_ING_FILTER, map_str, f->persistence, VALUE_META_DSTIP, ttl, action);
-	else
-		run_farm_map(buf, a, family, NFTLB_F_CHAIN_PRE_FILTER, map_str, f->persistence, VALUE_META_MARK, ttl, action);
-
 	return 0;
 }
 
-static int run_farm_manage_sessions(struct u_buffer *buf, struct farm *f, int stype, int family, int action)
+static int run_farm_bck_maps_update(struct u_buffer *buf, struct nftst *n, int family)
 {
-	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char *client;
-	struct session *s;
-	struct list_head *sessions;
-
-	if (action != ACTION_START && action != ACTION_RELOAD)
-		return 0;
-
-	if (f->persistence == VALUE_META_NONE)
-		return 0;
+	struct farm *f = nftst_get_farm(n);
+	struct backend *b;
+	int maps = f->nft_bck_maps & get_bck_maps_family(family);
+	int kind;
 
-	if (f->bcks_usable == 0)
-		return 0;
+	if (f->action != ACTION_RELOAD || f->reload_action != VALUE_RLD_BCKS)
+		return -1;
 
-	if ((action != ACTION_START && action != ACTION_RELOAD))
-		return 0;
+	if (!maps || maps != get_bck_maps_needed(n, family))
+		return -1;
 
-	get_chain_name(chain, f->name, NFTLB_F_CHAIN_ING_FILTER);
+	// the slots of the rule are fixed, each available backend needs one
+	if ((maps & get_bck_map_bit(NFTLB_BCK_MAP_SCHED, family)) && f->bcks_available > f->nft_sched_slots)
+		return -1;
 
-	if (stype == SESSION_TYPE_STATIC) {
-		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "static-sessions-%s", f->name);
-		sessions = &f->static_sessions;
-	} else {
-		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "persist-%s", f->name);
-		sessions = &f->timed_sessions;
+	// per backend limits are rules that depend on the backends state
+	list_for_each_entry(b, &f->backends, list) {
+		if (b->estconnlimit)
+			return -1;
 	}
 
-	list_for_each_entry(s, sessions, list) {
-		client = (char *) malloc(255);
-		if (!client) {
-			u_log_print(LOG_ERR, "%s():%d: unable to allocate parsed client %s for farm %s", __FUNCTION__, __LINE__, s->client, f->name);
-			continue;
-		}
-
-		if (session_get_client(s, &client)) {
-			if ((action == ACTION_RELOAD && (s->action == ACTION_STOP || s->action == ACTION_DELETE)) || s->action == ACTION_RELOAD)
-				concat_exec_cmd(buf, " ; delete element %s %s %s { %s }", print_nft_table_family(family, get_stage_by_farm_mode(f)), NFTLB_TABLE_NAME, map_str, client);
-
-			if (f->mode == VALUE_MODE_DSR) {
-				if ((action == ACTION_START || s->action == ACTION_START || s->action == ACTION_RELOAD) && s->bck && s->bck->ethaddr != DEFAULT_ETHADDR && backend_is_available(s->bck)) {
-					if (stype == SESSION_TYPE_TIMED && s->expiration)
-						concat_exec_cmd(buf, " ; add element %s %s %s { %s expires %s : %s }", print_nft_table_family(family, get_stage_by_farm_mode(f)), NFTLB_TABLE_NAME, map_str, client, s->expiration, s->bck->ethaddr);
-					else
-						concat_exec_cmd(buf, " ; add element %s %s %s { %s : %s }", print_nft_table_family(family, get_stage_by_farm_mode(f)), NFTLB_TABLE_NAME, map_str, client, s->bck->ethaddr);
-				}
-			} else if (f->mode == VALUE_MODE_STLSDNAT) {
-				if ((action == ACTION_START || s->action == ACTION_START || s->action == ACTION_RELOAD) && s->bck && s->bck->ipaddr != DEFAULT_IPADDR && backend_is_available(s->bck)) {
-					if (stype == SESSION_TYPE_TIMED && s->expiration)
-						concat_exec_cmd(buf, " ; add element %s %s %s { %s expires %s : %s }", print_nft_table_family(family, get_stage_by_farm_mode(f)), NFTLB_TABLE_NAME, map_str, client, s->expiration, s->bck->ipaddr);
-					else
-						concat_exec_cmd(buf, " ; add element %s %s %s { %s : %s }", print_nft_table_family(family, get_stage_by_farm_mode(f)), NFTLB_TABLE_NAME, map_str, client, s->bck->ipaddr);
-				}
-			} else {
-				if ((action == ACTION_START || s->action == ACTION_START || s->action == ACTION_RELOAD) && s->bck && s->bck->mark != DEFAULT_MARK && backend_is_available(s->bck)) {
-					if (stype == SESSION_TYPE_TIMED && s->expiration)
-						concat_exec_cmd(buf, " ; add element %s %s %s { %s expires %s : 0x%x }", print_nft_table_family(family, get_stage_by_farm_mode(f)), NFTLB_TABLE_NAME, map_str, client, s->expiration, backend_get_mark(s->bck));
-					else
-						concat_exec_cmd(buf, " ; add element %s %s %s { %s : 0x%x }", print_nft_table_family(family, get_stage_by_farm_mode(f)), NFTLB_TABLE_NAME, map_str, client, backend_get_mark(s->bck));
-				}
-			}
+	u_log_print(LOG_DEBUG, "%s():%d: updating backend maps of farm %s", __FUNCTION__, __LINE__, f->name);
 
-		}
-		free(client);
-		s->action = ACTION_NONE;
+	for (kind = 0; kind < NFTLB_BCK_MAP_MAX; kind++) {
+		if (maps & get_bck_map_bit(kind, family))
+			run_farm_bck_map(buf, n, family, kind, ACTION_RELOAD);
 	}
 
+	run_farm_snat(buf, n, family, ACTION_RELOAD);
+	run_farm_manage_sessions(buf, f, SESSION_TYPE_STATIC, family, ACTION_RELOAD);
+	run_farm_manage_sessions(buf, f, SESSION_TYPE_TIMED, family, ACTION_RELOAD);
+
 	return 0;
 }
 
-static int run_farm_rules_update_sessions(struct u_buffer *buf, struct nftst *n, int family, char *chain, int action)
+static int run_farm_attrs_update(struct u_buffer *buf, struct nftst *n, int family)
 {
 	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	int naction = nftst_get_action(n);
+	int rld = f->reload_action;
 
-	if (f->persistence == VALUE_META_NONE || f->total_bcks == 0)
-		return 0;
+	if (f->action != ACTION_RELOAD || !(rld & VALUE_RLD_ATTRS) || farm_is_ingress_mode(f))
+		return -1;
 
-	snprintf(map_str, NFTLB_MAX_OBJ_NAME, "persist-%s", f->name);
+	u_log_print(LOG_DEBUG, "%s():%d: updating attributes of farm %s", __FUNCTION__, __LINE__, f->name);
 
-	if (action != ACTION_START && action != ACTION_RELOAD)
-		return 0;
+	if (rld & (VALUE_RLD_HELPER | VALUE_RLD_PERSISTTM | VALUE_RLD_SCHED))
+		run_farm_rules_filter(buf, n, family, ACTION_RELOAD);
 
-	switch (f->mode) {
-	case VALUE_MODE_DSR:
-		u_buf_concat(buf, " update @%s { ",  map_str);
-		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
-		concat_exec_cmd(buf, " : ");
-		run_farm_rules_gen_meta_param(buf, a->protocol, family, VALUE_META_DSTMAC, NFTLB_MAP_KEY_RULE);
-		concat_exec_cmd(buf, " }");
-		break;
-	case VALUE_MODE_STLSDNAT:
-		u_buf_concat(buf, " update @%s { ",  map_str);
-		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
-		concat_exec_cmd(buf, " : ");
-		run_farm_rules_gen_meta_param(buf, a->protocol, family, VALUE_META_DSTIP, NFTLB_MAP_KEY_RULE);
-		concat_exec_cmd(buf, " }");
-		break;
-	default:
-		if (farm_get_masquerade(f))
-			u_buf_concat(buf, " ; add rule %s %s %s ct mark != { 0x00000000, %u } update @%s { ", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, masquerade_mark, map_str);
-		else
-			u_buf_concat(buf, " ; add rule %s %s %s ct mark != 0x00000000 update @%s { ", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, map_str);
-		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
-		concat_exec_cmd(buf, " : ct mark }");
-		break;
+	if ((rld & (VALUE_RLD_LOG | VALUE_RLD_LOGPREFIX)) && f->mode != VALUE_MODE_LOCAL) {
+		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, naction, ACTION_RELOAD);
+		run_farm_rules_gen_nat(buf, n, family, NFTLB_F_CHAIN_PRE_DNAT, ACTION_RELOAD);
 	}
 
+	if (rld & (VALUE_RLD_LOG | VALUE_RLD_LOGPREFIX | VALUE_RLD_FLOWOFFLOAD))
+		run_farm_rules_forward(buf, n, family, ACTION_RELOAD);
+
+	if (rld & VALUE_RLD_SRCADDR)
+		run_farm_snat(buf, n, family, ACTION_RELOAD);
+
 	return 0;
 }
 
-static int run_farm_rules_check_sessions(struct u_buffer *buf, struct nftst *n, int stype, int family, int type, int action)
+static int run_farm_rules(struct u_buffer *buf, struct nftst *n, int family)
 {
 	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
+	int action = nftst_get_action(n);
 
-	if (f->persistence == VALUE_META_NONE || f->total_bcks == 0)
-		return 0;
+	if (f->action == ACTION_RELOAD && action == ACTION_NONE)
+		action = ACTION_RELOAD;
 
-	if (action != ACTION_START && action != ACTION_RELOAD)
+	if (action == ACTION_RELOAD && run_farm_bck_maps_update(buf, n, family) == 0)
 		return 0;
 
-	if (stype == SESSION_TYPE_STATIC)
-		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "static-sessions-%s", f->name);
-	else
-		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "persist-%s", f->name);
+	if (action == ACTION_RELOAD && run_farm_attrs_update(buf, n, family) == 0)
+		return 0;
 
-	get_chain_name(chain, f->name, type);
+	// a full reload regenerates the backends with the rest of the farm
+	f->reload_action &= ~VALUE_RLD_BCKS;
 
 	switch (f->mode) {
+	case VALUE_MODE_STLSDNAT:
+		run_farm_stlsnat(buf, n, family, action);
+		break;
 	case VALUE_MODE_DSR:
-		get_chain_name(chain, f->name, NFTLB_F_CHAIN_ING_FILTER);
-		u_buf_concat(buf, " ; add rule %s %s %s ether daddr set", print_nft_table_family(family, NFTLB_F_CHAIN_ING_FILTER), NFTLB_TABLE_NAME, chain);
-		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
-		concat_exec_cmd(buf, " map @%s ether saddr set %s", map_str, a->iethaddr);
-
-		if (stype == SESSION_TYPE_TIMED)
-			run_farm_rules_update_sessions(buf, n, family, chain, action);
-
-		u_buf_concat(buf, " fwd to");
-		if (f->bcks_have_if) {
-			u_buf_concat(buf, " ether daddr");
-			run_farm_rules_gen_bck_map(buf, n, BCK_MAP_ETHADDR, BCK_MAP_OFACE, NFTLB_CHECK_AVAIL);
-		} else
-			u_buf_concat(buf, " %s", f->oface);
-		concat_exec_cmd(buf, "");
+		run_farm_dsr(buf, n, family, action);
 		break;
-
-	case VALUE_MODE_STLSDNAT:
-		get_chain_name(chain, f->name, NFTLB_F_CHAIN_ING_FILTER);
-		u_buf_concat(buf, " ; add rule %s %s %s %s daddr set", print_nft_table_family(family, NFTLB_F_CHAIN_ING_FILTER), NFTLB_TABLE_NAME, chain, print_nft_family(family));
-		run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
-		concat_exec_cmd(buf, " map @%s ether daddr set %s daddr", map_str, print_nft_family(family));
-		run_farm_rules_gen_bck_map(buf, n, BCK_MAP_IPADDR, BCK_MAP_ETHADDR, NFTLB_CHECK_AVAIL);
-
-		if (f->bcks_have_port) {
-			u_buf_concat(buf, " th dport set ether daddr");
-			run_farm_rules_gen_bck_map(buf, n, BCK_MAP_ETHADDR, BCK_MAP_PORT, NFTLB_CHECK_AVAIL);
-		}
-
-		u_buf_concat(buf, " ether saddr set %s", f->oethaddr);
-
-		if (stype == SESSION_TYPE_TIMED)
-			run_farm_rules_update_sessions(buf, n, family, chain, action);
-
-		u_buf_concat(buf, " fwd to");
-		if (f->bcks_have_if) {
-			u_buf_concat(buf, " ether daddr");
-			run_farm_rules_gen_bck_map(buf, n, BCK_MAP_ETHADDR, BCK_MAP_OFACE, NFTLB_CHECK_AVAIL);
-		} else
-			u_buf_concat(buf, " %s", f->oface);
-		concat_exec_cmd(buf, "");
+	case VALUE_MODE_LOCAL:
+		run_farm_local(buf, n, family, action);
 		break;
-
 	default:
-		get_chain_name(chain, f->name, NFTLB_F_CHAIN_PRE_FILTER);
-		if (stype == SESSION_TYPE_STATIC) {
-			u_buf_concat(buf, " ; add rule %s %s %s ct mark set", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain);
-			run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
-			concat_exec_cmd(buf, " map @%s accept", map_str);
-		} else {
-			u_buf_concat(buf, " ; add rule %s %s %s ct state new ct mark set", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain);
-			run_farm_rules_gen_meta_param(buf, a->protocol, family, f->persistence, NFTLB_MAP_KEY_RULE);
-			concat_exec_cmd(buf, " map @%s", map_str);
-		}
-		break;
+		run_farm_nat(buf, n, family, action);
 	}
 
 	return 0;
 }
 
-static void run_farm_meter(struct u_buffer *buf, struct farm *f, int table_family, int family, int type, char *name, int action)
-{
-	switch (action) {
-	case ACTION_START:
-		u_buf_concat(buf, " ; add set %s %s %s { type %s ; flags dynamic ; ", print_nft_table_family(table_family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, name, print_nft_family_type(family));
+struct nft_fingerprint_stct {
+	unsigned long long	epoch;
+	unsigned int		changed;
+	unsigned int		unchanged;
+};
 
-		if (type == KEY_ELEMENTS)
-			u_buf_concat(buf, "counter ; ");
+static struct nft_fingerprint_stct st_fp;
 
-		// ct count doesn't require timeout as it is implemented implicitly
-		if (type != KEY_ESTCONNLIMIT &&
-			f->limitsttl)
-			u_buf_concat(buf, "timeout %ds; ", f->limitsttl);
-		concat_exec_cmd(buf, "} ;");
-		break;
-	case ACTION_STOP:
-		concat_exec_cmd(buf, " ; delete set %s %s %s ; ", print_nft_table_family(table_family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, name);
-		break;
-	default:
-		break;
+static unsigned long long nft_fingerprint_data(unsigned long long hash, const void *data, int len)
+{
+	const unsigned char *ptr = (const unsigned char *)data;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= ptr[i];
+		hash *= NFTLB_FNV_PRIME;
 	}
+
+	return hash;
 }
 
-static int run_farm_log_rate_limit(struct u_buffer *buf, struct nftst *n)
+static unsigned long long nft_fingerprint_int(unsigned long long hash, int value)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	char rtlimit_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	return nft_fingerprint_data(hash, &value, sizeof(value));
+}
 
-	if ((f && !f->logrtlimit) || (a && !a->logrtlimit))
-		return 0;
+static unsigned long long nft_fingerprint_str(unsigned long long hash, const char *str)
+{
+	if (!str)
+		str = "";
 
-	if (f) {
-		obj_print_rtlimit(rtlimit_str, f->logrtlimit, f->logrtlimit_unit);
-		u_buf_concat(buf, " limit rate %s", rtlimit_str);
-	}
+	return nft_fingerprint_data(hash, str, strlen(str) + 1);
+}
 
-	if (a) {
-		obj_print_rtlimit(rtlimit_str, a->logrtlimit, a->logrtlimit_unit);
-		u_buf_concat(buf, " limit rate %s", rtlimit_str);
-	}
+/* the epoch invalidates every fingerprint once the ruleset is reset */
+static unsigned long long nft_fingerprint_seed(void)
+{
+	return nft_fingerprint_data(NFTLB_FNV_OFFSET, &st_fp.epoch, sizeof(st_fp.epoch));
+}
 
-	return 0;
+static unsigned long long nft_fingerprint_policy_attrs(unsigned long long hash, struct policy *p)
+{
+	hash = nft_fingerprint_str(hash, p->name);
+	hash = nft_fingerprint_int(hash, p->type);
+	hash = nft_fingerprint_int(hash, p->route);
+	hash = nft_fingerprint_int(hash, p->family);
+	hash = nft_fingerprint_int(hash, p->timeout);
+	hash = nft_fingerprint_str(hash, p->logprefix);
+
+	return hash;
 }
 
-static void run_farm_rules_log_and_verdict(struct u_buffer *buf, struct nftst *n, int logrt, int flags, int verdict, int key, int chain)
+static unsigned long long nft_fingerprint_address_attrs(unsigned long long hash, struct address *a)
 {
-	char logprefix_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	hash = nft_fingerprint_str(hash, a->name);
+	hash = nft_fingerprint_str(hash, a->iface);
+	hash = nft_fingerprint_str(hash, a->iethaddr);
+	hash = nft_fingerprint_int(hash, a->ifidx);
+	hash = nft_fingerprint_str(hash, a->ipaddr);
+	hash = nft_fingerprint_str(hash, a->ports);
+	hash = nft_fingerprint_int(hash, a->family);
+	hash = nft_fingerprint_int(hash, a->protocol);
+	hash = nft_fingerprint_int(hash, a->verdict);
+	hash = nft_fingerprint_str(hash, a->logprefix);
+	hash = nft_fingerprint_int(hash, a->logrtlimit);
+	hash = nft_fingerprint_int(hash, a->logrtlimit_unit);
+
+	return hash;
+}
 
-	if (flags & VALUE_VERDICT_LOG) {
-		if (logrt) {
-			u_buf_concat(buf, " jump {");
-			run_farm_log_rate_limit(buf, n);
-		}
-		print_log_format(logprefix_str, key, chain, n);
-		u_buf_concat(buf, " log prefix \"%s\"", logprefix_str);
-		if (logrt) {
-			u_buf_concat(buf, " ;");
-		}
-	}
+static unsigned long long nft_fingerprint_sessions(unsigned long long hash, struct list_head *sessions)
+{
+	struct session *s;
 
-	u_buf_concat(buf, " %s", print_nft_verdict(flags, verdict));
+	list_for_each_entry(s, sessions, list) {
+		hash = nft_fingerprint_str(hash, s->client);
+		hash = nft_fingerprint_str(hash, s->bck ? s->bck->name : NULL);
+		hash = nft_fingerprint_str(hash, s->expiration);
+		hash = nft_fingerprint_int(hash, s->state);
+		hash = nft_fingerprint_int(hash, s->action);
+	}
 
-	if (flags & VALUE_VERDICT_LOG && logrt)
-		u_buf_concat(buf, "; }");
-	concat_exec_cmd(buf, "");
+	return hash;
 }
 
-static int run_farm_rules_filter_policies(struct u_buffer *buf, struct farm *f, int family, char *chain, int action)
+static unsigned long long nft_fingerprint_policy(struct policy *p)
 {
-	char meter_str[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char burst_str[NFTLB_MAX_OBJ_NAME] = { 0 };
-	struct nftst *n = nftst_create_from_farm(f);
-	char rtlimit_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	unsigned long long hash = nft_fingerprint_policy_attrs(nft_fingerprint_seed(), p);
+	struct element *e;
 
-	if ((action == ACTION_START || action == ACTION_RELOAD) && f->tcpstrict == VALUE_SWITCH_ON) {
-		u_buf_concat(buf, " ; add rule %s %s %s ct state invalid",
-						print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain);
-		run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, VALUE_TYPE_DENY, KEY_TCPSTRICT_LOGPREFIX, NFTLB_F_CHAIN_PRE_FILTER);
+	// the elements already applied are released along with the commit
+	list_for_each_entry(e, &p->elements, list) {
+		if (e->action == ACTION_NONE)
+			continue;
+		hash = nft_fingerprint_str(hash, e->data);
+		hash = nft_fingerprint_str(hash, e->time);
+		hash = nft_fingerprint_int(hash, e->action);
 	}
 
-	snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s", CONFIG_KEY_NEWRTLIMIT, f->name);
-	if ((action == ACTION_START && f->newrtlimit != DEFAULT_NEWRTLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_NEWRTLIMIT_START))
-		run_farm_meter(buf, f, family, family, KEY_NEWRTLIMIT, meter_str, ACTION_START);
-	if (((action == ACTION_STOP || action == ACTION_DELETE) && f->newrtlimit != DEFAULT_NEWRTLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_NEWRTLIMIT_STOP))
-		run_farm_meter(buf, f, family, family, KEY_NEWRTLIMIT, meter_str, ACTION_STOP);
-	if ((action == ACTION_START || action == ACTION_RELOAD) && f->newrtlimit != DEFAULT_NEWRTLIMIT) {
-		if (f->newrtlimitbst != DEFAULT_RTLIMITBURST)
-			snprintf(burst_str, NFTLB_MAX_OBJ_NAME, "burst %d packets ", f->newrtlimitbst);
-		//~ u_buf_concat(buf, " ; add rule %s %s %s ct state new add @%s { %s saddr limit rate over %s %s counter }",
-		obj_print_rtlimit(rtlimit_str, f->newrtlimit, f->newrtlimit_unit);
-		u_buf_concat(buf, " ; add rule %s %s %s ct state new add @%s { %s saddr limit rate over %s %s }",
-				   print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, meter_str, print_nft_family(family), rtlimit_str, burst_str);
-		run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, VALUE_TYPE_DENY, KEY_NEWRTLIMIT_LOGPREFIX, NFTLB_F_CHAIN_PRE_FILTER);
-	}
+	return hash;
+}
 
-	snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s", CONFIG_KEY_RSTRTLIMIT, f->name);
-	if ((action == ACTION_START && f->rstrtlimit != DEFAULT_RSTRTLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_RSTRTLIMIT_START))
-		run_farm_meter(buf, f, family, family, KEY_RSTRTLIMIT, meter_str, ACTION_START);
-	if (((action == ACTION_STOP || action == ACTION_DELETE) && f->rstrtlimit != DEFAULT_RSTRTLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_RSTRTLIMIT_STOP))
-		run_farm_meter(buf, f, family, family, KEY_RSTRTLIMIT, meter_str, ACTION_STOP);
-	if ((action == ACTION_START || action == ACTION_RELOAD) && f->rstrtlimit != DEFAULT_RSTRTLIMIT) {
-		if (f->rstrtlimitbst != DEFAULT_RTLIMITBURST)
-			snprintf(burst_str, NFTLB_MAX_OBJ_NAME, "burst %d packets ", f->rstrtlimitbst);
-		//~ u_buf_concat(buf, " ; add rule %s %s %s tcp flags rst add @%s { %s saddr limit rate over %s %s counter }",
-		obj_print_rtlimit(rtlimit_str, f->rstrtlimit, f->rstrtlimit_unit);
-		u_buf_concat(buf, " ; add rule %s %s %s tcp flags rst add @%s { %s saddr limit rate over %s %s }",
-				   print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, meter_str, print_nft_family(family), rtlimit_str, burst_str);
-		run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, VALUE_TYPE_DENY, KEY_RSTRTLIMIT_LOGPREFIX, NFTLB_F_CHAIN_PRE_FILTER);
+static unsigned long long nft_fingerprint_address(struct address *a)
+{
+	unsigned long long hash = nft_fingerprint_address_attrs(nft_fingerprint_seed(), a);
+	struct addresspolicy *ap;
+	struct farmaddress *fa;
+
+	list_for_each_entry(ap, &a->policies, list) {
+		hash = nft_fingerprint_int(hash, ap->action);
+		hash = nft_fingerprint_policy_attrs(hash, ap->policy);
 	}
 
-	snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s", CONFIG_KEY_ESTCONNLIMIT, f->name);
-	if ((action == ACTION_START && f->estconnlimit != DEFAULT_ESTCONNLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_ESTCONNLIMIT_START))
-		run_farm_meter(buf, f, family, family, KEY_ESTCONNLIMIT, meter_str, ACTION_START);
-	if (((action == ACTION_STOP || action == ACTION_DELETE) && f->estconnlimit != DEFAULT_ESTCONNLIMIT) || (action == ACTION_RELOAD && f->reload_action & VALUE_RLD_ESTCONNLIMIT_STOP))
-		run_farm_meter(buf, f, family, family, KEY_ESTCONNLIMIT, meter_str, ACTION_STOP);
-	if ((action == ACTION_START || action == ACTION_RELOAD) && f->estconnlimit != DEFAULT_ESTCONNLIMIT) {
-		//~ u_buf_concat(buf, " ; add rule %s %s %s ct state new add @%s { %s saddr ct count over %d counter }",
-		u_buf_concat(buf, " ; add rule %s %s %s ct state new add @%s { %s saddr ct count over %d }",
-						print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, meter_str, print_nft_family(family), f->estconnlimit);
-		run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, VALUE_TYPE_DENY, KEY_ESTCONNLIMIT_LOGPREFIX, NFTLB_F_CHAIN_PRE_FILTER);
+	list_for_each_entry(fa, &a->farms, address_list) {
+		hash = nft_fingerprint_int(hash, fa->action);
+		hash = nft_fingerprint_str(hash, fa->farm->name);
+		hash = nft_fingerprint_int(hash, fa->farm->action);
+		hash = nft_fingerprint_int(hash, fa->farm->mode);
+		hash = nft_fingerprint_int(hash, fa->farm->state);
 	}
 
-	if ((action == ACTION_START || action == ACTION_RELOAD) && f->queue != DEFAULT_QUEUE)
-		concat_exec_cmd(buf, " ; add rule %s %s %s tcp flags syn queue num %d bypass",
-						print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, f->queue);
-	return 0;
+	return hash;
 }
 
-static int run_farm_rules_gen_limits_per_bck(struct u_buffer *buf, struct farm *f, int family, char *chain, int action)
+static unsigned long long nft_fingerprint_farm(struct farm *f)
 {
+	unsigned long long hash = nft_fingerprint_seed();
+	struct farmaddress *fa;
+	struct farmpolicy *fp;
 	struct backend *b;
-	struct nftst *n = nftst_create_from_farm(f);
+	int attrs[] = {
+		f->ofidx, f->mode, f->responsettl, f->scheduler, f->schedparam, f->persistence, f->persistttl, f->persistsize,
+		f->helper, f->log, f->logrtlimit, f->logrtlimit_unit, f->mark, f->state, f->priority, f->limitsttl,
+		f->newrtlimit, f->newrtlimit_unit, f->newrtlimitbst, f->rstrtlimit, f->rstrtlimit_unit, f->rstrtlimitbst,
+		f->estconnlimit, f->tcpstrict, f->queue, f->verdict, f->flow_offload, f->intra_connect,
+	};
+
+	hash = nft_fingerprint_str(hash, f->name);
+	hash = nft_fingerprint_str(hash, f->oface);
+	hash = nft_fingerprint_str(hash, f->oethaddr);
+	hash = nft_fingerprint_str(hash, f->srcaddr);
+	hash = nft_fingerprint_str(hash, f->logprefix);
+	hash = nft_fingerprint_str(hash, f->newrtlimit_logprefix);
+	hash = nft_fingerprint_str(hash, f->rstrtlimit_logprefix);
+	hash = nft_fingerprint_str(hash, f->estconnlimit_logprefix);
+	hash = nft_fingerprint_str(hash, f->tcpstrict_logprefix);
+	hash = nft_fingerprint_data(hash, attrs, sizeof(attrs));
 
 	list_for_each_entry(b, &f->backends, list) {
-		if (b->estconnlimit == 0)
-			continue;
+		hash = nft_fingerprint_str(hash, b->name);
+		hash = nft_fingerprint_str(hash, b->ipaddr);
+		hash = nft_fingerprint_str(hash, b->ethaddr);
+		hash = nft_fingerprint_int(hash, b->ofidx);
+		hash = nft_fingerprint_str(hash, b->oface);
+		hash = nft_fingerprint_str(hash, b->port);
+		hash = nft_fingerprint_str(hash, b->srcaddr);
+		hash = nft_fingerprint_int(hash, b->weight);
+		hash = nft_fingerprint_int(hash, b->priority);
+		hash = nft_fingerprint_int(hash, b->mark);
+		hash = nft_fingerprint_int(hash, b->estconnlimit);
+		hash = nft_fingerprint_str(hash, b->estconnlimit_logprefix);
+		hash = nft_fingerprint_int(hash, b->state);
+	}
 
-		if ((b->action == ACTION_STOP && !backend_is_usable(b)) || (action == ACTION_STOP || action == ACTION_DELETE))
-			continue;
+	list_for_each_entry(fa, &f->addresses, list) {
+		hash = nft_fingerprint_int(hash, fa->action);
+		hash = nft_fingerprint_address_attrs(hash, fa->address);
+	}
 
-		nftst_set_backend(n, b);
-		u_buf_concat(buf, " ; add rule %s %s %s ct mark 0x%x ct count over %d",
-						print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, backend_get_mark(b), b->estconnlimit);
-		run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, VALUE_TYPE_DENY, KEY_ESTCONNLIMIT_LOGPREFIX, NFTLB_F_CHAIN_PRE_FILTER);
+	// the farms filter the traffic with the sets of their policies
+	list_for_each_entry(fp, &f->policies, list) {
+		hash = nft_fingerprint_int(hash, fp->action);
+		hash = nft_fingerprint_policy_attrs(hash, fp->policy);
 	}
 
-	return 0;
+	hash = nft_fingerprint_sessions(hash, &f->static_sessions);
+	hash = nft_fingerprint_sessions(hash, &f->timed_sessions);
+
+	return hash;
 }
 
-static int run_farm_rules_filter_marks(struct u_buffer *buf, struct nftst *n, int family, char *chain, int action)
+/*
+ * The fingerprint covers the inputs of the object rules and is checked
+ * before generating them, so an object that is the same as when its rules
+ * were last applied only gets its pending actions cleared, leaving the
+ * counters and the chains untouched. Starting or stopping the object
+ * always regenerates it.
+ */
+static int nft_fingerprint_skip(unsigned long long hash, unsigned long long fingerprint, int action, char *name)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct backend *b;
+	if (serialize || (action != ACTION_RELOAD && action != ACTION_NONE) || hash != fingerprint) {
+		st_fp.changed++;
+		return 0;
+	}
 
-	int mark = farm_get_mark(f);
+	u_log_print(LOG_DEBUG, "%s():%d: rules of %s unchanged, skipping commit", __FUNCTION__, __LINE__, name);
+	st_fp.unchanged++;
 
-	if (action == ACTION_START || action == ACTION_RELOAD) {
-		if (f->bcks_available) {
-			u_buf_concat(buf, " ; add rule %s %s %s ct state new ct mark 0x0 ct mark set", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain);
-			if (f->scheduler == VALUE_SCHED_SYMHASH && f->bcks_available == 1) { // FIXME: Control bug in nftables
-				list_for_each_entry(b, &f->backends, list) {
-					if (!backend_is_available(b))
-						continue;
-					u_buf_concat(buf, " 0x%x", backend_get_mark(b));
-				}
-			} else {
-				if (run_farm_rules_gen_sched(buf, n, family) == -1)
-					return -1;
-				run_farm_rules_gen_bck_map(buf, n, BCK_MAP_WEIGHT, BCK_MAP_MARK, NFTLB_CHECK_AVAIL);
-			}
-			run_farm_rules_gen_limits_per_bck(buf, f, family, chain, action);
-		} else if (mark != DEFAULT_MARK) {
-			u_buf_concat(buf, " ; add rule %s %s %s ct state new ct mark 0x0 ct mark set 0x%x", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_FILTER), NFTLB_TABLE_NAME, chain, mark);
-		}
-	} else if (action == ACTION_STOP || action == ACTION_DELETE || (action == ACTION_RELOAD && f->bcks_usable == 0)) {
-		run_farm_rules_gen_limits_per_bck(buf, f, family, chain, action);
-	}
-	concat_exec_cmd(buf, "");
+	return 1;
+}
 
-	return 0;
+/* the inputs once the rules are generated and the actions cleared */
+static void nft_fingerprint_set(unsigned long long *fingerprint, unsigned long long hash, int action)
+{
+	if (action == ACTION_STOP || action == ACTION_DELETE)
+		hash = 0;
+
+	*fingerprint = hash;
 }
 
-static int run_farm_rules_filter(struct u_buffer *buf, struct nftst *n, int family, int action)
+static void nft_fingerprint_invalidate(void)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
-	int need = need_filter(f);
-	int naction = nftst_get_action(n);
+	st_fp.epoch++;
+}
 
-	if (!need && f->reload_action == VALUE_RLD_NONE)
-		return 0;
+void nft_fingerprint_reset(void)
+{
+	st_fp.changed = 0;
+	st_fp.unchanged = 0;
+}
 
-	get_chain_name(chain, f->name, NFTLB_F_CHAIN_PRE_FILTER);
+int nft_fingerprint_unchanged(void)
+{
+	return st_fp.unchanged && !st_fp.changed;
+}
 
-	if (action == ACTION_RELOAD && need && (STATEFUL_RLD_START(f->reload_action)))
-		action = ACTION_RELOAD;
+int nft_reset(void)
+{
+	struct u_buffer buf;
+	int ret = 0;
 
-	if (action == ACTION_RELOAD && !need && (STATEFUL_RLD_STOP(f->reload_action)))
-		action = ACTION_STOP;
+	u_buf_create(&buf);
 
-	switch (action) {
-	case ACTION_START:
-	case ACTION_RELOAD:
-		run_base_table(buf, NFTLB_F_CHAIN_PRE_FILTER, family, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_FILTER, family, get_rules_needed(a), action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_FILTER, family, naction, action);
-		run_farm_rules_filter_policies(buf, f, family, chain, action);
-		if (f->mode != VALUE_MODE_LOCAL) {
-			run_farm_rules_filter_helper(buf, n, family, chain, action);
-			run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
-			run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
-			run_farm_manage_sessions(buf, f, SESSION_TYPE_STATIC, family, action);
-			run_farm_manage_sessions(buf, f, SESSION_TYPE_TIMED, family, action);
-			run_farm_rules_check_sessions(buf, n, SESSION_TYPE_STATIC, family, NFTLB_F_CHAIN_PRE_FILTER, action);
-			run_farm_rules_check_sessions(buf, n, SESSION_TYPE_TIMED, family, NFTLB_F_CHAIN_PRE_FILTER, action);
-			run_farm_rules_filter_marks(buf, n, family, chain, action);
-			run_farm_rules_update_sessions(buf, n, family, chain, action);
-		}
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_FILTER, family, naction, action);
-		if (f->mode != VALUE_MODE_LOCAL) {
-			run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
-			run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
-			run_farm_rules_filter_marks(buf, n, family, chain, action);
-			run_farm_rules_filter_helper(buf, n, family, chain, action);
-		}
-		run_farm_rules_filter_policies(buf, f, family, chain, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_FILTER, family, get_rules_needed(a), action);
-		break;
-	default:
-		break;
-	}
+	if (nft_base_rules.dnat_rules_v4 ||
+	    nft_base_rules.snat_rules_v4 ||
+	    nft_base_rules.filter_rules_v4 ||
+	    nft_base_rules.fwd_rules_v4 ||
+	    nft_base_rules.out_filter_rules_v4 ||
+	    nft_base_rules.out_nat_rules_v4)
+		nft_table_handler(&buf, print_nft_family(VALUE_FAMILY_IPV4), ACTION_DELETE);
+
+	if (nft_base_rules.dnat_rules_v6 ||
+	    nft_base_rules.snat_rules_v6 ||
+	    nft_base_rules.filter_rules_v6 ||
+	    nft_base_rules.fwd_rules_v6 ||
+	    nft_base_rules.out_filter_rules_v6 ||
+	    nft_base_rules.out_nat_rules_v6)
+		nft_table_handler(&buf, print_nft_family(VALUE_FAMILY_IPV6), ACTION_DELETE);
+
+	if (nft_base_rules.ndv_ingress_rules.n_interfaces ||
+		nft_base_rules.ndv_ingress_dnat_rules.n_interfaces ||
+		nft_base_rules.ndv_ingress_policies)
+		nft_table_handler(&buf, print_nft_family(VALUE_FAMILY_NETDEV), ACTION_DELETE);
+
+	exec_cmd(u_buf_get_data(&buf));
+	u_buf_clean(&buf);
+	clean_rules_counters();
+
+	farm_s_clean_nft_chains();
+	address_s_clean_nft_chains();
+	nft_fingerprint_invalidate();
+
+	// the farms generated ahead have to be generated again from scratch
+	nft_rulerize_farms_release();
+
+	return ret;
+}
+
+int nft_check_tables(void)
+{
+	char cmd[NFTLB_MAX_OBJ_NAME] = { 0 };
+	const char *buf;
+
+	snprintf(cmd, NFTLB_MAX_OBJ_NAME, "list table %s %s", NFTLB_IPV4_FAMILY_STR, NFTLB_TABLE_NAME);
+	if (exec_cmd_list_terse(cmd, &buf) == 0)
+		nft_base_rules.dnat_rules_v4 = 1;
+
+	snprintf(cmd, NFTLB_MAX_OBJ_NAME, "list table %s %s", NFTLB_IPV6_FAMILY_STR, NFTLB_TABLE_NAME);
+	if (exec_cmd_list_terse(cmd, &buf) == 0)
+		nft_base_rules.dnat_rules_v6 = 1;
+
+	snprintf(cmd, NFTLB_MAX_OBJ_NAME, "list table %s %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME);
+	if (exec_cmd_list_terse(cmd, &buf) == 0)
+		nft_base_rules.ndv_ingress_rules.n_interfaces = 1;
 
-	return 0;
+	return nft_base_rules.dnat_rules_v4 ||
+		   nft_base_rules.dnat_rules_v6 ||
+		   nft_base_rules.ndv_ingress_rules.n_interfaces;
 }
 
-static int get_farm_interfaces(struct nftst *n, char *list)
+static char *nft_warm_kinds[] = { "chain", "map", "set", "flowtable", "ct helper", NULL };
+
+static unsigned int get_table_active(char *family)
 {
-	struct backend *b;
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	int number = 0;
-	char *p = NULL;
+	if (strcmp(family, NFTLB_IPV4_FAMILY_STR) == 0)
+		return NFTLB_TABLE_IP_ACTIVE;
+	if (strcmp(family, NFTLB_IPV6_FAMILY_STR) == 0)
+		return NFTLB_TABLE_IP6_ACTIVE;
+	return NFTLB_TABLE_NETDEV_ACTIVE;
+}
 
-	if (a->iface) {
-		strcat(list, a->iface);
-		number++;
-	}
+static void nft_warm_add_obj(char *kind, char *family, char *name, int len)
+{
+	struct nft_warm_obj *objs;
 
-	if (f->oface && !(p = strstr(list, f->oface))) {
-		if (number)
-			strcat(list, ", ");
-		strcat(list, f->oface);
-		number++;
-	}
+	objs = (struct nft_warm_obj *)realloc(st_warm.objs, (st_warm.total + 1) * sizeof(struct nft_warm_obj));
+	if (!objs)
+		return;
 
-	list_for_each_entry(b, &f->backends, list) {
-		if (b->oface && !(p = strstr(list, b->oface))) {
-			if (number)
-				strcat(list, ", ");
-			strcat(list, b->oface);
-			number++;
+	st_warm.objs = objs;
+	st_warm.objs[st_warm.total].name = strndup(name, len);
+	if (!st_warm.objs[st_warm.total].name)
+		return;
+	st_warm.objs[st_warm.total].kind = kind;
+	st_warm.objs[st_warm.total].family = family;
+	st_warm.total++;
+}
+
+/* collect the "<kind> <name> {" declarations of a table listing */
+static void nft_warm_parse_table(char *family, const char *list)
+{
+	const char *line, *end, *name;
+	int i, klen, len;
+
+	for (line = list; line && *line != '\0'; line = end ? end + 1 : NULL) {
+		end = strchr(line, '\n');
+		while (*line == '\t' || *line == ' ')
+			line++;
+
+		for (i = 0; nft_warm_kinds[i]; i++) {
+			klen = strlen(nft_warm_kinds[i]);
+			if (strncmp(line, nft_warm_kinds[i], klen) != 0 || line[klen] != ' ')
+				continue;
+
+			name = line + klen + 1;
+			len = strcspn(name, " \n");
+			if (strncmp(name + len, " {", 2) == 0 && (name[len + 2] == '\n' || name[len + 2] == '\0'))
+				nft_warm_add_obj(nft_warm_kinds[i], family, (char *)name, len);
+			break;
 		}
 	}
+}
 
-	return number;
+static void nft_warm_clean(void)
+{
+	int i;
+
+	for (i = 0; i < st_warm.total; i++)
+		free(st_warm.objs[i].name);
+	if (st_warm.objs)
+		free(st_warm.objs);
+
+	st_warm.objs = NULL;
+	st_warm.total = 0;
+	st_warm.tables = 0;
+	st_warm.pending = 0;
 }
 
-static void run_farm_flowtable(struct u_buffer *buf, struct nftst *n, int family, char *name, int action)
+/*
+ * Adopt the existing nftlb tables instead of deleting them. The first commit
+ * flushes their rules and the static maps and sets, and regenerates them in a
+ * single transaction. The persistence maps and the meters still declared by
+ * the configuration keep their elements.
+ */
+int nft_warm_start(void)
 {
-	char interfaces[NFTLB_MAX_OBJ_NAME] = { 0 };
-	struct farm *f = nftst_get_farm(n);
+	char *families[] = { NFTLB_IPV4_FAMILY_STR, NFTLB_IPV6_FAMILY_STR, NFTLB_NETDEV_FAMILY_STR, NULL };
+	char cmd[NFTLB_MAX_OBJ_NAME] = { 0 };
+	const char *list;
+	int i;
 
-	if (!farm_needs_flowtable(f) || !get_farm_interfaces(n, interfaces))
-		return;
+	nft_warm_clean();
 
-	switch (action) {
-	case ACTION_START:
-		concat_exec_cmd(buf, " ; add flowtable %s %s %s { hook %s priority %d ; devices = { %s } ; } ;", print_nft_table_family(family, NFTLB_F_CHAIN_FWD_FILTER), NFTLB_TABLE_NAME, name, NFTLB_HOOK_INGRESS, nftlb_flowtable_prio++, interfaces);
-		break;
-	case ACTION_STOP:
-	case ACTION_DELETE:
-		concat_exec_cmd(buf, " ; delete flowtable %s %s %s ; ", print_nft_table_family(family, NFTLB_F_CHAIN_FWD_FILTER), NFTLB_TABLE_NAME, name);
-		nftlb_flowtable_prio--;
-		break;
-	default:
-		break;
+	for (i = 0; families[i]; i++) {
+		snprintf(cmd, NFTLB_MAX_OBJ_NAME, "list table %s %s", families[i], NFTLB_TABLE_NAME);
+		if (exec_cmd_list_terse(cmd, &list) != 0 || !list)
+			continue;
+		st_warm.tables |= get_table_active(families[i]);
+		nft_warm_parse_table(families[i], list);
 	}
-	return;
+
+	clean_rules_counters();
+	st_warm.pending = (st_warm.tables != 0);
+
+	u_log_print(LOG_INFO, "%s():%d: warm start adopting %d objects of the existing tables", __FUNCTION__, __LINE__, st_warm.total);
+
+	return 0;
 }
 
-static void run_farm_gen_flowtable_rules(struct u_buffer *buf, struct nftst *n, int family, char *chain, char *name, int action)
+static int nft_warm_is_farm_obj(const char *name, const char *key, struct farm *f)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
+	char meter_str[NFTLB_MAX_OBJ_NAME] = { 0 };
 
-	if (!farm_needs_flowtable(f) || !a->iface)
-		return;
+	snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s", key, f->name);
+	return strcmp(name, meter_str) == 0;
+}
 
-	concat_exec_cmd(buf, " ; add rule %s %s %s flow add @%s", print_nft_table_family(family, NFTLB_F_CHAIN_FWD_FILTER), NFTLB_TABLE_NAME, chain, name);
-	return;
+/* the persistence maps and the meters of the configured farms are filled from the packet path */
+static int nft_warm_is_kept(const char *name)
+{
+	struct list_head *farms = obj_get_farms();
+	char meter_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	struct farmpolicy *fp;
+	struct farm *f;
+
+	list_for_each_entry(f, farms, list) {
+		if (f->persistence != VALUE_META_NONE && nft_warm_is_farm_obj(name, "persist", f))
+			return 1;
+		if (f->newrtlimit != DEFAULT_NEWRTLIMIT && nft_warm_is_farm_obj(name, CONFIG_KEY_NEWRTLIMIT, f))
+			return 1;
+		if (f->rstrtlimit != DEFAULT_RSTRTLIMIT && nft_warm_is_farm_obj(name, CONFIG_KEY_RSTRTLIMIT, f))
+			return 1;
+		if (f->estconnlimit != DEFAULT_ESTCONNLIMIT && nft_warm_is_farm_obj(name, CONFIG_KEY_ESTCONNLIMIT, f))
+			return 1;
+		list_for_each_entry(fp, &f->policies, list) {
+			snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s-cnt", fp->policy->name, f->name);
+			if (strcmp(name, meter_str) == 0)
+				return 1;
+		}
+	}
+
+	return 0;
 }
 
-static int run_farm_rules_forward(struct u_buffer *buf, struct nftst *n, int family, int action)
+static void nft_warm_begin(struct u_buffer *buf)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	int naction = nftst_get_action(n);
-	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char flowtable[NFTLB_MAX_OBJ_NAME] = { 0 };
+	char *families[] = { NFTLB_IPV4_FAMILY_STR, NFTLB_IPV6_FAMILY_STR, NFTLB_NETDEV_FAMILY_STR, NULL };
+	int i;
 
-	if (!need_forward(f))
-		return 0;
+	for (i = 0; families[i]; i++) {
+		if (st_warm.tables & get_table_active(families[i]))
+			u_buf_concat(buf, " ; flush table %s %s", families[i], NFTLB_TABLE_NAME);
+	}
 
-	get_chain_name(chain, f->name, NFTLB_F_CHAIN_FWD_FILTER);
-	get_flowtable_name(flowtable, f);
+	// the elements generated from the configuration are added again
+	for (i = 0; i < st_warm.total; i++) {
+		if ((strcmp(st_warm.objs[i].kind, "map") == 0 || strcmp(st_warm.objs[i].kind, "set") == 0) &&
+			!nft_warm_is_kept(st_warm.objs[i].name))
+			u_buf_concat(buf, " ; flush %s %s %s %s", st_warm.objs[i].kind, st_warm.objs[i].family, NFTLB_TABLE_NAME, st_warm.objs[i].name);
+	}
+}
 
-	switch (action) {
-	case ACTION_START:
-		run_base_table(buf, NFTLB_F_CHAIN_FWD_FILTER, family, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, get_rules_needed(a), action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, naction, action);
-		run_farm_gen_log_rules(buf, f, family, chain, VALUE_LOG_FORWARD, NFTLB_F_CHAIN_FWD_FILTER, action);
-		run_farm_flowtable(buf, n, family, flowtable, action);
-		run_farm_gen_flowtable_rules(buf, n, family, chain, flowtable, action);
-		break;
-	case ACTION_RELOAD:
-		run_base_table(buf, NFTLB_F_CHAIN_FWD_FILTER, family, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, get_rules_needed(a), action);
+/* index the objects declared by the generated commands as "<kind> <family> <name>" */
+static void nft_warm_index(struct u_hash *declared, char *cmds)
+{
+	char key[NFTLB_MAX_OBJ_NAME * 3];
+	char family[NFTLB_MAX_OBJ_NAME];
+	char name[NFTLB_MAX_OBJ_NAME];
+	char *ptr;
+	int i, klen;
+
+	for (ptr = strstr(cmds, "add "); ptr; ptr = strstr(ptr, "add ")) {
+		ptr += strlen("add ");
+		for (i = 0; nft_warm_kinds[i]; i++) {
+			klen = strlen(nft_warm_kinds[i]);
+			if (strncmp(ptr, nft_warm_kinds[i], klen) != 0 || ptr[klen] != ' ')
+				continue;
+			if (sscanf(ptr + klen, " %255s " NFTLB_TABLE_NAME " %255[^ ;{]", family, name) == 2) {
+				snprintf(key, sizeof(key), "%s %s %s", nft_warm_kinds[i], family, name);
+				if (!u_hash_lookup(declared, key))
+					u_hash_add(declared, key, declared);
+			}
+			break;
+		}
+	}
+}
 
-		run_nftst_rules_gen_chain(buf, n, family, NFTLB_F_CHAIN_FWD_FILTER, ACTION_RELOAD);
-		run_nftst_rules_gen_srv_map_by_protocol(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, ACTION_RELOAD);
+/* delete the adopted objects and tables that the configuration doesn't declare anymore */
+static void nft_warm_reconcile(struct u_buffer *buf)
+{
+	char *families[] = { NFTLB_IPV4_FAMILY_STR, NFTLB_IPV6_FAMILY_STR, NFTLB_NETDEV_FAMILY_STR, NULL };
+	char key[NFTLB_MAX_OBJ_NAME * 3];
+	struct nft_warm_obj *o;
+	struct u_hash declared;
+	int i, k, stale = 0;
+
+	u_hash_init(&declared);
+	nft_warm_index(&declared, u_buf_get_data(buf));
+
+	// rules were flushed, so the chains go first and then the objects they used
+	for (k = 0; nft_warm_kinds[k]; k++) {
+		for (i = 0; i < st_warm.total; i++) {
+			o = &st_warm.objs[i];
+			if (o->kind != nft_warm_kinds[k] || !(nft_base_rules.tables & get_table_active(o->family)))
+				continue;
+			snprintf(key, sizeof(key), "%s %s %s", o->kind, o->family, o->name);
+			if (u_hash_lookup(&declared, key))
+				continue;
+			u_buf_concat(buf, " ; delete %s %s %s %s", o->kind, o->family, NFTLB_TABLE_NAME, o->name);
+			stale++;
+		}
+	}
 
-		run_farm_gen_log_rules(buf, f, family, chain, VALUE_LOG_FORWARD, NFTLB_F_CHAIN_FWD_FILTER, action);
-		run_farm_gen_flowtable_rules(buf, n, family, chain, flowtable, action);
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, naction, action);
-		run_farm_flowtable(buf, n, family, flowtable, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_FWD_FILTER, family, get_rules_needed(a), action);
-		break;
-	default:
-		break;
+	for (i = 0; families[i]; i++) {
+		if ((st_warm.tables & get_table_active(families[i])) && !(nft_base_rules.tables & get_table_active(families[i]))) {
+			u_buf_concat(buf, " ; delete table %s %s", families[i], NFTLB_TABLE_NAME);
+			stale++;
+		}
 	}
 
-	return 0;
+	u_hash_clean(&declared);
+
+	u_log_print(LOG_INFO, "%s():%d: warm start replacing the adopted tables, %d stale objects deleted", __FUNCTION__, __LINE__, stale);
 }
 
-static int run_farm_rules_output(struct u_buffer *buf, struct nftst *n, int family, int action)
+static void concat_set_element(struct nft_elem_block *blk, struct policy *p, int cmd, char *data)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	int naction = nftst_get_action(n);
+	/* elements the netlink batch can't take go through the nft command */
+	if (nlbatch_enabled() && !serialize &&
+		nlbatch_elem_append(cmd, NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name, p->family, data) == 0)
+		return;
 
-	if (!need_output(f))
+	elem_block_concat(blk, "%s", data);
+}
+
+static int run_set_elements(struct u_buffer *buf, struct policy *p)
+{
+	struct nft_elem_block add, del;
+	struct element *e;
+
+	if (!p->total_elem)
 		return 0;
 
-	switch (action) {
+	elem_block_init(&add, buf, " ; %s element %s %s %s {", NFTLB_NFT_ACTION_ADD, NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name);
+	elem_block_init(&del, buf, " ; %s element %s %s %s {", NFTLB_NFT_ACTION_DEL, NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name);
+
+	switch (p->action) {
 	case ACTION_START:
-		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, get_rules_needed(a), action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, naction, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, get_rules_needed(a), action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, naction, action);
+		list_for_each_entry(e, &p->elements, list) {
+			concat_set_element(&add, p, NLBATCH_ELEM_ADD, e->data);
+			e->action = ACTION_NONE;
+		}
+		elem_block_end(&add);
 		break;
+	case ACTION_FLUSH:
+		concat_exec_cmd(buf, " ; flush set %s %s %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name);
+		/* fallthrough */
 	case ACTION_RELOAD:
-		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, get_rules_needed(a), action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, naction, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, get_rules_needed(a), action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, naction, action);
+		list_for_each_entry(e, &p->elements, list) {
+			if (e->action != ACTION_START)
+				continue;
+			concat_set_element(&add, p, NLBATCH_ELEM_ADD, e->data);
+			e->action = ACTION_NONE;
+		}
+		elem_block_end(&add);
+
+		list_for_each_entry(e, &p->elements, list) {
+			if (e->action != ACTION_DELETE && e->action != ACTION_STOP)
+				continue;
+			concat_set_element(&del, p, NLBATCH_ELEM_DEL, e->data);
+			e->action = ACTION_NONE;
+		}
+		elem_block_end(&del);
 		break;
 	case ACTION_DELETE:
 	case ACTION_STOP:
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, naction, action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, naction, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_FILTER, family, get_rules_needed(a), action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_OUT_DNAT, family, get_rules_needed(a), action);
+		list_for_each_entry(e, &p->elements, list) {
+			concat_set_element(&del, p, NLBATCH_ELEM_DEL, e->data);
+			e->action = ACTION_NONE;
+		}
+		elem_block_end(&del);
 		break;
 	default:
 		break;
@@ -2519,638 +5041,763 @@ static int run_farm_rules_output(struct u_buffer *buf, struct nftst *n, int fami
 	return 0;
 }
 
-static int run_farm_rules_ingress_policies(struct u_buffer *buf, struct farm *f, char *chain, int action)
+static int run_set_farm_policies(struct u_buffer *buf, struct policy *p)
 {
 	struct farmpolicy *fp;
 	char meter_str[NFTLB_MAX_OBJ_NAME] = { 0 };
-	struct nftst *n = nftst_create_from_farm(f);
-
-	list_for_each_entry(fp, &f->policies, list) {
-		nftst_set_policy(n, fp->policy);
-		snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s-cnt", fp->policy->name, f->name);
-		if ((fp->action == ACTION_RELOAD && f->policies_action == ACTION_RELOAD) ||
-			(action == ACTION_START && f->policies_action != ACTION_RELOAD) ||
-			(action == ACTION_RELOAD && f->policies_action == ACTION_START) ||
-			(fp->action == ACTION_START && f->policies_action == ACTION_RELOAD)) {
-			run_farm_meter(buf, f, VALUE_FAMILY_NETDEV, fp->policy->family, KEY_ELEMENTS, meter_str, ACTION_START);
-			nftst_set_policy(n, fp->policy);
 
-		} else if (((action == ACTION_STOP || action == ACTION_DELETE) && f->policies_action != ACTION_RELOAD) ||
-					(action == ACTION_RELOAD && f->policies_action == ACTION_STOP) ||
-					(fp->action == ACTION_STOP && f->policies_action == ACTION_RELOAD)) {
-			run_farm_meter(buf, f, VALUE_FAMILY_NETDEV, fp->policy->family, KEY_ELEMENTS, meter_str, ACTION_STOP);
-		}
+	if (!p->used)
+		return 0;
 
-		if ((fp->action == ACTION_NONE && (f->policies_action == ACTION_RELOAD || f->policies_action == ACTION_START)) ||
-			(fp->action == ACTION_START && (f->policies_action == ACTION_RELOAD || f->policies_action == ACTION_START)) ||
-			(fp->action == ACTION_RELOAD && f->policies_action == ACTION_RELOAD)) {
-			u_buf_concat(buf, " ; add rule %s %s %s %s saddr @%s add @%s { %s saddr }",
-							NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, chain, print_nft_family(fp->policy->family), fp->policy->name, meter_str, print_nft_family(fp->policy->family));
-			run_farm_rules_log_and_verdict(buf, n, f->logrtlimit, f->verdict, fp->policy->type, KEY_LOGPREFIX, NFTLB_F_CHAIN_ING_FILTER);
+	list_for_each_entry(fp, &p->farms, policy_list) {
+		snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s-cnt", p->name, fp->farm->name);
+		switch (p->action) {
+		case ACTION_FLUSH:
+			concat_exec_cmd(buf, " ; flush set %s %s %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, meter_str);
+			break;
+		case ACTION_STOP:
+		case ACTION_DELETE:
+		case ACTION_START:
+		default:
+			break;
 		}
-
-		fp->action = ACTION_NONE;
 	}
 
 	return 0;
 }
 
-static int run_nftst_rules_ingress_policies(struct u_buffer *buf, struct nftst *n, char *chain, int action)
+static int run_policy_set(struct u_buffer *buf, struct policy *p)
 {
-	struct address *a = nftst_get_address(n);
-	struct addresspolicy *ap;
+	switch (p->action) {
+	case ACTION_START:
+		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_START);
+		concat_exec_cmd(buf, " ; add set %s %s %s { type %s ; flags interval ; auto-merge ; counter ; }", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name, print_nft_family_type(p->family));
+		nft_base_rules.ndv_ingress_policies++;
+		run_set_elements(buf, p);
+		break;
+	case ACTION_RELOAD:
+		run_set_elements(buf, p);
+		break;
+	case ACTION_FLUSH:
+		run_set_elements(buf, p);
+		run_set_farm_policies(buf, p);
+		break;
+	case ACTION_STOP:
+	case ACTION_DELETE:
+		concat_exec_cmd(buf, " ; delete set %s %s %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name);
+
+		if (nft_base_rules.ndv_ingress_policies > 0)
+			nft_base_rules.ndv_ingress_policies--;
+		if (nft_base_rules.ndv_ingress_policies == 0)
+			run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_DELETE);
+		break;
+	case ACTION_NONE:
+	default:
+		break;
+	}
 
-	if (a->policies_action != ACTION_START && a->policies_action != ACTION_RELOAD && action != ACTION_RELOAD)
-		return 0;
+	p->action = ACTION_NONE;
 
-	list_for_each_entry(ap, &a->policies, list) {
-		u_buf_concat(buf, " ; add rule %s %s %s %s saddr @%s",
-						NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, chain, print_nft_family(ap->policy->family), ap->policy->name);
-		run_farm_rules_log_and_verdict(buf, n, a->logrtlimit, a->verdict, ap->policy->type, KEY_LOGPREFIX, NFTLB_F_CHAIN_ING_FILTER);
-		ap->action = ACTION_NONE;
-	}
+	print_service_counters();
+	print_nft_base_rules();
 
 	return 0;
 }
 
-static void get_farm_rules_nat_params(struct u_buffer *buf, int family, int mode)
+static int nft_txn_active(void)
 {
-	switch (mode) {
-	case BCK_MAP_IPADDR_PORT:
-		u_buf_concat(buf, " %s addr . port", print_nft_family(family));
-		break;
-	default:
-		break;
-	}
+	return nft_txn.depth > 0 && !serialize;
 }
 
-static int run_farm_rules_gen_nat(struct u_buffer *buf, struct nftst *n, int family, int type, int action)
+static void nft_txn_save(int *field)
 {
-	struct farm *f = nftst_get_farm(n);
-	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
-	int bck_map_data = BCK_MAP_IPADDR;
-
-	if (f->bcks_usable == 0)
-		return 0;
-
-	get_chain_name(chain, f->name, type);
+	struct nft_txn_log *log = &nft_txn.log;
+	struct nft_txn_field *undo;
+	int size;
+
+	if (log->undo_len == log->undo_size) {
+		size = log->undo_size ? log->undo_size * 2 : NFTLB_TXN_UNDO_SIZE;
+		undo = (struct nft_txn_field *)realloc(log->undo, size * sizeof(struct nft_txn_field));
+		if (!undo) {
+			u_log_print(LOG_ERR, "%s():%d: unable to allocate the transaction undo log", __FUNCTION__, __LINE__);
+			return;
+		}
+		log->undo = undo;
+		log->undo_size = size;
+	}
 
-	switch (f->mode) {
-	case VALUE_MODE_DSR:
-		run_farm_rules_check_sessions(buf, n, SESSION_TYPE_STATIC, family, NFTLB_F_CHAIN_ING_FILTER, action);
-		run_farm_rules_check_sessions(buf, n, SESSION_TYPE_TIMED, family, NFTLB_F_CHAIN_ING_FILTER, action);
+	log->undo[log->undo_len].field = field;
+	log->undo[log->undo_len].value = *field;
+	log->undo_len++;
+}
 
-		if (f->bcks_available) {
-			u_buf_concat(buf, " ; add rule %s %s %s", print_nft_table_family(family, NFTLB_F_CHAIN_ING_FILTER), NFTLB_TABLE_NAME, chain);
-			run_farm_log_prefix(buf, f, VALUE_LOG_INPUT, NFTLB_F_CHAIN_ING_FILTER, ACTION_START);
-			// TODO: support of different output interfaces per backend during saddr
-			u_buf_concat(buf, " ether saddr set %s ether daddr set", f->oethaddr);
-			run_farm_rules_gen_sched(buf, n, family);
-			run_farm_rules_gen_bck_map(buf, n, BCK_MAP_WEIGHT, BCK_MAP_ETHADDR, NFTLB_CHECK_AVAIL);
-			run_farm_rules_update_sessions(buf, n, family, chain, action);
-			run_farm_log_prefix(buf, f, VALUE_LOG_OUTPUT, NFTLB_F_CHAIN_ING_DNAT, ACTION_START);
-			u_buf_concat(buf, " fwd to");
-			if (f->bcks_have_if) {
-				u_buf_concat(buf, " ether daddr");
-				run_farm_rules_gen_bck_map(buf, n, BCK_MAP_ETHADDR, BCK_MAP_OFACE, NFTLB_CHECK_AVAIL);
-			} else
-				u_buf_concat(buf, " %s", f->oface);
-		}
-		concat_exec_cmd(buf, "");
-		break;
-	case VALUE_MODE_STLSDNAT:
-		snprintf(map_str, NFTLB_MAX_OBJ_NAME, "map-%s-back", f->name);
-		concat_exec_cmd(buf, " ; add rule %s %s %s update @%s { %s saddr : ether saddr }", print_nft_table_family(family, NFTLB_F_CHAIN_ING_FILTER), NFTLB_TABLE_NAME, chain, map_str, print_nft_family(family));
+static void nft_txn_save_farm(struct farm *f)
+{
+	struct backend *b;
+	struct farmaddress *fa;
+	struct farmpolicy *fp;
+	struct session *s;
 
-		run_farm_rules_check_sessions(buf, n, SESSION_TYPE_STATIC, family, NFTLB_F_CHAIN_ING_FILTER, action);
-		run_farm_rules_check_sessions(buf, n, SESSION_TYPE_TIMED, family, NFTLB_F_CHAIN_ING_FILTER, action);
+	nft_txn_save(&f->action);
+	nft_txn_save(&f->reload_action);
+	nft_txn_save(&f->policies_action);
+	nft_txn_save(&f->nft_chains);
+	nft_txn_save(&f->nft_bck_maps);
+	nft_txn_save(&f->nft_sched_slots);
+
+	list_for_each_entry(b, &f->backends, list)
+		nft_txn_save(&b->action);
+	list_for_each_entry(fa, &f->addresses, list)
+		nft_txn_save(&fa->action);
+	list_for_each_entry(fp, &f->policies, list)
+		nft_txn_save(&fp->action);
+	list_for_each_entry(s, &f->static_sessions, list)
+		nft_txn_save(&s->action);
+	list_for_each_entry(s, &f->timed_sessions, list)
+		nft_txn_save(&s->action);
+
+	nft_txn.log.objects++;
+}
 
-		if (f->bcks_available) {
-			u_buf_concat(buf, " ; add rule %s %s %s", print_nft_table_family(family, NFTLB_F_CHAIN_ING_FILTER), NFTLB_TABLE_NAME, chain);
-			run_farm_log_prefix(buf, f, VALUE_LOG_INPUT, NFTLB_F_CHAIN_ING_FILTER, ACTION_START);
-			u_buf_concat(buf, " %s daddr set", print_nft_family(family));
-			run_farm_rules_gen_sched(buf, n, family);
-			run_farm_rules_gen_bck_map(buf, n, BCK_MAP_WEIGHT, BCK_MAP_IPADDR, NFTLB_CHECK_AVAIL);
-			u_buf_concat(buf, " ether daddr set %s daddr", print_nft_family(family));
-			run_farm_rules_gen_bck_map(buf, n, BCK_MAP_IPADDR, BCK_MAP_ETHADDR, NFTLB_CHECK_AVAIL);
+static void nft_txn_save_address(struct address *a)
+{
+	struct addresspolicy *ap;
 
-			if (f->bcks_have_port) {
-				u_buf_concat(buf, " th dport set ether daddr");
-				run_farm_rules_gen_bck_map(buf, n, BCK_MAP_ETHADDR, BCK_MAP_PORT, NFTLB_CHECK_AVAIL);
-			}
+	nft_txn_save(&a->action);
+	nft_txn_save(&a->policies_action);
+	nft_txn_save(&a->nft_chains);
 
-			// TODO: support of different output interfaces per backend during saddr
-			u_buf_concat(buf, " ether saddr set %s", f->oethaddr);
+	list_for_each_entry(ap, &a->policies, list)
+		nft_txn_save(&ap->action);
 
-			run_farm_rules_update_sessions(buf, n, family, chain, action);
+	nft_txn.log.objects++;
+}
 
-			run_farm_log_prefix(buf, f, VALUE_LOG_OUTPUT, NFTLB_F_CHAIN_ING_DNAT, ACTION_START);
-			u_buf_concat(buf, " fwd to");
-			if (f->bcks_have_if) {
-				u_buf_concat(buf, " ether daddr");
-				run_farm_rules_gen_bck_map(buf, n, BCK_MAP_ETHADDR, BCK_MAP_OFACE, NFTLB_CHECK_AVAIL);
-			} else {
-				u_buf_concat(buf, " %s", f->oface);
-			}
-		}
-		concat_exec_cmd(buf, "");
-		break;
-	case VALUE_MODE_LOCAL:
-		run_farm_gen_log_rules(buf, f, family, chain, VALUE_LOG_INPUT, NFTLB_F_CHAIN_PRE_DNAT, ACTION_START);
-		break;
-	default:
-		run_farm_gen_log_rules(buf, f, family, chain, VALUE_LOG_INPUT, NFTLB_F_CHAIN_PRE_DNAT, ACTION_START);
+static void nft_txn_save_policy(struct policy *p)
+{
+	struct element *e;
 
-		u_buf_concat(buf, " ; add rule %s %s %s", print_nft_table_family(family, NFTLB_F_CHAIN_PRE_DNAT), NFTLB_TABLE_NAME, chain);
+	nft_txn_save(&p->action);
+	nft_txn_save(&p->total_elem);
 
-		if (nftst_get_proto(n) != VALUE_PROTO_ALL)
-			u_buf_concat(buf, " %s %s %s", print_nft_family(family), print_nft_family_protocol(family), print_nft_protocol(nftst_get_proto(n)));
+	list_for_each_entry(e, &p->elements, list)
+		nft_txn_save(&e->action);
 
-		u_buf_concat(buf, " dnat");
+	nft_txn.log.objects++;
+}
 
-		if (f->bcks_have_port && nftst_get_proto(n) != VALUE_PROTO_ALL)
-			bck_map_data = BCK_MAP_IPADDR_PORT;
+static void nft_txn_segment(int type, void *obj, int start)
+{
+	struct nft_txn_log *log = &nft_txn.log;
+	struct nft_txn_seg *segs;
+	int size;
 
-		get_farm_rules_nat_params(buf, family, bck_map_data);
-		u_buf_concat(buf, " to ct mark");
-		run_farm_rules_gen_bck_map(buf, n, BCK_MAP_MARK, bck_map_data, NFTLB_CHECK_USABLE);
+	// the commands generated before an immediate execution are already applied
+	if (start > nft_txn.buf.next)
+		start = 0;
 
-		concat_exec_cmd(buf, "");
+	if (start == nft_txn.buf.next)
+		return;
 
-		break;
+	if (log->segs_len == log->segs_size) {
+		size = log->segs_size ? log->segs_size * 2 : NFTLB_TXN_SEGS_SIZE;
+		segs = (struct nft_txn_seg *)realloc(log->segs, size * sizeof(struct nft_txn_seg));
+		if (!segs) {
+			u_log_print(LOG_ERR, "%s():%d: unable to allocate the transaction segments", __FUNCTION__, __LINE__);
+			return;
+		}
+		log->segs = segs;
+		log->segs_size = size;
 	}
 
-	return 0;
+	log->segs[log->segs_len].type = type;
+	log->segs[log->segs_len].obj = obj;
+	log->segs[log->segs_len].start = start;
+	log->segs[log->segs_len].end = nft_txn.buf.next;
+	log->segs_len++;
 }
 
-static int run_nftst_ingress_policies(struct u_buffer *buf, struct nftst *n, int family, int action)
+static void nft_txn_log_forget(struct nft_txn_log *log, char *obj, size_t size)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	int naction = nftst_get_action(n);
-	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
-
-	if ((f && !farm_needs_policies(f)) ||
-		(!f && a && !address_needs_policies(a)) ||
-		(f && !farm_is_ingress_mode(f) && naction == ACTION_NONE))
-		return 0;
+	char *field;
+	int i;
 
-	get_chain_name(chain, nftst_get_name(n), NFTLB_F_CHAIN_ING_FILTER);
+	if (log->forgotten)
+		return;
 
-	switch (action) {
-	case ACTION_START:
-		if ((f && !farm_is_ingress_mode(f)) || a) {
-				run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, ACTION_START);
-				run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), ACTION_START);
-				if ((f && f->policies_used > 1) || (a && a->policies_used > 1))
-					run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_RELOAD, ACTION_RELOAD);
-				else
-					run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_START, ACTION_START);
+	for (i = 0; i < log->undo_len; i++) {
+		field = (char *)log->undo[i].field;
+		if (field >= obj && field < obj + size) {
+			log->forgotten = 1;
+			return;
 		}
+	}
 
-		if (f)
-			run_farm_rules_ingress_policies(buf, f, chain, action);
-		else if (a)
-			run_nftst_rules_ingress_policies(buf, n, chain, action);
-		break;
-	case ACTION_RELOAD:
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_RELOAD, ACTION_RELOAD);
-		if (f)
-			run_farm_rules_ingress_policies(buf, f, chain, action);
-		else if (a)
-			run_nftst_rules_ingress_policies(buf, n, chain, action);
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		if ((f && !farm_is_ingress_mode(f)) || a) {
-			run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_STOP, ACTION_STOP);
-			run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), ACTION_STOP);
-			run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, ACTION_STOP);
+	for (i = 0; i < log->segs_len; i++) {
+		if (log->segs[i].obj == (void *)obj) {
+			log->forgotten = 1;
+			return;
 		}
-
-		if (f && f->addresses_used <= 1)
-			run_farm_rules_ingress_policies(buf, f, chain, action);
-		else if (a)
-			run_nftst_rules_ingress_policies(buf, n, chain, action);
-
-		break;
-	default:
-		break;
 	}
-
-	return 0;
 }
 
-static int run_farm_dsr(struct u_buffer *buf, struct nftst *n, int family, int action)
+/*
+ * The object is about to be freed, so the transactions that saved it can't
+ * be rolled back anymore and their failure requires a full reload.
+ */
+void nft_txn_forget(void *obj, size_t size)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	int naction = nftst_get_action(n);
+	struct nft_commit_job *job;
 
-	switch (action) {
-	case ACTION_RELOAD:
-	case ACTION_START:
-		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, naction, action);
-		run_nftst_ingress_policies(buf, n, family, ACTION_RELOAD);
-		run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
-		run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
-		run_farm_manage_sessions(buf, f, SESSION_TYPE_STATIC, family, action);
-		run_farm_manage_sessions(buf, f, SESSION_TYPE_TIMED, family, action);
-		run_farm_rules_gen_nat(buf, n, family, NFTLB_F_CHAIN_ING_FILTER, action);
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, naction, action);
-		run_farm_manage_sessions(buf, f, SESSION_TYPE_STATIC, family, action);
-		run_farm_manage_sessions(buf, f, SESSION_TYPE_TIMED, family, action);
-		run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
-		run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), action);
-		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, action);
-		run_nftst_ingress_policies(buf, n, family, f->policies_action);
-		break;
-	default:
-		break;
-	}
+	if (nft_txn.depth)
+		nft_txn_log_forget(&nft_txn.log, (char *)obj, size);
 
-	return 0;
+	if (!st_wrk.running)
+		return;
+
+	list_for_each_entry(job, &st_wrk.logged, logged)
+		nft_txn_log_forget(job->log, (char *)obj, size);
 }
 
-static int run_farm_stlsnat(struct u_buffer *buf, struct nftst *n, int family, int action)
+static void copy_ndv_base(struct if_base_rule_list *dst, struct if_base_rule_list *src)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	int naction = nftst_get_action(n);
-	char chain[NFTLB_MAX_OBJ_NAME] = { 0 };
-	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	struct if_base_rule *ifentry;
+	int i;
 
-	snprintf(map_str, NFTLB_MAX_OBJ_NAME, "map-%s-back", f->name);
+	dst->n_interfaces = 0;
+	for (i = 0; i < src->n_interfaces; i++) {
+		ifentry = (struct if_base_rule *)malloc(sizeof(struct if_base_rule));
+		if (!ifentry)
+			break;
+		ifentry->ifname = strdup(src->interfaces[i]->ifname);
+		ifentry->rules_v4 = src->interfaces[i]->rules_v4;
+		ifentry->rules_v6 = src->interfaces[i]->rules_v6;
+		dst->interfaces[dst->n_interfaces++] = ifentry;
+	}
+}
 
-	get_chain_name(chain, f->name, NFTLB_F_CHAIN_ING_DNAT);
+int nft_transaction_begin(void)
+{
+	struct nft_txn_log *log = &nft_txn.log;
 
-	switch (action) {
-	case ACTION_RELOAD:
-	case ACTION_START:
-		run_nftst_ingress_policies(buf, n, family, f->policies_action);
-		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_DNAT, family, get_rules_needed(a), action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_DNAT, family, naction, action);
-		run_farm_map(buf, a, family, NFTLB_F_CHAIN_ING_DNAT, map_str, VALUE_META_SRCIP, VALUE_META_SRCMAC, f->persistttl, action);
-		concat_exec_cmd(buf, " ; add rule %s %s %s %s saddr set %s ether saddr set %s ether daddr set %s daddr map @%s fwd to %s", print_nft_table_family(family, NFTLB_F_CHAIN_ING_DNAT), NFTLB_TABLE_NAME, chain, print_nft_family(family), a->ipaddr, a->iethaddr, print_nft_family(family), map_str, a->iface);
-		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, naction, action);
-		run_nftst_ingress_policies(buf, n, family, f->policies_action);
-		run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
-		run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
-		run_farm_manage_sessions(buf, f, SESSION_TYPE_STATIC, family, action);
-		run_farm_manage_sessions(buf, f, SESSION_TYPE_TIMED, family, action);
-		run_farm_rules_gen_nat(buf, n, family, NFTLB_F_CHAIN_ING_FILTER, action);
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_DNAT, family, naction, action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, naction, action);
-		run_farm_manage_sessions(buf, f, SESSION_TYPE_STATIC, family, action);
-		run_farm_manage_sessions(buf, f, SESSION_TYPE_TIMED, family, action);
-		run_farm_sessions_map(buf, n, SESSION_TYPE_STATIC, family, action);
-		run_farm_sessions_map(buf, n, SESSION_TYPE_TIMED, family, action);
-		run_farm_map(buf, a, family, NFTLB_F_CHAIN_ING_DNAT, map_str, VALUE_META_SRCIP, VALUE_META_SRCMAC, f->persistttl, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_DNAT, family, get_rules_needed(a), action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_ING_FILTER, family, get_rules_needed(a), action);
-		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, family, action);
-		run_nftst_ingress_policies(buf, n, family, f->policies_action);
-		break;
-	default:
-		break;
-	}
+	if (nft_txn.depth++)
+		return 0;
+
+	u_buf_create(&nft_txn.buf);
+	if (st_warm.pending)
+		nft_warm_begin(&nft_txn.buf);
+	log->objects = 0;
+	log->executed = 0;
+	log->forgotten = 0;
+	log->undo_len = 0;
+	log->segs_len = 0;
+	init_list_head(&log->elements);
+
+	log->base_rules = nft_base_rules;
+	copy_ndv_base(&log->base_rules.ndv_ingress_rules, &nft_base_rules.ndv_ingress_rules);
+	copy_ndv_base(&log->base_rules.ndv_ingress_dnat_rules, &nft_base_rules.ndv_ingress_dnat_rules);
+	memcpy(log->service_counters, service_counters, sizeof(service_counters));
 
 	return 0;
 }
 
-static int run_farm_nat(struct u_buffer *buf, struct nftst *n, int family, int action)
+/*
+ * The generated elements are deleted from the policy, but within a
+ * transaction they are kept until it is applied, to restore them if the
+ * commit fails.
+ */
+void nft_transaction_release_elements(struct policy *p)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
-	int naction = nftst_get_action(n);
+	if (nft_txn_active())
+		element_s_detach(p, &nft_txn.log.elements);
+	else
+		element_s_delete(p);
+}
 
-	u_log_print(LOG_DEBUG, "%s():%d: ", __FUNCTION__, __LINE__);
+/* the queued transaction keeps its own log, the next one starts a new one */
+static struct nft_txn_log *nft_txn_log_detach(void)
+{
+	struct nft_txn_log *log;
 
-	switch (action) {
-	case ACTION_RELOAD:
-	case ACTION_START:
-		run_farm_rules_filter(buf, n, family, action);
-		run_nftst_ingress_policies(buf, n, family, f->policies_action);
-		run_base_table(buf, NFTLB_F_CHAIN_PRE_DNAT, family, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, get_rules_needed(a), action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, get_rules_needed(a), action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, naction, action);
-		run_farm_rules_gen_nat(buf, n, family, NFTLB_F_CHAIN_PRE_DNAT, action);
-		run_farm_rules_forward(buf, n, family, action);
-		run_farm_rules_output(buf, n, family, action);
-		run_farm_snat(buf, n, family, action);
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		run_farm_rules_forward(buf, n, family, action);
-		run_farm_rules_output(buf, n, family, action);
-		run_farm_rules_filter(buf, n, family, action);
-		run_farm_snat(buf, n, family, action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, naction, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, get_rules_needed(a), action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, get_rules_needed(a), action);
-		run_base_table(buf, NFTLB_F_CHAIN_PRE_DNAT, family, action);
-		run_nftst_ingress_policies(buf, n, family, f->policies_action);
-		break;
-	default:
-		break;
+	log = (struct nft_txn_log *)malloc(sizeof(struct nft_txn_log));
+	if (!log) {
+		u_log_print(LOG_ERR, "%s():%d: transaction log memory allocation error", __FUNCTION__, __LINE__);
+		reset_ndv_base(&nft_txn.log.base_rules.ndv_ingress_rules);
+		reset_ndv_base(&nft_txn.log.base_rules.ndv_ingress_dnat_rules);
+		return NULL;
 	}
 
-	return 0;
+	*log = nft_txn.log;
+	init_list_head(&log->elements);
+	list_splice_init(&nft_txn.log.elements, &log->elements);
+	nft_txn.log.undo = NULL;
+	nft_txn.log.undo_size = 0;
+	nft_txn.log.segs = NULL;
+	nft_txn.log.segs_size = 0;
+	nft_txn.log.base_rules.ndv_ingress_rules.n_interfaces = 0;
+	nft_txn.log.base_rules.ndv_ingress_dnat_rules.n_interfaces = 0;
+
+	return log;
 }
 
-static int run_farm_local(struct u_buffer *buf, struct nftst *n, int family, int action)
+static void nft_txn_undo(struct nft_txn_log *log)
 {
-	struct farm *f = nftst_get_farm(n);
-	struct address *a = nftst_get_address(n);
+	int i;
 
-	switch (action) {
-	case ACTION_RELOAD:
-	case ACTION_START:
-		run_base_table(buf, NFTLB_F_CHAIN_PRE_DNAT, family, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, get_rules_needed(a), action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, get_rules_needed(a), action);
-		run_farm_snat(buf, n, family, action);
-		run_farm_rules_filter(buf, n, family, action);
-		run_nftst_ingress_policies(buf, n, family, f->policies_action);
-		run_farm_rules_forward(buf, n, family, action);
-		run_farm_rules_output(buf, n, family, action);
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, action, action);
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		run_nftst_rules_gen_vsrv(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, action, action);
-		run_farm_rules_forward(buf, n, family, action);
-		run_farm_rules_output(buf, n, family, action);
-		run_farm_rules_filter(buf, n, family, action);
-		run_farm_snat(buf, n, family, action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_PRE_DNAT, family, get_rules_needed(a), action);
-		run_base_chain(buf, n, NFTLB_F_CHAIN_POS_SNAT, family, get_rules_needed(a), action);
-		run_base_table(buf, NFTLB_F_CHAIN_PRE_DNAT, family, action);
-		run_nftst_ingress_policies(buf, n, family, f->policies_action);
-		break;
-	default:
-		break;
+	if (log->forgotten) {
+		element_s_release(&log->elements);
+		return;
 	}
 
-	return 0;
+	for (i = log->undo_len - 1; i >= 0; i--)
+		*log->undo[i].field = log->undo[i].value;
+
+	element_s_attach(&log->elements);
 }
 
-static int run_farm_rules(struct u_buffer *buf, struct nftst *n, int family)
+/* the freed objects can't be restored, the recovery reloads the ruleset */
+static void nft_transaction_rollback(struct nft_txn_log *log)
 {
-	struct farm *f = nftst_get_farm(n);
-	int action = nftst_get_action(n);
+	u_log_print(LOG_INFO, "%s():%d: rolling back %d objects", __FUNCTION__, __LINE__, log->objects);
 
-	if (f->action == ACTION_RELOAD && action == ACTION_NONE)
-		action = ACTION_RELOAD;
+	nft_txn_undo(log);
+	nft_bck_elems_epoch++;
 
-	switch (f->mode) {
-	case VALUE_MODE_STLSDNAT:
-		run_farm_stlsnat(buf, n, family, action);
-		break;
-	case VALUE_MODE_DSR:
-		run_farm_dsr(buf, n, family, action);
-		break;
-	case VALUE_MODE_LOCAL:
-		run_farm_local(buf, n, family, action);
-		break;
+	reset_ndv_base(&nft_base_rules.ndv_ingress_rules);
+	reset_ndv_base(&nft_base_rules.ndv_ingress_dnat_rules);
+	nft_base_rules = log->base_rules;
+	log->base_rules.ndv_ingress_rules.n_interfaces = 0;
+	log->base_rules.ndv_ingress_dnat_rules.n_interfaces = 0;
+	memcpy(service_counters, log->service_counters, sizeof(service_counters));
+	nft_fingerprint_invalidate();
+
+	/* the restored actions have to be rulerized again */
+	policy_s_set_dirty();
+	address_s_set_dirty();
+	farm_s_set_dirty();
+}
+
+/*
+ * nftables applies every commit atomically, so the failed one left the
+ * ruleset untouched. The object segments are bisected with dry runs to find
+ * the first one rejected on top of the commands generated before it.
+ */
+static struct nft_txn_seg *nft_txn_culprit(struct nft_txn_log *log, char *cmd)
+{
+	struct nft_txn_seg *seg;
+	int low = 0;
+	int high = log->segs_len - 1;
+	int found = -1;
+	int error;
+	int mid;
+	char c;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		seg = &log->segs[mid];
+
+		c = cmd[seg->end];
+		cmd[seg->end] = '\0';
+		error = exec_cmd_check(cmd);
+		cmd[seg->end] = c;
+
+		if (error) {
+			found = mid;
+			high = mid - 1;
+		} else
+			low = mid + 1;
+	}
+
+	if (found < 0)
+		return NULL;
+
+	// the commands preceding the object have to be valid on their own
+	seg = &log->segs[found];
+	c = cmd[seg->start];
+	cmd[seg->start] = '\0';
+	error = exec_cmd_check(cmd);
+	cmd[seg->start] = c;
+
+	return error ? NULL : seg;
+}
+
+static int nft_txn_reject(struct nft_txn_seg *seg)
+{
+	struct address *a;
+	struct farm *f;
+
+	switch (seg->type) {
+	case LEVEL_FARMS:
+		f = (struct farm *)seg->obj;
+		farm_set_config_error(f);
+		config_set_output(". Farm '%s' rules rejected, set to %s", f->name, CONFIG_VALUE_STATE_CONFERR);
+		return 0;
+	case LEVEL_ADDRESSES:
+		a = (struct address *)seg->obj;
+		u_log_print(LOG_INFO, "%s():%d: address %s changes discarded", __FUNCTION__, __LINE__, a->name);
+		a->action = ACTION_NONE;
+		a->policies_action = ACTION_NONE;
+		list_del_init(&a->dirty);
+		config_set_output(". Address '%s' rules rejected, changes discarded", a->name);
+		return 0;
 	default:
-		run_farm_nat(buf, n, family, action);
+		// farms and addresses depend on the policies, they need a full reload
+		return -1;
 	}
+}
+
+/*
+ * Disable the object whose rules were rejected and apply the rest of the
+ * rolled back transaction again, without touching the running ruleset. The
+ * error is the result of the new attempt.
+ */
+static int nft_transaction_recover(struct nft_txn_log *log, char *cmd, int *error)
+{
+	struct nft_txn_seg *seg;
+
+	if (log->executed || log->forgotten || nft_txn.retries >= NFTLB_TXN_MAX_RETRIES)
+		return -1;
+
+	seg = nft_txn_culprit(log, cmd);
+	if (!seg || nft_txn_reject(seg))
+		return -1;
+
+	u_log_print(LOG_ERR, "%s():%d: retrying the transaction without the rejected object", __FUNCTION__, __LINE__);
+
+	nft_txn.retries++;
+	*error = obj_rulerize(OBJ_START) ? -1 : 0;
+	nft_txn.retries--;
 
 	return 0;
 }
 
-int nft_reset(void)
+int nft_transaction_commit(void)
 {
+	struct nft_txn_log *log = NULL;
 	struct u_buffer buf;
-	int ret = 0;
+	struct u_buffer raw;
+	unsigned int max_bytes = nft_max_bytes;
+	int warm = st_warm.pending;
+	int atomic;
+	int retry;
+	int error = 0;
 
-	u_buf_create(&buf);
+	if (nft_txn.depth == 0 || --nft_txn.depth)
+		return 0;
 
-	if (nft_base_rules.dnat_rules_v4 ||
-	    nft_base_rules.snat_rules_v4 ||
-	    nft_base_rules.filter_rules_v4 ||
-	    nft_base_rules.fwd_rules_v4 ||
-	    nft_base_rules.out_filter_rules_v4 ||
-	    nft_base_rules.out_nat_rules_v4)
-		nft_table_handler(&buf, print_nft_family(VALUE_FAMILY_IPV4), ACTION_DELETE);
+	/* the recovery could open a new transaction */
+	buf = nft_txn.buf;
 
-	if (nft_base_rules.dnat_rules_v6 ||
-	    nft_base_rules.snat_rules_v6 ||
-	    nft_base_rules.filter_rules_v6 ||
-	    nft_base_rules.fwd_rules_v6 ||
-	    nft_base_rules.out_filter_rules_v6 ||
-	    nft_base_rules.out_nat_rules_v6)
-		nft_table_handler(&buf, print_nft_family(VALUE_FAMILY_IPV6), ACTION_DELETE);
+	if (nft_txn.log.objects)
+		u_log_print(LOG_DEBUG, "%s():%d: commit transaction of %d objects", __FUNCTION__, __LINE__, nft_txn.log.objects);
 
-	if (nft_base_rules.ndv_ingress_rules.n_interfaces ||
-		nft_base_rules.ndv_ingress_dnat_rules.n_interfaces ||
-		nft_base_rules.ndv_ingress_policies)
-		nft_table_handler(&buf, print_nft_family(VALUE_FAMILY_NETDEV), ACTION_DELETE);
+	if (warm) {
+		nft_warm_reconcile(&buf);
+		nft_warm_clean();
+		// splitting the commit would expose the flushed tables
+		max_bytes = 0;
+	}
 
-	exec_cmd(u_buf_get_data(&buf));
+	exec_cmd_merge_elems(&buf);
+
+	// the object segments point to the commands as they were generated
+	u_buf_create(&raw);
+	if (nft_optimize && nft_txn.log.segs_len)
+		u_buf_concat(&raw, "%s", u_buf_get_data(&buf));
+
+	exec_cmd_optimize(&buf);
+
+	// a split commit could have applied some chunks already
+	atomic = !warm && (!max_bytes || buf.next <= (int)max_bytes);
+
+	if (nft_worker_active()) {
+		// the failure of a warm commit is recovered with a full reload
+		if (!warm)
+			log = nft_txn_log_detach();
+		if (!log) {
+			reset_ndv_base(&nft_txn.log.base_rules.ndv_ingress_rules);
+			reset_ndv_base(&nft_txn.log.base_rules.ndv_ingress_dnat_rules);
+			element_s_release(&nft_txn.log.elements);
+		}
+		error = nft_worker_queue(&buf, max_bytes, log, raw.next ? &raw : NULL);
+		u_buf_clean(&raw);
+		u_buf_clean(&buf);
+		print_service_counters();
+		print_nft_base_rules();
+		return error;
+	}
+
+	if (u_buf_isempty(&buf))
+		error = exec_cmd_batch(&buf);
+	else
+		error = exec_cmd_chunked(u_buf_get_data(&buf), max_bytes, NFTLB_EXEC_LOG);
+	if (error) {
+		nlbatch_reset();
+		nft_transaction_rollback(&nft_txn.log);
+		// the adopted tables are still there, the recovery has to delete them
+		if (warm)
+			nft_check_tables();
+		if (!atomic || nft_transaction_recover(&nft_txn.log, raw.next ? u_buf_get_data(&raw) : u_buf_get_data(&buf), &retry))
+			obj_recovery();
+		u_buf_clean(&raw);
+		u_buf_clean(&buf);
+		return error;
+	}
+	u_buf_clean(&raw);
+
+	reset_ndv_base(&nft_txn.log.base_rules.ndv_ingress_rules);
+	reset_ndv_base(&nft_txn.log.base_rules.ndv_ingress_dnat_rules);
+	element_s_release(&nft_txn.log.elements);
 	u_buf_clean(&buf);
-	clean_rules_counters();
 
-	farm_s_clean_nft_chains();
-	address_s_clean_nft_chains();
+	print_service_counters();
+	print_nft_base_rules();
 
-	return ret;
+	return error;
 }
 
-int nft_check_tables(void)
+/*
+ * The worker stopped at the failed commit, so the ruleset is the one before
+ * it and the queued commits were not applied. Their objects are rolled back
+ * to the state before the failed commit, the object whose rules were rejected
+ * is disabled and the changes of all of them are generated again in a single
+ * commit. Whenever some of them can't be rolled back the whole ruleset is
+ * reloaded from the current objects. A split commit could have applied some
+ * chunks, so its objects are rolled back and the whole ruleset is reloaded
+ * from them. The requests of the discarded commits get the result of the
+ * recovery.
+ */
+static void nft_worker_recovery(struct nft_commit_job *failed)
 {
-	char cmd[NFTLB_MAX_OBJ_NAME] = { 0 };
-	const char *buf;
+	struct nft_commit_job *job, *next;
+	struct list_head jobs;
+	unsigned int first = 0, last = 0;
+	int undoable = failed->log && !failed->log->executed && !failed->log->forgotten;
+	int targeted;
+	int error = -1;
+	char *cmd;
+
+	init_list_head(&jobs);
+
+	pthread_mutex_lock(&st_wrk.lock);
+	while (st_wrk.busy)
+		pthread_cond_wait(&st_wrk.cond, &st_wrk.lock);
+	list_splice_tail_init(&st_wrk.done, &jobs);
+	list_splice_tail_init(&st_wrk.queue, &jobs);
+	st_wrk.failed = 0;
+	pthread_mutex_unlock(&st_wrk.lock);
+
+	list_for_each_entry(job, &jobs, list) {
+		if (!first)
+			first = job->id;
+		last = job->id;
+		if (!job->log || job->log->executed || job->log->forgotten)
+			undoable = 0;
+	}
 
-	snprintf(cmd, NFTLB_MAX_OBJ_NAME, "list table %s %s", NFTLB_IPV4_FAMILY_STR, NFTLB_TABLE_NAME);
-	if (exec_cmd_open(cmd, &buf, 0) == 0)
-		nft_base_rules.dnat_rules_v4 = 1;
-	exec_cmd_close(buf);
+	if (first)
+		u_log_print(LOG_ERR, "%s():%d: commits %u to %u discarded, their changes are applied by the recovery", __FUNCTION__, __LINE__, first, last);
 
-	snprintf(cmd, NFTLB_MAX_OBJ_NAME, "list table %s %s", NFTLB_IPV6_FAMILY_STR, NFTLB_TABLE_NAME);
-	if (exec_cmd_open(cmd, &buf, 0) == 0)
-		nft_base_rules.dnat_rules_v6 = 1;
-	exec_cmd_close(buf);
+	/*
+	 * The chunks of a split commit applied before the failure stay in the
+	 * ruleset, so the objects are rolled back but the ruleset is reloaded.
+	 */
+	targeted = undoable && failed->atomic;
 
-	snprintf(cmd, NFTLB_MAX_OBJ_NAME, "list table %s %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME);
-	if (exec_cmd_open(cmd, &buf, 0) == 0)
-		nft_base_rules.ndv_ingress_rules.n_interfaces = 1;
-	exec_cmd_close(buf);
+	st_wrk.bypass = 1;
+	if (undoable) {
+		list_for_each_entry_reverse(job, &jobs, list)
+			nft_txn_undo(job->log);
+		nft_transaction_rollback(failed->log);
+	}
+	if (targeted) {
+		cmd = failed->raw.next ? u_buf_get_data(&failed->raw) : u_buf_get_data(&failed->buf);
+		targeted = !nft_transaction_recover(failed->log, cmd, &error);
+	}
+	if (!targeted) {
+		nft_check_tables();
+		error = obj_recovery() ? 0 : -1;
+		// the rolled back changes were not applied
+		if (undoable)
+			error = -1;
+	}
+	st_wrk.bypass = 0;
 
-	return nft_base_rules.dnat_rules_v4 ||
-		   nft_base_rules.dnat_rules_v6 ||
-		   nft_base_rules.ndv_ingress_rules.n_interfaces;
+	list_for_each_entry_safe(job, next, &jobs, list) {
+		list_del(&job->list);
+		nft_commit_waiters_update(job->id, error);
+		nft_commit_job_delete(job);
+	}
 }
 
-static int run_set_elements(struct u_buffer *buf, struct policy *p)
+/* handle the results of the executed commits on the main loop */
+static void nft_worker_collect(void)
 {
-	struct element *e;
-	int index = 0;
+	struct nft_commit_job *job, *next, *failed = NULL;
+	struct list_head jobs;
 
-	if (!p->total_elem)
-		return 0;
+	init_list_head(&jobs);
 
-	switch (p->action) {
-	case ACTION_START:
-		list_for_each_entry(e, &p->elements, list) {
-			if (index)
-				u_buf_concat(buf, ", %s", e->data);
-			else {
-				index++;
-				u_buf_concat(buf, " ; add element %s %s %s { %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name, e->data);
-			}
-			e->action = ACTION_NONE;
-		}
-		if (index)
-			concat_exec_cmd(buf, " }");
-		break;
-	case ACTION_FLUSH:
-		concat_exec_cmd(buf, " ; flush set %s %s %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name);
-		/* fallthrough */
-	case ACTION_RELOAD:
-		list_for_each_entry(e, &p->elements, list) {
-			if (e->action != ACTION_START)
-				continue;
-			if (index)
-				u_buf_concat(buf, ", %s", e->data);
-			else {
-				index++;
-				u_buf_concat(buf, " ; add element %s %s %s { %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name, e->data);
-			}
-			e->action = ACTION_NONE;
-		}
-		if (index)
-			concat_exec_cmd(buf, " }");
+	pthread_mutex_lock(&st_wrk.lock);
+	list_splice_tail_init(&st_wrk.done, &jobs);
+	pthread_mutex_unlock(&st_wrk.lock);
 
-		index = 0;
-		list_for_each_entry(e, &p->elements, list) {
-			if (e->action != ACTION_DELETE && e->action != ACTION_STOP)
-				continue;
-			if (index)
-				u_buf_concat(buf, ", %s", e->data);
-			else {
-				index++;
-				u_buf_concat(buf, " ; delete element %s %s %s { %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name, e->data);
-			}
-			e->action = ACTION_NONE;
-		}
-		if (index)
-			concat_exec_cmd(buf, " }");
-		break;
-	case ACTION_DELETE:
-	case ACTION_STOP:
-		list_for_each_entry(e, &p->elements, list) {
-			if (index)
-				u_buf_concat(buf, ", %s", e->data);
-			else {
-				index++;
-				u_buf_concat(buf, " ; delete element %s %s %s { %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name, e->data);
-			}
-			e->action = ACTION_NONE;
+	list_for_each_entry_safe(job, next, &jobs, list) {
+		list_del(&job->list);
+		nft_commit_waiters_update(job->id, job->error);
+		if (job->error && !failed) {
+			failed = job;
+			continue;
 		}
-		if (index)
-			concat_exec_cmd(buf, " }");
-		break;
-	default:
-		break;
+		nft_commit_job_delete(job);
 	}
 
-	return 0;
+	if (failed) {
+		nft_worker_recovery(failed);
+		nft_commit_job_delete(failed);
+	}
+
+	nft_commit_waiters_notify();
 }
 
-static int run_set_farm_policies(struct u_buffer *buf, struct policy *p)
+static void nft_worker_done_cb(struct ev_loop *loop, struct ev_async *w, int revents)
 {
-	struct list_head *farms = obj_get_farms();
-	struct farm *f, *next;
-	struct farmpolicy *fp;
-	char meter_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	nft_worker_collect();
+}
 
-	if (!p->used)
-		return 0;
+/*
+ * Wait for the queued commits to be applied, so that the kernel reads see
+ * the changes already accepted, and handle their results.
+ */
+void nft_commit_sync(void)
+{
+	if (!st_wrk.running || st_wrk.bypass)
+		return;
+
+	pthread_mutex_lock(&st_wrk.lock);
+	while (st_wrk.busy || (!list_empty(&st_wrk.queue) && !st_wrk.failed))
+		pthread_cond_wait(&st_wrk.cond, &st_wrk.lock);
+	pthread_mutex_unlock(&st_wrk.lock);
+
+	// the recovery can't run within an open transaction, the main loop does it
+	if (!nft_txn.depth)
+		nft_worker_collect();
+}
+
+static void * nft_gen_run(void *arg);
+
+/* the pool that generates the farms ahead, the current thread is one more */
+static void nft_gen_start(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	st_gen.stop = 0;
+	for (i = 0; i < cpus - 1 && i < NFTLB_GEN_MAX_WORKERS; i++) {
+		if (pthread_create(&st_gen.threads[i], NULL, nft_gen_run, NULL) != 0)
+			break;
+		st_gen.workers++;
+	}
+}
+
+static void nft_gen_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&st_gen.lock);
+	st_gen.stop = 1;
+	pthread_cond_broadcast(&st_gen.cond);
+	pthread_mutex_unlock(&st_gen.lock);
+
+	for (i = 0; i < st_gen.workers; i++)
+		pthread_join(st_gen.threads[i], NULL);
+	st_gen.workers = 0;
+}
+
+int nft_worker_init(void)
+{
+	struct ev_async *commit = events_create_commit();
+	sigset_t mask, oldmask;
 
-	list_for_each_entry_safe(f, next, farms, list) {
-		fp = farmpolicy_lookup_by_name(f, p->name);
-		if (!fp)
-			continue;
+	if (!commit)
+		return -1;
 
-		snprintf(meter_str, NFTLB_MAX_OBJ_NAME, "%s-%s-cnt", p->name, f->name);
-		switch (p->action) {
-		case ACTION_FLUSH:
-			concat_exec_cmd(buf, " ; flush set %s %s %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, meter_str);
-			break;
-		case ACTION_STOP:
-		case ACTION_DELETE:
-		case ACTION_START:
-		default:
-			break;
-		}
+	init_list_head(&st_wrk.queue);
+	init_list_head(&st_wrk.done);
+	init_list_head(&st_wrk.logged);
+	init_list_head(&st_wrk.waiters);
+	st_wrk.stop = 0;
+	st_wrk.failed = 0;
+
+	ev_async_init(commit, nft_worker_done_cb);
+	ev_async_start(get_loop(), commit);
+
+	/* signals are handled by the event loop thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	if (pthread_create(&st_wrk.thread, NULL, nft_worker_run, NULL) != 0) {
+		pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+		u_log_print(LOG_ERR, "%s():%d: unable to create the commit worker", __FUNCTION__, __LINE__);
+		ev_async_stop(get_loop(), commit);
+		events_delete_commit();
+		return -1;
 	}
+	nft_gen_start();
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	st_wrk.running = 1;
 
 	return 0;
 }
 
-static int run_policy_set(struct u_buffer *buf, struct policy *p)
+/* called from the exit path of the main loop, the queued commits are applied before */
+void nft_worker_fini(void)
 {
-	switch (p->action) {
-	case ACTION_START:
-		run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_START);
-		concat_exec_cmd(buf, " ; add set %s %s %s { type %s ; flags interval ; auto-merge ; counter ; }", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name, print_nft_family_type(p->family));
-		nft_base_rules.ndv_ingress_policies++;
-		run_set_elements(buf, p);
-		break;
-	case ACTION_RELOAD:
-		run_set_elements(buf, p);
-		break;
-	case ACTION_FLUSH:
-		run_set_elements(buf, p);
-		run_set_farm_policies(buf, p);
-		break;
-	case ACTION_STOP:
-	case ACTION_DELETE:
-		concat_exec_cmd(buf, " ; delete set %s %s %s", NFTLB_NETDEV_FAMILY_STR, NFTLB_TABLE_NAME, p->name);
+	if (!st_wrk.running)
+		return;
 
-		if (nft_base_rules.ndv_ingress_policies > 0)
-			nft_base_rules.ndv_ingress_policies--;
-		if (nft_base_rules.ndv_ingress_policies == 0)
-			run_base_table(buf, NFTLB_F_CHAIN_ING_FILTER, VALUE_FAMILY_NETDEV, ACTION_DELETE);
-		break;
-	case ACTION_NONE:
-	default:
-		break;
-	}
+	nft_commit_sync();
 
-	p->action = ACTION_NONE;
+	pthread_mutex_lock(&st_wrk.lock);
+	st_wrk.stop = 1;
+	pthread_cond_signal(&st_wrk.cond);
+	pthread_mutex_unlock(&st_wrk.lock);
 
-	print_service_counters();
-	print_nft_base_rules();
+	pthread_join(st_wrk.thread, NULL);
+	st_wrk.running = 0;
 
-	return 0;
+	nft_gen_stop();
+
+	ev_async_stop(get_loop(), events_get_commit());
+	events_delete_commit();
 }
 
 int nft_rulerize_policies(struct policy *p)
 {
 	struct u_buffer buf;
+	int action = p->action;
 	int ret = 0;
+	int start;
+
+	if (nft_fingerprint_skip(nft_fingerprint_policy(p), p->nft_fingerprint, p->action, p->name)) {
+		p->action = ACTION_NONE;
+		return ret;
+	}
+
+	if (nft_txn_active()) {
+		nft_txn_save_policy(p);
+		start = nft_txn.buf.next;
+		run_policy_set(&nft_txn.buf, p);
+		nft_txn_segment(LEVEL_POLICIES, p, start);
+		nft_fingerprint_set(&p->nft_fingerprint, nft_fingerprint_policy(p), action);
+		return ret;
+	}
 
 	u_buf_create(&buf);
 
 	run_policy_set(&buf, p);
-	exec_cmd(u_buf_get_data(&buf));
+	nft_fingerprint_set(&p->nft_fingerprint, nft_fingerprint_policy(p), action);
+	exec_cmd_commit(&buf);
 
 	u_buf_clean(&buf);
 
@@ -3182,14 +5829,225 @@ int nft_get_rules_buffer(const char **buf, int key, struct nftst *n)
 		break;
 	}
 
-	error = exec_cmd_open(cmd, buf, 0);
+	error = exec_cmd_open(cmd, buf, NFTLB_EXEC_SILENT);
 
 	return error;
 }
 
+struct nft_sessions_dump {
+	struct farm		*f;
+	int				family;
+	int				key;
+	int				data;
+	nft_session_cb	cb;
+	void			*arg;
+};
+
+static const int nft_map_fields[] = {
+	VALUE_META_SRCIP,
+	VALUE_META_DSTIP,
+	VALUE_META_SRCPORT,
+	VALUE_META_DSTPORT,
+	VALUE_META_SRCMAC,
+	VALUE_META_DSTMAC,
+	VALUE_META_MARK,
+	VALUE_META_NONE,
+};
+
+/*
+ * Print a binary key or value of a map built by run_farm_map() as nft
+ * lists it. Every field of a concatenation is aligned to 32 bits.
+ */
+static int nft_print_map_value(char *str, int size, const unsigned char *val, uint32_t len, int family, int param)
+{
+	int af = (family == VALUE_FAMILY_IPV6) ? AF_INET6 : AF_INET;
+	char addr[INET6_ADDRSTRLEN];
+	uint32_t mark;
+	uint16_t port;
+	uint32_t flen;
+	int pos = 0;
+	int i;
+
+	for (i = 0; nft_map_fields[i] != VALUE_META_NONE; i++) {
+		if (!(param & nft_map_fields[i]))
+			continue;
+
+		switch (nft_map_fields[i]) {
+		case VALUE_META_SRCIP:
+		case VALUE_META_DSTIP:
+			flen = (af == AF_INET6) ? 16 : 4;
+			break;
+		case VALUE_META_SRCPORT:
+		case VALUE_META_DSTPORT:
+			flen = sizeof(port);
+			break;
+		case VALUE_META_SRCMAC:
+		case VALUE_META_DSTMAC:
+			flen = 6;
+			break;
+		default:
+			flen = sizeof(mark);
+			break;
+		}
+
+		if (!val || flen > len)
+			return -1;
+
+		if (pos)
+			pos += snprintf(str + pos, size - pos, " . ");
+
+		switch (nft_map_fields[i]) {
+		case VALUE_META_SRCIP:
+		case VALUE_META_DSTIP:
+			inet_ntop(af, val, addr, sizeof(addr));
+			pos += snprintf(str + pos, size - pos, "%s", addr);
+			break;
+		case VALUE_META_SRCPORT:
+		case VALUE_META_DSTPORT:
+			memcpy(&port, val, sizeof(port));
+			pos += snprintf(str + pos, size - pos, "%u", ntohs(port));
+			break;
+		case VALUE_META_SRCMAC:
+		case VALUE_META_DSTMAC:
+			pos += snprintf(str + pos, size - pos, "%02x:%02x:%02x:%02x:%02x:%02x", val[0], val[1], val[2], val[3], val[4], val[5]);
+			break;
+		default:
+			memcpy(&mark, val, sizeof(mark));
+			pos += snprintf(str + pos, size - pos, "0x%08x", mark);
+			break;
+		}
+
+		if (pos >= size)
+			return -1;
+
+		flen = (flen + 3) & ~3;
+		if (flen > len)
+			flen = len;
+		val += flen;
+		len -= flen;
+	}
+
+	return 0;
+}
+
+static void nft_print_time(char *str, int size, uint64_t ms)
+{
+	int pos = 0;
+
+	str[0] = '\0';
+
+	if (ms >= 86400000)
+		pos += snprintf(str + pos, size - pos, "%" PRIu64 "d", ms / 86400000);
+	ms %= 86400000;
+	if (ms >= 3600000)
+		pos += snprintf(str + pos, size - pos, "%" PRIu64 "h", ms / 3600000);
+	ms %= 3600000;
+	if (ms >= 60000)
+		pos += snprintf(str + pos, size - pos, "%" PRIu64 "m", ms / 60000);
+	ms %= 60000;
+	if (ms >= 1000)
+		pos += snprintf(str + pos, size - pos, "%" PRIu64 "s", ms / 1000);
+	ms %= 1000;
+	if (ms > 0 || pos == 0)
+		snprintf(str + pos, size - pos, "%" PRIu64 "ms", ms);
+}
+
+static int nft_sessions_dump_cb(struct nlbatch_elem *e, void *data)
+{
+	struct nft_sessions_dump *dump = (struct nft_sessions_dump *)data;
+	char client[NFTLB_MAX_OBJ_NAME];
+	char bck[NFTLB_MAX_OBJ_NAME];
+	char expiration[NFTLB_MAX_OBJ_NAME];
+
+	if (nft_print_map_value(client, NFTLB_MAX_OBJ_NAME, e->key, e->key_len, dump->family, dump->key) ||
+		nft_print_map_value(bck, NFTLB_MAX_OBJ_NAME, e->data, e->data_len, dump->family, dump->data)) {
+		u_log_print(LOG_DEBUG, "%s():%d: unexpected element in the sessions of farm %s", __FUNCTION__, __LINE__, dump->f->name);
+		return 0;
+	}
+
+	nft_print_time(expiration, NFTLB_MAX_OBJ_NAME, e->expiration);
+
+	return dump->cb(dump->f, client, bck, expiration, dump->arg);
+}
+
+/*
+ * Stream the timed sessions of the farm address from the persistence map
+ * through netlink. Returns the number of sessions read or -1 if the dump
+ * isn't available.
+ */
+int nft_get_sessions(struct nftst *n, nft_session_cb cb, void *data)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	char map_str[NFTLB_MAX_OBJ_NAME] = { 0 };
+	struct nft_sessions_dump dump;
+
+	if (!f || !a || f->persistence == VALUE_META_NONE)
+		return 0;
+
+	// the callers parse the nft listing instead
+	if (nft_listing)
+		return -1;
+
+	nft_commit_sync();
+
+	dump.f = f;
+	dump.family = a->family;
+	dump.key = f->persistence;
+	dump.cb = cb;
+	dump.arg = data;
+
+	// the same data types than run_farm_sessions_map()
+	if (f->mode == VALUE_MODE_DSR)
+		dump.data = VALUE_META_DSTMAC;
+	else if (f->mode == VALUE_MODE_STLSDNAT)
+		dump.data = VALUE_META_DSTIP;
+	else
+		dump.data = VALUE_META_MARK;
+
+	snprintf(map_str, NFTLB_MAX_OBJ_NAME, "persist-%s", f->name);
+
+	return nlbatch_dump_elems(print_nft_table_family(a->family, get_stage_by_farm_mode(f)), NFTLB_TABLE_NAME, map_str, nft_sessions_dump_cb, &dump);
+}
+
+static unsigned long long nft_get_counter_packets(char *family, char *name)
+{
+	char cmd[NFTLB_MAX_OBJ_NAME] = { 0 };
+	const char *buf = NULL;
+	const char *ptr;
+
+	snprintf(cmd, NFTLB_MAX_OBJ_NAME, "list counter %s %s %s", family, NFTLB_TABLE_NAME, name);
+	if (exec_cmd_open(cmd, &buf, NFTLB_EXEC_SILENT) || !buf || (ptr = strstr(buf, "packets ")) == NULL)
+		return 0;
+
+	return strtoull(ptr + 8, NULL, 10);
+}
+
+/*
+ * Insertions rejected because the bounded persistence map of the farm address
+ * was full. Returns -1 if the map isn't bounded.
+ */
+int nft_get_persist_rejected(struct nftst *n, unsigned long long *rejected)
+{
+	struct farm *f = nftst_get_farm(n);
+	struct address *a = nftst_get_address(n);
+	char counter[NFTLB_MAX_OBJ_NAME] = { 0 };
+
+	if (!f || !a || f->persistence == VALUE_META_NONE || !farm_persist_bounded(f))
+		return -1;
+
+	nft_commit_sync();
+
+	print_persist_counter(counter, f);
+	*rejected = nft_get_counter_packets(print_nft_table_family(a->family, NFTLB_F_CHAIN_PRE_FILTER), counter);
+
+	return 0;
+}
+
 void nft_del_rules_buffer(const char *buf)
 {
-	exec_cmd_close(buf);
+	/* the output buffer is owned by the persistent context and it is
+	 * recycled by the next command */
 }
 
 static int run_address_rules(struct u_buffer *buf, struct nftst *n, int family)
@@ -3235,43 +6093,306 @@ static int run_nftst(struct u_buffer *buf, struct nftst *n)
 int nft_rulerize_address(struct address *a)
 {
 	struct u_buffer buf;
+	int action = a->action;
 	int ret = 0;
 	struct nftst *n = nftst_create_from_address(a);
+	int start;
 
 	if (!n)
 		return ret;
 
+	if (nft_fingerprint_skip(nft_fingerprint_address(a), a->nft_fingerprint, action, a->name)) {
+		nftst_actions_done(n);
+		nftst_delete(n);
+		return ret;
+	}
+
+	if (nft_txn_active()) {
+		nft_txn_save_address(a);
+		start = nft_txn.buf.next;
+		ret = run_nftst(&nft_txn.buf, n);
+		nft_txn_segment(LEVEL_ADDRESSES, a, start);
+		nftst_actions_done(n);
+		nftst_delete(n);
+		nft_fingerprint_set(&a->nft_fingerprint, nft_fingerprint_address(a), action);
+		return ret;
+	}
+
 	u_buf_create(&buf);
 
 	ret = run_nftst(&buf, n);
 
-	exec_cmd(u_buf_get_data(&buf));
+	exec_cmd_commit(&buf);
 	u_buf_clean(&buf);
 	nftst_actions_done(n);
 	nftst_delete(n);
+	nft_fingerprint_set(&a->nft_fingerprint, nft_fingerprint_address(a), action);
 
 	return ret;
 }
 
-int nft_rulerize_farms(struct farm *f)
+static void run_farm_addresses(struct u_buffer *buf, struct nftst *n)
 {
+	struct farm *f = nftst_get_farm(n);
 	struct farmaddress *fa;
+
+	list_for_each_entry(fa, &f->addresses, list) {
+		nftst_set_address(n, fa->address);
+		nftst_set_action(n, fa->action);
+		run_nftst(buf, n);
+	}
+}
+
+static struct nft_frag *nft_frag_create(void)
+{
+	struct nft_frag *frag = (struct nft_frag *)calloc(1, sizeof(struct nft_frag));
+
+	if (!frag)
+		return NULL;
+
+	if (u_buf_create(&frag->buf)) {
+		free(frag);
+		return NULL;
+	}
+
+	return frag;
+}
+
+static void nft_frag_delete(struct nft_frag *frag)
+{
+	if (!frag)
+		return;
+
+	u_buf_clean(&frag->buf);
+	if (frag->ops)
+		free(frag->ops);
+	free(frag);
+}
+
+/*
+ * Append the commands of a farm generated by the pool, applying the updates
+ * of the base rules and the service counters where they were found.
+ */
+static void nft_frag_apply(struct u_buffer *buf, struct nft_frag *frag)
+{
+	char *data = u_buf_get_data(&frag->buf);
+	struct nft_gen_op *op;
+	int pos = 0;
+	int i;
+
+	for (i = 0; i < frag->ops_len; i++) {
+		op = &frag->ops[i];
+		if (op->offset > pos)
+			u_buf_concat(buf, "%.*s", op->offset - pos, data + pos);
+		pos = op->offset;
+
+		switch (op->kind) {
+		case NFTLB_GEN_OP_TABLE:
+			run_base_table(buf, op->type, op->family, op->action);
+			break;
+		case NFTLB_GEN_OP_CHAIN:
+			run_base_chain(buf, &op->n, op->type, op->family, op->rules, op->action);
+			break;
+		case NFTLB_GEN_OP_COUNTERS:
+			update_service_counters(op->address, op->type, op->rules, op->family, op->qty, op->action);
+			break;
+		case NFTLB_GEN_OP_SNAT_BEGIN:
+			if (has_snat_rules(op->family))
+				break;
+			// without postrouting rules the elements and their updates are dropped
+			while (i + 1 < frag->ops_len && frag->ops[i + 1].kind != NFTLB_GEN_OP_SNAT_END)
+				i++;
+			pos = (i + 1 < frag->ops_len) ? frag->ops[++i].offset : frag->buf.next;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (frag->buf.next > pos)
+		u_buf_concat(buf, "%s", data + pos);
+}
+
+static void nft_gen_farm(struct farm *f)
+{
+	struct nftst n = { .farm = f, .action = f->action };
+
+	gen_frag = f->nft_frag;
+	run_farm_addresses(&gen_frag->buf, &n);
+	gen_frag = NULL;
+}
+
+static void nft_gen_farms(void)
+{
+	int i;
+
+	while ((i = __sync_fetch_and_add(&st_gen.next, 1)) < st_gen.total)
+		nft_gen_farm(st_gen.farms[i]);
+}
+
+/* the pool threads wait for the farms of the next rulerize */
+static void * nft_gen_run(void *arg)
+{
+	unsigned int batch = 0;
+
+	pthread_mutex_lock(&st_gen.lock);
+	while (1) {
+		while (!st_gen.stop && st_gen.batch == batch)
+			pthread_cond_wait(&st_gen.cond, &st_gen.lock);
+		if (st_gen.stop)
+			break;
+		batch = st_gen.batch;
+		pthread_mutex_unlock(&st_gen.lock);
+
+		nft_gen_farms();
+
+		pthread_mutex_lock(&st_gen.lock);
+		if (--st_gen.busy == 0)
+			pthread_cond_signal(&st_gen.done);
+	}
+	pthread_mutex_unlock(&st_gen.lock);
+
+	return NULL;
+}
+
+/*
+ * Generate the commands of the queued farms with the pool before they are
+ * rulerized one by one in order. The farms that aren't rulerized were already
+ * taken out of the queue, and the shared updates are applied in farm order,
+ * so the output is the same as a serial generation. It's only worth it with
+ * lots of farms, as in the initial load or a recovery.
+ */
+void nft_rulerize_farms_prepare(struct list_head *farms)
+{
+	unsigned long long fingerprint;
+	struct timespec start;
+	struct farm *f;
+	int total = 0;
+
+	if (serialize || !st_gen.workers || st_gen.farms)
+		return;
+
+	list_for_each_entry(f, farms, dirty) {
+		if (f->action == ACTION_START || f->action == ACTION_RELOAD)
+			total++;
+	}
+
+	if (total < NFTLB_GEN_MIN_FARMS)
+		return;
+
+	st_gen.farms = (struct farm **)malloc(total * sizeof(struct farm *));
+	if (!st_gen.farms)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	list_for_each_entry(f, farms, dirty) {
+		if (f->action != ACTION_START && f->action != ACTION_RELOAD)
+			continue;
+
+		// the unchanged farms are skipped when they take their turn
+		fingerprint = nft_fingerprint_farm(f);
+		if (f->action == ACTION_RELOAD && fingerprint == f->nft_fingerprint)
+			continue;
+
+		f->nft_frag = nft_frag_create();
+		if (!f->nft_frag)
+			continue;
+		f->nft_frag->fingerprint = fingerprint;
+
+		// the farm is changed by the pool before its turn
+		if (nft_txn_active())
+			nft_txn_save_farm(f);
+
+		st_gen.farms[st_gen.total++] = f;
+	}
+
+	pthread_mutex_lock(&st_gen.lock);
+	st_gen.next = 0;
+	st_gen.busy = st_gen.workers;
+	st_gen.batch++;
+	pthread_cond_broadcast(&st_gen.cond);
+	pthread_mutex_unlock(&st_gen.lock);
+
+	// the current thread is a worker as well
+	nft_gen_farms();
+
+	pthread_mutex_lock(&st_gen.lock);
+	while (st_gen.busy)
+		pthread_cond_wait(&st_gen.done, &st_gen.lock);
+	pthread_mutex_unlock(&st_gen.lock);
+
+	u_log_print(LOG_DEBUG, "%s():%d: %d farms generated by %d workers in %ld us",
+				__FUNCTION__, __LINE__, st_gen.total, st_gen.workers + 1, elapsed_usec(&start));
+}
+
+/* drop the commands of the farms that finally weren't rulerized */
+void nft_rulerize_farms_release(void)
+{
+	struct farm *f;
+
+	if (!st_gen.farms)
+		return;
+
+	list_for_each_entry(f, obj_get_farms(), list) {
+		nft_frag_delete(f->nft_frag);
+		f->nft_frag = NULL;
+	}
+
+	free(st_gen.farms);
+	st_gen.farms = NULL;
+	st_gen.total = 0;
+	st_gen.next = 0;
+}
+
+int nft_rulerize_farms(struct farm *f)
+{
 	struct nftst *n = nftst_create_from_farm(f);
+	struct nft_frag *frag = f->nft_frag;
 	struct u_buffer buf;
+	int action = f->action;
 	int ret = 0;
+	int start;
 
-	u_buf_create(&buf);
+	// a recovery while the farm is applied releases the commands of the others
+	f->nft_frag = NULL;
 
-	list_for_each_entry(fa, &f->addresses, list) {
-		nftst_set_address(n, fa->address);
-		nftst_set_action(n, fa->action);
-		run_nftst(&buf, n);
+	if (nft_fingerprint_skip(frag ? frag->fingerprint : nft_fingerprint_farm(f), f->nft_fingerprint, action, f->name)) {
+		nft_frag_delete(frag);
+		nftst_actions_done(n);
+		nftst_delete(n);
+		return ret;
 	}
 
-	exec_cmd(u_buf_get_data(&buf));
+	if (nft_txn_active()) {
+		if (!frag)
+			nft_txn_save_farm(f);
+		start = nft_txn.buf.next;
+		if (frag)
+			nft_frag_apply(&nft_txn.buf, frag);
+		else
+			run_farm_addresses(&nft_txn.buf, n);
+		nft_txn_segment(LEVEL_FARMS, f, start);
+		nft_frag_delete(frag);
+		nftst_actions_done(n);
+		nftst_delete(n);
+		nft_fingerprint_set(&f->nft_fingerprint, nft_fingerprint_farm(f), action);
+		return ret;
+	}
+
+	u_buf_create(&buf);
+
+	if (frag)
+		nft_frag_apply(&buf, frag);
+	else
+		run_farm_addresses(&buf, n);
+	nft_frag_delete(frag);
+
+	exec_cmd_commit(&buf);
 	u_buf_clean(&buf);
 	nftst_actions_done(n);
 	nftst_delete(n);
+	nft_fingerprint_set(&f->nft_fingerprint, nft_fingerprint_farm(f), action);
 
 	print_service_counters();
 	print_nft_base_rules();
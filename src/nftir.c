@@ -0,0 +1,572 @@
+/*
+ *   This file is part of nftlb, nftables load balancer.
+ *
+ *   Copyright (C) RELIANOID
+ *   Author: Laura Garcia Liebana <laura@relianoid.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nftir.h"
+#include "nft.h"
+#include "u_hash.h"
+#include "u_log.h"
+
+#define NFTIR_OP_OTHER			0
+#define NFTIR_OP_ADD			1
+#define NFTIR_OP_DELETE			2
+#define NFTIR_OP_FLUSH			3
+
+#define NFTIR_KIND_OTHER		0
+#define NFTIR_KIND_TABLE		1
+#define NFTIR_KIND_CHAIN		2
+#define NFTIR_KIND_RULE			3
+#define NFTIR_KIND_SET			4
+#define NFTIR_KIND_ELEMENT		5
+#define NFTIR_KIND_FLOWTABLE	6
+
+#define NFTIR_ELEM_SEP			", "
+#define NFTIR_KEY_SEP			" : "
+#define NFTIR_MAX_KEY			256
+
+/*
+ * The generated commands are parsed into statements, the element statements
+ * keep their element list so the passes can work per element. Everything
+ * points into a private copy of the command buffer.
+ */
+struct nftir_elem {
+	char			*data;
+	int				len;
+	int				dropped;
+	struct nftir_stmt	*stmt;
+};
+
+struct nftir_stmt {
+	int					op;
+	int					kind;
+	char				*text;
+	char				*obj;
+	struct nftir_elem	**elems;
+	int					n_elems;
+	int					size_elems;
+	int					live_elems;
+	unsigned int		bytes;
+	int					dropped;
+};
+
+struct nftir_set {
+	int				known_empty;
+	struct u_hash	adds;
+};
+
+struct nftir {
+	char				*src;
+	struct nftir_stmt	*stmts;
+	int					n_stmts;
+	int					size_stmts;
+	struct nftir_set	**sets;
+	int					n_sets;
+	struct u_hash		sets_idx;
+};
+
+static char *nftir_trim(char *str)
+{
+	char *end;
+
+	while (*str == ' ')
+		str++;
+
+	end = str + strlen(str);
+	while (end > str && *(end - 1) == ' ')
+		*--end = '\0';
+
+	return str;
+}
+
+static char *nftir_word(char *ptr, char **word, int *len)
+{
+	while (*ptr == ' ')
+		ptr++;
+
+	*word = ptr;
+	while (*ptr != '\0' && *ptr != ' ' && *ptr != '{')
+		ptr++;
+	*len = ptr - *word;
+
+	return ptr;
+}
+
+static int nftir_word_is(char *word, int len, char *str)
+{
+	return (int)strlen(str) == len && strncmp(word, str, len) == 0;
+}
+
+static int nftir_elem_add(struct nftir_stmt *s, struct nftir_elem *e)
+{
+	struct nftir_elem **elems;
+	int size;
+
+	if (s->n_elems == s->size_elems) {
+		size = s->size_elems ? s->size_elems * 2 : 16;
+		elems = (struct nftir_elem **)realloc(s->elems, size * sizeof(struct nftir_elem *));
+		if (!elems)
+			return 1;
+		s->elems = elems;
+		s->size_elems = size;
+	}
+
+	e->stmt = s;
+	s->elems[s->n_elems++] = e;
+	s->live_elems++;
+	s->bytes += e->len + strlen(NFTIR_ELEM_SEP);
+
+	return 0;
+}
+
+static int nftir_parse_elems(struct nftir_stmt *s, char *ptr)
+{
+	struct nftir_elem *e;
+	char *next;
+
+	for (; ptr; ptr = next) {
+		next = nft_cmd_split(ptr, ',');
+		if (next)
+			*next++ = '\0';
+
+		ptr = nftir_trim(ptr);
+		if (*ptr == '\0')
+			continue;
+
+		e = (struct nftir_elem *)calloc(1, sizeof(struct nftir_elem));
+		if (!e)
+			return 1;
+		e->data = ptr;
+		e->len = strlen(ptr);
+		if (nftir_elem_add(s, e)) {
+			free(e);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int nftir_parse_stmt(struct nftir_stmt *s, char *text)
+{
+	char *ptr, *word, *obj, *open, *close;
+	int len, nwords;
+
+	memset(s, 0, sizeof(struct nftir_stmt));
+	s->text = text;
+
+	ptr = nftir_word(text, &word, &len);
+	if (nftir_word_is(word, len, "add"))
+		s->op = NFTIR_OP_ADD;
+	else if (nftir_word_is(word, len, "delete"))
+		s->op = NFTIR_OP_DELETE;
+	else if (nftir_word_is(word, len, "flush"))
+		s->op = NFTIR_OP_FLUSH;
+
+	ptr = nftir_word(ptr, &word, &len);
+	if (nftir_word_is(word, len, "table"))
+		s->kind = NFTIR_KIND_TABLE;
+	else if (nftir_word_is(word, len, "chain"))
+		s->kind = NFTIR_KIND_CHAIN;
+	else if (nftir_word_is(word, len, "rule"))
+		s->kind = NFTIR_KIND_RULE;
+	else if (nftir_word_is(word, len, "set") || nftir_word_is(word, len, "map"))
+		s->kind = NFTIR_KIND_SET;
+	else if (nftir_word_is(word, len, "element"))
+		s->kind = NFTIR_KIND_ELEMENT;
+	else if (nftir_word_is(word, len, "flowtable"))
+		s->kind = NFTIR_KIND_FLOWTABLE;
+
+	if (s->kind == NFTIR_KIND_OTHER)
+		return 0;
+
+	/* family, table and the object name */
+	nwords = (s->kind == NFTIR_KIND_TABLE) ? 2 : 3;
+	while (*ptr == ' ')
+		ptr++;
+	obj = ptr;
+	while (nwords--)
+		ptr = nftir_word(ptr, &word, &len);
+
+	s->obj = strndup(obj, ptr - obj);
+	if (!s->obj)
+		return 1;
+
+	if (s->kind != NFTIR_KIND_ELEMENT || (s->op != NFTIR_OP_ADD && s->op != NFTIR_OP_DELETE))
+		return 0;
+
+	open = strchr(ptr, '{');
+	close = strrchr(ptr, '}');
+	if (!open || !close || close < open) {
+		s->kind = NFTIR_KIND_OTHER;
+		return 0;
+	}
+
+	*close = '\0';
+	return nftir_parse_elems(s, open + 1);
+}
+
+static int nftir_parse(struct nftir *ir, char *cmds)
+{
+	struct nftir_stmt *stmts;
+	char *ptr, *next;
+	int size;
+
+	for (ptr = cmds; ptr; ptr = next) {
+		next = nft_cmd_split(ptr, ';');
+		if (next)
+			*next++ = '\0';
+
+		ptr = nftir_trim(ptr);
+		if (*ptr == '\0')
+			continue;
+
+		if (ir->n_stmts == ir->size_stmts) {
+			size = ir->size_stmts ? ir->size_stmts * 2 : 64;
+			stmts = (struct nftir_stmt *)realloc(ir->stmts, size * sizeof(struct nftir_stmt));
+			if (!stmts)
+				return 1;
+			ir->stmts = stmts;
+			ir->size_stmts = size;
+		}
+
+		if (nftir_parse_stmt(&ir->stmts[ir->n_stmts++], ptr))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void nftir_drop_elem(struct nftir_elem *e)
+{
+	e->dropped = 1;
+	e->stmt->bytes -= e->len + strlen(NFTIR_ELEM_SEP);
+	if (--e->stmt->live_elems == 0)
+		e->stmt->dropped = 1;
+}
+
+static struct nftir_set *nftir_get_set(struct nftir *ir, char *obj)
+{
+	struct nftir_set **sets;
+	struct nftir_set *set;
+
+	set = (struct nftir_set *)u_hash_lookup(&ir->sets_idx, obj);
+	if (set)
+		return set;
+
+	set = (struct nftir_set *)calloc(1, sizeof(struct nftir_set));
+	if (!set)
+		return NULL;
+
+	sets = (struct nftir_set **)realloc(ir->sets, (ir->n_sets + 1) * sizeof(struct nftir_set *));
+	if (!sets || u_hash_add(&ir->sets_idx, obj, set)) {
+		if (sets)
+			ir->sets = sets;
+		free(set);
+		return NULL;
+	}
+
+	ir->sets = sets;
+	ir->sets[ir->n_sets++] = set;
+	u_hash_init(&set->adds);
+
+	return set;
+}
+
+static void nftir_set_reset(struct nftir_set *set, int known_empty)
+{
+	u_hash_clean(&set->adds);
+	set->known_empty = known_empty;
+}
+
+static void nftir_sets_reset(struct nftir *ir)
+{
+	int i;
+
+	for (i = 0; i < ir->n_sets; i++)
+		nftir_set_reset(ir->sets[i], 0);
+}
+
+static int nftir_elem_key(struct nftir_elem *e, char *key, int size)
+{
+	char *sep = strstr(e->data, NFTIR_KEY_SEP);
+	int len = sep ? sep - e->data : e->len;
+
+	if (len >= size)
+		return 1;
+
+	memcpy(key, e->data, len);
+	key[len] = '\0';
+
+	return 0;
+}
+
+/*
+ * Drop the elements added and then deleted from a set in the same commit,
+ * only if the set was flushed before so the element couldn't exist already.
+ * Repeated additions of the same element are dropped as well.
+ */
+static void nftir_pass_cancel(struct nftir *ir, struct nftir_stats *stats)
+{
+	char key[NFTIR_MAX_KEY];
+	struct nftir_elem *e, *prev;
+	struct nftir_stmt *s;
+	struct nftir_set *set;
+	int i, j;
+
+	for (i = 0; i < ir->n_stmts; i++) {
+		s = &ir->stmts[i];
+
+		switch (s->kind) {
+		case NFTIR_KIND_SET:
+			if (s->op == NFTIR_OP_ADD)
+				break;
+			set = nftir_get_set(ir, s->obj);
+			if (!set) {
+				nftir_sets_reset(ir);
+				break;
+			}
+			nftir_set_reset(set, s->op == NFTIR_OP_FLUSH || s->op == NFTIR_OP_DELETE);
+			break;
+		case NFTIR_KIND_ELEMENT:
+			if (!s->n_elems)
+				break;
+			set = (struct nftir_set *)u_hash_lookup(&ir->sets_idx, s->obj);
+			if (!set || !set->known_empty)
+				break;
+			for (j = 0; j < s->n_elems; j++) {
+				e = s->elems[j];
+				if (nftir_elem_key(e, key, NFTIR_MAX_KEY))
+					continue;
+				prev = (struct nftir_elem *)u_hash_lookup(&set->adds, key);
+				if (s->op == NFTIR_OP_DELETE) {
+					if (!prev)
+						continue;
+					u_hash_del(&set->adds, key, prev);
+					nftir_drop_elem(prev);
+					nftir_drop_elem(e);
+					stats->cancelled++;
+				} else if (!prev) {
+					u_hash_add(&set->adds, key, e);
+				} else if (strcmp(prev->data, e->data) == 0) {
+					nftir_drop_elem(e);
+					stats->dedup++;
+				} else {
+					/* the element is updated, it can't be tracked anymore */
+					u_hash_del(&set->adds, key, prev);
+				}
+			}
+			break;
+		case NFTIR_KIND_RULE:
+		case NFTIR_KIND_CHAIN:
+			break;
+		default:
+			if (s->op != NFTIR_OP_ADD)
+				nftir_sets_reset(ir);
+			break;
+		}
+	}
+}
+
+/*
+ * Drop the repeated declarations of tables, chains, sets and flowtables, as
+ * adding an existing object is a no-op unless it was deleted in between.
+ * Rules are never deduplicated, adding a rule twice is not idempotent.
+ */
+static void nftir_pass_dedup(struct nftir *ir, struct nftir_stats *stats)
+{
+	struct nftir_stmt *s;
+	struct u_hash seen;
+	int i;
+
+	u_hash_init(&seen);
+
+	for (i = 0; i < ir->n_stmts; i++) {
+		s = &ir->stmts[i];
+		if (s->dropped || s->kind == NFTIR_KIND_RULE || s->kind == NFTIR_KIND_ELEMENT)
+			continue;
+
+		/* flushing only removes the content, the object is still there */
+		if (s->op == NFTIR_OP_FLUSH && s->kind != NFTIR_KIND_OTHER)
+			continue;
+
+		if (s->op != NFTIR_OP_ADD || s->kind == NFTIR_KIND_OTHER) {
+			u_hash_clean(&seen);
+			continue;
+		}
+
+		if (u_hash_lookup(&seen, s->text)) {
+			s->dropped = 1;
+			stats->dedup++;
+			continue;
+		}
+
+		u_hash_add(&seen, s->text, s);
+	}
+
+	u_hash_clean(&seen);
+}
+
+/* merge the consecutive element lists of the same command and set, under the ceilings */
+static void nftir_pass_merge(struct nftir *ir, unsigned int max_elements, unsigned int max_bytes, struct nftir_stats *stats)
+{
+	struct nftir_stmt *s, *leader = NULL;
+	int i, j;
+
+	for (i = 0; i < ir->n_stmts; i++) {
+		s = &ir->stmts[i];
+		if (s->dropped)
+			continue;
+
+		if (!s->n_elems) {
+			leader = NULL;
+			continue;
+		}
+
+		if (!leader || leader->op != s->op || strcmp(leader->obj, s->obj) != 0 ||
+			(max_elements && (unsigned int)(leader->live_elems + s->live_elems) > max_elements) ||
+			(max_bytes && leader->bytes + s->bytes > max_bytes)) {
+			leader = s;
+			continue;
+		}
+
+		for (j = 0; j < s->n_elems; j++) {
+			if (s->elems[j]->dropped)
+				continue;
+			if (nftir_elem_add(leader, s->elems[j]))
+				break;
+			s->elems[j] = NULL;
+		}
+
+		if (j < s->n_elems) {
+			/* out of memory, keep what couldn't be moved where it was */
+			leader = s;
+			continue;
+		}
+
+		s->dropped = 1;
+		stats->merged++;
+	}
+}
+
+static void nftir_render(struct nftir *ir, struct u_buffer *buf)
+{
+	struct nftir_stmt *s;
+	int i, j, first;
+
+	u_buf_reset(buf);
+
+	for (i = 0; i < ir->n_stmts; i++) {
+		s = &ir->stmts[i];
+		if (s->dropped)
+			continue;
+
+		if (!s->n_elems) {
+			u_buf_concat(buf, " ; %s", s->text);
+			continue;
+		}
+
+		u_buf_concat(buf, " ; %s element %s {", (s->op == NFTIR_OP_ADD) ? "add" : "delete", s->obj);
+		for (j = 0, first = 1; j < s->n_elems; j++) {
+			if (!s->elems[j] || s->elems[j]->dropped)
+				continue;
+			u_buf_concat(buf, "%s%s", first ? " " : NFTIR_ELEM_SEP, s->elems[j]->data);
+			first = 0;
+		}
+		u_buf_concat(buf, " }");
+	}
+}
+
+static void nftir_free(struct nftir *ir)
+{
+	struct nftir_stmt *s;
+	int i, j;
+
+	for (i = 0; i < ir->n_stmts; i++) {
+		s = &ir->stmts[i];
+		for (j = 0; j < s->n_elems; j++) {
+			if (s->elems[j] && s->elems[j]->stmt == s)
+				free(s->elems[j]);
+		}
+		if (s->elems)
+			free(s->elems);
+		if (s->obj)
+			free(s->obj);
+	}
+
+	for (i = 0; i < ir->n_sets; i++) {
+		u_hash_clean(&ir->sets[i]->adds);
+		free(ir->sets[i]);
+	}
+
+	if (ir->sets)
+		free(ir->sets);
+	u_hash_clean(&ir->sets_idx);
+	if (ir->stmts)
+		free(ir->stmts);
+	if (ir->src)
+		free(ir->src);
+}
+
+/*
+ * Parse the generated commands and run the optimization passes over them,
+ * the buffer is rendered again only if any statement changed. On error the
+ * buffer is left untouched.
+ */
+int nftir_optimize(struct u_buffer *buf, unsigned int max_elements, unsigned int max_bytes, struct nftir_stats *stats)
+{
+	struct nftir ir = { 0 };
+	int i, changes, ret = 0;
+
+	memset(stats, 0, sizeof(struct nftir_stats));
+
+	if (!u_buf_get_data(buf) || u_buf_isempty(buf))
+		return 0;
+
+	u_hash_init(&ir.sets_idx);
+
+	ir.src = strdup(u_buf_get_data(buf));
+	if (!ir.src || nftir_parse(&ir, ir.src)) {
+		u_log_print(LOG_ERR, "%s():%d: unable to parse the commands, memory allocation error", __FUNCTION__, __LINE__);
+		ret = 1;
+		goto out;
+	}
+
+	for (i = 0; i < ir.n_stmts; i++) {
+		if (ir.stmts[i].kind == NFTIR_KIND_RULE && ir.stmts[i].op == NFTIR_OP_ADD)
+			stats->rules++;
+		stats->elements += ir.stmts[i].n_elems;
+	}
+	stats->stmts = ir.n_stmts;
+
+	nftir_pass_cancel(&ir, stats);
+	nftir_pass_dedup(&ir, stats);
+	nftir_pass_merge(&ir, max_elements, max_bytes, stats);
+
+	changes = stats->dedup + stats->cancelled + stats->merged;
+	if (changes)
+		nftir_render(&ir, buf);
+
+out:
+	nftir_free(&ir);
+	return ret;
+}
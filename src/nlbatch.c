@@ -0,0 +1,657 @@
+/*
+ *   This file is part of nftlb, nftables load balancer.
+ *
+ *   Copyright (C) RELIANOID
+ *   Author: Laura Garcia Liebana <laura@relianoid.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Affero General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Affero General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Affero General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+#include <libmnl/libmnl.h>
+#include <libnftnl/common.h>
+#include <libnftnl/batch.h>
+#include <libnftnl/set.h>
+
+#include "nlbatch.h"
+#include "objects.h"
+#include "list.h"
+#include "u_log.h"
+
+#define NLBATCH_PAGE_SIZE			(128 * 1024)
+#define NLBATCH_OVERRUN_SIZE		(UINT16_MAX + 4096)
+#define NLBATCH_ELEM_SEP			", "
+#define NLBATCH_MAX_ELEM			100
+#define NLBATCH_MAX_KEY				16
+#define NLBATCH_DUMP_SIZE			(32 * 1024)
+
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK				10
+#endif
+
+struct nlbatch_block {
+	struct list_head	list;
+	int					cmd;
+	char				*family;
+	char				*table;
+	char				*set;
+	int					key_family;
+	int					total_elem;
+	struct u_buffer		data;
+};
+
+struct nlbatch_stct {
+	struct mnl_socket	*nl;
+	unsigned int		portid;
+	uint32_t			seq;
+	struct list_head	blocks;
+	struct mnl_socket	*dump;
+	unsigned int		dump_portid;
+};
+
+struct nlbatch_dump_stct {
+	int					(*cb)(struct nlbatch_elem *e, void *arg);
+	void				*arg;
+	int					elements;
+	int					stopped;
+};
+
+static struct nlbatch_stct st_nlb = {
+	.nl		= NULL,
+	.dump	= NULL,
+};
+
+/* the batches are sent from the commit worker while the dumps run on the main loop */
+static uint32_t nlbatch_seq(void)
+{
+	return __sync_fetch_and_add(&st_nlb.seq, 1);
+}
+
+int nlbatch_init(void)
+{
+	int one = 1;
+
+	if (st_nlb.nl)
+		return 0;
+
+	init_list_head(&st_nlb.blocks);
+
+	st_nlb.nl = mnl_socket_open(NETLINK_NETFILTER);
+	if (!st_nlb.nl) {
+		u_log_print(LOG_ERR, "%s():%d: unable to open the netfilter netlink socket", __FUNCTION__, __LINE__);
+		return -1;
+	}
+
+	if (mnl_socket_bind(st_nlb.nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		u_log_print(LOG_ERR, "%s():%d: unable to bind the netfilter netlink socket", __FUNCTION__, __LINE__);
+		mnl_socket_close(st_nlb.nl);
+		st_nlb.nl = NULL;
+		return -1;
+	}
+
+	/* acks don't need to carry back the original message payload */
+	setsockopt(mnl_socket_get_fd(st_nlb.nl), SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+
+	st_nlb.portid = mnl_socket_get_portid(st_nlb.nl);
+	st_nlb.seq = time(NULL);
+
+	return 0;
+}
+
+void nlbatch_fini(void)
+{
+	if (st_nlb.dump) {
+		mnl_socket_close(st_nlb.dump);
+		st_nlb.dump = NULL;
+	}
+
+	if (!st_nlb.nl)
+		return;
+
+	nlbatch_reset();
+	mnl_socket_close(st_nlb.nl);
+	st_nlb.nl = NULL;
+}
+
+int nlbatch_enabled(void)
+{
+	return st_nlb.nl != NULL;
+}
+
+int nlbatch_is_empty(void)
+{
+	return !st_nlb.nl || list_empty(&st_nlb.blocks);
+}
+
+static struct nlbatch_block * nlbatch_block_create(int cmd, char *family, char *table, char *set, int key_family)
+{
+	struct nlbatch_block *blk = (struct nlbatch_block *)malloc(sizeof(struct nlbatch_block));
+	if (!blk) {
+		u_log_print(LOG_ERR, "Netlink batch block memory allocation error");
+		return NULL;
+	}
+
+	if (u_buf_create(&blk->data)) {
+		free(blk);
+		return NULL;
+	}
+
+	blk->cmd = cmd;
+	blk->family = family;
+	blk->table = table;
+	blk->set = strdup(set);
+	blk->key_family = key_family;
+	blk->total_elem = 0;
+
+	list_add_tail(&blk->list, &st_nlb.blocks);
+
+	return blk;
+}
+
+static void nlbatch_block_delete(struct nlbatch_block *blk)
+{
+	list_del(&blk->list);
+	u_buf_clean(&blk->data);
+	if (blk->set)
+		free(blk->set);
+	free(blk);
+}
+
+void nlbatch_reset_blocks(struct list_head *blocks)
+{
+	struct nlbatch_block *blk, *next;
+
+	list_for_each_entry_safe(blk, next, blocks, list)
+		nlbatch_block_delete(blk);
+}
+
+void nlbatch_reset(void)
+{
+	if (!st_nlb.nl)
+		return;
+
+	nlbatch_reset_blocks(&st_nlb.blocks);
+}
+
+void nlbatch_detach(struct list_head *blocks)
+{
+	init_list_head(blocks);
+
+	if (!st_nlb.nl)
+		return;
+
+	list_splice_init(&st_nlb.blocks, blocks);
+}
+
+int nlbatch_elem_append(int cmd, char *family, char *table, char *set, int key_family, char *data)
+{
+	struct nlbatch_block *blk = NULL;
+
+	if (!st_nlb.nl)
+		return -1;
+
+	/* the element wouldn't fit to be parsed back, leave it to the nft path */
+	if (strlen(data) >= NLBATCH_MAX_ELEM)
+		return -1;
+
+	if (!list_empty(&st_nlb.blocks)) {
+		blk = list_entry(st_nlb.blocks.prev, struct nlbatch_block, list);
+		if (blk->cmd != cmd || strcmp(blk->set, set) != 0 || strcmp(blk->family, family) != 0)
+			blk = NULL;
+	}
+
+	if (!blk)
+		blk = nlbatch_block_create(cmd, family, table, set, key_family);
+	if (!blk)
+		return -1;
+
+	if (blk->total_elem)
+		u_buf_concat(&blk->data, "%s%s", NLBATCH_ELEM_SEP, data);
+	else
+		u_buf_concat(&blk->data, "%s", data);
+	blk->total_elem++;
+
+	return 0;
+}
+
+int nlbatch_render_blocks(struct u_buffer *buf, struct list_head *blocks)
+{
+	struct nlbatch_block *blk;
+
+	list_for_each_entry(blk, blocks, list)
+		u_buf_concat(buf, " ; %s element %s %s %s { %s }", (blk->cmd == NLBATCH_ELEM_ADD) ? "add" : "delete",
+					 blk->family, blk->table, blk->set, u_buf_get_data(&blk->data));
+
+	return 0;
+}
+
+int nlbatch_render(struct u_buffer *buf)
+{
+	if (!st_nlb.nl)
+		return 0;
+
+	return nlbatch_render_blocks(buf, &st_nlb.blocks);
+}
+
+static int nlbatch_get_nfproto(char *family)
+{
+	if (strcmp(family, "ip") == 0)
+		return NFPROTO_IPV4;
+	if (strcmp(family, "ip6") == 0)
+		return NFPROTO_IPV6;
+	if (strcmp(family, "netdev") == 0)
+		return NFPROTO_NETDEV;
+	return NFPROTO_INET;
+}
+
+/* add one to a network order key, returns 1 on overflow */
+static int nlbatch_key_inc(unsigned char *key, int len)
+{
+	int i;
+
+	for (i = len - 1; i >= 0; i--) {
+		if (++key[i] != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Translate an element of an interval set (address, prefix or range) into
+ * its start key and the exclusive end key. Returns 0 if the end doesn't
+ * need an explicit element (the interval reaches the top of the key space).
+ */
+static int nlbatch_parse_interval(char *data, int key_family, unsigned char *start, unsigned char *end, int *len)
+{
+	char str[NLBATCH_MAX_ELEM];
+	int af = (key_family == VALUE_FAMILY_IPV6) ? AF_INET6 : AF_INET;
+	char *sep;
+	int prefix = -1;
+	int i, bits;
+
+	*len = (af == AF_INET6) ? 16 : 4;
+	snprintf(str, NLBATCH_MAX_ELEM, "%s", data);
+
+	if ((sep = strchr(str, '/')) != NULL) {
+		*sep = '\0';
+		prefix = atoi(sep + 1);
+		if (prefix < 0 || prefix > *len * 8)
+			return -1;
+	} else if ((sep = strchr(str, '-')) != NULL) {
+		*sep = '\0';
+		if (inet_pton(af, sep + 1, end) != 1)
+			return -1;
+	}
+
+	if (inet_pton(af, str, start) != 1)
+		return -1;
+
+	if (prefix >= 0) {
+		for (i = 0; i < *len; i++) {
+			bits = prefix - i * 8;
+			if (bits >= 8)
+				continue;
+			start[i] &= (bits <= 0) ? 0 : (unsigned char)(0xff << (8 - bits));
+		}
+		memcpy(end, start, *len);
+		for (i = 0; i < *len; i++) {
+			bits = prefix - i * 8;
+			if (bits >= 8)
+				continue;
+			end[i] |= (bits <= 0) ? 0xff : (unsigned char)(0xff >> bits);
+		}
+	} else if (!sep)
+		memcpy(end, start, *len);
+
+	return !nlbatch_key_inc(end, *len);
+}
+
+static int nlbatch_block_build(struct nftnl_batch *batch, struct nlbatch_block *blk)
+{
+	unsigned char start[NLBATCH_MAX_KEY], end[NLBATCH_MAX_KEY];
+	char elem[NLBATCH_MAX_ELEM] = { 0 };
+	struct nftnl_set_elems_iter *iter;
+	struct nftnl_set_elem *e;
+	struct nftnl_set *s;
+	struct nlmsghdr *nlh;
+	char *ptr, *next;
+	int family = nlbatch_get_nfproto(blk->family);
+	int msgs = 0;
+	int len, ret;
+
+	s = nftnl_set_alloc();
+	if (!s)
+		return -1;
+
+	nftnl_set_set_str(s, NFTNL_SET_TABLE, blk->table);
+	nftnl_set_set_str(s, NFTNL_SET_NAME, blk->set);
+	nftnl_set_set_u32(s, NFTNL_SET_FAMILY, family);
+
+	for (ptr = u_buf_get_data(&blk->data); ptr && *ptr != '\0'; ptr = next) {
+		next = strstr(ptr, NLBATCH_ELEM_SEP);
+		len = next ? (int)(next - ptr) : (int)strlen(ptr);
+		if (len >= NLBATCH_MAX_ELEM) {
+			u_log_print(LOG_ERR, "%s():%d: element too long for set %s", __FUNCTION__, __LINE__, blk->set);
+			nftnl_set_free(s);
+			return -1;
+		}
+		snprintf(elem, NLBATCH_MAX_ELEM, "%.*s", len, ptr);
+		if (next)
+			next += strlen(NLBATCH_ELEM_SEP);
+
+		ret = nlbatch_parse_interval(elem, blk->key_family, start, end, &len);
+		if (ret < 0) {
+			u_log_print(LOG_ERR, "%s():%d: invalid element %s for set %s", __FUNCTION__, __LINE__, elem, blk->set);
+			nftnl_set_free(s);
+			return -1;
+		}
+
+		e = nftnl_set_elem_alloc();
+		if (!e)
+			goto err_elem;
+		nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, start, len);
+		nftnl_set_elem_add(s, e);
+
+		if (!ret)
+			continue;
+
+		e = nftnl_set_elem_alloc();
+		if (!e)
+			goto err_elem;
+		nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, end, len);
+		nftnl_set_elem_set_u32(e, NFTNL_SET_ELEM_FLAGS, NFT_SET_ELEM_INTERVAL_END);
+		nftnl_set_elem_add(s, e);
+	}
+
+	iter = nftnl_set_elems_iter_create(s);
+	if (!iter) {
+		nftnl_set_free(s);
+		return -1;
+	}
+
+	do {
+		if (blk->cmd == NLBATCH_ELEM_ADD)
+			nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(batch), NFT_MSG_NEWSETELEM, family,
+										NLM_F_CREATE | NLM_F_ACK, nlbatch_seq());
+		else
+			nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(batch), NFT_MSG_DELSETELEM, family,
+										NLM_F_ACK, nlbatch_seq());
+		ret = nftnl_set_elems_nlmsg_build_payload_iter(nlh, iter);
+		nftnl_batch_next(batch);
+		msgs++;
+	} while (ret > 0);
+
+	nftnl_set_elems_iter_destroy(iter);
+	nftnl_set_free(s);
+
+	return msgs;
+
+err_elem:
+	u_log_print(LOG_ERR, "Netlink batch element memory allocation error");
+	nftnl_set_free(s);
+	return -1;
+}
+
+static int nlbatch_send(struct nftnl_batch *batch)
+{
+	int iov_len = nftnl_batch_iovec_len(batch);
+	struct sockaddr_nl snl = { .nl_family = AF_NETLINK };
+	struct iovec iov[iov_len];
+	struct msghdr msg = {
+		.msg_name		= &snl,
+		.msg_namelen	= sizeof(snl),
+		.msg_iov		= iov,
+		.msg_iovlen		= iov_len,
+	};
+	int size = NLBATCH_PAGE_SIZE * iov_len;
+
+	nftnl_batch_iovec(batch, iov, iov_len);
+	setsockopt(mnl_socket_get_fd(st_nlb.nl), SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size));
+
+	return sendmsg(mnl_socket_get_fd(st_nlb.nl), &msg, 0);
+}
+
+static int nlbatch_recv_acks(int expected)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct pollfd pfd = { .fd = mnl_socket_get_fd(st_nlb.nl), .events = POLLIN };
+	const struct nlmsghdr *nlh;
+	const struct nlmsgerr *err;
+	int acks = 0;
+	int error = 0;
+	int len;
+
+	while (acks < expected) {
+		/* once the kernel reported an error, just drain what is pending */
+		if (error && poll(&pfd, 1, 0) <= 0)
+			break;
+
+		len = mnl_socket_recvfrom(st_nlb.nl, buf, sizeof(buf));
+		if (len < 0) {
+			u_log_print(LOG_ERR, "%s():%d: netlink receive error: %s", __FUNCTION__, __LINE__, strerror(errno));
+			return -1;
+		}
+
+		for (nlh = (const struct nlmsghdr *)buf; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len)) {
+			if (nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+			acks++;
+			err = mnl_nlmsg_get_payload(nlh);
+			if (err->error) {
+				u_log_print(LOG_ERR, "nft netlink batch error : %s", strerror(-err->error));
+				error = -1;
+			}
+		}
+	}
+
+	return error;
+}
+
+int nlbatch_commit_blocks(struct list_head *blocks)
+{
+	struct nftnl_batch *batch;
+	struct nlbatch_block *blk;
+	int expected = 0;
+	int ret;
+
+	if (!st_nlb.nl || list_empty(blocks))
+		return 0;
+
+	batch = nftnl_batch_alloc(NLBATCH_PAGE_SIZE, NLBATCH_OVERRUN_SIZE);
+	if (!batch) {
+		u_log_print(LOG_ERR, "Netlink batch memory allocation error");
+		return -1;
+	}
+
+	nftnl_batch_begin(nftnl_batch_buffer(batch), nlbatch_seq());
+	nftnl_batch_next(batch);
+
+	list_for_each_entry(blk, blocks, list) {
+		u_log_print(LOG_NOTICE, "nft netlink exec : %s element %s %s %s with %d elements",
+					(blk->cmd == NLBATCH_ELEM_ADD) ? "add" : "delete", blk->family, blk->table, blk->set, blk->total_elem);
+		ret = nlbatch_block_build(batch, blk);
+		if (ret < 0) {
+			nftnl_batch_free(batch);
+			return -1;
+		}
+		expected += ret;
+	}
+
+	nftnl_batch_end(nftnl_batch_buffer(batch), nlbatch_seq());
+	nftnl_batch_next(batch);
+
+	if (nlbatch_send(batch) < 0) {
+		u_log_print(LOG_ERR, "%s():%d: netlink send error: %s", __FUNCTION__, __LINE__, strerror(errno));
+		nftnl_batch_free(batch);
+		return -1;
+	}
+
+	ret = nlbatch_recv_acks(expected);
+	nftnl_batch_free(batch);
+
+	return ret;
+}
+
+int nlbatch_commit(void)
+{
+	return nlbatch_commit_blocks(&st_nlb.blocks);
+}
+
+/* dumps use their own socket, they are available even without the netlink batch */
+static struct mnl_socket * nlbatch_dump_socket(void)
+{
+	if (st_nlb.dump)
+		return st_nlb.dump;
+
+	st_nlb.dump = mnl_socket_open(NETLINK_NETFILTER);
+	if (!st_nlb.dump) {
+		u_log_print(LOG_ERR, "%s():%d: unable to open the netfilter netlink dump socket", __FUNCTION__, __LINE__);
+		return NULL;
+	}
+
+	if (mnl_socket_bind(st_nlb.dump, 0, MNL_SOCKET_AUTOPID) < 0) {
+		u_log_print(LOG_ERR, "%s():%d: unable to bind the netfilter netlink dump socket", __FUNCTION__, __LINE__);
+		mnl_socket_close(st_nlb.dump);
+		st_nlb.dump = NULL;
+		return NULL;
+	}
+
+	st_nlb.dump_portid = mnl_socket_get_portid(st_nlb.dump);
+	__sync_bool_compare_and_swap(&st_nlb.seq, 0, time(NULL));
+
+	return st_nlb.dump;
+}
+
+/* every message is decoded and released before the next one is received */
+static int nlbatch_dump_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nlbatch_dump_stct *dump = (struct nlbatch_dump_stct *)data;
+	struct nftnl_set_elems_iter *iter;
+	struct nftnl_set_elem *e;
+	struct nftnl_set *s;
+	struct nlbatch_elem elem;
+	int ret = MNL_CB_OK;
+
+	s = nftnl_set_alloc();
+	if (!s)
+		return MNL_CB_ERROR;
+
+	if (nftnl_set_elems_nlmsg_parse(nlh, s) < 0) {
+		nftnl_set_free(s);
+		return MNL_CB_ERROR;
+	}
+
+	iter = nftnl_set_elems_iter_create(s);
+	if (!iter) {
+		nftnl_set_free(s);
+		return MNL_CB_ERROR;
+	}
+
+	for (e = nftnl_set_elems_iter_next(iter); e; e = nftnl_set_elems_iter_next(iter)) {
+		memset(&elem, 0, sizeof(elem));
+		elem.key = nftnl_set_elem_get(e, NFTNL_SET_ELEM_KEY, &elem.key_len);
+		if (nftnl_set_elem_is_set(e, NFTNL_SET_ELEM_DATA))
+			elem.data = nftnl_set_elem_get(e, NFTNL_SET_ELEM_DATA, &elem.data_len);
+		if (nftnl_set_elem_is_set(e, NFTNL_SET_ELEM_EXPIRATION))
+			elem.expiration = nftnl_set_elem_get_u64(e, NFTNL_SET_ELEM_EXPIRATION);
+		if (!elem.key)
+			continue;
+
+		dump->elements++;
+		if (dump->cb(&elem, dump->arg)) {
+			dump->stopped = 1;
+			ret = MNL_CB_STOP;
+			break;
+		}
+	}
+
+	nftnl_set_elems_iter_destroy(iter);
+	nftnl_set_free(s);
+
+	return ret;
+}
+
+/*
+ * Dump the elements of a set or map and hand them to the callback in their
+ * binary form. A non zero return of the callback stops the dump. Returns the
+ * number of elements read, 0 if the set doesn't exist or -1 on error.
+ */
+int nlbatch_dump_elems(char *family, char *table, char *set, int (*cb)(struct nlbatch_elem *e, void *arg), void *arg)
+{
+	char buf[NLBATCH_DUMP_SIZE];
+	struct nlbatch_dump_stct dump = {
+		.cb			= cb,
+		.arg		= arg,
+		.elements	= 0,
+		.stopped	= 0,
+	};
+	struct mnl_socket *nl;
+	struct nlmsghdr *nlh;
+	struct nftnl_set *s;
+	uint32_t seq;
+	int ret;
+
+	nl = nlbatch_dump_socket();
+	if (!nl)
+		return -1;
+
+	s = nftnl_set_alloc();
+	if (!s)
+		return -1;
+
+	seq = nlbatch_seq();
+	nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETSETELEM, nlbatch_get_nfproto(family), NLM_F_DUMP | NLM_F_ACK, seq);
+	nftnl_set_set_str(s, NFTNL_SET_TABLE, table);
+	nftnl_set_set_str(s, NFTNL_SET_NAME, set);
+	nftnl_set_elems_nlmsg_build_payload(nlh, s);
+	nftnl_set_free(s);
+
+	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
+		u_log_print(LOG_ERR, "%s():%d: netlink send error: %s", __FUNCTION__, __LINE__, strerror(errno));
+		return -1;
+	}
+
+	do {
+		ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
+		if (ret <= 0)
+			break;
+		ret = mnl_cb_run(buf, ret, seq, st_nlb.dump_portid, nlbatch_dump_cb, &dump);
+	} while (ret > 0);
+
+	if (ret < 0 && errno == ENOENT)
+		return 0;
+
+	if (ret < 0)
+		u_log_print(LOG_ERR, "%s():%d: netlink dump of %s %s %s failed: %s", __FUNCTION__, __LINE__, family, table, set, strerror(errno));
+
+	// the rest of the dump would be read as the reply of the next request
+	if (ret < 0 || dump.stopped) {
+		mnl_socket_close(st_nlb.dump);
+		st_nlb.dump = NULL;
+	}
+
+	return (ret < 0) ? -1 : dump.elements;
+}
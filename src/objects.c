@@ -45,19 +45,31 @@
 struct obj_config	current_obj;
 
 struct list_head	farms;
+struct u_hash		farms_index;
+struct list_head	farms_dirty;
 int			total_farms = 0;
 int			dsr_counter = 0;
 struct list_head	policies;
+struct u_hash		policies_index;
+struct list_head	policies_dirty;
 int			total_policies = 0;
 struct list_head	addresses;
+struct u_hash		addresses_index;
+struct list_head	addresses_dirty;
 int			total_addresses = 0;
 static unsigned int cmdtry = 0;
 
 void objects_init(void)
 {
 	init_list_head(&farms);
+	u_hash_init(&farms_index);
+	init_list_head(&farms_dirty);
 	init_list_head(&policies);
+	u_hash_init(&policies_index);
+	init_list_head(&policies_dirty);
 	init_list_head(&addresses);
+	u_hash_init(&addresses_index);
+	init_list_head(&addresses_dirty);
 }
 
 struct list_head * obj_get_farms(void)
@@ -65,16 +77,46 @@ struct list_head * obj_get_farms(void)
 	return &farms;
 }
 
+struct u_hash * obj_get_farms_index(void)
+{
+	return &farms_index;
+}
+
+struct list_head * obj_get_farms_dirty(void)
+{
+	return &farms_dirty;
+}
+
 struct list_head * obj_get_policies(void)
 {
 	return &policies;
 }
 
+struct u_hash * obj_get_policies_index(void)
+{
+	return &policies_index;
+}
+
+struct list_head * obj_get_policies_dirty(void)
+{
+	return &policies_dirty;
+}
+
 struct list_head * obj_get_addresses(void)
 {
 	return &addresses;
 }
 
+struct u_hash * obj_get_addresses_index(void)
+{
+	return &addresses_index;
+}
+
+struct list_head * obj_get_addresses_dirty(void)
+{
+	return &addresses_dirty;
+}
+
 int obj_get_total_farms(void)
 {
 	return total_farms;
@@ -277,6 +319,8 @@ char * obj_print_key(int key)
 		return CONFIG_KEY_PERSIST;
 	case KEY_PERSISTTM:
 		return CONFIG_KEY_PERSISTTM;
+	case KEY_PERSISTSIZE:
+		return CONFIG_KEY_PERSISTSIZE;
 	case KEY_HELPER:
 		return CONFIG_KEY_HELPER;
 	case KEY_LOG:
@@ -572,7 +616,7 @@ int obj_set_attribute(struct config_pair *c, int actionable, int apply_action)
 		ret = farm_set_attribute(c);
 
 		if (actionable && ret == PARSER_OK && action != ACTION_NONE)
-			farm_pos_actionable(c);
+			farm_pos_actionable(c, action);
 		break;
 	case LEVEL_BCKS:
 		if (!backend_changed(c))
@@ -703,6 +747,7 @@ int obj_rulerize(int mode)
 {
 	int out = 0;
 	obj_config_init();
+	nft_transaction_begin();
 	if (mode == OBJ_START_INV) {
 		out = farm_s_rulerize();
 		out = out + address_s_rulerize();
@@ -712,6 +757,8 @@ int obj_rulerize(int mode)
 		out = out + address_s_rulerize();
 		out = out + farm_s_rulerize();
 	}
+	if (nft_transaction_commit())
+		out++;
 	return out;
 }
 
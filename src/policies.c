@@ -30,6 +30,8 @@
 #include "nft.h"
 #include "u_log.h"
 
+static unsigned int policy_seq = 0;
+
 static struct policy * policy_create(char *name)
 {
 	struct list_head *policies = obj_get_policies();
@@ -49,13 +51,20 @@ static struct policy * policy_create(char *name)
 	p->used = 0;
 	p->logprefix = DEFAULT_POLICY_LOGPREFIX;
 	p->action = DEFAULT_ACTION;
+	p->nft_fingerprint = 0;
+	p->seq = policy_seq++;
+	init_list_head(&p->dirty);
 
 	init_list_head(&p->elements);
+	init_list_head(&p->farms);
+	u_hash_init(&p->elements_index);
 
 	p->total_elem = 0;
 
 	list_add_tail(&p->list, policies);
+	u_hash_add(obj_get_policies_index(), p->name, p);
 	obj_set_total_policies(obj_get_total_policies() + 1);
+	policy_set_dirty(p);
 
 	return p;
 }
@@ -66,12 +75,16 @@ static int policy_delete(struct policy *p)
 		return 0;
 
 	list_del(&p->list);
+	list_del_init(&p->dirty);
+	u_hash_del(obj_get_policies_index(), p->name, p);
+	u_hash_clean(&p->elements_index);
 
 	if (p->name)
 		free(p->name);
 	if (p->logprefix && strcmp(p->logprefix, DEFAULT_POLICY_LOGPREFIX) != 0)
 		free(p->logprefix);
 
+	nft_txn_forget(p, sizeof(struct policy));
 	free(p);
 	obj_set_total_policies(obj_get_total_policies() - 1);
 
@@ -145,15 +158,7 @@ void policies_s_print(void)
 
 struct policy * policy_lookup_by_name(const char *name)
 {
-	struct list_head *policies = obj_get_policies();
-	struct policy *p;
-
-	list_for_each_entry(p, policies, list) {
-		if (strcmp(p->name, name) == 0)
-			return p;
-	}
-
-	return NULL;
+	return (struct policy *)u_hash_lookup(obj_get_policies_index(), name);
 }
 
 int policy_changed(struct config_pair *c)
@@ -245,17 +250,18 @@ int policy_set_action(struct policy *p, int action)
 		return 0;
 
 	if (action == ACTION_DELETE) {
-		farm_s_lookup_policy_action(p->name, action);
+		farm_s_lookup_policy_action(p, action);
 		policy_delete(p);
 		return 1;
 	}
 
 	if (action == ACTION_STOP || action == ACTION_RELOAD) {
-		farm_s_lookup_policy_action(p->name, action);
+		farm_s_lookup_policy_action(p, action);
 		address_s_lookup_policy_action(p->name, action);
 	}
 
 	p->action = action;
+	policy_set_dirty(p);
 
 	return 1;
 }
@@ -330,32 +336,58 @@ int policy_rulerize(struct policy *p)
 	int ret = 0;
 	u_log_print(LOG_DEBUG, "%s():%d: rulerize policy %s", __FUNCTION__, __LINE__, p->name);
 
-	policy_print(p);
+	list_del_init(&p->dirty);
 
 	if (p->action == ACTION_NONE) {
 		u_log_print(LOG_INFO, "%s():%d: policy %s won't be rulerized", __FUNCTION__, __LINE__, p->name);
 		return 0;
 	}
 
+	policy_print(p);
+
 	ret = nft_rulerize_policies(p);
-	element_s_delete(p);
+	nft_transaction_release_elements(p);
 	return ret;
 }
 
 int policy_s_rulerize(void)
 {
+	struct list_head *dirty = obj_get_policies_dirty();
 	struct policy *p;
 	int ret = 0;
 	int output = 0;
 
-	u_log_print(LOG_DEBUG, "%s():%d: rulerize all policies", __FUNCTION__, __LINE__);
+	u_log_print(LOG_DEBUG, "%s():%d: rulerize changed policies", __FUNCTION__, __LINE__);
 
-	struct list_head *policies = obj_get_policies();
-
-	list_for_each_entry(p, policies, list) {
+	while (!list_empty(dirty)) {
+		p = list_first_entry(dirty, struct policy, dirty);
 		ret = policy_rulerize(p);
 		output = output || ret;
 	}
 
 	return output;
 }
+
+void policy_set_dirty(struct policy *p)
+{
+	struct list_head *dirty = obj_get_policies_dirty();
+	struct policy *pos;
+
+	if (!list_empty(&p->dirty))
+		return;
+
+	list_for_each_entry_reverse(pos, dirty, dirty) {
+		if (pos->seq < p->seq)
+			break;
+	}
+	list_add(&p->dirty, &pos->dirty);
+}
+
+void policy_s_set_dirty(void)
+{
+	struct list_head *policies = obj_get_policies();
+	struct policy *p;
+
+	list_for_each_entry(p, policies, list)
+		policy_set_dirty(p);
+}
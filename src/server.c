@@ -46,6 +46,8 @@
 
 #define SRV_PORT_DEF			"5555"
 
+#define SRV_HEADER_COMMIT_SKIPPED	"X-Commit: skipped" HTTP_LINE_END
+
 #define STR_GET_ACTION			"GET"
 #define STR_POST_ACTION			"POST"
 #define STR_PUT_ACTION			"PUT"
@@ -64,10 +66,11 @@ enum ws_methods {
 
 struct nftlb_http_state {
 	enum ws_methods		method;
-	char			uri[SRV_MAX_IDENT];
+	char			*uri;
 	char			*body;
 	enum ws_responses	status_code;
 	char			*body_response;
+	int			commit_skipped;
 };
 
 struct nftlb_server {
@@ -161,7 +164,16 @@ static int get_request(int fd, struct u_buffer *buf, struct nftlb_http_state *st
 		return -1;
 	}
 
-	sscanf(u_buf_get_data(buf), "%199[^ ] %199[^ ] ", method, state->uri);
+	sscanf(u_buf_get_data(buf), "%199[^ ] ", method);
+
+	// the uri is sized to the request, the levels are bounded when parsed
+	ptr = u_buf_get_data(buf) + strlen(method);
+	ptr += strspn(ptr, " ");
+	state->uri = strndup(ptr, strcspn(ptr, " \r\n"));
+	if (!state->uri) {
+		state->status_code = WS_HTTP_500;
+		return -1;
+	}
 
 	u_log_print(LOG_NOTICE, "%s():%d: request: %s %s", __FUNCTION__, __LINE__, method, state->uri);
 
@@ -237,6 +249,8 @@ final:
 
 static int init_http_state(struct nftlb_http_state *state)
 {
+	state->uri = NULL;
+	state->commit_skipped = 0;
 	state->body_response = malloc(SRV_MAX_BUF);
 	if (!state->body_response) {
 		state->status_code = parse_to_http_status(PARSER_STRUCT_FAILED);
@@ -248,6 +262,8 @@ static int init_http_state(struct nftlb_http_state *state)
 
 static int fin_http_state(struct nftlb_http_state *state)
 {
+	if (state->uri)
+		free(state->uri);
 	if (state->body_response)
 		free(state->body_response);
 	return 0;
@@ -279,15 +295,21 @@ static int send_get_response(struct nftlb_http_state *state)
 	char secondlevel[SRV_MAX_IDENT] = {0};
 	char thirdlevel[SRV_MAX_IDENT] = {0};
 	char fourthlevel[SRV_MAX_IDENT] = {0};
+	char *query;
 	int ret = PARSER_STRUCT_FAILED;
 
+	// the query string, if any, is not part of the levels
+	query = strchr(state->uri, '?');
+	if (query)
+		*query++ = '\0';
+
 	sscanf(state->uri, "/%199[^/]/%199[^/]/%199[^/]/%199[^\n]",
 	       firstlevel, secondlevel, thirdlevel, fourthlevel);
 
 	if (strcmp(firstlevel, CONFIG_KEY_FARMS) == 0) {
 
 		if (strcmp(thirdlevel, CONFIG_KEY_SESSIONS) == 0)
-			ret = config_print_farm_sessions(&state->body_response, secondlevel);
+			ret = config_print_farm_sessions(&state->body_response, secondlevel, query);
 		else if (strcmp(thirdlevel, "") == 0)
 			ret = config_print_farms(&state->body_response, secondlevel);
 
@@ -297,6 +319,9 @@ static int send_get_response(struct nftlb_http_state *state)
 	else if (strcmp(firstlevel, CONFIG_KEY_ADDRESSES) == 0)
 		ret = config_print_addresses(&state->body_response, secondlevel);
 
+	else if (strcmp(firstlevel, CONFIG_KEY_STATS) == 0)
+		ret = config_print_stats(&state->body_response);
+
 	state->status_code = parse_to_http_status(ret);
 	if (ret) {
 		config_print_response(&state->body_response, "%s%s", "invalid request",
@@ -474,28 +499,56 @@ delete_end:
 static int send_post_response(struct nftlb_http_state *state)
 {
 	char firstlevel[SRV_MAX_IDENT] = {0};
+	char secondlevel[SRV_MAX_IDENT] = {0};
+	char thirdlevel[SRV_MAX_IDENT] = {0};
 	char message[SRV_MAX_IDENT] = {0};
 	int ret = 0;
 
-	sscanf(state->uri, "/%199[^\n]", firstlevel);
+	sscanf(state->uri, "/%199[^/]/%199[^/]/%199[^\n]", firstlevel, secondlevel, thirdlevel);
+
+	// POST /farms/<my_farm>/sessions
+	if (strcmp(firstlevel, CONFIG_KEY_FARMS) == 0 && strcmp(thirdlevel, CONFIG_KEY_SESSIONS) == 0) {
+		nft_fingerprint_reset();
+		ret = config_load_farm_sessions(secondlevel, state->body);
+		if (ret != PARSER_OK && ret != PARSER_VALID_FAILED) {
+			snprintf(message, SRV_MAX_IDENT, "%s", "error parsing sessions");
+			goto post_end;
+		}
+		if (ret == PARSER_OK)
+			goto post_rulerize;
+
+		// some sessions were rejected, the accepted ones are applied
+		if (obj_rulerize(OBJ_START)) {
+			snprintf(message, SRV_MAX_IDENT, "%s", "error generating rules");
+			ret = PARSER_FAILED;
+		} else
+			snprintf(message, SRV_MAX_IDENT, "%s", "sessions partially loaded");
+		goto post_end;
+	}
 
-	if ((strcmp(firstlevel, CONFIG_KEY_FARMS) != 0) &&
-		(strcmp(firstlevel, CONFIG_KEY_POLICIES) != 0) &&
-		(strcmp(firstlevel, CONFIG_KEY_ADDRESSES) != 0)) {
+	if ((strcmp(firstlevel, CONFIG_KEY_FARMS) != 0 &&
+		strcmp(firstlevel, CONFIG_KEY_POLICIES) != 0 &&
+		strcmp(firstlevel, CONFIG_KEY_ADDRESSES) != 0) ||
+		strcmp(secondlevel, "") != 0) {
 		snprintf(message, SRV_MAX_IDENT, "%s", "invalid request");
 		ret = PARSER_OBJ_UNKNOWN;
 		goto post_end;
 	}
 
+	nft_fingerprint_reset();
+
 	ret = server_load_config(state->body, message, ACTION_START);
 	if (ret != PARSER_OK)
 		goto post_end;
 
+post_rulerize:
+
 	snprintf(message, SRV_MAX_IDENT, "%s", "success");
 	if (obj_rulerize(OBJ_START)) {
 		snprintf(message, SRV_MAX_IDENT, "%s", "error generating rules");
 		ret = PARSER_FAILED;
-	}
+	} else if (nft_fingerprint_unchanged())
+		state->commit_skipped = 1;
 
 post_end:
 	config_print_response(&state->body_response, "%s%s", message, config_get_output());
@@ -612,6 +665,7 @@ struct nftlb_client {
 	struct ev_io		io;
 	struct ev_timer		timer;
 	struct sockaddr_storage	addr;
+	struct nftlb_http_state	state;
 };
 
 static char *nftlb_client_address(struct sockaddr_storage *addr, char *str)
@@ -654,17 +708,45 @@ static void nftlb_http_send_response(struct ev_io *io,
 {
 	char response[SRV_MAX_HEADER];
 
-	sprintf(response, "%s%s%d%s%s", ws_str_responses[state->status_code],
-		HTTP_HEADER_CONTENTLEN, size,
-		HTTP_LINE_END, HTTP_LINE_END);
+	sprintf(response, "%s%s%d%s%s%s", ws_str_responses[state->status_code],
+		HTTP_HEADER_CONTENTLEN, size, HTTP_LINE_END,
+		state->commit_skipped ? SRV_HEADER_COMMIT_SKIPPED : "",
+		HTTP_LINE_END);
 	send(io->fd, response, strlen(response), 0);
 }
 
+static void nftlb_http_send_body(struct ev_io *io, struct nftlb_http_state *state)
+{
+	nftlb_http_send_response(io, state, strlen(state->body_response));
+	send(io->fd, state->body_response, strlen(state->body_response), 0);
+}
+
+/* the response of a request that changed the ruleset waits for its commits */
+static void nftlb_commit_cb(void *data, int error)
+{
+	struct nftlb_client *cli = (struct nftlb_client *)data;
+	char cli_address[INET6_ADDRSTRLEN + 6]; //max address length + port length
+
+	if (error && cli->state.status_code == WS_HTTP_200) {
+		config_print_response(&cli->state.body_response, "%s", "error generating rules");
+		cli->state.status_code = parse_to_http_status(PARSER_FAILED);
+	}
+
+	nftlb_http_send_body(&cli->io, &cli->state);
+
+	u_log_print(LOG_DEBUG, "connection closed by server %s\n",
+				   nftlb_client_address(&cli->addr, cli_address));
+
+	fin_http_state(&cli->state);
+	nftlb_client_release(get_loop(), cli);
+}
+
 static void nftlb_read_cb(struct ev_loop *loop, struct ev_io *io, int revents)
 {
 	struct u_buffer buf;
 	struct nftlb_http_state state;
 	struct nftlb_client *cli;
+	unsigned int commit_id;
 	ssize_t size;
 	char cli_address[INET6_ADDRSTRLEN + 6]; //max address length + port length
 
@@ -676,10 +758,13 @@ static void nftlb_read_cb(struct ev_loop *loop, struct ev_io *io, int revents)
 
 	u_buf_create(&buf);
 	size = recv(io->fd, u_buf_get_data(&buf), U_DEF_BUFFER_SIZE - 1, 0);
-	if (size < 0)
+	if (size < 0) {
+		u_buf_clean(&buf);
 		return;
+	}
 
 	buf.next = size;
+	buf.data[size] = '\0';
 
 	if (size == 0) {
 		u_log_print(LOG_DEBUG, "connection closed by client %s\n",
@@ -695,13 +780,22 @@ static void nftlb_read_cb(struct ev_loop *loop, struct ev_io *io, int revents)
 		goto end;
 	}
 
+	commit_id = nft_commit_id();
+
 	if (send_response(&state) < 0) {
 		nftlb_http_send_response(io, &state, 0);
 		goto end;
 	}
 
-	nftlb_http_send_response(io, &state, strlen(state.body_response));
-	send(io->fd, state.body_response, strlen(state.body_response), 0);
+	cli->state = state;
+	if (nft_commit_notify(commit_id, nftlb_commit_cb, cli) == 0) {
+		u_buf_clean(&buf);
+		ev_io_stop(loop, &cli->io);
+		ev_timer_stop(loop, &cli->timer);
+		return;
+	}
+
+	nftlb_http_send_body(io, &state);
 
 	u_log_print(LOG_DEBUG, "connection closed by server %s\n",
 				   nftlb_client_address(&cli->addr, cli_address));
@@ -833,6 +927,7 @@ int server_init(void)
 
 void server_fini(void)
 {
+	ev_io_stop(get_loop(), events_get_srv());
 	events_delete_srv();
 	close(nftserver.sd);
 }
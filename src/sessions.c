@@ -22,6 +22,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 #include "sessions.h"
 #include "farms.h"
@@ -31,10 +33,72 @@
 #include "u_string.h"
 #include "u_log.h"
 
+extern unsigned int sessions_ttl;
+
+static unsigned long long session_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* milliseconds of an expiration printed by nft, like 1h2m3s456ms */
+static unsigned long long session_parse_expiration(const char *str)
+{
+	unsigned long long total = 0;
+	unsigned long long value;
+	char *end;
+
+	while (str && *str != '\0') {
+		value = strtoull(str, &end, 10);
+		if (end == str)
+			break;
+
+		if (strncmp(end, "ms", 2) == 0) {
+			total += value;
+			end++;
+		} else if (*end == 'd')
+			total += value * 86400000;
+		else if (*end == 'h')
+			total += value * 3600000;
+		else if (*end == 'm')
+			total += value * 60000;
+		else if (*end == 's')
+			total += value * 1000;
+		else
+			break;
+
+		str = end + 1;
+	}
+
+	return total;
+}
+
+/* backend of the map data, a mark, a mac or an ip address depending on the mode */
+static struct backend * session_lookup_backend(struct farm *f, const char *bck)
+{
+	if (!bck || strcmp(bck, "") == 0)
+		return NULL;
+
+	switch (f->mode) {
+	case VALUE_MODE_DNAT:
+	case VALUE_MODE_SNAT:
+		return backend_lookup_by_key(f, KEY_MARK, NULL, (int) strtol(bck, NULL, 16));
+	case VALUE_MODE_DSR:
+		return backend_lookup_by_key(f, KEY_ETHADDR, bck, 0);
+	case VALUE_MODE_STLSDNAT:
+		return backend_lookup_by_key(f, KEY_IPADDR, bck, 0);
+	default:
+		break;
+	}
+
+	return NULL;
+}
+
 static struct session * session_create(struct farm *f, int type, char *client, char *bck, char *expiration)
 {
 	struct session *s;
-	struct backend *b;
 
 	u_log_print(LOG_DEBUG, "%s():%d: farm %s type %d client %s bck %s expiration %s", __FUNCTION__, __LINE__, f->name, type, client, bck, expiration);
 
@@ -54,38 +118,22 @@ static struct session * session_create(struct farm *f, int type, char *client, c
 	s->state = VALUE_STATE_OFF;
 	s->action = ACTION_NONE;
 
-	s->bck = NULL;
-	if (!bck || strcmp(bck, "") == 0 )
-		goto cont;
-
-	switch (f->mode) {
-	case VALUE_MODE_DNAT:
-	case VALUE_MODE_SNAT:
-		if ((b = backend_lookup_by_key(f, KEY_MARK, NULL, (int) strtol(bck, NULL, 16))) != NULL)
-			s->bck = b;
-		break;
-	case VALUE_MODE_DSR:
-		if ((b = backend_lookup_by_key(f, KEY_ETHADDR, bck, 0)) != NULL)
-			s->bck = b;
-		break;
-	case VALUE_MODE_STLSDNAT:
-		if ((b = backend_lookup_by_key(f, KEY_IPADDR, bck, 0)) != NULL)
-			s->bck = b;
-		break;
-	default:
-		break;
-	}
-
-cont:
+	s->bck = session_lookup_backend(f, bck);
+	init_list_head(&s->bck_list);
 	s->expiration = DEFAULT_SESSION_EXPIRATION;
 
 	if (type == SESSION_TYPE_TIMED) {
 		s->state = VALUE_STATE_UP;
 		list_add_tail(&s->list, &f->timed_sessions);
+		u_hash_add(&f->timed_sessions_index, s->client, s);
 		f->total_timed_sessions++;
 		obj_set_attribute_string(expiration, &s->expiration);
+		s->expires = session_now() + session_parse_expiration(expiration);
+		if (s->bck)
+			list_add_tail(&s->bck_list, &s->bck->timed_sessions);
 	} else {
 		list_add_tail(&s->list, &f->static_sessions);
+		u_hash_add(&f->static_sessions_index, s->client, s);
 		f->total_static_sessions++;
 	}
 
@@ -160,17 +208,22 @@ static int session_delete_node(struct session *s, int type)
 	u_log_print(LOG_DEBUG, "%s():%d: client %s", __FUNCTION__, __LINE__, s->client);
 
 	list_del(&s->list);
+	list_del(&s->bck_list);
 
-	if (type == SESSION_TYPE_STATIC)
+	if (type == SESSION_TYPE_STATIC) {
+		u_hash_del(&s->f->static_sessions_index, s->client, s);
 		s->f->total_static_sessions--;
-	else
+	} else {
+		u_hash_del(&s->f->timed_sessions_index, s->client, s);
 		s->f->total_timed_sessions--;
+	}
 
 	if (s->client)
 		free(s->client);
 	if (s->expiration)
 		free(s->expiration);
 
+	nft_txn_forget(s, sizeof(struct session));
 	free(s);
 
 	return 0;
@@ -209,23 +262,18 @@ int session_set_action(struct session *s, int type, int action)
 
 struct session * session_lookup_by_key(struct farm *f, int type, int key, const char *name)
 {
-	struct session *s;
-	struct list_head *sessions;
+	struct u_hash *sessions;
 
 	if (type == SESSION_TYPE_TIMED)
-		sessions = &f->timed_sessions;
+		sessions = &f->timed_sessions_index;
 	else
-		sessions = &f->static_sessions;
+		sessions = &f->static_sessions_index;
 
-	list_for_each_entry(s, sessions, list) {
-		switch (key) {
-		case KEY_CLIENT:
-			if (strcmp(s->client, name) == 0)
-				return s;
-			break;
-		default:
-			return NULL;
-		}
+	switch (key) {
+	case KEY_CLIENT:
+		return (struct session *)u_hash_lookup(sessions, name);
+	default:
+		break;
 	}
 
 	return NULL;
@@ -247,6 +295,9 @@ int session_s_delete(struct farm *f, int type)
 	list_for_each_entry_safe(s, next, sessions, list)
 		session_delete_node(s, type);
 
+	if (type == SESSION_TYPE_TIMED)
+		f->timed_sessions_stamp = 0;
+
 	return 0;
 }
 
@@ -299,18 +350,36 @@ void session_s_print(struct farm *f)
 	}
 }
 
+static int session_dump_cb(struct farm *f, char *client, char *bck, char *expiration, void *data)
+{
+	session_create(f, SESSION_TYPE_TIMED, client, bck, expiration);
+
+	return 0;
+}
+
 int session_get_timed(struct farm *f)
 {
 	struct farmaddress *fa;
 	struct nftst *n = nftst_create_from_farm(f);
 	const char *buf;
+	int families = 0;
 
 	u_log_print(LOG_DEBUG, "%s():%d: farm %s", __FUNCTION__, __LINE__, f->name);
 
-	f->total_timed_sessions = 0;
+	session_s_delete(f, SESSION_TYPE_TIMED);
+	f->timed_sessions_stamp = session_now();
 	list_for_each_entry(fa, &f->addresses, list) {
+		// the addresses of the same family share the persistence map
+		if (families & (1 << fa->address->family))
+			continue;
+		families |= 1 << fa->address->family;
+
 		nftst_set_address(n, fa->address);
 		nftst_set_action(n, fa->action);
+		if (nft_get_sessions(n, session_dump_cb, NULL) >= 0)
+			continue;
+
+		// the netlink dump isn't available, parse the nft listing instead
 		nft_get_rules_buffer(&buf, KEY_SESSIONS, n);
 		nft_parse_sessions(f, buf);
 		nft_del_rules_buffer(buf);
@@ -320,9 +389,295 @@ int session_get_timed(struct farm *f)
 	return 0;
 }
 
-int session_get_client(struct session *s, char **parsed)
+/* forget the sessions already removed from the map or expired since the dump */
+static void session_s_prune_timed(struct farm *f)
 {
-	sprintf(*parsed, "%s", s->client);
+	unsigned long long now = session_now();
+	struct session *s, *next;
+
+	list_for_each_entry_safe(s, next, &f->timed_sessions, list) {
+		if ((s->state == VALUE_STATE_OFF && s->action == ACTION_NONE) || s->expires <= now)
+			session_delete_node(s, SESSION_TYPE_TIMED);
+	}
+}
+
+static int session_timed_cached(struct farm *f)
+{
+	return sessions_ttl && f->timed_sessions_stamp &&
+		session_now() - f->timed_sessions_stamp < (unsigned long long)sessions_ttl * 1000;
+}
+
+/* reuse the timed sessions of a recent dump, otherwise dump them again */
+int session_get_timed_cached(struct farm *f)
+{
+	if (!session_timed_cached(f))
+		return session_get_timed(f);
+
+	u_log_print(LOG_DEBUG, "%s():%d: farm %s using %d cached sessions", __FUNCTION__, __LINE__, f->name, f->total_timed_sessions);
+	session_s_prune_timed(f);
+
+	return 0;
+}
+
+/* release the timed sessions once their actions are applied, or keep them cached */
+void session_put_timed(struct farm *f)
+{
+	if (!sessions_ttl) {
+		session_s_delete(f, SESSION_TYPE_TIMED);
+		return;
+	}
+
+	session_s_prune_timed(f);
+}
+
+void session_filter_init(struct session_filter *flt)
+{
+	memset(flt, 0, sizeof(struct session_filter));
+}
+
+void session_filter_clean(struct session_filter *flt)
+{
+	if (flt->client)
+		free(flt->client);
+	session_filter_init(flt);
+}
+
+/* the client is an address prefix like 10.0.0.0/8 or the beginning of the client key */
+static int session_filter_set_client(struct session_filter *flt, const char *value)
+{
+	char addr[INET6_ADDRSTRLEN] = { 0 };
+	char *prefix;
+	char *end;
+	int max;
+
+	obj_set_attribute_string((char *)value, &flt->client);
+	flt->client_family = 0;
+
+	snprintf(addr, INET6_ADDRSTRLEN, "%s", value);
+	prefix = strchr(addr, '/');
+	if (prefix)
+		*prefix++ = '\0';
+
+	if (inet_pton(AF_INET, addr, flt->client_addr) == 1) {
+		flt->client_family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, addr, flt->client_addr) == 1) {
+		flt->client_family = AF_INET6;
+		max = 128;
+	} else
+		return PARSER_OK;
+
+	flt->client_prefix = max;
+	if (!prefix)
+		return PARSER_OK;
+
+	flt->client_prefix = (int)strtol(prefix, &end, 10);
+	if (*prefix == '\0' || *end != '\0' || flt->client_prefix < 0 || flt->client_prefix > max)
+		return PARSER_VALID_FAILED;
+
+	return PARSER_OK;
+}
+
+int session_filter_set(struct farm *f, struct session_filter *flt, int key, const char *value)
+{
+	char *end;
+
+	switch (key) {
+	case KEY_BACKEND:
+		flt->bck = backend_lookup_by_key(f, KEY_NAME, value, 0);
+		if (!flt->bck) {
+			config_set_output(". Unknown backend '%s'", value);
+			return PARSER_OBJ_UNKNOWN;
+		}
+		break;
+	case KEY_CLIENT:
+		return session_filter_set_client(flt, value);
+	case KEY_EXPIRESBEFORE:
+		// plain seconds or a time like 1m30s
+		flt->expires_before = strtoull(value, &end, 10) * 1000;
+		if (*end != '\0')
+			flt->expires_before = session_parse_expiration(value);
+		if (!flt->expires_before)
+			return PARSER_VALID_FAILED;
+		break;
+	default:
+		return PARSER_STRUCT_FAILED;
+	}
+
+	return PARSER_OK;
+}
+
+static int session_filter_client(struct session_filter *flt, const char *client)
+{
+	unsigned char addr[16];
+	char str[INET6_ADDRSTRLEN];
+	size_t len;
+	int bytes, bits;
+
+	if (!flt->client)
+		return 1;
+
+	if (!flt->client_family)
+		return strncmp(client, flt->client, strlen(flt->client)) == 0;
+
+	// the address is the first field of a concatenated client key
+	len = strcspn(client, " ");
+	if (len >= INET6_ADDRSTRLEN)
+		return 0;
+	memcpy(str, client, len);
+	str[len] = '\0';
+
+	if (inet_pton(flt->client_family, str, addr) != 1)
+		return 0;
+
+	bytes = flt->client_prefix / 8;
+	bits = flt->client_prefix % 8;
+	if (memcmp(addr, flt->client_addr, bytes) != 0)
+		return 0;
+	if (bits && ((addr[bytes] ^ flt->client_addr[bytes]) & (0xff << (8 - bits)) & 0xff))
+		return 0;
+
+	return 1;
+}
+
+static int session_filter_backend(struct farm *f, struct session_filter *flt, struct backend *bck)
+{
+	if (!flt->bck || bck == flt->bck)
+		return 1;
+
+	// the backends sharing a mark share its sessions
+	return bck && (f->mode == VALUE_MODE_DNAT || f->mode == VALUE_MODE_SNAT || f->mode == VALUE_MODE_LOCAL) &&
+		backend_get_mark(bck) == backend_get_mark(flt->bck);
+}
+
+static int session_filter_expiration(struct session_filter *flt, const char *expiration)
+{
+	if (!flt->expires_before)
+		return 1;
+
+	return expiration && session_parse_expiration(expiration) < flt->expires_before;
+}
+
+static int session_filter_match(struct farm *f, struct session_filter *flt, const char *client, struct backend *bck, const char *expiration)
+{
+	return session_filter_client(flt, client) &&
+		session_filter_expiration(flt, expiration) &&
+		session_filter_backend(f, flt, bck);
+}
+
+struct session_dump {
+	struct session_filter	*flt;
+	session_filter_cb		cb;
+	void					*data;
+};
+
+static int session_s_dump_cb(struct farm *f, char *client, char *bck, char *expiration, void *data)
+{
+	struct session_dump *dump = (struct session_dump *)data;
+	struct backend *b;
+
+	// the static session of the client is matched first in the ruleset
+	if (u_hash_lookup(&f->static_sessions_index, client))
+		return 0;
+
+	// the backend is resolved only for the clients that pass the other checks
+	if (!session_filter_client(dump->flt, client) ||
+		!session_filter_expiration(dump->flt, expiration))
+		return 0;
+
+	b = session_lookup_backend(f, bck);
+	if (!session_filter_backend(f, dump->flt, b))
+		return 0;
+
+	return dump->cb(f, client, b, expiration, dump->data);
+}
+
+static void session_s_dump_list(struct farm *f, struct list_head *sessions, struct session_filter *flt, session_filter_cb cb, void *data)
+{
+	struct session *s;
+
+	list_for_each_entry(s, sessions, list) {
+		if (sessions == &f->timed_sessions && u_hash_lookup(&f->static_sessions_index, s->client))
+			continue;
+		if (session_filter_match(f, flt, s->client, s->bck, s->expiration))
+			cb(f, s->client, s->bck, s->expiration, data);
+	}
+}
+
+/*
+ * Stream the static and timed sessions of the farm that match the filter.
+ * The timed session of a client with a static session is skipped. The timed
+ * sessions are filtered while they are read from the kernel, so the
+ * discarded ones are never stored. If the dump fails, the callback is
+ * called with a NULL client to discard what it got so far and the sessions
+ * are sent again from the parsed listing. Returns the number of timed
+ * sessions read before filtering them, which is the fill of the maps.
+ */
+int session_s_dump(struct farm *f, struct session_filter *flt, session_filter_cb cb, void *data)
+{
+	struct session_dump dump = { flt, cb, data };
+	struct farmaddress *fa;
+	struct nftst *n;
+	int families = 0;
+	int total = 0;
+	int ret = 0;
+
+	session_s_dump_list(f, &f->static_sessions, flt, cb, data);
+
+	n = nftst_create_from_farm(f);
+	list_for_each_entry(fa, &f->addresses, list) {
+		// the addresses of the same family share the persistence map
+		if (families & (1 << fa->address->family))
+			continue;
+		families |= 1 << fa->address->family;
+
+		nftst_set_address(n, fa->address);
+		nftst_set_action(n, fa->action);
+		if ((ret = nft_get_sessions(n, session_s_dump_cb, &dump)) < 0)
+			break;
+		total += ret;
+	}
+	nftst_delete(n);
+
+	if (ret >= 0)
+		return total;
+
+	// the netlink dump isn't available, filter the parsed sessions instead
+	cb(f, NULL, NULL, NULL, data);
+	session_s_dump_list(f, &f->static_sessions, flt, cb, data);
+	session_get_timed(f);
+	session_s_dump_list(f, &f->timed_sessions, flt, cb, data);
+	total = f->total_timed_sessions;
+	session_put_timed(f);
+
+	return total;
+}
+
+/*
+ * Pin the client to the backend with a static session, updating the session
+ * of the client if it already exists. Returns 1 if the session changed, 0 if
+ * it was already pinned to the backend or -1 if it can't be created.
+ */
+int session_set_static(struct farm *f, const char *client, const char *bck)
+{
+	struct session *s;
+	struct backend *b;
+
+	b = backend_lookup_by_key(f, KEY_NAME, bck, 0);
+	if (!b)
+		return -1;
+
+	s = session_lookup_by_key(f, SESSION_TYPE_STATIC, KEY_CLIENT, client);
+	if (!s) {
+		s = session_create(f, SESSION_TYPE_STATIC, (char *)client, NULL, NULL);
+		if (!s)
+			return -1;
+	} else if (s->bck == b)
+		return 0;
+
+	s->bck = b;
+	if (!session_set_action(s, SESSION_TYPE_STATIC, ACTION_START))
+		session_set_action(s, SESSION_TYPE_STATIC, ACTION_RELOAD);
 
 	return 1;
 }
@@ -330,7 +685,7 @@ int session_get_client(struct session *s, char **parsed)
 int session_backend_action(struct farm *f, struct backend *b, int action)
 {
 	struct session *s, *next;
-	int hastimed = f->total_timed_sessions;
+	struct backend *bck;
 
 	u_log_print(LOG_DEBUG, "%s():%d: farm %s backend %s action %d", __FUNCTION__, __LINE__, f->name, b->name, action);
 
@@ -343,25 +698,49 @@ int session_backend_action(struct farm *f, struct backend *b, int action)
 		}
 	}
 
-	if (!hastimed)
-		session_get_timed(f);
+	// sessions dumped just for this call would be released before applying their actions
+	if (sessions_ttl)
+		session_get_timed_cached(f);
+	else if (!f->timed_sessions_stamp)
+		return 0;
 
-	if (f->total_timed_sessions != 0) {
-		list_for_each_entry_safe(s, next, &f->timed_sessions, list) {
-			if (s->bck &&
-				((farm_is_ingress_mode(f) && b == s->bck) ||
-				 obj_equ_attribute_int(backend_get_mark(b), backend_get_mark(s->bck)))) {
-				session_set_action(s, SESSION_TYPE_TIMED, action);
-			}
-		}
+	// only the sessions pinned to the backend or to its mark are visited
+	list_for_each_entry(bck, &f->backends, list) {
+		if (bck != b && !obj_equ_attribute_int(backend_get_mark(b), backend_get_mark(bck)))
+			continue;
+		list_for_each_entry_safe(s, next, &bck->timed_sessions, bck_list)
+			session_set_action(s, SESSION_TYPE_TIMED, action);
 	}
 
-	if (!hastimed)
-		session_s_delete(f, SESSION_TYPE_TIMED);
-
 	return 0;
 }
 
+/* the sessions left pinned to a deleted backend stay without backend */
+void session_backend_detach(struct farm *f, struct backend *b)
+{
+	struct session *s, *next;
+
+	list_for_each_entry_safe(s, next, &b->timed_sessions, bck_list) {
+		s->bck = NULL;
+		list_del_init(&s->bck_list);
+	}
+
+	list_for_each_entry(s, &f->static_sessions, list) {
+		if (s->bck == b)
+			s->bck = NULL;
+	}
+}
+
+/*
+ * The cached timed sessions were resolved to the backends by their mark,
+ * ether or ip address, so they are dumped again after any of them changed.
+ */
+void session_uncache_timed(struct farm *f)
+{
+	if (sessions_ttl)
+		f->timed_sessions_stamp = 0;
+}
+
 int session_set_attribute(struct config_pair *c)
 {
 	struct farm *f = obj_get_current_farm();
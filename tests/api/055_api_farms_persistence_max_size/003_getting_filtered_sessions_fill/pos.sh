@@ -0,0 +1,8 @@
+#!/bin/bash
+
+logger ">> POS"
+# the expiration counts down, only its format is checked
+sed -i -E 's/"expiration": "([0-9]+[dhms]|[0-9]+ms)+"/"expiration": "<timeout>"/' report-*-req.out
+nft delete element nftlb persist-newfarm { 192.168.44.4, 192.168.44.5 }
+nft list map nftlb persist-newfarm | logger
+logger "POS <<"
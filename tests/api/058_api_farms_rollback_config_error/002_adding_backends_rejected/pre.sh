@@ -0,0 +1,7 @@
+#!/bin/bash
+
+logger ">> PRE"
+nft delete element nftlb nat-proto-services { tcp . 200.1.1.2 . 80 }
+nft delete chain nftlb nat-lb02
+nft list table nftlb | logger
+logger "PRE <<"
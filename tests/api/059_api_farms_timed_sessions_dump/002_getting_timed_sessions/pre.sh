@@ -0,0 +1,6 @@
+#!/bin/bash
+
+logger ">> PRE"
+nft add element nftlb persist-newfarm { 192.168.44.4 : 0x00000202 }
+nft list map nftlb persist-newfarm | logger
+logger "PRE <<"
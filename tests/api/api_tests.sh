@@ -27,6 +27,15 @@ REPORTS=0
 STOP=""
 TESTGROUP=""
 
+# test groups executed again with other options, expecting the same results
+RERUN_GROUPS=(
+	"001_api_managing_backends/ -S"
+	"003_api_managing_farms_persistence/ -s"
+	"016_api_remove_bck_maintenance/ -T 10"
+	"018_api_farms_dyn_sessions/ -T 10"
+	"059_api_farms_timed_sessions_dump/ -N"
+)
+
 while getopts "g:s:r" o; do
     case "${o}" in
         g)
@@ -46,17 +55,25 @@ shift $((OPTIND-1))
 
 echo "" > /var/log/syslog
 
+RUNS=()
 for DIRTEST0 in `ls -d */`; do
+	RUNS+=("${DIRTEST0} ")
+done
+RUNS+=("${RERUN_GROUPS[@]}")
+
+for RUN in "${RUNS[@]}"; do
+	DIRTEST0=${RUN%% *}
+	GROUP_ARGS=${RUN#* }
 	if [ "$TESTGROUP" != "" ] && [[ "${TESTGROUP}" != "${DIRTEST0}"* ]]; then
 		continue
 	fi
 
 kill -9 `pidof nftlb` 2> /dev/null
 $NFTBIN flush ruleset
-$NFTLBIN $NFTLB_ARGS -d -k "$APISRV_KEY" -H $APISRV_ADDR -P $APISRV_PORT -l $DEBUG > /dev/null
+$NFTLBIN $NFTLB_ARGS $GROUP_ARGS -d -k "$APISRV_KEY" -H $APISRV_ADDR -P $APISRV_PORT -l $DEBUG > /dev/null
 sleep 1s
 
-	echo "$DIRTEST0: "
+	echo "${DIRTEST0}${GROUP_ARGS:+ $GROUP_ARGS}: "
 	cd ${DIRTEST0}
 
 	for DIRTEST in `ls -d */`; do
@@ -46,13 +46,23 @@ for test in `ls -d ${TESTS}`; do
 	inputfile="${test}/input.json"
 	outputfile="${test}/output.nft"
 	reportfile="${test}/report-output.nft"
+	argsfile="${test}/args"
+
+	testargs=""
+	if [ -f ${argsfile} ]; then
+		if [ $APISERVER -eq 1 ]; then
+			echo "Skipped, it requires nftlb options"
+			continue;
+		fi
+		testargs=`cat ${argsfile}`
+	fi
 
 	if [ $APISERVER -eq 1 ]; then
 		$CURL -H "Expect:" -H "Key: $APISRV_KEY" -X DELETE http://localhost:$APISRV_PORT/farms
 		$CURL -H "Expect:" -H "Key: $APISRV_KEY" -X POST http://localhost:$APISRV_PORT/farms -d "@${inputfile}"
 		statusexec=$?
 	else
-		$NFTLBIN $NFTLB_ARGS -e -l 7 -c ${inputfile}
+		$NFTLBIN $NFTLB_ARGS $testargs -e -l 7 -c ${inputfile}
 		statusexec=$?
 	fi
 
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) RELIANOID
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _U_HASH_H_
+#define _U_HASH_H_
+
+#define U_HASH_MIN_SIZE 16
+
+struct u_hash_entry {
+	struct u_hash_entry *next;
+	unsigned int hash;
+	char *key;
+	void *data;
+};
+
+/*
+ * String keyed hash table with chained buckets. A zeroed table is a valid
+ * empty table, the buckets are allocated with the first entry.
+ */
+struct u_hash {
+	struct u_hash_entry **buckets;
+	unsigned int size;
+	unsigned int count;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void u_hash_init(struct u_hash *h);
+void u_hash_clean(struct u_hash *h);
+int u_hash_add(struct u_hash *h, const char *key, void *data);
+int u_hash_del(struct u_hash *h, const char *key, void *data);
+void *u_hash_lookup(struct u_hash *h, const char *key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _U_HASH_H_ */
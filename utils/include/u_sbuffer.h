@@ -22,6 +22,7 @@
 #include "u_common.h"
 
 #define EXTRA_SIZE 1024
+#define U_BUF_SCRATCH_MAX_SIZE (64 * 1024)
 
 struct u_buffer {
 	int size;
@@ -36,12 +37,14 @@ extern "C" {
 int u_buf_get_size(struct u_buffer *buf);
 char *u_buf_get_next(struct u_buffer *buf);
 int u_buf_resize(struct u_buffer *buf, int times);
+int u_buf_reserve(struct u_buffer *buf, int len);
 int u_buf_create(struct u_buffer *buf);
 int u_buf_isempty(struct u_buffer *buf);
 char *u_buf_get_data(struct u_buffer *buf);
 int u_buf_clean(struct u_buffer *buf);
 int u_buf_reset(struct u_buffer *buf);
 int u_buf_concat_va(struct u_buffer *buf, int len, char *fmt, va_list args);
+int u_buf_vconcat(struct u_buffer *buf, char *fmt, va_list args);
 int u_buf_concat(struct u_buffer *buf, char *fmt, ...);
 
 #ifdef __cplusplus
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) RELIANOID
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "u_hash.h"
+#include "u_log.h"
+
+static unsigned int u_hash_key(const char *key)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* append the entry to its bucket, so entries with the same key keep the insertion order */
+static void u_hash_link(struct u_hash_entry **buckets, unsigned int size, struct u_hash_entry *e)
+{
+	struct u_hash_entry **pe = &buckets[e->hash & (size - 1)];
+
+	while (*pe)
+		pe = &(*pe)->next;
+
+	e->next = NULL;
+	*pe = e;
+}
+
+static int u_hash_resize(struct u_hash *h, unsigned int size)
+{
+	struct u_hash_entry **buckets;
+	struct u_hash_entry *e, *next;
+	unsigned int i;
+
+	buckets = (struct u_hash_entry **)calloc(size, sizeof(struct u_hash_entry *));
+	if (!buckets)
+		return 1;
+
+	for (i = 0; i < h->size; i++) {
+		for (e = h->buckets[i]; e; e = next) {
+			next = e->next;
+			u_hash_link(buckets, size, e);
+		}
+	}
+
+	if (h->buckets)
+		free(h->buckets);
+	h->buckets = buckets;
+	h->size = size;
+
+	return 0;
+}
+
+void u_hash_init(struct u_hash *h)
+{
+	h->buckets = NULL;
+	h->size = 0;
+	h->count = 0;
+}
+
+void u_hash_clean(struct u_hash *h)
+{
+	struct u_hash_entry *e, *next;
+	unsigned int i;
+
+	for (i = 0; i < h->size; i++) {
+		for (e = h->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e->key);
+			free(e);
+		}
+	}
+
+	if (h->buckets)
+		free(h->buckets);
+	u_hash_init(h);
+}
+
+int u_hash_add(struct u_hash *h, const char *key, void *data)
+{
+	struct u_hash_entry *e;
+
+	if (!key)
+		return 1;
+
+	if (h->count >= h->size &&
+		u_hash_resize(h, h->size ? h->size * 2 : U_HASH_MIN_SIZE)) {
+		u_log_print(LOG_ERR, "Error resizing the hash table from a size of %d!", h->size);
+		return 1;
+	}
+
+	e = (struct u_hash_entry *)malloc(sizeof(struct u_hash_entry));
+	if (!e)
+		return 1;
+
+	e->key = strdup(key);
+	if (!e->key) {
+		free(e);
+		return 1;
+	}
+	e->hash = u_hash_key(key);
+	e->data = data;
+
+	u_hash_link(h->buckets, h->size, e);
+	h->count++;
+
+	return 0;
+}
+
+int u_hash_del(struct u_hash *h, const char *key, void *data)
+{
+	struct u_hash_entry **pe, *e;
+	unsigned int hash;
+
+	if (!key || !h->size)
+		return 1;
+
+	hash = u_hash_key(key);
+	for (pe = &h->buckets[hash & (h->size - 1)]; (e = *pe); pe = &e->next) {
+		if (e->data == data && e->hash == hash && strcmp(e->key, key) == 0) {
+			*pe = e->next;
+			free(e->key);
+			free(e);
+			h->count--;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+void *u_hash_lookup(struct u_hash *h, const char *key)
+{
+	struct u_hash_entry *e;
+	unsigned int hash;
+
+	if (!key || !h->size)
+		return NULL;
+
+	hash = u_hash_key(key);
+	for (e = h->buckets[hash & (h->size - 1)]; e; e = e->next) {
+		if (e->hash == hash && strcmp(e->key, key) == 0)
+			return e->data;
+	}
+
+	return NULL;
+}
@@ -75,17 +75,22 @@ int u_log_print(int loglevel, const char *fmt, ...)
     if (loglevel > u_log_level)
         return 0;
 
+    // other threads log as well, so every line is written at once
     if (u_log_output & UTILS_LOG_OUTPUT_STDOUT) {
         va_start(args, fmt);
+        flockfile(stdout);
         vfprintf(stdout, fmt, args);
         fprintf(stdout, "\n");
+        funlockfile(stdout);
         va_end(args);
     }
 
     if (u_log_output & UTILS_LOG_OUTPUT_STDERR) {
         va_start(args, fmt);
+        flockfile(stderr);
         vfprintf(stderr, fmt, args);
         fprintf(stderr, "\n");
+        funlockfile(stderr);
         va_end(args);
     }
 
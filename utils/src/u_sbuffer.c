@@ -15,6 +15,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <pthread.h>
+#include <string.h>
 #include "u_sbuffer.h"
 #include "u_log.h"
 
@@ -28,15 +30,34 @@ char *u_buf_get_next(struct u_buffer *buf)
 	return buf->data + buf->next;
 }
 
-int u_buf_resize(struct u_buffer *buf, int times)
+/*
+ * Keep the last released buffer of every thread to be reused by the next
+ * u_buf_create() of that thread, so generating the rules of every farm doesn't
+ * pay a fresh allocation and its regrowth each time. The slot is bounded to
+ * the sizes calloc() zeroes by hand anyway, so zeroing a reused buffer costs
+ * the same. A thread specific key frees the slot when its thread exits.
+ */
+static __thread char *u_buf_scratch;
+static __thread int u_buf_scratch_size;
+static pthread_key_t u_buf_scratch_key;
+static pthread_once_t u_buf_scratch_once = PTHREAD_ONCE_INIT;
+
+static void u_buf_scratch_key_create(void)
 {
-	char *pbuf;
-	int newsize;
+	pthread_key_create(&u_buf_scratch_key, free);
+}
 
-	if (times == 0)
-		return 0;
+static void u_buf_scratch_set(char *data, int size)
+{
+	pthread_once(&u_buf_scratch_once, u_buf_scratch_key_create);
+	pthread_setspecific(u_buf_scratch_key, data);
+	u_buf_scratch = data;
+	u_buf_scratch_size = size;
+}
 
-	newsize = buf->size + (times * EXTRA_SIZE) + 1;
+static int u_buf_grow(struct u_buffer *buf, int newsize)
+{
+	char *pbuf;
 
 	if (!buf->data)
 		return 1;
@@ -50,11 +71,53 @@ int u_buf_resize(struct u_buffer *buf, int times)
 	return 0;
 }
 
+int u_buf_resize(struct u_buffer *buf, int times)
+{
+	int newsize;
+
+	if (times == 0)
+		return 0;
+
+	newsize = buf->size + (times * EXTRA_SIZE) + 1;
+	if (newsize < buf->size * 2)
+		newsize = buf->size * 2;
+
+	return u_buf_grow(buf, newsize);
+}
+
+/* ensure room for len more bytes plus the terminator, doubling the size */
+int u_buf_reserve(struct u_buffer *buf, int len)
+{
+	int newsize = buf->size ? buf->size : U_DEF_BUFFER_SIZE;
+
+	if (buf->next + len < buf->size)
+		return 0;
+
+	while (buf->next + len >= newsize)
+		newsize *= 2;
+
+	if (u_buf_grow(buf, newsize)) {
+		u_log_print(LOG_ERR, "Error resizing the buffer to %d from a size of %d!",
+			newsize, buf->size);
+		return 1;
+	}
+
+	return 0;
+}
+
 int u_buf_create(struct u_buffer *buf)
 {
 	buf->size = 0;
 	buf->next = 0;
 
+	if (u_buf_scratch) {
+		buf->data = u_buf_scratch;
+		buf->size = u_buf_scratch_size;
+		u_buf_scratch_set(NULL, 0);
+		memset(buf->data, 0, buf->size);
+		return 0;
+	}
+
 	buf->data = (char *)calloc(1, U_DEF_BUFFER_SIZE);
 	if (!buf->data) {
 		return 1;
@@ -77,8 +140,13 @@ char *u_buf_get_data(struct u_buffer *buf)
 
 int u_buf_clean(struct u_buffer *buf)
 {
-	if (buf->data)
-		free(buf->data);
+	if (buf->data) {
+		if (!u_buf_scratch && buf->size <= U_BUF_SCRATCH_MAX_SIZE)
+			u_buf_scratch_set(buf->data, buf->size);
+		else
+			free(buf->data);
+	}
+	buf->data = NULL;
 	buf->size = 0;
 	buf->next = 0;
 	return 0;
@@ -114,17 +182,41 @@ int u_buf_concat_va(struct u_buffer *buf, int len, char *fmt, va_list args)
 	return 0;
 }
 
-int u_buf_concat(struct u_buffer *buf, char *fmt, ...)
+/* format straight into the free space, only retry when it doesn't fit */
+int u_buf_vconcat(struct u_buffer *buf, char *fmt, va_list args)
 {
+	va_list cargs;
 	int len;
-	va_list args;
 
-	va_start(args, fmt);
-	len = vsnprintf(0, 0, fmt, args);
-	va_end(args);
+	if (!buf->data)
+		return 1;
+
+	va_copy(cargs, args);
+	len = vsnprintf(u_buf_get_next(buf), buf->size - buf->next, fmt, cargs);
+	va_end(cargs);
+
+	if (len < 0)
+		return 1;
+
+	if (buf->next + len >= buf->size) {
+		if (u_buf_reserve(buf, len))
+			return 1;
+		va_copy(cargs, args);
+		vsnprintf(u_buf_get_next(buf), len + 1, fmt, cargs);
+		va_end(cargs);
+	}
+
+	buf->next += len;
+
+	return 0;
+}
+
+int u_buf_concat(struct u_buffer *buf, char *fmt, ...)
+{
+	va_list args;
 
 	va_start(args, fmt);
-	u_buf_concat_va(buf, len, fmt, args);
+	u_buf_vconcat(buf, fmt, args);
 	va_end(args);
 
 	return 0;
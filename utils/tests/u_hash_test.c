@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) RELIANOID
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "u_hash.h"
+
+#define CHECK(cond)									\
+	do {										\
+		if (!(cond)) {								\
+			fprintf(stderr, "%s:%d: check failed: %s\n",			\
+				__FILE__, __LINE__, #cond);				\
+			return 1;							\
+		}									\
+	} while (0)
+
+static int test_lookup(void)
+{
+	struct u_hash h;
+	int data[3];
+
+	u_hash_init(&h);
+	CHECK(u_hash_lookup(&h, "bck0") == NULL);
+	CHECK(u_hash_del(&h, "bck0", &data[0]) == 1);
+
+	CHECK(u_hash_add(&h, "bck0", &data[0]) == 0);
+	CHECK(u_hash_add(&h, "bck1", &data[1]) == 0);
+	CHECK(u_hash_add(&h, NULL, &data[2]) == 1);
+	CHECK(h.count == 2);
+	CHECK(u_hash_lookup(&h, "bck0") == &data[0]);
+	CHECK(u_hash_lookup(&h, "bck1") == &data[1]);
+	CHECK(u_hash_lookup(&h, "bck2") == NULL);
+	CHECK(u_hash_lookup(&h, NULL) == NULL);
+
+	CHECK(u_hash_del(&h, "bck0", &data[1]) == 1);
+	CHECK(u_hash_del(&h, "bck0", &data[0]) == 0);
+	CHECK(u_hash_lookup(&h, "bck0") == NULL);
+	CHECK(h.count == 1);
+
+	u_hash_clean(&h);
+	CHECK(h.count == 0 && h.size == 0 && h.buckets == NULL);
+	return 0;
+}
+
+/* the entries with the same key are found in insertion order */
+static int test_duplicates(void)
+{
+	struct u_hash h;
+	int data[3];
+
+	u_hash_init(&h);
+	CHECK(u_hash_add(&h, "10.0.0.1", &data[0]) == 0);
+	CHECK(u_hash_add(&h, "10.0.0.1", &data[1]) == 0);
+	CHECK(u_hash_add(&h, "10.0.0.1", &data[2]) == 0);
+	CHECK(u_hash_lookup(&h, "10.0.0.1") == &data[0]);
+
+	CHECK(u_hash_del(&h, "10.0.0.1", &data[1]) == 0);
+	CHECK(u_hash_lookup(&h, "10.0.0.1") == &data[0]);
+	CHECK(u_hash_del(&h, "10.0.0.1", &data[0]) == 0);
+	CHECK(u_hash_lookup(&h, "10.0.0.1") == &data[2]);
+
+	u_hash_clean(&h);
+	return 0;
+}
+
+/* the table grows past its minimum size and keeps every entry */
+static int test_resize(void)
+{
+	struct u_hash h;
+	static int data[U_HASH_MIN_SIZE * 8];
+	char key[32];
+	int i;
+
+	u_hash_init(&h);
+	for (i = 0; i < U_HASH_MIN_SIZE * 8; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		CHECK(u_hash_add(&h, key, &data[i]) == 0);
+	}
+	CHECK(h.count == U_HASH_MIN_SIZE * 8);
+	CHECK(h.size >= h.count);
+	CHECK((h.size & (h.size - 1)) == 0);
+
+	for (i = 0; i < U_HASH_MIN_SIZE * 8; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		CHECK(u_hash_lookup(&h, key) == &data[i]);
+	}
+
+	for (i = 0; i < U_HASH_MIN_SIZE * 8; i += 2) {
+		snprintf(key, sizeof(key), "key%d", i);
+		CHECK(u_hash_del(&h, key, &data[i]) == 0);
+	}
+	for (i = 0; i < U_HASH_MIN_SIZE * 8; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		CHECK(u_hash_lookup(&h, key) == (i % 2 ? &data[i] : NULL));
+	}
+
+	u_hash_clean(&h);
+	return 0;
+}
+
+int main(void)
+{
+	if (test_lookup() || test_duplicates() || test_resize())
+		return 1;
+
+	return 0;
+}
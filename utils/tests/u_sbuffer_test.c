@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) RELIANOID
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "u_sbuffer.h"
+
+#define CHECK(cond)									\
+	do {										\
+		if (!(cond)) {								\
+			fprintf(stderr, "%s:%d: check failed: %s\n",			\
+				__FILE__, __LINE__, #cond);				\
+			return 1;							\
+		}									\
+	} while (0)
+
+static int is_zeroed(struct u_buffer *buf)
+{
+	int i;
+
+	for (i = 0; i < buf->size; i++) {
+		if (buf->data[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+static int test_concat(void)
+{
+	struct u_buffer buf;
+
+	CHECK(u_buf_create(&buf) == 0);
+	CHECK(u_buf_isempty(&buf));
+	CHECK(u_buf_get_size(&buf) == U_DEF_BUFFER_SIZE);
+
+	u_buf_concat(&buf, "add rule %s %s", "ip", "nftlb");
+	u_buf_concat(&buf, " ; flush chain %s", "filter-lb01");
+	CHECK(strcmp(u_buf_get_data(&buf), "add rule ip nftlb ; flush chain filter-lb01") == 0);
+	CHECK(buf.next == (int)strlen(u_buf_get_data(&buf)));
+
+	u_buf_reset(&buf);
+	CHECK(u_buf_isempty(&buf) && buf.next == 0);
+
+	u_buf_clean(&buf);
+	CHECK(buf.data == NULL && buf.size == 0 && buf.next == 0);
+	return 0;
+}
+
+/* an append that doesn't fit doubles the size until it does */
+static int test_growth(void)
+{
+	struct u_buffer buf;
+	char chunk[1000];
+	int i;
+
+	memset(chunk, 'x', sizeof(chunk) - 1);
+	chunk[sizeof(chunk) - 1] = '\0';
+
+	CHECK(u_buf_create(&buf) == 0);
+	for (i = 0; i < 5; i++)
+		u_buf_concat(&buf, "%s", chunk);
+	CHECK(buf.next == 5 * 999);
+	CHECK(u_buf_get_size(&buf) == 2 * U_DEF_BUFFER_SIZE);
+	CHECK(strlen(u_buf_get_data(&buf)) == 5 * 999);
+
+	CHECK(u_buf_reserve(&buf, 5 * U_DEF_BUFFER_SIZE) == 0);
+	CHECK(u_buf_get_size(&buf) == 8 * U_DEF_BUFFER_SIZE);
+	CHECK(u_buf_reserve(&buf, 10) == 0);
+	CHECK(u_buf_get_size(&buf) == 8 * U_DEF_BUFFER_SIZE);
+
+	u_buf_clean(&buf);
+	return 0;
+}
+
+/* a released buffer is handed zeroed to the next create of the same thread */
+static int test_scratch(void)
+{
+	struct u_buffer buf;
+	char chunk[U_DEF_BUFFER_SIZE * 2];
+	char *data;
+	int size;
+
+	memset(chunk, 'x', sizeof(chunk) - 1);
+	chunk[sizeof(chunk) - 1] = '\0';
+
+	CHECK(u_buf_create(&buf) == 0);
+	u_buf_concat(&buf, "%s", chunk);
+	data = u_buf_get_data(&buf);
+	size = u_buf_get_size(&buf);
+	CHECK(size > U_DEF_BUFFER_SIZE);
+	u_buf_clean(&buf);
+
+	CHECK(u_buf_create(&buf) == 0);
+	CHECK(u_buf_get_data(&buf) == data);
+	CHECK(u_buf_get_size(&buf) == size);
+	CHECK(buf.next == 0);
+	CHECK(is_zeroed(&buf));
+	u_buf_clean(&buf);
+
+	/* the buffers over the scratch limit are freed */
+	CHECK(u_buf_create(&buf) == 0);
+	CHECK(u_buf_reserve(&buf, U_BUF_SCRATCH_MAX_SIZE) == 0);
+	CHECK(u_buf_get_size(&buf) > U_BUF_SCRATCH_MAX_SIZE);
+	u_buf_clean(&buf);
+
+	CHECK(u_buf_create(&buf) == 0);
+	CHECK(u_buf_get_size(&buf) == U_DEF_BUFFER_SIZE);
+	CHECK(is_zeroed(&buf));
+	u_buf_clean(&buf);
+	return 0;
+}
+
+static void *test_scratch_thread(void *arg)
+{
+	*(int *)arg = test_scratch();
+	return NULL;
+}
+
+/* every thread keeps its own scratch, released when the thread exits */
+static int test_scratch_threads(void)
+{
+	pthread_t th;
+	int ret = 1;
+
+	CHECK(pthread_create(&th, NULL, test_scratch_thread, &ret) == 0);
+	CHECK(pthread_join(th, NULL) == 0);
+	return ret;
+}
+
+int main(void)
+{
+	if (test_concat() || test_growth() || test_scratch() || test_scratch_threads())
+		return 1;
+
+	return 0;
+}